@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <string.h>
@@ -10,6 +13,21 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Global constant
 #define MAX_BUFFER 2048
@@ -18,17 +36,459 @@
 #define CHUNK_SIZE 8192
 #define MAX_FILE_SIZE (50 * 1024 * 1024)
 
+// On-the-wire compression of uploadf/downlf payloads
+#define WIRE_FRAME_RAW (64 * 1024)
+#define WIRE_STORED 0x80000000u
+#define WIRE_SAMPLE 4096
+#define WIRE_MIN_SIZE 512
+
+// Chained uploads: every hop answers with one line per stored copy, then this line once the chain is done
+#define CHAIN_END "end"
+
+// Listing cache limits
+#define LIST_CACHE_SLOTS 64
+#define LIST_CACHE_BLOB 16384
+#define LIST_VERSION_BUCKETS 1024
+
+// Log of removed files kept in each storage root for incremental downltar
+#define REMOVED_LOG ".removed.log"
+#define DELETED_MANIFEST ".downltar_deleted"
+
+// Compressed downltar streams
+#define TAR_STREAMED 0xFFFFFFFFu
+// Frame length ending a framed stream that failed part way
+#define TAR_FRAME_ERROR 0xFFFFFFFFu
+#define TAR_NOT_COMPRESSED -2
+#define GZ_BLOCK_SIZE (256 * 1024)
+#define GZ_MAX_THREADS 8
+
+// Routing table limits
+#define MAX_NODES 32
+#define MAX_ROUTES 64
+#define MAX_POOL_NODES 8
+#define ROUTE_BUCKETS 64
+#define RING_VNODES 160
+#define MAX_NODE_WEIGHT 16
+
+// Online rebalancing after a routing table reload (SIGHUP)
+#define MIGRATE_DEFAULT_KBPS 4096
+// Recent removals remembered, so neither the rebalancer nor the catalog scan brings a removed file back
+#define RECENT_REMOVALS 4096
+// Walks of the rebalancer while files fail to move, and the pause before each walk after the first
+#define MIGRATE_PASSES 3
+#define MIGRATE_RETRY_SEC 10
+
+// Replica selection by peer load and reply time
+#define PEER_STATS_SLOTS (MAX_NODES * 2)
+#define PEER_EWMA_SHIFT 3
+#define PEER_DEFAULT_US 5000
+#define PEER_DOWN_US 1000000
+#define PEER_STALE_SEC 5
+
+// Hedged downlf: a second copy is asked when the first reply is slower than the recent percentile
+#define HEDGE_BUCKETS 24
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MIN_SAMPLES 20
+#define HEDGE_WINDOW 1024
+#define HEDGE_MIN_US 1000
+#define HEDGE_MAX_US 250000
+#define HEDGE_BUDGET_PCT 5
+#define HEDGE_BURST 10
+
+// Erasure coded files: fragments carry a header, files below the minimum size are stored whole
+#define EC_MAGIC "S1EC"
+#define EC_VERSION 1
+#define EC_HEADER_SIZE 32
+#define EC_DEFAULT_MIN_SIZE (1024 * 1024)
+// Fragments are uploaded as "<path>.ecstage.<pid>", no extension matches it so listings and archives skip it
+#define EC_STAGE_SUFFIX ".ecstage."
+
+// Write-behind uploads: journal directory in S1's root, drained by the forwarder in batches
+#define FORWARD_QUEUE ".forward"
+#define FORWARD_BATCH 256
+#define FORWARD_POLL_SEC 1
+#define FORWARD_MAX_BACKOFF 60
+#define FORWARD_RESCAN_SEC 30
+
+// Metadata catalog: a file in S1's root mapped by every process, one open addressed slot per stored file
+#define CATALOG_FILE ".catalog"
+#define CATALOG_MAGIC "S1CT"
+#define CATALOG_VERSION 1
+#define CATALOG_SLOTS 65536
+#define CATALOG_MAX_LOAD_PCT 90
+#define CATALOG_RESCAN_SEC 10
+#define CATALOG_FREE 0
+#define CATALOG_USED 1
+#define CATALOG_DELETED 2
+
+// Bloom filters the peers publish of their files, refreshed after removals or when they get old
+#define BLOOM_SLOTS (MAX_NODES * 2)
+#define BLOOM_MAX_BYTES (128 * 1024)
+#define BLOOM_MAX_HASHES 16
+#define BLOOM_RECENT 1024
+#define BLOOM_POLL_SEC 1
+#define BLOOM_REFRESH_SEC 30
+#define BLOOM_MAX_AGE_SEC 300
+
+// Request statistics: log-linear latency histograms (8 sub-buckets per power of two microseconds, like
+// HDR histograms) per client command and per peer, served by "stats" and on the optional metrics port
+#define STATS_PREFIX "s1"
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS 312
+#define STATS_COMMANDS 6
+
+// Seconds a metrics scrape may take to send its request or to read the reply
+#define METRICS_TIMEOUT_SEC 2
+
+// Request stage timing: commands slower than the threshold (-s, milliseconds) are logged in S1's root
+#define SLOW_LOG_FILE ".slow.log"
+// A slow log past this size is renamed to SLOW_LOG_FILE.1, replacing the previous one
+#define SLOW_LOG_MAX_BYTES (4 * 1024 * 1024)
+#define SLOW_REQUEST_MS 1000
+#define STAGE_EVENTS 64
+
+// Distributed tracing: spans of this node kept for "trace <id>" in a ring shared by the children
+#define SPAN_RING 4096
+
+// Workload capture (-w): every client command with its paths and file sizes, no file data, appended to a
+// binary trace for s25Replay
+#define WORKLOAD_MAGIC "S1WL"
+#define WORKLOAD_VERSION 1
+
 // Response codes
 #define SUCCESS 0
 #define ERROR_NETWORK -2
+#define ERROR_REMOTE -3
+
+// A storage node, port 0 marks S1 itself which keeps its files under $HOME/S1
+typedef struct
+{
+    char name[32];
+    char ip[64];
+    int port;
+    char root[32];
+} StorageNode;
+
+// One virtual node on a route's hash ring
+typedef struct
+{
+    unsigned int hash;
+    int node;
+} RingPoint;
+
+// One route: files with ext (optionally only under a ~S1 prefix) go to a pool of nodes
+typedef struct
+{
+    char ext[16];
+    char prefix[MAX_PATH];
+    int prefixLen;
+    int nodes[MAX_POOL_NODES];
+    int weights[MAX_POOL_NODES];
+    int nodeCount;
+    RingPoint *ring;
+    int ringSize;
+    int replicas;
+    int writeQuorum;
+    int dataShards;
+    int parityShards;
+    int ecMinSize;
+    int writeBehind;
+    int next;
+} Route;
+
+// Routes are chained per extension bucket, so a lookup hashes the extension once
+typedef struct
+{
+    StorageNode nodes[MAX_NODES];
+    int nodeCount;
+    Route routes[MAX_ROUTES];
+    int routeCount;
+    int buckets[ROUTE_BUCKETS];
+    int migrateKBps;
+} RoutingTable;
+
+// Routing table, loaded in main before the accept loop and again on SIGHUP
+RoutingTable routing;
+
+// Table in force before the last reload, consulted while files still move to their new owners
+RoutingTable previousRouting;
+
+// Reload this process's tables come from, a child that finds a newer one in the shared count loads the table again
+unsigned long routingGeneration = 0;
+
+// Routing table file given with -r, NULL for the command line table
+const char *routingFile = NULL;
+
+// Set by the SIGHUP handler, the accept loop reloads the table
+volatile sig_atomic_t reloadRequested = 0;
+
+// Progress of the rebalancer, shared with every forked child
+typedef struct
+{
+    int active;
+    unsigned long generation;
+    long filesMoved;
+    long bytesMoved;
+    long filesFailed;
+    // Ring of the path hashes of recent removals, removals counts every one noted so far. The catalog scan
+    // reads it as well, it is kept with or without a migration.
+    unsigned long removals;
+    unsigned long long removedHashes[RECENT_REMOVALS];
+} MigrationState;
+
+MigrationState *migration = NULL;
+
+// Latency histogram updated with atomic adds from every process, no lock
+typedef struct
+{
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long sumUs;
+    unsigned long maxUs;
+} LatencyHist;
+
+// Moving average of a peer's reply time and its requests in flight, across all children. forward holds
+// every first reply time, failures the requests that found the peer down.
+typedef struct
+{
+    int used;
+    char ip[64];
+    int port;
+    long inflight;
+    unsigned long ewmaUs;
+    long lastSample;
+    LatencyHist forward;
+    unsigned long failures;
+} PeerStat;
+
+// replyHist counts downlf first replies in power of two microsecond buckets, hedgeCredit is the hedge budget
+typedef struct
+{
+    pthread_mutex_t lock;
+    PeerStat peers[PEER_STATS_SLOTS];
+    unsigned long replyHist[HEDGE_BUCKETS];
+    unsigned long replySamples;
+    long hedgeCredit;
+    unsigned long hedgesSent;
+    unsigned long hedgesWon;
+} PeerStats;
+
+PeerStats *peerStats = NULL;
+
+// Set once the client negotiated deflate frames for uploadf/downlf payloads (per forked child)
+int clientWireDeflate = 0;
+
+// Counters of one client command
+typedef struct
+{
+    LatencyHist latency;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    long inflight;
+} CommandStats;
+
+// Request statistics shared by all forked children
+typedef struct
+{
+    long startedAt;
+    unsigned long connections;
+    unsigned long slowRequests;
+    CommandStats commands[STATS_COMMANDS];
+} ServerStats;
+
+ServerStats *serverStats = NULL;
+
+// Commands with their own statistics, the rest are counted as "other"
+const char *statsCommandNames[STATS_COMMANDS] = {"uploadf", "downlf", "removef", "downltar", "dispfnames", "other"};
+
+// Port of the Prometheus text endpoint on 127.0.0.1 (-m, 0 for none) and the process serving it
+int metricsPort = 0;
+pid_t metricsPid = 0;
+
+// Stages a client command spends its time in
+enum
+{
+    STAGE_CLIENT_RECV,
+    STAGE_CLIENT_SEND,
+    STAGE_MKDIR,
+    STAGE_LOCAL_IO,
+    STAGE_JOURNAL,
+    STAGE_PEER_CONNECT,
+    STAGE_PEER_SEND,
+    STAGE_PEER_REPLY,
+    STAGE_PEER_RECV,
+    STAGE_PAUSE,
+    STAGE_COUNT
+};
+
+const char *stageNames[STAGE_COUNT] = {"client_recv", "client_send", "mkdir", "local_io", "journal",
+                                       "peer_connect", "peer_send", "peer_reply", "peer_recv", "pause"};
+
+// One stage of a command, in microseconds from its start
+typedef struct
+{
+    int stage;
+    unsigned long startUs;
+    unsigned long durUs;
+} StageEvent;
+
+// Timeline of the command this child is serving, stages are only recorded while active is set
+typedef struct
+{
+    int active;
+    struct timespec started;
+    long long startedWallUs;
+    char command[256];
+    unsigned long totalUs[STAGE_COUNT];
+    unsigned long calls[STAGE_COUNT];
+    int events;
+    StageEvent event[STAGE_EVENTS];
+} RequestTimeline;
+
+RequestTimeline timeline;
+long slowRequestMs = SLOW_REQUEST_MS;
+
+// One timed operation of a trace, times in wall clock microseconds so spans of all nodes line up
+typedef struct
+{
+    unsigned long seq;
+    unsigned long long traceId;
+    unsigned long long spanId;
+    unsigned long long parentId;
+    long long startUs;
+    unsigned long durUs;
+    int pid;
+    int tid;
+    char name[32];
+    char detail[96];
+} Span;
+
+// Recent spans of every child, head counts the spans ever written
+typedef struct
+{
+    unsigned long head;
+    Span spans[SPAN_RING];
+} SpanRing;
+
+SpanRing *spanRing = NULL;
+
+// Client command this child is serving as it goes to the workload trace; sizes[i] is the file size
+// received or sent for args[i], -1 when no file moved
+typedef struct
+{
+    int active;
+    unsigned int seq;
+    int argCount;
+    char args[MAX_COMMAND_ARGS][MAX_PATH];
+    int sizes[MAX_COMMAND_ARGS];
+} WorkloadRecord;
+
+WorkloadRecord workload;
+
+// Workload trace opened in append mode before forking (-w, -1 for none)
+int workloadFd = -1;
+
+// Trace of the command this child is serving (traceId 0 when none), spanId is its root span
+typedef struct
+{
+    unsigned long long traceId;
+    unsigned long long spanId;
+    unsigned long long parentId;
+    long long startUs;
+} TraceContext;
+
+TraceContext currentTrace;
+
+// Port S1 listens on, the process id of its spans in exported traces
+int s1Port = 0;
+
+// One cached dispfnames result, valid while its version matches the directory's version
+typedef struct
+{
+    char dir[MAX_PATH];
+    unsigned long version;
+    unsigned long lastUsed;
+    int valid;
+    int len;
+    char blob[LIST_CACHE_BLOB];
+} ListCacheEntry;
+
+// Listing cache shared by all forked children (mapped before the accept loop)
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned long clock;
+    unsigned long dirVersion[LIST_VERSION_BUCKETS];
+    ListCacheEntry entries[LIST_CACHE_SLOTS];
+} ListCache;
+
+ListCache *listCache = NULL;
+
+// What S1 knows about one stored file: the node it went to, its size (-1 unknown), upload time and CRC-32
+typedef struct
+{
+    int state;
+    unsigned int keyHash;
+    int hasCrc;
+    unsigned int crc;
+    long long size;
+    long mtime;
+    char node[32];
+    char path[MAX_PATH];
+} CatalogEntry;
 
-// Global variable for server 2-4 communication
-char *server2_ip;
-int server2_port;
-char *server3_ip;
-int server3_port;
-char *server4_ip;
-int server4_port;
+// Catalog shared by every process through $HOME/S1/.catalog. complete is set once this run's scan of
+// the nodes finished, only then does a missing entry mean a missing file.
+typedef struct
+{
+    char magic[4];
+    int version;
+    int slots;
+    int complete;
+    int overflow;
+    long live;
+    long used;
+    pthread_mutex_t lock;
+    CatalogEntry entries[CATALOG_SLOTS];
+} Catalog;
+
+Catalog *catalog = NULL;
+
+// Process filling the catalog from the nodes' listings
+pid_t catalogScanPid = 0;
+
+// A node's Bloom filter of its files with one extension (bytes is 0 until fetched). S1 sets the bits of
+// every file before storing it on the node, and keeps the last keys in recent so a refresh that raced
+// with those stores can set them again.
+typedef struct
+{
+    int used;
+    char ip[64];
+    int port;
+    char root[32];
+    char ext[16];
+    unsigned int bytes;
+    int hashes;
+    long fetchedAt;
+    long removals;
+    unsigned long added;
+    unsigned long addSeq;
+    unsigned long long recent[BLOOM_RECENT];
+    unsigned char bits[BLOOM_MAX_BYTES];
+} BloomFilter;
+
+// Filters shared by every forked child, rejected counts the misses answered without a peer
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned long rejected;
+    BloomFilter filters[BLOOM_SLOTS];
+} BloomFilters;
+
+BloomFilters *blooms = NULL;
+
+// Process fetching the peers' Bloom filters
+pid_t bloomRefresherPid = 0;
 
 // top-level alphabetical comparator for qsort
 static int cmpstr(const void *a, const void *b)
@@ -78,235 +538,1161 @@ int receiveDataInChunks(int socket, char *buffer, int expectedSize)
     return totalReceived;
 }
 
-// Function to communicate with other server using server_port and server_ip
-int communicateWithServer(char *commandType, char *filePath, char *fileBuffer, int fileSize, char *sIp, int sPort, char *response, int main_clinet_sd)
+// Helper function to check whether a payload is worth deflating on the wire
+int wireWorthCompressing(const char *name, const char *data, int dataSize)
 {
-    // Socket variable
-    int client_sd;
-    struct sockaddr_in server_addr;
-    // Socket call
-    if ((client_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    // Skip formats that are compressed already
+    const char *dot = name ? strrchr(name, '.') : NULL;
+    if (dot && (strcmp(dot, ".zip") == 0 || strcmp(dot, ".pdf") == 0))
     {
-        fprintf(stderr, "Could not create socket\n");
-        exit(1);
+        return 0;
     }
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(sPort);
-    inet_pton(AF_INET, sIp, &server_addr.sin_addr);
-    // Connect call to connect with other server
-    if (connect(client_sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if (dataSize < WIRE_MIN_SIZE)
     {
-        close(client_sd);
-        return -1;
+        return 0;
     }
-    // If command is uploadf
-    if (strcmp(commandType, "uploadf") == 0)
+    // Quick entropy check: deflate a small sample and skip if it barely shrinks
+    unsigned char sample[WIRE_SAMPLE + 64];
+    uLongf sampleLen = sizeof(sample);
+    int n = dataSize < WIRE_SAMPLE ? dataSize : WIRE_SAMPLE;
+    if (compress2(sample, &sampleLen, (const Bytef *)data, n, 1) != Z_OK)
     {
-        // Frist send the command to server using write
-        char command[MAX_BUFFER];
-        snprintf(command, MAX_BUFFER, "uploadf %s", filePath);
-        if (write(client_sd, command, strlen(command)) < 0)
-        {
-            // If write fails, close connection and send error message
-            close(client_sd);
-            strcpy(response, "Error: Failed to send command to server");
-            return ERROR_NETWORK;
-        }
-        // Sleep for 10ms
-        usleep(10000);
-        // Use htonl to convert host bytes to network bytes
-        uint32_t networkFileSize = htonl((uint32_t)fileSize);
-        // Send file size to server using write
-        if (write(client_sd, &networkFileSize, sizeof(networkFileSize)) != sizeof(networkFileSize))
-        {
-            close(client_sd);
-            strcpy(response, "Error: Failed to send file size to Server");
-            return ERROR_NETWORK;
-        }
-        // Send file data in chunk
-        if (sendDataInChunks(client_sd, fileBuffer, fileSize) != fileSize)
-        {
-            // Error if all data is not sent
-            close(client_sd);
-            strcpy(response, "Error: Failed to send file data to Server");
-            return ERROR_NETWORK;
-        }
-        // Read response from server
-        int responseLen = read(client_sd, response, MAX_BUFFER - 1);
-        if (responseLen <= 0)
-        {
-            strcpy(response, "Error: No response from Server");
-            close(client_sd);
-            return ERROR_NETWORK;
-        }
-        response[responseLen] = '\0';
-        // Close the connection
-        close(client_sd);
+        return 0;
     }
-    // If command is removef
-    if (strcmp(commandType, "removef") == 0)
+    return sampleLen < (uLongf)n * 9 / 10;
+}
+
+// Helper function to send data as deflate frames, blocks that do not shrink go stored
+int sendCompressedData(int socket, const char *data, int dataSize, int compress)
+{
+    uLong outCap = compressBound(WIRE_FRAME_RAW);
+    unsigned char *out = compress ? (unsigned char *)malloc(outCap) : NULL;
+    for (int offset = 0; offset < dataSize; offset += WIRE_FRAME_RAW)
     {
-        char command[MAX_BUFFER];
-        snprintf(command, MAX_BUFFER, "removef %s", filePath);
-        // Frist send the command to server using write
-        if (write(client_sd, command, strlen(command)) < 0)
+        int n = (dataSize - offset > WIRE_FRAME_RAW) ? WIRE_FRAME_RAW : (dataSize - offset);
+        const char *frame = data + offset;
+        uint32_t header = WIRE_STORED | (uint32_t)n;
+        // Each frame carries its length, the high bit marks a stored (raw) frame
+        uLongf outLen = outCap;
+        if (out && compress2(out, &outLen, (const Bytef *)frame, n, 1) == Z_OK && outLen < (uLongf)n)
         {
-            close(client_sd);
-            strcpy(response, "Error: Failed to send command to server");
-            return ERROR_NETWORK;
+            frame = (const char *)out;
+            header = (uint32_t)outLen;
         }
-        // Read response from server
-        int responseLen = read(client_sd, response, MAX_BUFFER - 1);
-        if (responseLen <= 0)
+        int frameLen = header & ~WIRE_STORED;
+        uint32_t netHeader = htonl(header);
+        if (write(socket, &netHeader, sizeof(netHeader)) != sizeof(netHeader) ||
+            sendDataInChunks(socket, frame, frameLen) != frameLen)
         {
-            strcpy(response, "Error: No response from Server");
-            close(client_sd);
-            return ERROR_NETWORK;
+            free(out);
+            return -1;
         }
-        response[responseLen] = '\0';
-        // Close the connection
-        close(client_sd);
     }
-    // If command is downlf
-    if (strcmp(commandType, "downlf") == 0)
+    free(out);
+    return dataSize;
+}
+
+// Helper function to receive data sent with sendCompressedData
+int receiveCompressedData(int socket, char *buffer, int expectedSize)
+{
+    uLong inCap = compressBound(WIRE_FRAME_RAW);
+    unsigned char *in = (unsigned char *)malloc(inCap);
+    if (!in)
     {
-        char command[MAX_BUFFER];
-        snprintf(command, MAX_BUFFER, "downlf %s", filePath);
-        // Frist send the command to server using write
-        if (write(client_sd, command, strlen(command)) < 0)
-        {
-            close(client_sd);
-            snprintf(response, MAX_BUFFER, "Error: Failed to send command to server");
-            write(main_clinet_sd, response, strlen(response));
-            return ERROR_NETWORK;
-        }
-        // Read initial response from server
-        int responseLen = read(client_sd, response, MAX_BUFFER - 1);
-        // If there is error in reading response from server
-        if (responseLen <= 0)
-        {
-            close(client_sd);
-            snprintf(response, MAX_BUFFER, "Error: Failed to read response from server");
-            write(main_clinet_sd, response, strlen(response));
-            return ERROR_NETWORK;
-        }
-        response[responseLen] = '\0';
-        // If there response contains error message from server
-        if (strstr(response, "Error:") != NULL || strstr(response, "File does not exist") != NULL)
-        {
-            // Print the server error message
-            close(client_sd);
-            write(main_clinet_sd, response, strlen(response));
-            return ERROR_NETWORK;
-        }
-        // Read file size from server(network bytes)
-        uint32_t networkFileSize;
-        int bytes = read(client_sd, &networkFileSize, sizeof(uint32_t));
-        // Use ntohl to convert network bytes to host bytes
-        int fileSize = ntohl(networkFileSize);
-        // Error if file size is invalid close connection with server and send error message to client
-        if (bytes <= 0 || fileSize <= 0 || fileSize > MAX_FILE_SIZE)
-        {
-            close(client_sd);
-            snprintf(response, MAX_BUFFER, "Error: Invalid file size");
-            write(main_clinet_sd, response, strlen(response));
-            return ERROR_NETWORK;
-        }
-        // Allocate memory for file based on size
-        char *fileData = malloc(fileSize + 1);
-        // Error if memory allocation fails
-        if (!fileData)
-        {
-            close(client_sd);
-            snprintf(response, MAX_BUFFER, "Error: Memory allocation failed");
-            write(main_clinet_sd, response, strlen(response));
-            return ERROR_NETWORK;
-        }
-        // Receive file data in portion from server
-        int totalReceived = receiveDataInChunks(client_sd, fileData, fileSize);
-        // Error if entire file is not received
-        if (totalReceived != fileSize)
-        {
-            free(fileData);
-            close(client_sd);
-            snprintf(response, MAX_BUFFER, "Error: Failed to receive complete file data");
-            write(main_clinet_sd, response, strlen(response));
-            return ERROR_NETWORK;
-        }
-        // Send success response to client first
-        snprintf(response, MAX_BUFFER, "Success: File retrieved from target server");
-        if (write(main_clinet_sd, response, strlen(response)) <= 0)
-        {
-            free(fileData);
-            return ERROR_NETWORK;
-        }
-        // Sleep for 10ms
-        usleep(10000);
-        // Send file name first to client
-        char *lastSlash = strrchr(filePath, '/');
-        char *fileName = (lastSlash == NULL) ? filePath : lastSlash + 1;
-        if (write(main_clinet_sd, fileName, strlen(fileName)) <= 0)
+        return -1;
+    }
+    int totalReceived = 0;
+    while (totalReceived < expectedSize)
+    {
+        int want = (expectedSize - totalReceived > WIRE_FRAME_RAW) ? WIRE_FRAME_RAW : (expectedSize - totalReceived);
+        uint32_t netHeader;
+        if (receiveDataInChunks(socket, (char *)&netHeader, sizeof(netHeader)) != sizeof(netHeader))
         {
-            free(fileData);
-            return ERROR_NETWORK;
+            break;
         }
-        usleep(10000);
-        // Send file size using write to client
-        // Use htonl to convert host bytes to network bytes
-        uint32_t networkFileSizeClient = htonl((uint32_t)fileSize);
-        if (write(main_clinet_sd, &networkFileSizeClient, sizeof(networkFileSizeClient)) != sizeof(networkFileSizeClient))
+        uint32_t header = ntohl(netHeader);
+        uint32_t frameLen = header & ~WIRE_STORED;
+        if (header & WIRE_STORED)
         {
-            free(fileData);
-            return ERROR_NETWORK;
+            // Stored frames land directly in the buffer
+            if (frameLen != (uint32_t)want ||
+                receiveDataInChunks(socket, buffer + totalReceived, want) != want)
+            {
+                break;
+            }
         }
-        usleep(10000);
-        // Send file data in chunk to client
-        if (sendDataInChunks(main_clinet_sd, fileData, fileSize) != fileSize)
+        else
         {
-            free(fileData);
-            return ERROR_NETWORK;
+            uLongf outLen = want;
+            if (frameLen > inCap ||
+                receiveDataInChunks(socket, (char *)in, frameLen) != (int)frameLen ||
+                uncompress((Bytef *)buffer + totalReceived, &outLen, in, frameLen) != Z_OK ||
+                outLen != (uLongf)want)
+            {
+                break;
+            }
         }
-        // Free file buffer
-        free(fileData);
-        // Close the connection with server
-        close(client_sd);
+        totalReceived += want;
     }
-    // Return sucess
-    return SUCCESS;
+    free(in);
+    return totalReceived == expectedSize ? totalReceived : -1;
 }
 
-// Helper function to get file extension
-char *getFileExtension(char *filename)
+// --- S1: request statistics ---
+
+// Histograms, counters, the Prometheus text helpers and the metrics process, shared with the other servers
+#include "s25Stats.h"
+
+// --- S1: distributed tracing ---
+
+// Helper function to map the span ring shared by the children, no spans are kept if it fails
+void initSpanRing()
 {
-    // Get the last occurenece of '.'
-    char *dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
+    void *mem = mmap(NULL, sizeof(SpanRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
     {
-        return "";
+        perror("mmap span ring");
+        return;
     }
-    // Return the position of '.'
-    return dot;
+    memset(mem, 0, sizeof(SpanRing));
+    spanRing = (SpanRing *)mem;
 }
 
-// Helper function to verify the existence of file
-int validateFileExist(char *filename)
+// Helper function to get the wall clock in microseconds, spans of all nodes share it
+static long long wallClockUs()
 {
-    struct stat st;
-    // Return 0, if file does not exist
-    if (stat(filename, &st) != 0)
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Helper function to make a random, non-zero trace or span id (xorshift, seeded per thread)
+static unsigned long long newTraceId()
+{
+    static __thread unsigned long long state = 0;
+    if (state == 0)
+        state = ((unsigned long long)wallClockUs() << 20) ^ ((unsigned long long)getpid() << 40) ^ (unsigned long long)(size_t)&state;
+    unsigned long long id;
+    do
     {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        id = state;
+    } while (id == 0);
+    return id;
+}
+
+// Helper function to add a span of the current trace to the ring. Writers claim a slot with one atomic add;
+// the slot's seq is cleared while it is written and set to the ticket after, so readers skip torn slots
+static void recordSpan(const char *name, const char *detail, unsigned long long spanId, unsigned long long parentId,
+                       long long startUs, unsigned long durUs)
+{
+    if (!spanRing || currentTrace.traceId == 0)
+        return;
+    unsigned long ticket = __atomic_fetch_add(&spanRing->head, 1, __ATOMIC_RELAXED);
+    Span *span = &spanRing->spans[ticket % SPAN_RING];
+    __atomic_store_n(&span->seq, 0, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    span->traceId = currentTrace.traceId;
+    span->spanId = spanId;
+    span->parentId = parentId;
+    span->startUs = startUs;
+    span->durUs = durUs;
+    span->pid = (int)getpid();
+    span->tid = (int)gettid();
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    snprintf(span->detail, sizeof(span->detail), "%s", detail ? detail : "");
+    __atomic_store_n(&span->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// Helper function to copy a finished span out of the ring, 0 if it is being rewritten
+static int readSpan(unsigned long slot, Span *out)
+{
+    Span *span = &spanRing->spans[slot];
+    unsigned long seq = __atomic_load_n(&span->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0)
         return 0;
-    }
-    // Return 1 if file not exist
-    return 1;
+    memcpy(out, span, sizeof(Span));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&span->seq, __ATOMIC_RELAXED) == seq;
 }
 
-// Helper function to create directory on server
-int createDirectory(char *path)
+// Helper function to take a leading "trace:<trace id>[:<parent span>]" token off a command, returns the rest
+static char *takeTraceContext(char *command, unsigned long long *traceId, unsigned long long *parentId)
 {
-    // Copy path to tempPath
-    char tempPath[MAX_PATH];
-    char *p = NULL;
+    *traceId = 0;
+    *parentId = 0;
+    if (strncmp(command, "trace:", 6) != 0)
+        return command;
+    if (sscanf(command + 6, "%llx:%llx", traceId, parentId) < 1)
+        *traceId = 0;
+    char *rest = command + 6;
+    while (*rest && *rest != ' ' && *rest != '\t')
+        rest++;
+    while (*rest == ' ' || *rest == '\t')
+        rest++;
+    return rest;
+}
+
+// Start the root span of a client command, under the client's trace when it sent one
+static void traceBegin(unsigned long long traceId, unsigned long long parentId)
+{
+    currentTrace.traceId = traceId ? traceId : newTraceId();
+    currentTrace.parentId = traceId ? parentId : 0;
+    currentTrace.spanId = newTraceId();
+    currentTrace.startUs = wallClockUs();
+}
+
+// Finish the root span of a client command
+static void traceEnd(const char *name, const char *detail)
+{
+    if (currentTrace.traceId == 0)
+        return;
+    recordSpan(name, detail, currentTrace.spanId, currentTrace.parentId, currentTrace.startUs,
+               (unsigned long)(wallClockUs() - currentTrace.startUs));
+    currentTrace.traceId = 0;
+}
+
+// Helper function to send a command to a peer, preceded by the trace context of the command being served
+static ssize_t writePeerCommand(int sd, const char *command)
+{
+    if (currentTrace.traceId == 0)
+        return write(sd, command, strlen(command));
+    char traced[MAX_BUFFER];
+    int len = snprintf(traced, sizeof(traced), "trace:%016llx:%016llx %s", currentTrace.traceId, currentTrace.spanId, command);
+    if (len >= (int)sizeof(traced))
+        return write(sd, command, strlen(command));
+    return write(sd, traced, len);
+}
+
+// --- S1: request stage timing ---
+
+// Helper function to get the microseconds since the request started
+static unsigned long timelineNowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = (now.tv_sec - timeline.started.tv_sec) * 1000000L + (now.tv_nsec - timeline.started.tv_nsec) / 1000;
+    return us > 0 ? (unsigned long)us : 0;
+}
+
+// Start the timeline of a client command
+static void timelineBegin(char *commandArgs[], int count)
+{
+    memset(timeline.totalUs, 0, sizeof(timeline.totalUs));
+    memset(timeline.calls, 0, sizeof(timeline.calls));
+    timeline.events = 0;
+    timeline.command[0] = '\0';
+    for (int i = 0, off = 0; i < count && commandArgs[i] && off < (int)sizeof(timeline.command) - 1; i++)
+        off += snprintf(timeline.command + off, sizeof(timeline.command) - off, "%s%s", i ? " " : "", commandArgs[i]);
+    clock_gettime(CLOCK_MONOTONIC, &timeline.started);
+    timeline.startedWallUs = wallClockUs();
+    timeline.active = 1;
+}
+
+// Helper function to note when a stage begins, 0 when no command is being timed
+static unsigned long stageBegin()
+{
+    return timeline.active ? timelineNowUs() : 0;
+}
+
+// Helper function to close a stage opened by stageBegin; the erasure coding workers call it from threads,
+// so slots and totals are claimed with atomics
+static void stageEnd(int stage, unsigned long begin)
+{
+    if (!timeline.active)
+        return;
+    unsigned long duration = timelineNowUs() - begin;
+    __atomic_add_fetch(&timeline.totalUs[stage], duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&timeline.calls[stage], 1, __ATOMIC_RELAXED);
+    int slot = __atomic_fetch_add(&timeline.events, 1, __ATOMIC_RELAXED);
+    if (slot < STAGE_EVENTS)
+    {
+        timeline.event[slot].stage = stage;
+        timeline.event[slot].startUs = begin;
+        timeline.event[slot].durUs = duration;
+    }
+    // Every stage is also a span of the command's trace
+    recordSpan(stageNames[stage], NULL, newTraceId(), currentTrace.spanId, timeline.startedWallUs + (long long)begin, duration);
+}
+
+// Helper function for the pauses between protocol messages, timed as their own stage
+static void protocolPause(useconds_t us)
+{
+    unsigned long begin = stageBegin();
+    usleep(us);
+    stageEnd(STAGE_PAUSE, begin);
+}
+
+// Finish the timeline of a client command; one slower than slowRequestMs is appended to the slow log with
+// its stage totals and every stage in order, in a single write so lines of several children do not mix
+static void timelineEnd()
+{
+    if (!timeline.active)
+        return;
+    timeline.active = 0;
+    unsigned long totalUs = timelineNowUs();
+    if (slowRequestMs < 0 || totalUs < (unsigned long)slowRequestMs * 1000)
+        return;
+    if (serverStats)
+        __atomic_add_fetch(&serverStats->slowRequests, 1, __ATOMIC_RELAXED);
+    char text[8192];
+    int len = 0;
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    len += strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+    len += snprintf(text + len, sizeof(text) - len, " pid %d trace %016llx %.1f ms: %s\n  totals:", (int)getpid(),
+                    currentTrace.traceId, totalUs / 1000.0, timeline.command);
+    unsigned long staged = 0;
+    for (int s = 0; s < STAGE_COUNT && len < (int)sizeof(text); s++)
+    {
+        if (timeline.calls[s] == 0)
+            continue;
+        staged += timeline.totalUs[s];
+        len += snprintf(text + len, sizeof(text) - len, " %s %.1f ms (%lu)", stageNames[s], timeline.totalUs[s] / 1000.0, timeline.calls[s]);
+    }
+    if (len < (int)sizeof(text))
+        len += snprintf(text + len, sizeof(text) - len, " other %.1f ms\n", staged < totalUs ? (totalUs - staged) / 1000.0 : 0.0);
+    int events = timeline.events < STAGE_EVENTS ? timeline.events : STAGE_EVENTS;
+    for (int e = 0; e < events && len < (int)sizeof(text); e++)
+        len += snprintf(text + len, sizeof(text) - len, "  +%.1f ms %s %.1f ms\n", timeline.event[e].startUs / 1000.0,
+                        stageNames[timeline.event[e].stage], timeline.event[e].durUs / 1000.0);
+    if (timeline.events > STAGE_EVENTS && len < (int)sizeof(text))
+        len += snprintf(text + len, sizeof(text) - len, "  ... %d more stages\n", timeline.events - STAGE_EVENTS);
+    if (len > (int)sizeof(text) - 1)
+    {
+        len = sizeof(text) - 1;
+        text[len - 1] = '\n';
+    }
+    char logPath[MAX_PATH];
+    snprintf(logPath, sizeof(logPath), "%s/S1/%s", getenv("HOME"), SLOW_LOG_FILE);
+    int fd = open(logPath, O_CREAT | O_WRONLY | O_APPEND, 0644);
+    if (fd < 0)
+        return;
+    write(fd, text, len);
+    struct stat st, current;
+    if (fstat(fd, &st) == 0 && st.st_size > SLOW_LOG_MAX_BYTES)
+    {
+        // The child that gets the lock first rotates, the others find a new file under the name
+        flock(fd, LOCK_EX);
+        if (stat(logPath, &current) == 0 && current.st_ino == st.st_ino)
+        {
+            char oldPath[MAX_PATH + 2];
+            snprintf(oldPath, sizeof(oldPath), "%s.1", logPath);
+            rename(logPath, oldPath);
+        }
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+}
+
+// --- S1: workload capture ---
+
+// Helper function to open the workload trace; a new trace starts with its magic and version. Every child
+// appends whole records with single writes to the shared O_APPEND descriptor, so records never interleave.
+int initWorkloadTrace(const char *file)
+{
+    int fd = open(file, O_CREAT | O_WRONLY | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        perror("workload trace");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        unsigned char header[8];
+        uint32_t version = htonl(WORKLOAD_VERSION);
+        memcpy(header, WORKLOAD_MAGIC, 4);
+        memcpy(header + 4, &version, 4);
+        if (write(fd, header, sizeof(header)) != sizeof(header))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    workloadFd = fd;
+    return 0;
+}
+
+// Start the workload record of a client command
+static void workloadBegin(char *commandArgs[], int count)
+{
+    if (workloadFd < 0)
+        return;
+    workload.argCount = 0;
+    for (int i = 0; i < count && i < MAX_COMMAND_ARGS && commandArgs[i]; i++)
+    {
+        snprintf(workload.args[i], sizeof(workload.args[i]), "%s", commandArgs[i]);
+        workload.sizes[i] = -1;
+        workload.argCount++;
+    }
+    workload.active = 1;
+}
+
+// Helper function to note the size of a file the current command moved. Files read from a peer are known by
+// the peer's path, so the size goes to the first argument without one that names the same file.
+static void workloadNoteSize(const char *path, int size)
+{
+    if (!workload.active)
+        return;
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    for (int i = 1; i < workload.argCount; i++)
+    {
+        slash = strrchr(workload.args[i], '/');
+        if (workload.sizes[i] < 0 && strcmp(slash ? slash + 1 : workload.args[i], name) == 0)
+        {
+            workload.sizes[i] = size;
+            return;
+        }
+    }
+}
+
+// Helper function to put a big-endian integer of bytes bytes in a record
+static unsigned char *putBe(unsigned char *p, unsigned long long v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        p[i] = (unsigned char)v;
+        v >>= 8;
+    }
+    return p + bytes;
+}
+
+// Finish the workload record of a client command and append it to the trace. Layout, big-endian:
+// u16 record length, u8 argument count, u8 reserved, u32 connection (child pid), u32 command number on the
+// connection, u64 start (wall clock us), u32 duration us, u32 bytes in, u32 bytes out, then per argument
+// i32 file size (-1 for none), u16 length and the text
+static void workloadEnd(unsigned long durUs, unsigned long long bytesIn, unsigned long long bytesOut)
+{
+    if (!workload.active)
+        return;
+    workload.active = 0;
+    unsigned char record[32 + MAX_COMMAND_ARGS * (6 + MAX_PATH)];
+    unsigned char *p = record + 2;
+    p = putBe(p, workload.argCount, 1);
+    p = putBe(p, 0, 1);
+    p = putBe(p, (unsigned int)getpid(), 4);
+    p = putBe(p, workload.seq++, 4);
+    p = putBe(p, (unsigned long long)timeline.startedWallUs, 8);
+    p = putBe(p, durUs < 0xFFFFFFFFUL ? durUs : 0xFFFFFFFFUL, 4);
+    p = putBe(p, bytesIn < 0xFFFFFFFFULL ? bytesIn : 0xFFFFFFFFULL, 4);
+    p = putBe(p, bytesOut < 0xFFFFFFFFULL ? bytesOut : 0xFFFFFFFFULL, 4);
+    for (int i = 0; i < workload.argCount; i++)
+    {
+        int len = strlen(workload.args[i]);
+        p = putBe(p, (unsigned int)workload.sizes[i], 4);
+        p = putBe(p, len, 2);
+        memcpy(p, workload.args[i], len);
+        p += len;
+    }
+    putBe(record, p - record, 2);
+    write(workloadFd, record, p - record);
+}
+
+// --- S1: peer load and latency ---
+
+// Helper function to map the peer statistics shared by the children, selection falls back to ring order if it fails
+void initPeerStats()
+{
+    void *mem = mmap(NULL, sizeof(PeerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap peer stats");
+        return;
+    }
+    memset(mem, 0, sizeof(PeerStats));
+    PeerStats *stats = (PeerStats *)mem;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&stats->lock, &attr) != 0)
+    {
+        pthread_mutexattr_destroy(&attr);
+        munmap(mem, sizeof(PeerStats));
+        return;
+    }
+    pthread_mutexattr_destroy(&attr);
+    peerStats = stats;
+}
+
+// Helper function to find the statistics slot of a peer, claiming a free one on first use
+static PeerStat *peerStat(const char *ip, int port)
+{
+    if (!peerStats)
+        return NULL;
+    // Claimed slots never change, so they are searched without the lock
+    for (int i = 0; i < PEER_STATS_SLOTS; i++)
+    {
+        PeerStat *stat = &peerStats->peers[i];
+        if (!__atomic_load_n(&stat->used, __ATOMIC_ACQUIRE))
+            break;
+        if (stat->port == port && strcmp(stat->ip, ip) == 0)
+            return stat;
+    }
+    if (pthread_mutex_lock(&peerStats->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&peerStats->lock);
+    PeerStat *found = NULL;
+    for (int i = 0; i < PEER_STATS_SLOTS && !found; i++)
+    {
+        PeerStat *stat = &peerStats->peers[i];
+        if (!stat->used)
+        {
+            snprintf(stat->ip, sizeof(stat->ip), "%s", ip);
+            stat->port = port;
+            __atomic_store_n(&stat->used, 1, __ATOMIC_RELEASE);
+            found = stat;
+        }
+        else if (stat->port == port && strcmp(stat->ip, ip) == 0)
+        {
+            found = stat;
+        }
+    }
+    pthread_mutex_unlock(&peerStats->lock);
+    return found;
+}
+
+// Helper function to give the microseconds since a start time
+static unsigned long elapsedUs(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Fold one reply time into a peer's moving average (weight 1/2^PEER_EWMA_SHIFT). A failed request is
+// counted as a failure and enters the average as PEER_DOWN_US, so a peer that is down looks slow
+static void peerObserve(const char *ip, int port, unsigned long us, int failed)
+{
+    PeerStat *stat = peerStat(ip, port);
+    if (!stat)
+        return;
+    if (failed)
+    {
+        __atomic_add_fetch(&stat->failures, 1, __ATOMIC_RELAXED);
+        us = PEER_DOWN_US;
+    }
+    else
+    {
+        recordLatency(&stat->forward, us);
+    }
+    // An average older than the stale window says nothing about the peer now, so it restarts
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int stale = now.tv_sec - __atomic_load_n(&stat->lastSample, __ATOMIC_RELAXED) > PEER_STALE_SEC;
+    unsigned long old = __atomic_load_n(&stat->ewmaUs, __ATOMIC_RELAXED);
+    unsigned long next;
+    do
+    {
+        next = (old == 0 || stale) ? us : old - (old >> PEER_EWMA_SHIFT) + (us >> PEER_EWMA_SHIFT);
+    } while (!__atomic_compare_exchange_n(&stat->ewmaUs, &old, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_store_n(&stat->lastSample, (long)now.tv_sec, __ATOMIC_RELAXED);
+}
+
+// Helper functions to count a request to a peer as in flight
+static void peerBegin(PeerStat *stat)
+{
+    if (stat)
+        __atomic_add_fetch(&stat->inflight, 1, __ATOMIC_RELAXED);
+}
+
+static void peerEnd(PeerStat *stat)
+{
+    if (stat)
+        __atomic_sub_fetch(&stat->inflight, 1, __ATOMIC_RELAXED);
+}
+
+// Expected wait at a node: its average reply time for each request ahead of ours plus ours, S1 itself costs nothing
+static unsigned long nodeCost(const StorageNode *node)
+{
+    if (node->port == 0)
+        return 0;
+    PeerStat *stat = peerStat(node->ip, node->port);
+    if (!stat)
+        return PEER_DEFAULT_US;
+    unsigned long ewma = __atomic_load_n(&stat->ewmaUs, __ATOMIC_RELAXED);
+    long inflight = __atomic_load_n(&stat->inflight, __ATOMIC_RELAXED);
+    if (ewma == 0)
+        ewma = PEER_DEFAULT_US;
+    // A peer that lost every comparison for a while wins the next one, so its stale average gets a fresh sample
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - __atomic_load_n(&stat->lastSample, __ATOMIC_RELAXED) > PEER_STALE_SEC)
+        ewma = 1;
+    return ewma * (unsigned long)((inflight > 0 ? inflight : 0) + 1);
+}
+
+// Helper function to count one downlf first reply time towards the hedge delay
+static void recordReplyTime(unsigned long us)
+{
+    if (!peerStats)
+        return;
+    int bucket = 0;
+    while (bucket < HEDGE_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+        bucket++;
+    __atomic_add_fetch(&peerStats->replyHist[bucket], 1, __ATOMIC_RELAXED);
+    // Halve the counts now and then so the percentile follows the recent reply times
+    if (__atomic_add_fetch(&peerStats->replySamples, 1, __ATOMIC_RELAXED) % HEDGE_WINDOW == 0)
+    {
+        for (int i = 0; i < HEDGE_BUCKETS; i++)
+            __atomic_store_n(&peerStats->replyHist[i], __atomic_load_n(&peerStats->replyHist[i], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+    }
+}
+
+// Helper function to give how long a downlf waits for its first reply before it is hedged, 0 for never
+static unsigned long hedgeDelayUs()
+{
+    if (!peerStats)
+        return 0;
+    unsigned long counts[HEDGE_BUCKETS];
+    unsigned long total = 0;
+    for (int i = 0; i < HEDGE_BUCKETS; i++)
+    {
+        counts[i] = __atomic_load_n(&peerStats->replyHist[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    if (total < HEDGE_MIN_SAMPLES)
+        return 0;
+    // Upper edge of the bucket holding the percentile
+    unsigned long seen = 0;
+    int bucket = 0;
+    while (bucket < HEDGE_BUCKETS - 1 && (seen + counts[bucket]) * 100 < total * HEDGE_PERCENTILE)
+        seen += counts[bucket++];
+    unsigned long delay = 1UL << (bucket + 1);
+    if (delay < HEDGE_MIN_US)
+        delay = HEDGE_MIN_US;
+    if (delay > HEDGE_MAX_US)
+        delay = HEDGE_MAX_US;
+    return delay;
+}
+
+// Every downlf earns HEDGE_BUDGET_PCT credit and a hedge costs 100, so hedges stay a few percent of the reads
+static void hedgeEarn()
+{
+    if (!peerStats)
+        return;
+    long credit = __atomic_load_n(&peerStats->hedgeCredit, __ATOMIC_RELAXED);
+    long next;
+    do
+    {
+        next = credit + HEDGE_BUDGET_PCT;
+        if (next > 100 * HEDGE_BURST)
+            next = 100 * HEDGE_BURST;
+    } while (!__atomic_compare_exchange_n(&peerStats->hedgeCredit, &credit, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static int hedgeSpend()
+{
+    if (!peerStats)
+        return 0;
+    long credit = __atomic_load_n(&peerStats->hedgeCredit, __ATOMIC_RELAXED);
+    do
+    {
+        if (credit < 100)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&peerStats->hedgeCredit, &credit, credit - 100, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&peerStats->hedgesSent, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// --- S1: talking to peers ---
+
+// Helper function to connect to a peer, returns the socket or -1
+static int connectToPeer(const char *ip, int port)
+{
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+        return -1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    unsigned long begin = stageBegin();
+    int connected = inet_pton(AF_INET, ip, &addr.sin_addr) > 0 &&
+                    connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    stageEnd(STAGE_PEER_CONNECT, begin);
+    if (!connected)
+    {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+// Function to communicate with other server using server_port and server_ip
+static int exchangeWithServer(char *commandType, char *filePath, char *fileBuffer, int fileSize, const char *sIp, int sPort, char *response)
+{
+    // Socket variable
+    int client_sd;
+    struct sockaddr_in server_addr;
+    // Socket call
+    if ((client_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        fprintf(stderr, "Could not create socket\n");
+        exit(1);
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(sPort);
+    inet_pton(AF_INET, sIp, &server_addr.sin_addr);
+    // Connect call to connect with other server
+    unsigned long begin = stageBegin();
+    int connected = connect(client_sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0;
+    stageEnd(STAGE_PEER_CONNECT, begin);
+    if (!connected)
+    {
+        close(client_sd);
+        // Only the failure counts, write and remove times say nothing of how fast the peer serves reads
+        peerObserve(sIp, sPort, 0, 1);
+        return -1;
+    }
+    // If command is uploadf
+    if (strcmp(commandType, "uploadf") == 0)
+    {
+        // Frist send the command to server using write
+        char command[MAX_BUFFER];
+        snprintf(command, MAX_BUFFER, "uploadf %s deflate", filePath);
+        if (writePeerCommand(client_sd, command) < 0)
+        {
+            // If write fails, close connection and send error message
+            close(client_sd);
+            strcpy(response, "Error: Failed to send command to server");
+            return ERROR_NETWORK;
+        }
+        // Sleep for 10ms
+        protocolPause(10000);
+        // Use htonl to convert host bytes to network bytes
+        uint32_t networkFileSize = htonl((uint32_t)fileSize);
+        // Send file size to server using write
+        if (write(client_sd, &networkFileSize, sizeof(networkFileSize)) != sizeof(networkFileSize))
+        {
+            close(client_sd);
+            strcpy(response, "Error: Failed to send file size to Server");
+            return ERROR_NETWORK;
+        }
+        // Send file data as deflate frames, stored when compression would not pay off
+        begin = stageBegin();
+        int sent = sendCompressedData(client_sd, fileBuffer, fileSize, wireWorthCompressing(filePath, fileBuffer, fileSize));
+        stageEnd(STAGE_PEER_SEND, begin);
+        if (sent != fileSize)
+        {
+            // Error if all data is not sent
+            close(client_sd);
+            strcpy(response, "Error: Failed to send file data to Server");
+            return ERROR_NETWORK;
+        }
+        // Read response from server
+        begin = stageBegin();
+        int responseLen = read(client_sd, response, MAX_BUFFER - 1);
+        stageEnd(STAGE_PEER_REPLY, begin);
+        if (responseLen <= 0)
+        {
+            strcpy(response, "Error: No response from Server");
+            close(client_sd);
+            return ERROR_NETWORK;
+        }
+        response[responseLen] = '\0';
+        // Close the connection
+        close(client_sd);
+    }
+    // If command is removef
+    if (strcmp(commandType, "removef") == 0)
+    {
+        char command[MAX_BUFFER];
+        snprintf(command, MAX_BUFFER, "removef %s", filePath);
+        // Frist send the command to server using write
+        if (writePeerCommand(client_sd, command) < 0)
+        {
+            close(client_sd);
+            strcpy(response, "Error: Failed to send command to server");
+            return ERROR_NETWORK;
+        }
+        // Read response from server
+        begin = stageBegin();
+        int responseLen = read(client_sd, response, MAX_BUFFER - 1);
+        stageEnd(STAGE_PEER_REPLY, begin);
+        if (responseLen <= 0)
+        {
+            strcpy(response, "Error: No response from Server");
+            close(client_sd);
+            return ERROR_NETWORK;
+        }
+        response[responseLen] = '\0';
+        // Close the connection
+        close(client_sd);
+    }
+    // Return sucess
+    return SUCCESS;
+}
+
+// Function to communicate with other server for uploadf/removef, counted as in flight for replica selection
+int communicateWithServer(char *commandType, char *filePath, char *fileBuffer, int fileSize, const char *sIp, int sPort, char *response)
+{
+    PeerStat *stat = peerStat(sIp, sPort);
+    peerBegin(stat);
+    int result = exchangeWithServer(commandType, filePath, fileBuffer, fileSize, sIp, sPort, response);
+    peerEnd(stat);
+    return result;
+}
+
+// Helper function to send a downlf request to a peer, returns the socket or -1 if the peer is down
+static int startPeerRead(const StorageNode *node, const char *filePath)
+{
+    int sd = connectToPeer(node->ip, node->port);
+    if (sd < 0)
+    {
+        peerObserve(node->ip, node->port, 0, 1);
+        return -1;
+    }
+    char command[MAX_BUFFER];
+    snprintf(command, MAX_BUFFER, "downlf %s deflate", filePath);
+    if (writePeerCommand(sd, command) < 0)
+    {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+// Helper function to read a peer's first downlf reply, SUCCESS when the file follows it
+static int readPeerReply(int sd, char *response)
+{
+    unsigned long begin = stageBegin();
+    int responseLen = read(sd, response, MAX_BUFFER - 1);
+    stageEnd(STAGE_PEER_REPLY, begin);
+    if (responseLen <= 0)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Failed to read response from server");
+        return ERROR_REMOTE;
+    }
+    response[responseLen] = '\0';
+    // Leave an error to the caller, another replica may have the file
+    if (strstr(response, "Error:") != NULL || strstr(response, "File does not exist") != NULL)
+        return ERROR_REMOTE;
+    return SUCCESS;
+}
+
+// Helper function to receive the file behind a peer's success reply, SUCCESS with *outData to free
+static int receivePeerFile(int sd, char **outData, int *outSize, char *response)
+{
+    // Read file size from server(network bytes)
+    uint32_t networkFileSize;
+    unsigned long begin = stageBegin();
+    int bytes = read(sd, &networkFileSize, sizeof(uint32_t));
+    stageEnd(STAGE_PEER_RECV, begin);
+    // Use ntohl to convert network bytes to host bytes
+    int fileSize = ntohl(networkFileSize);
+    // Error if file size is invalid
+    if (bytes <= 0 || fileSize <= 0 || fileSize > MAX_FILE_SIZE)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Invalid file size");
+        return ERROR_REMOTE;
+    }
+    // Allocate memory for file based on size
+    char *fileData = malloc(fileSize + 1);
+    if (!fileData)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Memory allocation failed");
+        return ERROR_REMOTE;
+    }
+    // Receive file data in portion from server
+    begin = stageBegin();
+    int totalReceived = receiveCompressedData(sd, fileData, fileSize);
+    stageEnd(STAGE_PEER_RECV, begin);
+    if (totalReceived != fileSize)
+    {
+        free(fileData);
+        snprintf(response, MAX_BUFFER, "Error: Failed to receive complete file data");
+        return ERROR_REMOTE;
+    }
+    *outData = fileData;
+    *outSize = fileSize;
+    return SUCCESS;
+}
+
+// Helper function to send a file read for downlf to the client, SUCCESS or ERROR_NETWORK
+static int sendFileToClient(int main_clinet_sd, const char *filePath, const char *fileData, int fileSize, char *response)
+{
+    // Send success response to client first
+    snprintf(response, MAX_BUFFER, "Success: File retrieved from target server");
+    if (write(main_clinet_sd, response, strlen(response)) <= 0)
+        return ERROR_NETWORK;
+    // Sleep for 10ms
+    protocolPause(10000);
+    // Send file name first to client
+    const char *lastSlash = strrchr(filePath, '/');
+    const char *fileName = (lastSlash == NULL) ? filePath : lastSlash + 1;
+    if (write(main_clinet_sd, fileName, strlen(fileName)) <= 0)
+        return ERROR_NETWORK;
+    protocolPause(10000);
+    // Use htonl to convert host bytes to network bytes
+    uint32_t networkFileSizeClient = htonl((uint32_t)fileSize);
+    if (write(main_clinet_sd, &networkFileSizeClient, sizeof(networkFileSizeClient)) != sizeof(networkFileSizeClient))
+        return ERROR_NETWORK;
+    workloadNoteSize(filePath, fileSize);
+    protocolPause(10000);
+    // Send file data in chunk to client, as deflate frames if it negotiated them
+    unsigned long begin = stageBegin();
+    int sent = clientWireDeflate ? sendCompressedData(main_clinet_sd, fileData, fileSize, wireWorthCompressing(filePath, fileData, fileSize))
+                                 : sendDataInChunks(main_clinet_sd, fileData, fileSize);
+    stageEnd(STAGE_CLIENT_SEND, begin);
+    return sent == fileSize ? SUCCESS : ERROR_NETWORK;
+}
+
+// Helper function to pass the file behind a peer's success reply on to the client, checked against the
+// catalog entry when one is given. ERROR_REMOTE means nothing reached the client yet, ERROR_NETWORK that
+// the client went away.
+static int relayPeerFile(int sd, const char *filePath, const CatalogEntry *known, char *response, int main_clinet_sd)
+{
+    char *fileData = NULL;
+    int fileSize = 0;
+    int result = receivePeerFile(sd, &fileData, &fileSize, response);
+    if (result != SUCCESS)
+        return result;
+    // A copy that differs from the last upload missed an overwrite, the caller tries another one
+    if (known && (known->size != fileSize || crc32(0L, (const Bytef *)fileData, fileSize) != known->crc))
+    {
+        free(fileData);
+        snprintf(response, MAX_BUFFER, "Error: Stale copy on server");
+        return ERROR_REMOTE;
+    }
+    result = sendFileToClient(main_clinet_sd, filePath, fileData, fileSize, response);
+    free(fileData);
+    return result;
+}
+
+// Fetch a file from a peer for downlf. If the first reply is slower than the hedge delay and the budget
+// allows, the backup copy is asked too and the slower request is cancelled by closing its socket.
+// Returns -1 if the primary is down, otherwise like relayPeerFile; *backupUsed tells if the backup was tried.
+static int hedgedPeerRead(const StorageNode *primary, const char *primaryPath, const StorageNode *backup, const char *backupPath, const CatalogEntry *known, char *response, int con_sd, int *backupUsed)
+{
+    const StorageNode *nodes[2] = {primary, backup};
+    const char *paths[2] = {primaryPath, backupPath};
+    PeerStat *stats[2] = {NULL, NULL};
+    int sds[2] = {-1, -1};
+    struct timespec started[2];
+    *backupUsed = 0;
+    hedgeEarn();
+    clock_gettime(CLOCK_MONOTONIC, &started[0]);
+    sds[0] = startPeerRead(primary, primaryPath);
+    if (sds[0] < 0)
+        return -1;
+    stats[0] = peerStat(primary->ip, primary->port);
+    peerBegin(stats[0]);
+    unsigned long delay = backup ? hedgeDelayUs() : 0;
+    int open = 1;
+    int winner = -1;
+    while (open > 0 && winner < 0)
+    {
+        struct pollfd fds[2];
+        int which[2];
+        int nfds = 0;
+        for (int i = 0; i < 2; i++)
+        {
+            if (sds[i] >= 0)
+            {
+                fds[nfds].fd = sds[i];
+                fds[nfds].events = POLLIN;
+                which[nfds++] = i;
+            }
+        }
+        int timeout = -1;
+        if (delay > 0)
+        {
+            unsigned long waited = elapsedUs(&started[0]);
+            timeout = waited >= delay ? 0 : (int)((delay - waited + 999) / 1000);
+        }
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+        {
+            snprintf(response, MAX_BUFFER, "Error: Failed to read response from server");
+            break;
+        }
+        if (ready == 0)
+        {
+            // The primary is slow, ask the backup as well; either way the delay has passed
+            delay = 0;
+            if (!hedgeSpend())
+                continue;
+            *backupUsed = 1;
+            clock_gettime(CLOCK_MONOTONIC, &started[1]);
+            sds[1] = startPeerRead(backup, backupPath);
+            if (sds[1] >= 0)
+            {
+                stats[1] = peerStat(backup->ip, backup->port);
+                peerBegin(stats[1]);
+                open++;
+            }
+            continue;
+        }
+        for (int k = 0; k < nfds && winner < 0; k++)
+        {
+            if (!fds[k].revents)
+                continue;
+            int i = which[k];
+            int result = readPeerReply(sds[i], response);
+            unsigned long us = elapsedUs(&started[i]);
+            peerObserve(nodes[i]->ip, nodes[i]->port, us, 0);
+            recordReplyTime(us);
+            if (result == SUCCESS)
+            {
+                winner = i;
+                continue;
+            }
+            close(sds[i]);
+            sds[i] = -1;
+            peerEnd(stats[i]);
+            open--;
+        }
+    }
+    // Cancel the loser; it took at least this long, which its average should reflect
+    for (int i = 0; i < 2; i++)
+    {
+        if (sds[i] >= 0 && i != winner)
+        {
+            peerObserve(nodes[i]->ip, nodes[i]->port, elapsedUs(&started[i]), 0);
+            close(sds[i]);
+            peerEnd(stats[i]);
+        }
+    }
+    if (winner < 0)
+        return ERROR_REMOTE;
+    if (winner == 1)
+        __atomic_add_fetch(&peerStats->hedgesWon, 1, __ATOMIC_RELAXED);
+    int result = relayPeerFile(sds[winner], paths[winner], known, response, con_sd);
+    close(sds[winner]);
+    peerEnd(stats[winner]);
+    return result;
+}
+
+// Helper function to count the acks of a chain as they come up it, until needed copies are stored or the
+// chain is done. The first error a hop reports is kept in response. Returns the copies stored, -1 on no reply
+static int readChainAcks(int sd, int needed, char *response)
+{
+    char buf[MAX_BUFFER];
+    int len = 0, stored = 0, replies = 0;
+    response[0] = '\0';
+    while (stored < needed)
+    {
+        char *nl = (char *)memchr(buf, '\n', len);
+        if (!nl)
+        {
+            int n = len < (int)sizeof(buf) ? read(sd, buf + len, sizeof(buf) - len) : -1;
+            if (n <= 0)
+                break;
+            len += n;
+            continue;
+        }
+        *nl = '\0';
+        if (strcmp(buf, CHAIN_END) == 0)
+            break;
+        replies++;
+        if (strstr(buf, "successfully"))
+            stored++;
+        else if (!response[0])
+            snprintf(response, MAX_BUFFER, "%s", buf);
+        len -= nl + 1 - buf;
+        memmove(buf, nl + 1, len);
+    }
+    if (stored > 0)
+        snprintf(response, MAX_BUFFER, "File uploaded successfully to Server");
+    return replies > 0 ? stored : -1;
+}
+
+// Send a file to the head of a replica chain, each peer stores it and passes the stream on. Each peer acks
+// its copy as soon as it is stored, so this returns once needed copies are, at least the head's own, and
+// the rest of the chain finishes on its own. Returns the copies stored by then, 0 if the head could not be
+// reached.
+int chainUpload(const StorageNode *head, const char *headPath, const char *chain, const char *fileBuffer, int fileSize, int needed, char *response)
+{
+    int sd = connectToPeer(head->ip, head->port);
+    if (sd < 0)
+    {
+        peerObserve(head->ip, head->port, 0, 1);
+        snprintf(response, MAX_BUFFER, "Error: Failed to connect to %s", head->name);
+        return 0;
+    }
+    PeerStat *stat = peerStat(head->ip, head->port);
+    peerBegin(stat);
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "uploadf %s deflate%s%s", headPath, chain[0] ? " " : "", chain);
+    uint32_t networkFileSize = htonl((uint32_t)fileSize);
+    int stored = -1;
+    if (writePeerCommand(sd, command) > 0)
+    {
+        protocolPause(10000);
+        unsigned long begin = stageBegin();
+        int sent = write(sd, &networkFileSize, sizeof(networkFileSize)) == sizeof(networkFileSize) &&
+                   sendCompressedData(sd, fileBuffer, fileSize, wireWorthCompressing(headPath, fileBuffer, fileSize)) == fileSize;
+        stageEnd(STAGE_PEER_SEND, begin);
+        if (sent)
+        {
+            begin = stageBegin();
+            // Without hops after the head its single reply is the only ack
+            if (chain[0])
+            {
+                // The head's ack comes first, after it read its whole copy, so closing after it is safe
+                stored = readChainAcks(sd, needed > 0 ? needed : 1, response);
+            }
+            else
+            {
+                int responseLen = read(sd, response, MAX_BUFFER - 1);
+                if (responseLen > 0)
+                {
+                    response[responseLen] = '\0';
+                    stored = strstr(response, "successfully") ? 1 : 0;
+                }
+            }
+            stageEnd(STAGE_PEER_REPLY, begin);
+        }
+    }
+    close(sd);
+    // The reply waits for the chain's writes, so it says little about this peer's read latency
+    peerEnd(stat);
+    if (stored < 0)
+    {
+        snprintf(response, MAX_BUFFER, "Error: No response from %s", head->name);
+        return 0;
+    }
+    return stored;
+}
+
+// Helper function to get file extension
+char *getFileExtension(char *filename)
+{
+    // Get the last occurenece of '.'
+    char *dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+    {
+        return "";
+    }
+    // Return the position of '.'
+    return dot;
+}
+
+// Helper function to verify the existence of file
+int validateFileExist(char *filename)
+{
+    struct stat st;
+    // Return 0, if file does not exist
+    if (stat(filename, &st) != 0)
+    {
+        return 0;
+    }
+    // Return 1 if file not exist
+    return 1;
+}
+
+// Helper function to create directory on server
+int createDirectory(char *path)
+{
+    // Copy path to tempPath
+    char tempPath[MAX_PATH];
+    char *p = NULL;
     int len;
     // Copy the input path
     snprintf(tempPath, sizeof(tempPath), "%s", path);
@@ -314,61 +1700,2489 @@ int createDirectory(char *path)
     // Remove trailing slash
     if (tempPath[len - 1] == '/')
     {
-        tempPath[len - 1] = 0;
+        tempPath[len - 1] = 0;
+    }
+    char *baseEnd = NULL;
+    // Check the path contains /S1/
+    if (strstr(tempPath, "/S1/"))
+    {
+        // Skip "/S1"
+        baseEnd = strstr(tempPath, "/S1/") + 3;
+    }
+    // Iterate through the path and create subdirectories
+    for (p = baseEnd; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = 0;
+            int result = mkdir(tempPath, 0755);
+            if (result == -1 && errno != EEXIST)
+            {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    int result = mkdir(tempPath, 0755);
+    if (result == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to spilt the command
+int tokenizeCommand(char *input, char *commandArgs[], int *count)
+{
+    // Copy input to copyInput
+    char copyInput[MAX_BUFFER];
+    strcpy(copyInput, input);
+    char *delimiter = " \t";
+    // Split on the base of delimiter using strtok
+    char *portion = strtok(copyInput, delimiter);
+    while (portion != NULL && *count < MAX_COMMAND_ARGS)
+    {
+        commandArgs[*count] = malloc(strlen(portion) + 1);
+        if (commandArgs[*count] == NULL)
+        {
+            printf("\nError: Memory allocation failed.\n");
+            return 0;
+        }
+        // Copy the split portion to commandArgs[]
+        strcpy(commandArgs[*count], portion);
+        // Increment the count
+        (*count)++;
+        portion = strtok(NULL, delimiter);
+    }
+    return 1;
+}
+
+// --- S1: routing table ---
+
+// Helper function to hash an extension into its route bucket (FNV-1a)
+static unsigned int routeBucket(const char *ext)
+{
+    unsigned int h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)ext; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h % ROUTE_BUCKETS;
+}
+
+// Helper function to find a node by name, returns its index or -1
+static int findNode(const char *name)
+{
+    for (int i = 0; i < routing.nodeCount; i++)
+    {
+        if (strcmp(routing.nodes[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Helper function to add a storage node, returns its index or -1
+static int addNode(const char *name, const char *ip, int port, const char *root)
+{
+    if (routing.nodeCount == MAX_NODES || findNode(name) >= 0)
+        return -1;
+    // Only S1 itself can be local, and it always stores under S1
+    if (port == 0 && strcmp(root, "S1") != 0)
+        return -1;
+    StorageNode *node = &routing.nodes[routing.nodeCount];
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    snprintf(node->ip, sizeof(node->ip), "%s", ip);
+    node->port = port;
+    snprintf(node->root, sizeof(node->root), "%s", root);
+    return routing.nodeCount++;
+}
+
+// Helper function to hash a ring key (FNV-1a 64 with a final mix so nearby keys spread out)
+static unsigned int ringHash(const char *key)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (unsigned int)(h >> 32);
+}
+
+// qsort comparator for ring points
+static int cmpRingPoint(const void *a, const void *b)
+{
+    unsigned int ha = ((const RingPoint *)a)->hash;
+    unsigned int hb = ((const RingPoint *)b)->hash;
+    return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+// Place RING_VNODES virtual nodes per unit of weight for every node of the pool
+static int buildRing(Route *route)
+{
+    int total = 0;
+    for (int i = 0; i < route->nodeCount; i++)
+        total += route->weights[i] * RING_VNODES;
+    route->ring = (RingPoint *)malloc(total * sizeof(RingPoint));
+    if (!route->ring)
+        return -1;
+    route->ringSize = 0;
+    for (int i = 0; i < route->nodeCount; i++)
+    {
+        // Points depend only on the node name, so adding a node moves just the keys it takes over
+        for (int v = 0; v < route->weights[i] * RING_VNODES; v++)
+        {
+            char key[64];
+            snprintf(key, sizeof(key), "%s#%d", routing.nodes[route->nodes[i]].name, v);
+            route->ring[route->ringSize].hash = ringHash(key);
+            route->ring[route->ringSize++].node = route->nodes[i];
+        }
+    }
+    qsort(route->ring, route->ringSize, sizeof(RingPoint), cmpRingPoint);
+    return 0;
+}
+
+// Helper function to add a route, an empty prefix covers the whole tree
+static int addRoute(const char *ext, const char *prefix, char *nodeNames[], int nameCount)
+{
+    if (routing.routeCount == MAX_ROUTES || ext[0] != '.' || nameCount < 1 || nameCount > MAX_POOL_NODES)
+        return -1;
+    if (prefix[0] != '\0' && strncmp(prefix, "~S1", 3) != 0)
+        return -1;
+    Route *route = &routing.routes[routing.routeCount];
+    snprintf(route->ext, sizeof(route->ext), "%s", ext);
+    snprintf(route->prefix, sizeof(route->prefix), "%s", prefix);
+    // "~S1" and "~S1/" cover everything, like no prefix at all
+    route->prefixLen = strlen(route->prefix);
+    while (route->prefixLen > 0 && route->prefix[route->prefixLen - 1] == '/')
+        route->prefix[--route->prefixLen] = '\0';
+    if (strcmp(route->prefix, "~S1") == 0)
+        route->prefix[route->prefixLen = 0] = '\0';
+    route->nodeCount = 0;
+    route->replicas = 1;
+    route->writeQuorum = 1;
+    route->dataShards = 0;
+    route->parityShards = 0;
+    route->ecMinSize = 0;
+    route->writeBehind = 0;
+    for (int i = 0; i < nameCount; i++)
+    {
+        // A node may carry a weight, "S2:3" takes three times the share of "S2"
+        char name[64];
+        snprintf(name, sizeof(name), "%s", nodeNames[i]);
+        int weight = 1;
+        char *colon = strchr(name, ':');
+        if (colon)
+        {
+            *colon = '\0';
+            weight = atoi(colon + 1);
+        }
+        int node = findNode(name);
+        if (node < 0 || weight < 1 || weight > MAX_NODE_WEIGHT)
+            return -1;
+        route->nodes[route->nodeCount] = node;
+        route->weights[route->nodeCount++] = weight;
+    }
+    if (buildRing(route) != 0)
+        return -1;
+    unsigned int b = routeBucket(route->ext);
+    route->next = routing.buckets[b];
+    routing.buckets[b] = routing.routeCount;
+    return routing.routeCount++;
+}
+
+// Helper function to check whether S1 itself is in a route's pool
+static int routeHasLocalNode(const Route *route)
+{
+    for (int i = 0; i < route->nodeCount; i++)
+        if (routing.nodes[route->nodes[i]].port == 0)
+            return 1;
+    return 0;
+}
+
+// Helper function to release the rings of a table and empty it
+static void freeRoutingTable(RoutingTable *table)
+{
+    for (int i = 0; i < table->routeCount; i++)
+        free(table->routes[i].ring);
+    memset(table, 0, sizeof(*table));
+    for (int i = 0; i < ROUTE_BUCKETS; i++)
+        table->buckets[i] = -1;
+}
+
+// Helper function to empty the routing table
+static void resetRoutingTable()
+{
+    freeRoutingTable(&routing);
+    routing.migrateKBps = MIGRATE_DEFAULT_KBPS;
+}
+
+// Build the default table from the command line: .c on S1, .pdf on S2, .txt on S3, .zip on S4
+void defaultRoutingTable(char *argv[])
+{
+    resetRoutingTable();
+    addNode("S1", "local", 0, "S1");
+    addNode("S2", argv[2], atoi(argv[3]), "S2");
+    addNode("S3", argv[4], atoi(argv[5]), "S3");
+    addNode("S4", argv[6], atoi(argv[7]), "S4");
+    char *s1[] = {"S1"}, *s2[] = {"S2"}, *s3[] = {"S3"}, *s4[] = {"S4"};
+    addRoute(".c", "", s1, 1);
+    addRoute(".pdf", "", s2, 1);
+    addRoute(".txt", "", s3, 1);
+    addRoute(".zip", "", s4, 1);
+}
+
+// Load the routing table from a file, returns 0 on success
+// Lines are "node <name> <ip> <port> <root>" (ip "local" and port 0 for S1 itself),
+// "route <ext> [~S1/prefix] <node>[:weight] [<node>[:weight]...]",
+// "replicate <ext> <copies> [<write_quorum>]", "erasure <ext> <data> <parity> [<min_size>]" or
+// "writebehind <ext>" after the routes of ext and "throttle <KB/s>" for the rebalancer; '#' starts a comment
+int loadRoutingTable(const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Cannot open routing table %s\n", file);
+        return -1;
+    }
+    resetRoutingTable();
+    char line[MAX_BUFFER];
+    int lineNo = 0;
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp))
+    {
+        lineNo++;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *tok[MAX_POOL_NODES + 4];
+        int n = 0;
+        char *save = NULL;
+        for (char *t = strtok_r(line, " \t\r\n", &save); t && n < MAX_POOL_NODES + 4; t = strtok_r(NULL, " \t\r\n", &save))
+            tok[n++] = t;
+        if (n == 0)
+            continue;
+        if (strcmp(tok[0], "node") == 0 && n == 5)
+        {
+            int port = atoi(tok[3]);
+            if ((port == 0) != (strcmp(tok[2], "local") == 0) || addNode(tok[1], tok[2], port, tok[4]) < 0)
+                rc = -1;
+        }
+        else if (strcmp(tok[0], "route") == 0 && n >= 3)
+        {
+            // A third token starting with ~S1 is the optional path prefix
+            int hasPrefix = strncmp(tok[2], "~S1", 3) == 0;
+            if (n < 3 + hasPrefix || addRoute(tok[1], hasPrefix ? tok[2] : "", tok + 2 + hasPrefix, n - 2 - hasPrefix) < 0)
+                rc = -1;
+        }
+        else if (strcmp(tok[0], "replicate") == 0 && (n == 3 || n == 4))
+        {
+            // A majority of the copies acknowledges a write unless a quorum is given
+            int copies = atoi(tok[2]);
+            int quorum = n == 4 ? atoi(tok[3]) : copies / 2 + 1;
+            int matched = 0;
+            for (int i = 0; i < routing.routeCount && copies >= 1 && quorum >= 1 && quorum <= copies; i++)
+            {
+                Route *route = &routing.routes[i];
+                if (strcmp(route->ext, tok[1]) != 0)
+                    continue;
+                // A pool smaller than the copy count keeps one copy per node
+                route->replicas = copies < route->nodeCount ? copies : route->nodeCount;
+                route->writeQuorum = quorum < route->replicas ? quorum : route->replicas;
+                route->dataShards = 0;
+                route->parityShards = 0;
+                matched++;
+            }
+            if (matched == 0)
+                rc = -1;
+        }
+        else if (strcmp(tok[0], "erasure") == 0 && (n == 4 || n == 5))
+        {
+            // Files of at least min_size bytes are striped; a write must store k plus half the parity fragments
+            int dataShards = atoi(tok[2]);
+            int parityShards = atoi(tok[3]);
+            int minSize = n == 5 ? atoi(tok[4]) : EC_DEFAULT_MIN_SIZE;
+            int matched = 0;
+            for (int i = 0; i < routing.routeCount && dataShards >= 1 && parityShards >= 1 && minSize > 0; i++)
+            {
+                Route *route = &routing.routes[i];
+                if (strcmp(route->ext, tok[1]) != 0)
+                    continue;
+                // Every fragment needs a node of its own, and S1 only encodes
+                if (routeHasLocalNode(route) || route->nodeCount < dataShards + parityShards)
+                {
+                    matched = 0;
+                    break;
+                }
+                route->replicas = 1;
+                route->dataShards = dataShards;
+                route->parityShards = parityShards;
+                route->ecMinSize = minSize;
+                route->writeQuorum = dataShards + parityShards / 2;
+                matched++;
+            }
+            if (matched == 0)
+                rc = -1;
+        }
+        else if (strcmp(tok[0], "writebehind") == 0 && n == 2)
+        {
+            // Uploads are acknowledged once journaled on S1, which a route to S1 itself gains nothing from
+            int matched = 0;
+            for (int i = 0; i < routing.routeCount; i++)
+            {
+                Route *route = &routing.routes[i];
+                if (strcmp(route->ext, tok[1]) != 0)
+                    continue;
+                if (routeHasLocalNode(route))
+                {
+                    matched = 0;
+                    break;
+                }
+                route->writeBehind = 1;
+                matched++;
+            }
+            if (matched == 0)
+                rc = -1;
+        }
+        else if (strcmp(tok[0], "throttle") == 0 && n == 2 && atoi(tok[1]) > 0)
+        {
+            routing.migrateKBps = atoi(tok[1]);
+        }
+        else
+        {
+            rc = -1;
+        }
+        if (rc != 0)
+            fprintf(stderr, "Error: Bad routing table entry at %s:%d\n", file, lineNo);
+    }
+    fclose(fp);
+    if (rc == 0 && routing.routeCount == 0)
+    {
+        fprintf(stderr, "Error: Routing table %s has no routes\n", file);
+        rc = -1;
+    }
+    return rc;
+}
+
+// Helper function to check whether a route prefix covers a ~S1 path (whole components only)
+static int prefixCovers(const Route *route, const char *tildePath)
+{
+    if (route->prefixLen == 0)
+        return 1;
+    return strncmp(tildePath, route->prefix, route->prefixLen) == 0 &&
+           (tildePath[route->prefixLen] == '\0' || tildePath[route->prefixLen] == '/');
+}
+
+// Find the route for ext at a ~S1 path in a given table, the longest matching prefix wins
+const Route *lookupRouteIn(const RoutingTable *table, const char *ext, const char *tildePath)
+{
+    const Route *best = NULL;
+    for (int i = table->buckets[routeBucket(ext)]; i >= 0; i = table->routes[i].next)
+    {
+        const Route *route = &table->routes[i];
+        if (strcmp(route->ext, ext) == 0 && prefixCovers(route, tildePath) &&
+            (!best || route->prefixLen > best->prefixLen))
+            best = route;
+    }
+    return best;
+}
+
+// Find the route for ext at a ~S1 path in the current table
+const Route *lookupRoute(const char *ext, const char *tildePath)
+{
+    return lookupRouteIn(&routing, ext, tildePath);
+}
+
+// Helper function to find the first ring point at or after a file's hash
+static int ringStart(const Route *route, const char *tildePath)
+{
+    unsigned int h = ringHash(tildePath);
+    int lo = 0, hi = route->ringSize;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (route->ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // Past the last point wraps around to the first
+    return lo == route->ringSize ? 0 : lo;
+}
+
+// Pick the node of a route's pool that owns a file: the first ring point at or after its hash
+const StorageNode *routeNodeIn(const RoutingTable *table, const Route *route, const char *tildePath)
+{
+    if (route->nodeCount == 1)
+        return &table->nodes[route->nodes[0]];
+    return &table->nodes[route->ring[ringStart(route, tildePath)].node];
+}
+
+// Collect the nodes holding copies (or erasure coded fragments) of a file: the owner, then the next
+// distinct nodes clockwise on the ring
+int replicaNodesIn(const RoutingTable *table, const Route *route, const char *tildePath, const StorageNode *out[])
+{
+    int copies = route->dataShards ? route->dataShards + route->parityShards : route->replicas;
+    if (copies <= 1 || route->nodeCount == 1)
+    {
+        out[0] = routeNodeIn(table, route, tildePath);
+        return 1;
+    }
+    int count = 0;
+    int seen[MAX_POOL_NODES];
+    int start = ringStart(route, tildePath);
+    for (int i = 0; i < route->ringSize && count < copies; i++)
+    {
+        int node = route->ring[(start + i) % route->ringSize].node;
+        int dup = 0;
+        for (int k = 0; k < count && !dup; k++)
+            dup = seen[k] == node;
+        if (dup)
+            continue;
+        seen[count] = node;
+        out[count++] = &table->nodes[node];
+    }
+    return count;
+}
+
+// Collect the replicas of a file in the current table
+int replicaNodes(const Route *route, const char *tildePath, const StorageNode *out[])
+{
+    return replicaNodesIn(&routing, route, tildePath, out);
+}
+
+// Pick the owner of a file in the current table
+const StorageNode *routeNode(const Route *route, const char *tildePath)
+{
+    return routeNodeIn(&routing, route, tildePath);
+}
+
+// Helper function to build the absolute path of a ~S1 path inside a node's root
+void nodePath(const StorageNode *node, const char *tildePath, char *out, size_t outLen)
+{
+    if (strncmp(tildePath, "~S1", 3) != 0)
+    {
+        snprintf(out, outLen, "%s", tildePath);
+        return;
+    }
+    snprintf(out, outLen, "%s/%s%s", getenv("HOME"), node->root, tildePath + 3);
+}
+
+// Collect every node serving ext anywhere in the tree, returns how many
+int routeNodesForExt(const char *ext, int nodesOut[], int max)
+{
+    int n = 0;
+    for (int i = 0; i < routing.routeCount; i++)
+    {
+        const Route *route = &routing.routes[i];
+        if (strcmp(route->ext, ext) != 0)
+            continue;
+        for (int j = 0; j < route->nodeCount; j++)
+        {
+            int seen = 0;
+            for (int k = 0; k < n && !seen; k++)
+                seen = nodesOut[k] == route->nodes[j];
+            if (!seen && n < max)
+                nodesOut[n++] = route->nodes[j];
+        }
+    }
+    return n;
+}
+
+// Collect the routed extensions in table order, returns how many
+int routeExtensions(const char *extsOut[], int max)
+{
+    int n = 0;
+    for (int i = 0; i < routing.routeCount; i++)
+    {
+        int seen = 0;
+        for (int k = 0; k < n && !seen; k++)
+            seen = strcmp(extsOut[k], routing.routes[i].ext) == 0;
+        if (!seen && n < max)
+            extsOut[n++] = routing.routes[i].ext;
+    }
+    return n;
+}
+
+// Helper function to give the archive name served for an extension
+void tarNameForExt(const char *ext, char *out, size_t outLen)
+{
+    // spec names
+    if (!strcmp(ext, ".c"))
+        snprintf(out, outLen, "cfiles.tar");
+    else if (!strcmp(ext, ".txt"))
+        snprintf(out, outLen, "text.tar");
+    else
+        snprintf(out, outLen, "%s.tar", ext + 1);
+}
+
+// --- S1: reads across replicas and migrations ---
+
+// Helper function to map the migration state shared by the children, double-read stays on if it fails
+void initMigrationState()
+{
+    void *mem = mmap(NULL, sizeof(MigrationState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap migration state");
+        return;
+    }
+    memset(mem, 0, sizeof(MigrationState));
+    migration = (MigrationState *)mem;
+}
+
+// Helper function to tell whether two table entries are the same storage node
+static int sameNode(const StorageNode *a, const StorageNode *b)
+{
+    return a->port == b->port && strcmp(a->ip, b->ip) == 0 && strcmp(a->root, b->root) == 0;
+}
+
+// Helper function to tell whether a node holds a file, peers are asked with "stat"
+static int nodeHasFile(const StorageNode *node, const char *tildePath)
+{
+    char path[MAX_PATH];
+    nodePath(node, tildePath, path, sizeof(path));
+    if (node->port == 0)
+        return validateFileExist(path);
+    int sd = connectToPeer(node->ip, node->port);
+    if (sd < 0)
+        return 0;
+    char cmd[MAX_BUFFER];
+    snprintf(cmd, sizeof(cmd), "stat %s", path);
+    char reply[MAX_BUFFER];
+    int n = -1;
+    if (writePeerCommand(sd, cmd) > 0)
+        n = read(sd, reply, sizeof(reply) - 1);
+    close(sd);
+    return n > 0 && strncmp(reply, "Success:", 8) == 0;
+}
+
+// Helper function to tell whether files may still sit on their owner from the previous table
+int migrationActive()
+{
+    if (previousRouting.routeCount == 0)
+        return 0;
+    return !migration || __atomic_load_n(&migration->active, __ATOMIC_ACQUIRE);
+}
+
+// Collect the nodes a file can be read from: its replicas, the least loaded of two random ones first
+// when a seed is given, then while a migration runs the previous replicas that are not among them.
+// The rebalancer copies before it removes, so one of them always has the file.
+static int readCandidates(const Route *route, const char *ext, const char *tildePath, unsigned int *seed, const StorageNode *out[])
+{
+    const StorageNode *replicas[MAX_POOL_NODES];
+    int n = replicaNodes(route, tildePath, replicas);
+    int first = 0;
+    if (seed && n > 1)
+    {
+        // Power of two choices: comparing two random copies avoids herding onto one idle peer
+        int a = rand_r(seed) % n;
+        int b = rand_r(seed) % (n - 1);
+        if (b >= a)
+            b++;
+        first = nodeCost(replicas[b]) < nodeCost(replicas[a]) ? b : a;
+    }
+    // The rest keep ring order as fallbacks
+    out[0] = replicas[first];
+    for (int k = 0, j = 1; k < n; k++)
+        if (k != first)
+            out[j++] = replicas[k];
+    if (!migrationActive())
+        return n;
+    const Route *oldRoute = lookupRouteIn(&previousRouting, ext, tildePath);
+    if (!oldRoute)
+        return n;
+    const StorageNode *old[MAX_POOL_NODES];
+    int oldCount = replicaNodesIn(&previousRouting, oldRoute, tildePath, old);
+    int total = n;
+    for (int k = 0; k < oldCount; k++)
+    {
+        int seen = 0;
+        for (int j = 0; j < total && !seen; j++)
+            seen = sameNode(out[j], old[k]);
+        if (!seen)
+            out[total++] = old[k];
+    }
+    return total;
+}
+
+// --- S1: erasure coded storage ---
+
+// GF(2^8) with the polynomial x^8+x^4+x^3+x^2+1, exp is doubled so a product needs no modulo
+static unsigned char gfExp[512];
+static unsigned char gfLog[256];
+
+// Multiply-accumulate kernel dst ^= c * src, picked for the CPU in initErasureCoding
+static void (*gfMulAdd)(unsigned char *dst, const unsigned char *src, unsigned char c, int len);
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0)
+        return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfInv(unsigned char a)
+{
+    return gfExp[255 - gfLog[a]];
+}
+
+// Helper function for the portable kernel, one table lookup per byte
+static void gfMulAddScalar(unsigned char *dst, const unsigned char *src, unsigned char c, int len)
+{
+    unsigned char row[256];
+    for (int i = 0; i < 256; i++)
+        row[i] = gfMul(c, (unsigned char)i);
+    for (int i = 0; i < len; i++)
+        dst[i] ^= row[src[i]];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Helper function to split c * x into the products of x's low and high nibble, so a byte shuffle looks them up
+static void gfNibbleTables(unsigned char c, unsigned char lo[16], unsigned char hi[16])
+{
+    for (int i = 0; i < 16; i++)
+    {
+        lo[i] = gfMul(c, (unsigned char)i);
+        hi[i] = gfMul(c, (unsigned char)(i << 4));
+    }
+}
+
+// 16 bytes per step, two pshufb lookups instead of 16 table reads
+__attribute__((target("ssse3"))) static void gfMulAddSsse3(unsigned char *dst, const unsigned char *src, unsigned char c, int len)
+{
+    unsigned char lo[16], hi[16];
+    gfNibbleTables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(v, mask));
+        __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    if (i < len)
+        gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+
+// The same with 32 bytes per step
+__attribute__((target("avx2"))) static void gfMulAddAvx2(unsigned char *dst, const unsigned char *src, unsigned char c, int len)
+{
+    unsigned char lo[16], hi[16];
+    gfNibbleTables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask));
+        __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    if (i < len)
+        gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+// Build the field tables and pick the widest multiply kernel the CPU has, before forking
+void initErasureCoding()
+{
+    int x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gfExp[i] = gfExp[i + 255] = (unsigned char)x;
+        gfLog[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    gfMulAdd = gfMulAddScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        gfMulAdd = gfMulAddAvx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        gfMulAdd = gfMulAddSsse3;
+#endif
+}
+
+// Coefficient of data shard j in parity shard p. The rows form a Cauchy matrix, so any k of the
+// k + m fragments (identity rows for data, these for parity) are independent.
+static unsigned char ecCoefficient(int k, int p, int j)
+{
+    return gfInv((unsigned char)((k + p) ^ j));
+}
+
+// A fragment's header, stored big endian in front of its shard:
+// "S1EC", version, k, m, index, file size, shard size, file crc32, shard crc32, 8 reserved bytes
+typedef struct
+{
+    int dataShards;
+    int parityShards;
+    int index;
+    int fileSize;
+    int shardSize;
+    uint32_t fileCrc;
+} EcFragment;
+
+static void putBe32(unsigned char *p, uint32_t v)
+{
+    uint32_t net = htonl(v);
+    memcpy(p, &net, sizeof(net));
+}
+
+static uint32_t getBe32(const unsigned char *p)
+{
+    uint32_t net;
+    memcpy(&net, p, sizeof(net));
+    return ntohl(net);
+}
+
+// Helper function to fill the shards of k + m zeroed fragments of fragSize bytes, each after its header space:
+// the data shards are the file cut in k pieces (the last one zero padded), then the m parity shards
+static void ecEncode(const char *fileBuffer, int fileSize, int k, int m, int shardSize, unsigned char *frags, int fragSize)
+{
+    for (int j = 0; j < k; j++)
+    {
+        int n = fileSize - j * shardSize;
+        if (n > shardSize)
+            n = shardSize;
+        if (n > 0)
+            memcpy(frags + (size_t)j * fragSize + EC_HEADER_SIZE, fileBuffer + (size_t)j * shardSize, n);
+    }
+    for (int p = 0; p < m; p++)
+    {
+        unsigned char *parity = frags + (size_t)(k + p) * fragSize + EC_HEADER_SIZE;
+        for (int j = 0; j < k; j++)
+            gfMulAdd(parity, frags + (size_t)j * fragSize + EC_HEADER_SIZE, ecCoefficient(k, p, j), shardSize);
+    }
+}
+
+// Helper function to fill in a fragment's header, its shard must already be in place
+static void ecWriteHeader(unsigned char *frag, const EcFragment *h)
+{
+    memset(frag, 0, EC_HEADER_SIZE);
+    memcpy(frag, EC_MAGIC, 4);
+    frag[4] = EC_VERSION;
+    frag[5] = (unsigned char)h->dataShards;
+    frag[6] = (unsigned char)h->parityShards;
+    frag[7] = (unsigned char)h->index;
+    putBe32(frag + 8, (uint32_t)h->fileSize);
+    putBe32(frag + 12, (uint32_t)h->shardSize);
+    putBe32(frag + 16, h->fileCrc);
+    putBe32(frag + 20, (uint32_t)crc32(0L, frag + EC_HEADER_SIZE, h->shardSize));
+}
+
+// Helper function to tell a fragment from a whole file by its first bytes
+static int ecIsFragment(const char *data, int len)
+{
+    return len >= EC_HEADER_SIZE && memcmp(data, EC_MAGIC, 4) == 0 && (unsigned char)data[4] == EC_VERSION;
+}
+
+// Helper function to read a fragment's header and check its shard, returns 0 for a sound fragment
+static int ecParseFragment(const char *data, int len, EcFragment *h)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    if (!ecIsFragment(data, len))
+        return -1;
+    h->dataShards = p[5];
+    h->parityShards = p[6];
+    h->index = p[7];
+    h->fileSize = (int)getBe32(p + 8);
+    h->shardSize = (int)getBe32(p + 12);
+    h->fileCrc = getBe32(p + 16);
+    if (h->dataShards < 1 || h->parityShards < 1 || h->dataShards + h->parityShards > MAX_POOL_NODES ||
+        h->index >= h->dataShards + h->parityShards || h->fileSize <= 0 || h->fileSize > MAX_FILE_SIZE ||
+        h->shardSize != (h->fileSize + h->dataShards - 1) / h->dataShards || len != EC_HEADER_SIZE + h->shardSize)
+        return -1;
+    return (uint32_t)crc32(0L, p + EC_HEADER_SIZE, h->shardSize) == getBe32(p + 20) ? 0 : -1;
+}
+
+// Rebuild the k data shards into out from any k fragments: a data fragment is copied, a missing data
+// shard is solved from the inverse of the fragments' k x k coefficient matrix
+static int ecDecode(int k, int shardSize, const int idx[], const unsigned char *shards[], unsigned char *out)
+{
+    unsigned char a[MAX_POOL_NODES][MAX_POOL_NODES];
+    unsigned char inv[MAX_POOL_NODES][MAX_POOL_NODES];
+    for (int r = 0; r < k; r++)
+    {
+        for (int c = 0; c < k; c++)
+        {
+            a[r][c] = idx[r] < k ? (idx[r] == c) : ecCoefficient(k, idx[r] - k, c);
+            inv[r][c] = r == c;
+        }
+    }
+    // Gauss-Jordan elimination, addition in GF(2^8) is xor
+    for (int c = 0; c < k; c++)
+    {
+        int pivot = c;
+        while (pivot < k && a[pivot][c] == 0)
+            pivot++;
+        if (pivot == k)
+            return -1;
+        for (int j = 0; j < k; j++)
+        {
+            unsigned char t = a[c][j];
+            a[c][j] = a[pivot][j];
+            a[pivot][j] = t;
+            t = inv[c][j];
+            inv[c][j] = inv[pivot][j];
+            inv[pivot][j] = t;
+        }
+        unsigned char scale = gfInv(a[c][c]);
+        for (int j = 0; j < k; j++)
+        {
+            a[c][j] = gfMul(a[c][j], scale);
+            inv[c][j] = gfMul(inv[c][j], scale);
+        }
+        for (int r = 0; r < k; r++)
+        {
+            unsigned char f = a[r][c];
+            if (r == c || f == 0)
+                continue;
+            for (int j = 0; j < k; j++)
+            {
+                a[r][j] ^= gfMul(f, a[c][j]);
+                inv[r][j] ^= gfMul(f, inv[c][j]);
+            }
+        }
+    }
+    for (int d = 0; d < k; d++)
+    {
+        unsigned char *dst = out + (size_t)d * shardSize;
+        int direct = -1;
+        for (int r = 0; r < k && direct < 0; r++)
+            if (idx[r] == d)
+                direct = r;
+        if (direct >= 0)
+        {
+            memcpy(dst, shards[direct], shardSize);
+            continue;
+        }
+        memset(dst, 0, shardSize);
+        for (int r = 0; r < k; r++)
+            if (inv[d][r])
+                gfMulAdd(dst, shards[r], inv[d][r], shardSize);
+    }
+    return 0;
+}
+
+// One fragment upload, run on its own thread
+typedef struct
+{
+    const StorageNode *node;
+    char path[MAX_PATH];
+    char *data;
+    int size;
+    int result;
+    char response[MAX_BUFFER];
+} EcUpload;
+
+static void *ecUploadWorker(void *arg)
+{
+    EcUpload *up = (EcUpload *)arg;
+    up->result = communicateWithServer("uploadf", up->path, up->data, up->size, up->node->ip, up->node->port, up->response);
+    return NULL;
+}
+
+// Helper function to put a staged fragment in place on its node, or drop it when dstPath is NULL; 0 on success
+static int ecCommitFragment(const StorageNode *node, const char *stagedPath, const char *dstPath)
+{
+    int sd = connectToPeer(node->ip, node->port);
+    if (sd < 0)
+        return -1;
+    char command[MAX_BUFFER], response[MAX_BUFFER];
+    if (dstPath)
+        snprintf(command, sizeof(command), "commitf %s %s", stagedPath, dstPath);
+    else
+        snprintf(command, sizeof(command), "commitf %s", stagedPath);
+    int n = -1;
+    if (writePeerCommand(sd, command) > 0)
+        n = read(sd, response, sizeof(response) - 1);
+    close(sd);
+    return n > 0 && strncmp(response, "Success:", 8) == 0 ? 0 : -1;
+}
+
+// Store a file of an erasure coded route. Below the route's minimum size it goes whole to its owner,
+// otherwise it is cut into k data shards plus m parity shards and each fragment goes to its own node,
+// all in parallel. The fragments are staged beside the old version and only put in place once the write
+// quorum of them is stored, so a failed upload leaves the old version whole.
+static int uploadErasure(const Route *route, const char *tildePath, const char *localPath, const char *fileBuffer, int fileSize, char *response)
+{
+    const StorageNode *nodes[MAX_POOL_NODES];
+    int count = replicaNodes(route, tildePath, nodes);
+    int k = route->dataShards;
+    char path[MAX_PATH];
+    if (fileSize < route->ecMinSize)
+    {
+        nodePath(nodes[0], tildePath, path, sizeof(path));
+        int result = communicateWithServer("uploadf", path, (char *)fileBuffer, fileSize, nodes[0]->ip, nodes[0]->port, response);
+        if (result == -1)
+            snprintf(response, MAX_BUFFER, "Error: Failed to connect to %s", nodes[0]->name);
+        if (result != SUCCESS)
+            return result;
+        if (localPath)
+            unlink(localPath);
+        // Fragments of an earlier striped version would otherwise turn up in archives
+        for (int i = 1; i < count; i++)
+        {
+            char reply[MAX_BUFFER];
+            nodePath(nodes[i], tildePath, path, sizeof(path));
+            communicateWithServer("removef", path, NULL, 0, nodes[i]->ip, nodes[i]->port, reply);
+        }
+        return SUCCESS;
+    }
+    if (count < k + route->parityShards)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Pool has %d of the %d nodes needed for fragments", count, k + route->parityShards);
+        return ERROR_NETWORK;
+    }
+    EcFragment h = {k, route->parityShards, 0, fileSize, (fileSize + k - 1) / k, (uint32_t)crc32(0L, (const Bytef *)fileBuffer, fileSize)};
+    int fragSize = EC_HEADER_SIZE + h.shardSize;
+    unsigned char *frags = (unsigned char *)calloc(count, fragSize);
+    EcUpload *ups = (EcUpload *)calloc(count, sizeof(EcUpload));
+    if (!frags || !ups)
+    {
+        free(frags);
+        free(ups);
+        snprintf(response, MAX_BUFFER, "Error: Memory allocation failed");
+        return ERROR_NETWORK;
+    }
+    ecEncode(fileBuffer, fileSize, k, h.parityShards, h.shardSize, frags, fragSize);
+    pthread_t threads[MAX_POOL_NODES];
+    int spawned[MAX_POOL_NODES];
+    for (int i = 0; i < count; i++)
+    {
+        h.index = i;
+        ecWriteHeader(frags + (size_t)i * fragSize, &h);
+        ups[i].node = nodes[i];
+        nodePath(nodes[i], tildePath, path, sizeof(path));
+        ups[i].data = (char *)frags + (size_t)i * fragSize;
+        ups[i].size = fragSize;
+        // A path with no room for the staging suffix is a fragment that could not be stored
+        if (snprintf(ups[i].path, sizeof(ups[i].path), "%s" EC_STAGE_SUFFIX "%d", path, (int)getpid()) >= (int)sizeof(ups[i].path))
+        {
+            spawned[i] = 0;
+            ups[i].result = ERROR_NETWORK;
+            continue;
+        }
+        spawned[i] = pthread_create(&threads[i], NULL, ecUploadWorker, &ups[i]) == 0;
+        if (!spawned[i])
+            ecUploadWorker(&ups[i]);
+    }
+    int stored = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (spawned[i])
+            pthread_join(threads[i], NULL);
+        ups[i].result = ups[i].result == SUCCESS && !strstr(ups[i].response, "Error") ? SUCCESS : ERROR_NETWORK;
+        if (ups[i].result == SUCCESS)
+            stored++;
+        else
+            fprintf(stderr, "Erasure: fragment %d of %s not stored on %s\n", i, tildePath, nodes[i]->name);
+    }
+    free(frags);
+    // Below the quorum the staged fragments are dropped and the old version stays as it was
+    int committed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (ups[i].result != SUCCESS)
+            continue;
+        nodePath(nodes[i], tildePath, path, sizeof(path));
+        if (ecCommitFragment(nodes[i], ups[i].path, stored >= route->writeQuorum ? path : NULL) == 0)
+            committed++;
+        else
+            fprintf(stderr, "Erasure: staged fragment %d of %s left on %s\n", i, tildePath, nodes[i]->name);
+    }
+    if (stored < route->writeQuorum)
+    {
+        free(ups);
+        snprintf(response, MAX_BUFFER, "Error: Stored %d of %d fragments, quorum is %d", stored, count, route->writeQuorum);
+        return ERROR_NETWORK;
+    }
+    // A fragment of the old version left where the new one failed would only mislead reads
+    for (int i = 0; i < count; i++)
+    {
+        if (ups[i].result == SUCCESS)
+            continue;
+        char reply[MAX_BUFFER];
+        nodePath(nodes[i], tildePath, path, sizeof(path));
+        communicateWithServer("removef", path, NULL, 0, nodes[i]->ip, nodes[i]->port, reply);
+    }
+    free(ups);
+    if (committed < route->writeQuorum)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Committed %d of %d fragments, quorum is %d", committed, count, route->writeQuorum);
+        return ERROR_NETWORK;
+    }
+    if (localPath)
+        unlink(localPath);
+    snprintf(response, MAX_BUFFER, "File uploaded successfully to Server (fragments %d/%d)", committed, count);
+    return SUCCESS;
+}
+
+// The fetches of one erasure coded read, shared with their threads
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int cancelled;
+    int running;
+} EcReadState;
+
+typedef struct
+{
+    EcReadState *state;
+    const StorageNode *node;
+    char path[MAX_PATH];
+    pthread_t thread;
+    int spawned;
+    int finished;
+    int examined;
+    int sd;
+    int result;
+    char *data;
+    int size;
+} EcFetch;
+
+// Fetch one fragment (or whole file) from a node; a cancelled read shuts the socket down under it
+static void *ecFetchWorker(void *arg)
+{
+    EcFetch *f = (EcFetch *)arg;
+    EcReadState *st = f->state;
+    char response[MAX_BUFFER];
+    PeerStat *stat = peerStat(f->node->ip, f->node->port);
+    peerBegin(stat);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int sd = startPeerRead(f->node, f->path);
+    int result = sd < 0 ? -1 : SUCCESS;
+    pthread_mutex_lock(&st->lock);
+    f->sd = sd;
+    if (st->cancelled)
+        result = ERROR_REMOTE;
+    pthread_mutex_unlock(&st->lock);
+    if (result == SUCCESS)
+    {
+        result = readPeerReply(sd, response);
+        peerObserve(f->node->ip, f->node->port, elapsedUs(&started), 0);
+    }
+    if (result == SUCCESS)
+        result = receivePeerFile(sd, &f->data, &f->size, response);
+    peerEnd(stat);
+    // Closed under the lock so a cancel never shuts down a descriptor that was reused
+    pthread_mutex_lock(&st->lock);
+    if (sd >= 0)
+        close(sd);
+    f->sd = -1;
+    f->result = result;
+    f->finished = 1;
+    st->running--;
+    pthread_cond_signal(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+// Read a file of an erasure coded route into memory. k nodes are asked at once and every failed
+// fetch starts the next node, so a degraded read still waits on k parallel replies only. A whole file
+// (one below the route's minimum size) is taken as it is. Returns SUCCESS with *outData to free.
+static int ecReadFile(const Route *route, const char *ext, const char *tildePath, char **outData, int *outSize, char *response)
+{
+    const StorageNode *candidates[MAX_POOL_NODES * 2];
+    int n = readCandidates(route, ext, tildePath, NULL, candidates);
+    EcFetch *fetches = (EcFetch *)calloc(n, sizeof(EcFetch));
+    if (!fetches)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Memory allocation failed");
+        return ERROR_REMOTE;
+    }
+    EcReadState st;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.changed, NULL);
+    st.cancelled = 0;
+    st.running = 0;
+    // The first sound fragment fixes the version and k, later ones must match it
+    EcFragment first = {0};
+    int chosen[MAX_POOL_NODES];
+    int idx[MAX_POOL_NODES];
+    int need = route->dataShards;
+    int good = 0, whole = -1, down = 0, next = 0;
+    pthread_mutex_lock(&st.lock);
+    while (whole < 0 && good < need)
+    {
+        while (next < n && st.running < need - good)
+        {
+            EcFetch *f = &fetches[next++];
+            f->state = &st;
+            f->node = candidates[next - 1];
+            f->sd = -1;
+            nodePath(f->node, tildePath, f->path, sizeof(f->path));
+            st.running++;
+            f->spawned = pthread_create(&f->thread, NULL, ecFetchWorker, f) == 0;
+            if (!f->spawned)
+            {
+                st.running--;
+                f->finished = 1;
+                f->result = -1;
+            }
+        }
+        for (int i = 0; i < next && whole < 0 && good < need; i++)
+        {
+            EcFetch *f = &fetches[i];
+            if (!f->finished || f->examined)
+                continue;
+            f->examined = 1;
+            EcFragment h;
+            if (f->result != SUCCESS)
+            {
+                down += f->result == -1;
+            }
+            else if (!ecIsFragment(f->data, f->size))
+            {
+                whole = i;
+            }
+            else if (ecParseFragment(f->data, f->size, &h) != 0)
+            {
+                fprintf(stderr, "Erasure: damaged fragment of %s on %s\n", tildePath, f->node->name);
+            }
+            else if (good == 0 || (h.fileCrc == first.fileCrc && h.fileSize == first.fileSize && h.dataShards == first.dataShards))
+            {
+                int dup = 0;
+                for (int g = 0; g < good && !dup; g++)
+                    dup = idx[g] == h.index;
+                if (dup)
+                    continue;
+                if (good == 0)
+                {
+                    first = h;
+                    need = h.dataShards;
+                }
+                idx[good] = h.index;
+                chosen[good++] = i;
+            }
+        }
+        if (whole >= 0 || good >= need)
+            break;
+        if (st.running == 0 && next == n)
+            break;
+        // Wait for a fetch unless one finished while this pass ran
+        int pending = 0;
+        for (int i = 0; i < next && !pending; i++)
+            pending = fetches[i].finished && !fetches[i].examined;
+        if (!pending && st.running > 0)
+            pthread_cond_wait(&st.changed, &st.lock);
+    }
+    // The fetches still running are not needed any more
+    st.cancelled = 1;
+    for (int i = 0; i < next; i++)
+        if (!fetches[i].finished && fetches[i].sd >= 0)
+            shutdown(fetches[i].sd, SHUT_RDWR);
+    pthread_mutex_unlock(&st.lock);
+    for (int i = 0; i < next; i++)
+        if (fetches[i].spawned)
+            pthread_join(fetches[i].thread, NULL);
+
+    int result = ERROR_REMOTE;
+    if (whole >= 0)
+    {
+        *outData = fetches[whole].data;
+        *outSize = fetches[whole].size;
+        fetches[whole].data = NULL;
+        result = SUCCESS;
+    }
+    else if (good >= need)
+    {
+        const unsigned char *shards[MAX_POOL_NODES];
+        for (int g = 0; g < good; g++)
+            shards[g] = (const unsigned char *)fetches[chosen[g]].data + EC_HEADER_SIZE;
+        unsigned char *out = (unsigned char *)malloc((size_t)need * first.shardSize);
+        if (!out)
+        {
+            snprintf(response, MAX_BUFFER, "Error: Memory allocation failed");
+        }
+        else if (ecDecode(need, first.shardSize, idx, shards, out) != 0 ||
+                 (uint32_t)crc32(0L, out, first.fileSize) != first.fileCrc)
+        {
+            free(out);
+            snprintf(response, MAX_BUFFER, "Error: Fragments of the file do not match");
+        }
+        else
+        {
+            *outData = (char *)out;
+            *outSize = first.fileSize;
+            result = SUCCESS;
+        }
+    }
+    else if (good > 0)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Only %d of %d fragments readable", good, need);
+    }
+    else if (down == n)
+    {
+        snprintf(response, MAX_BUFFER, "Error: Failed to connect to %s", candidates[0]->name);
+    }
+    else
+    {
+        snprintf(response, MAX_BUFFER, "Error: File does not exist on Server");
+    }
+    for (int i = 0; i < next; i++)
+        free(fetches[i].data);
+    free(fetches);
+    pthread_cond_destroy(&st.changed);
+    pthread_mutex_destroy(&st.lock);
+    return result;
+}
+
+// Helper function to check whether any route stripes files of an extension
+static int extErasureCoded(const char *ext)
+{
+    for (int i = 0; i < routing.routeCount; i++)
+        if (routing.routes[i].dataShards > 0 && strcmp(routing.routes[i].ext, ext) == 0)
+            return 1;
+    return 0;
+}
+
+// --- S1: dispfnames listing cache ---
+
+// Helper function to create the shared listing cache, caching stays off if it fails
+void initListCache()
+{
+    void *mem = mmap(NULL, sizeof(ListCache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap listing cache");
+        return;
+    }
+    memset(mem, 0, sizeof(ListCache));
+    ListCache *cache = (ListCache *)mem;
+    // The lock is shared across processes and survives a child dying while holding it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&cache->lock, &attr) != 0)
+    {
+        pthread_mutexattr_destroy(&attr);
+        munmap(mem, sizeof(ListCache));
+        return;
+    }
+    pthread_mutexattr_destroy(&attr);
+    listCache = cache;
+}
+
+// Helper function to take the listing cache lock
+static void lockListCache()
+{
+    if (pthread_mutex_lock(&listCache->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&listCache->lock);
+    }
+}
+
+// Helper function to normalize a ~S1 directory into a cache key (no trailing slash)
+static void listCacheKey(const char *dir, char *key, size_t keyLen)
+{
+    snprintf(key, keyLen, "%s", dir);
+    int len = strlen(key);
+    while (len > 3 && key[len - 1] == '/')
+    {
+        key[--len] = '\0';
+    }
+}
+
+// Helper function to map a directory key to its version bucket
+static unsigned int listVersionBucket(const char *key)
+{
+    // FNV-1a hash of the key
+    unsigned int h = 2166136261u;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h % LIST_VERSION_BUCKETS;
+}
+
+// Helper function to read the current version stamp of a ~S1 directory
+unsigned long listCacheVersion(const char *dir)
+{
+    if (!listCache)
+        return 0;
+    char key[MAX_PATH];
+    listCacheKey(dir, key, sizeof(key));
+    lockListCache();
+    unsigned long version = listCache->dirVersion[listVersionBucket(key)];
+    pthread_mutex_unlock(&listCache->lock);
+    return version;
+}
+
+// Helper function to invalidate cached listings of a ~S1 directory ("*" drops all)
+void invalidateListCache(const char *dir)
+{
+    if (!listCache)
+        return;
+    lockListCache();
+    if (strcmp(dir, "*") == 0)
+    {
+        for (int i = 0; i < LIST_VERSION_BUCKETS; i++)
+            listCache->dirVersion[i]++;
+    }
+    else
+    {
+        char key[MAX_PATH];
+        listCacheKey(dir, key, sizeof(key));
+        // Bumping the version makes every entry built against the old one stale
+        listCache->dirVersion[listVersionBucket(key)]++;
+    }
+    pthread_mutex_unlock(&listCache->lock);
+}
+
+// Helper function to invalidate the directory that contains a ~S1 file path
+void invalidateListCacheForFile(const char *filePath)
+{
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", filePath);
+    char *lastSlash = strrchr(dir, '/');
+    if (lastSlash != NULL)
+    {
+        *lastSlash = '\0';
+    }
+    invalidateListCache(dir);
+}
+
+// Helper function to look up a cached listing, returns malloc'ed blob or -1 on miss
+int lookupListCache(const char *dir, char **outBlob, int *outLen)
+{
+    *outBlob = NULL;
+    *outLen = 0;
+    if (!listCache)
+        return -1;
+    char key[MAX_PATH];
+    listCacheKey(dir, key, sizeof(key));
+    int found = -1;
+    lockListCache();
+    unsigned long version = listCache->dirVersion[listVersionBucket(key)];
+    for (int i = 0; i < LIST_CACHE_SLOTS; i++)
+    {
+        ListCacheEntry *e = &listCache->entries[i];
+        if (!e->valid || e->version != version || strcmp(e->dir, key) != 0)
+            continue;
+        // Copy out while holding the lock, the slot may be reused right after
+        if (e->len > 0)
+        {
+            *outBlob = (char *)malloc(e->len);
+            if (!*outBlob)
+                break;
+            memcpy(*outBlob, e->blob, e->len);
+        }
+        *outLen = e->len;
+        e->lastUsed = ++listCache->clock;
+        found = 0;
+        break;
+    }
+    pthread_mutex_unlock(&listCache->lock);
+    return found;
+}
+
+// Helper function to store a merged listing built against the given version stamp
+void storeListCache(const char *dir, unsigned long version, const char *blob, int len)
+{
+    if (!listCache || len > LIST_CACHE_BLOB)
+        return;
+    char key[MAX_PATH];
+    listCacheKey(dir, key, sizeof(key));
+    lockListCache();
+    // Skip the store if the directory changed while the listing was being built
+    if (listCache->dirVersion[listVersionBucket(key)] != version)
+    {
+        pthread_mutex_unlock(&listCache->lock);
+        return;
+    }
+    // Reuse the slot of the same directory, otherwise a free or least recently used slot
+    int slot = 0;
+    for (int i = 0; i < LIST_CACHE_SLOTS; i++)
+    {
+        ListCacheEntry *e = &listCache->entries[i];
+        if (e->valid && strcmp(e->dir, key) == 0)
+        {
+            slot = i;
+            break;
+        }
+        if (!e->valid)
+        {
+            slot = i;
+        }
+        else if (listCache->entries[slot].valid && e->lastUsed < listCache->entries[slot].lastUsed)
+        {
+            slot = i;
+        }
+    }
+    ListCacheEntry *e = &listCache->entries[slot];
+    snprintf(e->dir, sizeof(e->dir), "%s", key);
+    e->version = version;
+    e->len = len;
+    if (len > 0)
+        memcpy(e->blob, blob, len);
+    e->lastUsed = ++listCache->clock;
+    e->valid = 1;
+    pthread_mutex_unlock(&listCache->lock);
+}
+
+// Function to handle the features handshake: features <codec>...
+void handleFeatures(int con_sd, char *commandArgs[], int *count)
+{
+    // Deflate frames and trace contexts are known, the reply lists the ones both sides use
+    clientWireDeflate = 0;
+    int clientTrace = 0;
+    for (int i = 1; i < *count; i++)
+    {
+        if (strcmp(commandArgs[i], "deflate") == 0)
+        {
+            clientWireDeflate = 1;
+        }
+        else if (strcmp(commandArgs[i], "trace") == 0)
+        {
+            clientTrace = 1;
+        }
+    }
+    char reply[64];
+    snprintf(reply, sizeof(reply), "features%s%s", clientWireDeflate ? " deflate" : "", clientTrace ? " trace" : "");
+    if (!clientWireDeflate && !clientTrace)
+        snprintf(reply, sizeof(reply), "features none");
+    write(con_sd, reply, strlen(reply));
+}
+
+// Helper function to tell whether a connection comes from this host or from a node of the routing table
+static int fromPeerAddress(int con_sd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(con_sd, (struct sockaddr *)&addr, &len) != 0 || addr.sin_family != AF_INET)
+        return 0;
+    if ((ntohl(addr.sin_addr.s_addr) >> 24) == 127)
+        return 1;
+    for (int i = 0; i < routing.nodeCount; i++)
+    {
+        struct in_addr nodeAddr;
+        if (inet_pton(AF_INET, routing.nodes[i].ip, &nodeAddr) > 0 && nodeAddr.s_addr == addr.sin_addr.s_addr)
+            return 1;
+    }
+    return 0;
+}
+
+// Function to handle invalidate command (sent by peers after their own changes)
+void handleInvalidate(int con_sd, char *commandArgs[], int *count)
+{
+    // Only the peers may drop cached listings, a client could otherwise force every dispfnames to the peers
+    if (!fromPeerAddress(con_sd))
+    {
+        const char *msg = "Error: invalidate is only accepted from the storage servers";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    if (*count != 2 || (strncmp(commandArgs[1], "~S1", 3) != 0 && strcmp(commandArgs[1], "*") != 0))
+    {
+        const char *msg = "Error: invalidate requires a ~S1 directory or *";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    invalidateListCache(commandArgs[1]);
+    const char *ok = "Success: Listing cache invalidated";
+    write(con_sd, ok, strlen(ok));
+}
+
+// Removal log helpers (recordRemoval), shared with the other servers
+#include "s25RemovalLog.h"
+
+// Store a file on every replica of its route: S1 keeps its own copy, remote replicas get it
+// through one chain. The upload succeeds as soon as the write quorum stored it.
+static int uploadReplicas(const Route *route, const char *tildePath, const char *localPath, const char *fileBuffer, int fileSize, char *response)
+{
+    const StorageNode *replicas[MAX_POOL_NODES];
+    const StorageNode *remote[MAX_POOL_NODES];
+    int count = replicaNodes(route, tildePath, replicas);
+    int stored = 0, keepLocal = 0, remoteCount = 0;
+    for (int r = 0; r < count; r++)
+    {
+        if (replicas[r]->port == 0)
+        {
+            keepLocal = 1;
+            stored++;
+        }
+        else
+        {
+            remote[remoteCount++] = replicas[r];
+        }
+    }
+    char reply[MAX_BUFFER];
+    snprintf(reply, sizeof(reply), "No remote replica");
+    // An unreachable head is skipped, the next replica leads the rest of the chain
+    for (int h = 0; h < remoteCount; h++)
+    {
+        char headPath[MAX_PATH], chain[MAX_BUFFER];
+        nodePath(remote[h], tildePath, headPath, sizeof(headPath));
+        // Hops are ip:port:path separated by '|', as many as fit in one command
+        int len = 0;
+        chain[0] = '\0';
+        for (int r = h + 1; r < remoteCount; r++)
+        {
+            char hop[MAX_PATH + 96];
+            char hopPath[MAX_PATH];
+            nodePath(remote[r], tildePath, hopPath, sizeof(hopPath));
+            int hopLen = snprintf(hop, sizeof(hop), "%s%s:%d:%s", len ? "|" : "", remote[r]->ip, remote[r]->port, hopPath);
+            if ((int)strlen(headPath) + len + hopLen + 32 >= MAX_BUFFER)
+                break;
+            memcpy(chain + len, hop, hopLen + 1);
+            len += hopLen;
+        }
+        // Only the copies still missing for the quorum are waited for
+        int copies = chainUpload(remote[h], headPath, chain, fileBuffer, fileSize, route->writeQuorum - stored, reply);
+        if (copies > 0 || !strstr(reply, "Failed to connect"))
+        {
+            stored += copies;
+            break;
+        }
+    }
+    if (stored >= route->writeQuorum)
+    {
+        // Remove file from Server1 unless it is one of the replicas
+        if (!keepLocal && localPath)
+            unlink(localPath);
+        snprintf(response, MAX_BUFFER, "File uploaded successfully to Server (replicas %d/%d)", stored, count);
+        return SUCCESS;
+    }
+    // The peer's own error only says more when no remote copy was stored
+    if (stored == keepLocal)
+        snprintf(response, MAX_BUFFER, "Error: Stored on %d of %d replicas, quorum is %d: %.200s", stored, count, route->writeQuorum, reply);
+    else
+        snprintf(response, MAX_BUFFER, "Error: Stored on %d of %d replicas, quorum is %d", stored, count, route->writeQuorum);
+    return ERROR_NETWORK;
+}
+
+// --- S1: metadata catalog ---
+
+// Helper function to take the catalog lock
+static void lockCatalog()
+{
+    if (pthread_mutex_lock(&catalog->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&catalog->lock);
+    }
+}
+
+// Helper function to normalize a ~S1 file path into a catalog key (no doubled or trailing slashes)
+static void catalogKey(const char *tildePath, char *key, size_t keyLen)
+{
+    size_t n = 0;
+    for (const char *p = tildePath; *p && n + 1 < keyLen; p++)
+    {
+        if (*p == '/' && n > 0 && key[n - 1] == '/')
+            continue;
+        key[n++] = *p;
+    }
+    while (n > 3 && key[n - 1] == '/')
+        n--;
+    key[n] = '\0';
+}
+
+// Helper function to hash a catalog key (FNV-1a)
+static unsigned int catalogHash(const char *key)
+{
+    unsigned int h = 2166136261u;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Helper function to probe for a key under the lock: returns its slot with *found set, otherwise the
+// first reusable slot on its probe path, -1 when the table has no room left
+static int catalogSlot(const char *key, unsigned int h, int *found)
+{
+    int reuse = -1;
+    *found = 0;
+    for (int n = 0; n < CATALOG_SLOTS; n++)
+    {
+        int slot = (h + n) % CATALOG_SLOTS;
+        CatalogEntry *e = &catalog->entries[slot];
+        if (e->state == CATALOG_FREE)
+            return reuse >= 0 ? reuse : slot;
+        if (e->state == CATALOG_DELETED)
+        {
+            if (reuse < 0)
+                reuse = slot;
+        }
+        else if (e->keyHash == h && strcmp(e->path, key) == 0)
+        {
+            *found = 1;
+            return slot;
+        }
+    }
+    return reuse;
+}
+
+// Helper function to hash a file path for the removals ring (64 bit FNV-1a of its catalog key)
+static unsigned long long removalHash(const char *tildePath)
+{
+    char key[MAX_PATH];
+    catalogKey(tildePath, key, sizeof(key));
+    unsigned long long h = 14695981039346656037ull;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Note a file about to be removed. It is noted before its copies go, so a copy the rebalancer lands or an
+// entry the catalog scan lists after the removal missed it is seen by their checks and not kept
+void noteRemoval(const char *tildePath)
+{
+    if (!migration)
+        return;
+    unsigned long n = __atomic_fetch_add(&migration->removals, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&migration->removedHashes[n % RECENT_REMOVALS], removalHash(tildePath), __ATOMIC_SEQ_CST);
+}
+
+// Helper function to get the count of removals noted so far, the mark removedSince starts from
+static unsigned long removalMark()
+{
+    return migration ? __atomic_load_n(&migration->removals, __ATOMIC_SEQ_CST) : 0;
+}
+
+// Helper function to tell whether a file was removed since a mark. When more removals than the ring holds
+// came since, the oldest are no longer known and only the ones still in the ring count
+static int removedSince(const char *tildePath, unsigned long mark)
+{
+    unsigned long end = removalMark();
+    if (end - mark > RECENT_REMOVALS)
+        mark = end - RECENT_REMOVALS;
+    unsigned long long h = removalHash(tildePath);
+    for (unsigned long n = mark; n < end; n++)
+        if (__atomic_load_n(&migration->removedHashes[n % RECENT_REMOVALS], __ATOMIC_SEQ_CST) == h)
+            return 1;
+    return 0;
+}
+
+// Helper function to add or update an entry. keepExisting is for a file a node listed at removal mark
+// listedAt: an entry that is already there is left alone, and a file removed since is not added back.
+static int catalogPut(const char *tildePath, const char *node, long long size, int hasCrc, unsigned int crc, long mtime,
+                      int keepExisting, unsigned long listedAt)
+{
+    if (!catalog)
+        return -1;
+    char key[MAX_PATH];
+    catalogKey(tildePath, key, sizeof(key));
+    unsigned int h = catalogHash(key);
+    lockCatalog();
+    int found;
+    int slot = catalogSlot(key, h, &found);
+    // Past the load limit new files go unrecorded, so a missing entry stops meaning a missing file
+    if (slot < 0 || (!found && catalog->entries[slot].state == CATALOG_FREE &&
+                     catalog->used + 1 > (long)CATALOG_SLOTS * CATALOG_MAX_LOAD_PCT / 100))
+    {
+        catalog->overflow = 1;
+        pthread_mutex_unlock(&catalog->lock);
+        return -1;
+    }
+    CatalogEntry *e = &catalog->entries[slot];
+    // Checked under the lock: a removal noted after it forgets the entry only once it is in
+    if (keepExisting && (found || removedSince(tildePath, listedAt)))
+    {
+        pthread_mutex_unlock(&catalog->lock);
+        return 0;
+    }
+    if (!found)
+    {
+        if (e->state == CATALOG_FREE)
+            catalog->used++;
+        catalog->live++;
+        snprintf(e->path, sizeof(e->path), "%s", key);
+        e->keyHash = h;
+    }
+    snprintf(e->node, sizeof(e->node), "%s", node);
+    e->size = size;
+    e->hasCrc = hasCrc;
+    e->crc = crc;
+    e->mtime = mtime;
+    e->state = CATALOG_USED;
+    pthread_mutex_unlock(&catalog->lock);
+    return 0;
+}
+
+// Helper function to drop the tombstones of removed files, run once at start before any child exists
+static void compactCatalog()
+{
+    if (catalog->used == catalog->live)
+        return;
+    CatalogEntry *live = catalog->live > 0 ? (CatalogEntry *)malloc(catalog->live * sizeof(CatalogEntry)) : NULL;
+    if (catalog->live > 0 && !live)
+        return;
+    long count = 0;
+    for (int i = 0; i < CATALOG_SLOTS; i++)
+    {
+        CatalogEntry *e = &catalog->entries[i];
+        if (e->state == CATALOG_USED && count < catalog->live)
+            live[count++] = *e;
+        // Free slots are left untouched so their pages stay unallocated
+        if (e->state != CATALOG_FREE)
+            e->state = CATALOG_FREE;
+    }
+    catalog->used = catalog->live = 0;
+    for (long i = 0; i < count; i++)
+        catalogPut(live[i].path, live[i].node, live[i].size, live[i].hasCrc, live[i].crc, live[i].mtime, 0, 0);
+    free(live);
+}
+
+// Helper function to map the catalog file, every lookup falls back to asking the nodes if it fails.
+// A file with another layout is started over, the catalog scan fills it again.
+void initCatalog()
+{
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/S1", getenv("HOME"));
+    mkdir(path, 0755);
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s", CATALOG_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror("open catalog");
+        return;
+    }
+    // The leading fields of Catalog
+    struct
+    {
+        char magic[4];
+        int version;
+        int slots;
+    } header;
+    struct stat st;
+    int valid = fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(Catalog) &&
+                pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                memcmp(header.magic, CATALOG_MAGIC, 4) == 0 && header.version == CATALOG_VERSION && header.slots == CATALOG_SLOTS;
+    // The table stays sparse on disk, only slots that were used take space
+    if (!valid && (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(Catalog)) != 0))
+    {
+        perror("size catalog");
+        close(fd);
+        return;
+    }
+    void *mem = mmap(NULL, sizeof(Catalog), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap catalog");
+        return;
+    }
+    Catalog *cat = (Catalog *)mem;
+    memcpy(cat->magic, CATALOG_MAGIC, 4);
+    cat->version = CATALOG_VERSION;
+    cat->slots = CATALOG_SLOTS;
+    cat->complete = 0;
+    cat->overflow = 0;
+    // The lock of an earlier run is stale, it is set up again like the listing cache's
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&cat->lock, &attr) != 0)
+    {
+        pthread_mutexattr_destroy(&attr);
+        munmap(mem, sizeof(Catalog));
+        return;
+    }
+    pthread_mutexattr_destroy(&attr);
+    catalog = cat;
+    compactCatalog();
+}
+
+// Look up a file: 1 with *out filled when it is catalogued, 0 when it certainly does not exist and -1
+// when only the nodes can tell (catalog unavailable, not scanned yet or full)
+int catalogLookup(const char *tildePath, CatalogEntry *out)
+{
+    if (!catalog)
+        return -1;
+    char key[MAX_PATH];
+    catalogKey(tildePath, key, sizeof(key));
+    unsigned int h = catalogHash(key);
+    lockCatalog();
+    int found;
+    int slot = catalogSlot(key, h, &found);
+    if (found)
+        *out = catalog->entries[slot];
+    int known = catalog->complete && !catalog->overflow;
+    pthread_mutex_unlock(&catalog->lock);
+    return found ? 1 : known ? 0 : -1;
+}
+
+// Record a file its nodes just stored
+void catalogRecord(const char *tildePath, const char *node, const char *data, int size)
+{
+    unsigned int crc = crc32(0L, (const Bytef *)data, size);
+    catalogPut(tildePath, node, size, 1, crc, (long)time(NULL), 0, 0);
+}
+
+// Record the node a file moved to, keeping what is known about its content
+void catalogMoved(const char *tildePath, const char *node)
+{
+    CatalogEntry e;
+    if (catalogLookup(tildePath, &e) == 1)
+        catalogPut(tildePath, node, e.size, e.hasCrc, e.crc, e.mtime, 0, 0);
+    else
+        catalogPut(tildePath, node, -1, 0, 0, 0, 0, 0);
+}
+
+// Forget a removed file, its slot becomes a tombstone so later probes continue past it
+void catalogForget(const char *tildePath)
+{
+    if (!catalog)
+        return;
+    char key[MAX_PATH];
+    catalogKey(tildePath, key, sizeof(key));
+    unsigned int h = catalogHash(key);
+    lockCatalog();
+    int found;
+    int slot = catalogSlot(key, h, &found);
+    if (found)
+    {
+        catalog->entries[slot].state = CATALOG_DELETED;
+        catalog->live--;
+    }
+    pthread_mutex_unlock(&catalog->lock);
+}
+
+// --- S1: peer Bloom filters ---
+
+// Helper function to map the shared Bloom filters, every node counts as maybe holding a file if it fails
+void initBloomFilters()
+{
+    void *mem = mmap(NULL, sizeof(BloomFilters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap bloom filters");
+        return;
+    }
+    BloomFilters *filters = (BloomFilters *)mem;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&filters->lock, &attr) != 0)
+    {
+        pthread_mutexattr_destroy(&attr);
+        munmap(mem, sizeof(BloomFilters));
+        return;
+    }
+    pthread_mutexattr_destroy(&attr);
+    blooms = filters;
+}
+
+// Helper function to take the Bloom filter lock
+static void lockBlooms()
+{
+    if (pthread_mutex_lock(&blooms->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&blooms->lock);
+    }
+}
+
+// Helper function to hash a Bloom filter key, 64-bit FNV-1a with a final mix so the low bits spread too
+static unsigned long long bloomHash(const char *key)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Helper function to set the bits of a key, probes are h1 + i * h2 over a power of two bit count
+static void bloomSet(unsigned char *bits, unsigned int nbits, int hashes, unsigned long long h)
+{
+    unsigned int h1 = (unsigned int)h;
+    unsigned int h2 = (unsigned int)(h >> 32) | 1;
+    for (int i = 0; i < hashes; i++)
+    {
+        unsigned int bit = (h1 + i * h2) & (nbits - 1);
+        bits[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+    }
+}
+
+// Helper function to test the bits of a key
+static int bloomTest(const unsigned char *bits, unsigned int nbits, int hashes, unsigned long long h)
+{
+    unsigned int h1 = (unsigned int)h;
+    unsigned int h2 = (unsigned int)(h >> 32) | 1;
+    for (int i = 0; i < hashes; i++)
+    {
+        unsigned int bit = (h1 + i * h2) & (nbits - 1);
+        if (!(bits[bit >> 3] & (1 << (bit & 7))))
+            return 0;
+    }
+    return 1;
+}
+
+// Helper function to build the key a peer filters a file under: its absolute path on the node. Paths
+// the peers leave out of their filters (hidden names) give -1.
+static int bloomKey(const StorageNode *node, const char *tildePath, char *key, size_t keyLen)
+{
+    char normal[MAX_PATH];
+    catalogKey(tildePath, normal, sizeof(normal));
+    if (strncmp(normal, "~S1/", 4) != 0 || strstr(normal, "/.") != NULL)
+        return -1;
+    nodePath(node, normal, key, keyLen);
+    return 0;
+}
+
+// Helper function to find the filter of a node and extension under the lock, optionally claiming a slot
+static BloomFilter *bloomSlot(const char *ip, int port, const char *root, const char *ext, int create)
+{
+    BloomFilter *empty = NULL;
+    for (int i = 0; i < BLOOM_SLOTS; i++)
+    {
+        BloomFilter *f = &blooms->filters[i];
+        if (!f->used)
+        {
+            if (!empty)
+                empty = f;
+            continue;
+        }
+        if (f->port == port && strcmp(f->ip, ip) == 0 && strcmp(f->root, root) == 0 && strcmp(f->ext, ext) == 0)
+            return f;
+    }
+    if (!create || !empty)
+        return NULL;
+    memset(empty, 0, offsetof(BloomFilter, recent));
+    empty->used = 1;
+    snprintf(empty->ip, sizeof(empty->ip), "%s", ip);
+    empty->port = port;
+    snprintf(empty->root, sizeof(empty->root), "%s", root);
+    snprintf(empty->ext, sizeof(empty->ext), "%s", ext);
+    return empty;
+}
+
+// Set a file's bits in the node's filter, called before the file is stored there
+void bloomAdd(const StorageNode *node, const char *tildePath)
+{
+    char key[MAX_PATH];
+    if (!blooms || node->port == 0 || bloomKey(node, tildePath, key, sizeof(key)) != 0)
+        return;
+    unsigned long long h = bloomHash(key);
+    lockBlooms();
+    BloomFilter *f = bloomSlot(node->ip, node->port, node->root, getFileExtension((char *)tildePath), 1);
+    if (f)
+    {
+        if (f->bytes > 0)
+            bloomSet(f->bits, f->bytes * 8, f->hashes, h);
+        f->recent[f->addSeq % BLOOM_RECENT] = h;
+        f->addSeq++;
+        f->added++;
+    }
+    pthread_mutex_unlock(&blooms->lock);
+}
+
+// Note a file removed from a node, its bits stay set until the filter is fetched again
+void bloomRemoved(const StorageNode *node, const char *tildePath)
+{
+    if (!blooms || node->port == 0)
+        return;
+    lockBlooms();
+    BloomFilter *f = bloomSlot(node->ip, node->port, node->root, getFileExtension((char *)tildePath), 0);
+    if (f)
+        f->removals++;
+    pthread_mutex_unlock(&blooms->lock);
+}
+
+// Tell whether a node may hold a file, 0 only when its filter rules the file out. S1's own files and
+// nodes without a filter yet are always asked.
+int bloomMayHave(const StorageNode *node, const char *tildePath)
+{
+    char key[MAX_PATH];
+    if (!blooms || node->port == 0 || bloomKey(node, tildePath, key, sizeof(key)) != 0)
+        return 1;
+    unsigned long long h = bloomHash(key);
+    lockBlooms();
+    BloomFilter *f = bloomSlot(node->ip, node->port, node->root, getFileExtension((char *)tildePath), 0);
+    int may = !f || f->bytes == 0 || bloomTest(f->bits, f->bytes * 8, f->hashes, h);
+    pthread_mutex_unlock(&blooms->lock);
+    return may;
+}
+
+// Helper function to count a miss that no peer had to answer
+static void bloomRejected()
+{
+    if (blooms)
+        __atomic_add_fetch(&blooms->rejected, 1, __ATOMIC_RELAXED);
+}
+
+// --- S1: write-behind forward queue ---
+
+// Forwarder process draining the queue, the children wake it when they queue a file
+pid_t forwarderPid = 0;
+volatile sig_atomic_t forwardWake = 0;
+
+// Store an uploaded file on the nodes of its route and catalog it. localPath is the copy staged on S1,
+// removed once the nodes have it (NULL when there is none).
+static int storeRoutedFile(const Route *route, const char *tildePath, const char *localPath, const char *fileBuffer, int fileSize, char *response)
+{
+    const StorageNode *node = routeNode(route, tildePath);
+    // The filters learn about the file first, a reader may look for it as soon as one node has it
+    const StorageNode *targets[MAX_POOL_NODES];
+    int targetCount = replicaNodes(route, tildePath, targets);
+    for (int t = 0; t < targetCount; t++)
+        bloomAdd(targets[t], tildePath);
+    int result;
+    if (route->dataShards > 0)
+    {
+        result = uploadErasure(route, tildePath, localPath, fileBuffer, fileSize, response);
+    }
+    else if (route->replicas > 1)
+    {
+        result = uploadReplicas(route, tildePath, localPath, fileBuffer, fileSize, response);
+    }
+    else if (node->port == 0)
+    {
+        // Files routed to S1 itself are already in place
+        snprintf(response, MAX_BUFFER, "File uploaded successfully to Server");
+        result = SUCCESS;
+    }
+    else
+    {
+        // Rewrite the path into the node's root and send the file there
+        char modifiedPath[MAX_PATH];
+        nodePath(node, tildePath, modifiedPath, sizeof(modifiedPath));
+        result = communicateWithServer("uploadf", modifiedPath, (char *)fileBuffer, fileSize, node->ip, node->port, response);
+        // Remove file from Server1 if successfully sent to the node
+        if (result == SUCCESS && localPath)
+            unlink(localPath);
+        else if (result == -1)
+            snprintf(response, MAX_BUFFER, "Error: Failed to connect to %s", node->name);
+    }
+    if (result == SUCCESS && !strstr(response, "Error"))
+        catalogRecord(tildePath, node->name, fileBuffer, fileSize);
+    return result;
+}
+
+// Helper function to build the path of the queue directory in S1's root
+static void forwardQueueDir(char *out, size_t outLen)
+{
+    snprintf(out, outLen, "%s/S1/%s", getenv("HOME"), FORWARD_QUEUE);
+}
+
+// Queue a file for the forwarder. The entry is a "<~S1 path>\n" line followed by the data, written under
+// a temporary name, synced and renamed, so a crash leaves the whole entry or none. Names sort by arrival
+// and end in the path's hash, so reads find pending files without opening every entry.
+static int queueForward(const char *tildePath, const char *fileBuffer, int fileSize)
+{
+    static unsigned int serial = 0;
+    char dir[MAX_PATH];
+    forwardQueueDir(dir, sizeof(dir));
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char name[64], tmp[MAX_PATH + 96], entry[MAX_PATH + 96];
+    snprintf(name, sizeof(name), "%016llx-%06d-%04x-%08x", (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec,
+             (int)getpid(), serial++ & 0xffff, ringHash(tildePath));
+    snprintf(tmp, sizeof(tmp), "%s/.%s", dir, name);
+    snprintf(entry, sizeof(entry), "%s/%s", dir, name);
+    int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    int pathLen = strlen(tildePath);
+    int ok = write(fd, tildePath, pathLen) == pathLen && write(fd, "\n", 1) == 1;
+    for (int done = 0; ok && done < fileSize;)
+    {
+        ssize_t n = write(fd, fileBuffer + done, fileSize - done);
+        ok = n > 0;
+        done += ok ? n : 0;
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, entry) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    // The rename has to reach the disk as well before the client hears back
+    int dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirFd >= 0)
+    {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    if (forwarderPid > 0)
+        kill(forwarderPid, SIGUSR1);
+    return 0;
+}
+
+// Helper function to read an entry's path and, when data is not NULL, its contents (to free)
+static int readForwardEntry(int fd, char *tildePath, size_t pathLen, char **data, int *size)
+{
+    char head[MAX_PATH + 1];
+    ssize_t n = pread(fd, head, sizeof(head) - 1, 0);
+    if (n <= 0)
+        return -1;
+    head[n] = '\0';
+    char *nl = strchr(head, '\n');
+    if (!nl || (size_t)(nl - head) >= pathLen)
+        return -1;
+    *nl = '\0';
+    memcpy(tildePath, head, nl - head + 1);
+    if (!data)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    off_t start = nl - head + 1;
+    long long len = st.st_size - start;
+    if (len <= 0 || len > MAX_FILE_SIZE || !(*data = malloc(len + 1)))
+        return -1;
+    for (long long done = 0; done < len;)
+    {
+        n = pread(fd, *data + done, len - done, start + done);
+        if (n <= 0)
+        {
+            free(*data);
+            *data = NULL;
+            return -1;
+        }
+        done += n;
+    }
+    *size = (int)len;
+    return 0;
+}
+
+// Helper function to check whether a queue entry name carries a path's hash
+static int entryMatchesHash(const char *name, const char *hash)
+{
+    size_t len = strlen(name);
+    return name[0] != '.' && len > 9 && strcmp(name + len - 8, hash) == 0 && name[len - 9] == '-';
+}
+
+// Helper function to open the newest queued entry of a path, returns the descriptor or -1
+static int openPendingEntry(const char *tildePath)
+{
+    char dir[MAX_PATH];
+    forwardQueueDir(dir, sizeof(dir));
+    DIR *d = opendir(dir);
+    if (!d)
+        return -1;
+    char hash[16];
+    snprintf(hash, sizeof(hash), "%08x", ringHash(tildePath));
+    char best[256] = "";
+    int bestFd = -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (!entryMatchesHash(de->d_name, hash) || strcmp(de->d_name, best) <= 0)
+            continue;
+        char entry[MAX_PATH + 256], queued[MAX_PATH];
+        snprintf(entry, sizeof(entry), "%s/%s", dir, de->d_name);
+        int fd = open(entry, O_RDONLY);
+        if (fd < 0)
+            continue;
+        if (readForwardEntry(fd, queued, sizeof(queued), NULL, NULL) != 0 || strcmp(queued, tildePath) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        if (bestFd >= 0)
+            close(bestFd);
+        bestFd = fd;
+        snprintf(best, sizeof(best), "%s", de->d_name);
+    }
+    closedir(d);
+    return bestFd;
+}
+
+// Send a file that is still queued to the client, returns 0 if the path has no readable entry
+static int sendPendingFile(int con_sd, const char *tildePath, char *response)
+{
+    int fd = openPendingEntry(tildePath);
+    if (fd < 0)
+        return 0;
+    char queued[MAX_PATH];
+    char *data = NULL;
+    int size = 0;
+    int found = readForwardEntry(fd, queued, sizeof(queued), &data, &size) == 0;
+    close(fd);
+    if (!found)
+        return 0;
+    sendFileToClient(con_sd, tildePath, data, size, response);
+    free(data);
+    return 1;
+}
+
+// Drop the queued entries of a path. An entry the forwarder is sending is locked, so this waits
+// for it and the nodes are asked to remove the file after it landed. Returns how many were dropped.
+static int dropPendingEntries(const char *tildePath)
+{
+    char dir[MAX_PATH];
+    forwardQueueDir(dir, sizeof(dir));
+    DIR *d = opendir(dir);
+    if (!d)
+        return 0;
+    char hash[16];
+    snprintf(hash, sizeof(hash), "%08x", ringHash(tildePath));
+    int dropped = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (!entryMatchesHash(de->d_name, hash))
+            continue;
+        char entry[MAX_PATH + 256], queued[MAX_PATH];
+        snprintf(entry, sizeof(entry), "%s/%s", dir, de->d_name);
+        int fd = open(entry, O_RDONLY);
+        if (fd < 0)
+            continue;
+        struct stat st;
+        if (flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 && st.st_nlink > 0 &&
+            readForwardEntry(fd, queued, sizeof(queued), NULL, NULL) == 0 && strcmp(queued, tildePath) == 0 &&
+            unlink(entry) == 0)
+            dropped++;
+        close(fd);
+    }
+    closedir(d);
+    return dropped;
+}
+
+// A queued entry as the forwarder knows it: the path it stores (NULL if unreadable) and its retry state
+typedef struct
+{
+    char name[64];
+    char *path;
+    unsigned int hash;
+    int attempts;
+    time_t nextTry;
+} ForwardEntry;
+
+// The forwarder's index of the queue in arrival order. It is kept between passes and only brought in step
+// with the directory when a file was queued, so a pass over a long queue lists and sorts nothing.
+typedef struct
+{
+    ForwardEntry *entries;
+    int count;
+} ForwardIndex;
+
+static void handleForwardWake(int sig)
+{
+    (void)sig;
+    forwardWake = 1;
+}
+
+// Helper function to sort entry names, which is arrival order
+static int cmpEntryName(const void *a, const void *b)
+{
+    return strcmp(((const ForwardEntry *)a)->name, ((const ForwardEntry *)b)->name);
+}
+
+// Store one queued entry on its nodes under the entry's lock, returns 0 once the entry is gone
+static int forwardEntry(const char *dir, const char *name, char *response)
+{
+    char entry[MAX_PATH + 96], tildePath[MAX_PATH];
+    snprintf(entry, sizeof(entry), "%s/%s", dir, name);
+    int fd = open(entry, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    // A removef that got the lock first unlinked the entry
+    struct stat st;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    char *data = NULL;
+    int size = 0;
+    int rc = -1;
+    if (readForwardEntry(fd, tildePath, sizeof(tildePath), &data, &size) != 0)
+    {
+        fprintf(stderr, "Forward: unreadable entry %s dropped\n", name);
+        rc = 0;
+    }
+    else
+    {
+        char ext[32];
+        snprintf(ext, sizeof(ext), "%s", getFileExtension(tildePath));
+        const Route *route = lookupRoute(ext, tildePath);
+        if (!route)
+        {
+            fprintf(stderr, "Forward: no route for %s, dropped\n", tildePath);
+            rc = 0;
+        }
+        else if (storeRoutedFile(route, tildePath, NULL, data, size, response) == SUCCESS && !strstr(response, "Error"))
+        {
+            invalidateListCacheForFile(tildePath);
+            rc = 0;
+        }
+    }
+    if (rc == 0)
+        unlink(entry);
+    close(fd);
+    free(data);
+    return rc;
+}
+
+// Helper function to bring the index in step with the queue directory: entries dropped meanwhile go, new
+// ones are read in, the others keep their path and retry state
+static void rescanForwardQueue(const char *dir, ForwardIndex *index)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    ForwardEntry *found = NULL;
+    int count = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(found->name))
+            continue;
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            ForwardEntry *grown = realloc(found, cap * sizeof(ForwardEntry));
+            if (!grown)
+                break;
+            found = grown;
+        }
+        memset(&found[count], 0, sizeof(ForwardEntry));
+        snprintf(found[count++].name, sizeof(found->name), "%s", de->d_name);
     }
-    char *baseEnd = NULL;
-    // Check the path contains /S1/
-    if (strstr(tempPath, "/S1/"))
+    closedir(d);
+    qsort(found, count, sizeof(ForwardEntry), cmpEntryName);
+    // Both lists are in name order, so one merge carries the known entries over
+    int known = 0;
+    for (int i = 0; i < count; i++)
     {
-        // Skip "/S1"
-        baseEnd = strstr(tempPath, "/S1/") + 3;
+        while (known < index->count && strcmp(index->entries[known].name, found[i].name) < 0)
+            free(index->entries[known++].path);
+        if (known < index->count && strcmp(index->entries[known].name, found[i].name) == 0)
+        {
+            found[i] = index->entries[known++];
+            continue;
+        }
+        char entry[MAX_PATH + 96], queued[MAX_PATH];
+        snprintf(entry, sizeof(entry), "%s/%s", dir, found[i].name);
+        int fd = open(entry, O_RDONLY);
+        if (fd >= 0 && readForwardEntry(fd, queued, sizeof(queued), NULL, NULL) == 0 && (found[i].path = strdup(queued)))
+            found[i].hash = ringHash(queued);
+        if (fd >= 0)
+            close(fd);
     }
-    // Iterate through the path and create subdirectories
-    for (p = baseEnd; *p; p++)
+    while (known < index->count)
+        free(index->entries[known++].path);
+    free(index->entries);
+    index->entries = found;
+    index->count = count;
+}
+
+// One pass over the queue: up to FORWARD_BATCH of the oldest entries that are due, in arrival order, so
+// entries waiting out a backoff never hold back the ones behind them. An entry with a newer one for the
+// same path is dropped, the newer upload wins; an entry that fails waits for its retry time, doubling up
+// to FORWARD_MAX_BACKOFF seconds.
+static void forwardBatch(const char *dir, ForwardIndex *index)
+{
+    time_t now = time(NULL);
+    int tried = 0, kept = 0;
+    for (int i = 0; i < index->count; i++)
     {
-        if (*p == '/')
+        ForwardEntry *e = &index->entries[i];
+        int gone = 0;
+        if (tried < FORWARD_BATCH && e->nextTry <= now)
         {
-            *p = 0;
-            int result = mkdir(tempPath, 0755);
-            if (result == -1 && errno != EEXIST)
+            int superseded = 0;
+            for (int j = i + 1; j < index->count && e->path && !superseded; j++)
+                superseded = index->entries[j].path && index->entries[j].hash == e->hash && strcmp(index->entries[j].path, e->path) == 0;
+            char response[MAX_BUFFER];
+            if (superseded)
             {
-                return -1;
+                char entry[MAX_PATH + 96];
+                snprintf(entry, sizeof(entry), "%s/%s", dir, e->name);
+                unlink(entry);
+                gone = 1;
+            }
+            else if (forwardEntry(dir, e->name, response) == 0)
+            {
+                tried++;
+                gone = 1;
+            }
+            else
+            {
+                tried++;
+                int wait = e->attempts < 6 ? 1 << e->attempts : FORWARD_MAX_BACKOFF;
+                e->attempts++;
+                e->nextTry = time(NULL) + (wait < FORWARD_MAX_BACKOFF ? wait : FORWARD_MAX_BACKOFF);
+                fprintf(stderr, "Forward: %s not stored (%s), retry in %d s\n", e->path ? e->path : e->name, response, wait);
             }
-            *p = '/';
         }
+        if (gone)
+            free(e->path);
+        else
+            index->entries[kept++] = *e;
     }
-    int result = mkdir(tempPath, 0755);
-    if (result == -1 && errno != EEXIST)
-    {
-        return -1;
-    }
-    return 0;
+    index->count = kept;
 }
 
-// Helper function to spilt the command
-int tokenizeCommand(char *input, char *commandArgs[], int *count)
+// Forwarder process: drains the queue, then sleeps until a child queues a file or a retry is due
+static void runForwarder()
 {
-    // Copy input to copyInput
-    char copyInput[MAX_BUFFER];
-    strcpy(copyInput, input);
-    char *delimiter = " \t";
-    // Split on the base of delimiter using strtok
-    char *portion = strtok(copyInput, delimiter);
-    while (portion != NULL)
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleForwardWake;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    ForwardIndex index = {NULL, 0};
+    time_t scanned = 0;
+    char dir[MAX_PATH];
+    forwardQueueDir(dir, sizeof(dir));
+    for (;;)
     {
-        commandArgs[*count] = malloc(strlen(portion) + 1);
-        if (commandArgs[*count] == NULL)
+        // The periodic rescan also finds files whose wake went to a forwarder since replaced
+        if (forwardWake || time(NULL) - scanned >= FORWARD_RESCAN_SEC)
         {
-            printf("\nError: Memory allocation failed.\n");
-            return 0;
+            forwardWake = 0;
+            rescanForwardQueue(dir, &index);
+            scanned = time(NULL);
         }
-        // Copy the split portion to commandArgs[]
-        strcpy(commandArgs[*count], portion);
-        // Increment the count
-        (*count)++;
-        portion = strtok(NULL, delimiter);
+        forwardBatch(dir, &index);
+        if (!forwardWake)
+            sleep(FORWARD_POLL_SEC);
     }
-    return 1;
+}
+
+// Fork the forwarder, it also drains entries left by an earlier run
+static void startForwarder()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        runForwarder();
+        exit(0);
+    }
+    if (pid < 0)
+        perror("\nFork Failed.\n");
+    else
+        forwarderPid = pid;
 }
 
 // Function to handle uploadf command
@@ -390,7 +4204,10 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
         strcpy(destPath, temp);
     }
     // Create the directory for the dest path
-    if (createDirectory(destPath) == -1)
+    unsigned long begin = stageBegin();
+    int created = createDirectory(destPath);
+    stageEnd(STAGE_MKDIR, begin);
+    if (created == -1)
     {
         char *errorMsg = "\nError: Failed to create directory on server.\n";
         write(con_sd, errorMsg, strlen(errorMsg));
@@ -401,9 +4218,11 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
     {
         char filename[MAX_PATH];
         char filepath[MAX_PATH];
+        char tildePath[MAX_PATH];
         char extension[32];
         char *fileBuffer;
         int fileSize;
+        int writeBehind;
     } FileInfo;
     // Create array of structure
     FileInfo files[3];
@@ -414,10 +4233,27 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
         // Copy file name from command
         strcpy(files[i].filename, commandArgs[i + 1]);
         snprintf(files[i].filepath, sizeof(files[i].filepath), "%s/%s", destPath, files[i].filename);
+        // The ~S1 path the file is routed by
+        if (snprintf(files[i].tildePath, sizeof(files[i].tildePath), "%s/%s", path, files[i].filename) >= (int)sizeof(files[i].tildePath))
+        {
+            char *errorMsg = "\nError: File path too long.\n";
+            write(con_sd, errorMsg, strlen(errorMsg));
+            for (int j = 0; j < i; j++)
+            {
+                if (files[j].fileBuffer)
+                {
+                    free(files[j].fileBuffer);
+                }
+            }
+            return;
+        }
         // Get and copy the file extension
         strcpy(files[i].extension, getFileExtension(files[i].filename));
         // Read file size first using write
-        if (read(con_sd, &files[i].fileSize, sizeof(int)) <= 0)
+        begin = stageBegin();
+        int sizeRead = read(con_sd, &files[i].fileSize, sizeof(int));
+        stageEnd(STAGE_CLIENT_RECV, begin);
+        if (sizeRead <= 0)
         {
             char *errorMsg = "\nError: Failed to receive file size.\n";
             write(con_sd, errorMsg, strlen(errorMsg));
@@ -444,6 +4280,7 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
             }
             return;
         }
+        workloadNoteSize(files[i].filename, files[i].fileSize);
         // Allocate buffer for file data
         files[i].fileBuffer = malloc(files[i].fileSize + 1);
         if (!files[i].fileBuffer)
@@ -459,8 +4296,11 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
             }
             return;
         }
-        // Receive file data in chunks
-        int bytesReceived = receiveDataInChunks(con_sd, files[i].fileBuffer, files[i].fileSize);
+        // Receive file data in chunks, as deflate frames if the client negotiated them
+        begin = stageBegin();
+        int bytesReceived = clientWireDeflate ? receiveCompressedData(con_sd, files[i].fileBuffer, files[i].fileSize)
+                                              : receiveDataInChunks(con_sd, files[i].fileBuffer, files[i].fileSize);
+        stageEnd(STAGE_CLIENT_RECV, begin);
         // Error if entire file is not read/received
         if (bytesReceived != files[i].fileSize)
         {
@@ -475,8 +4315,16 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
             }
             return;
         }
+        // Write-behind files are journaled when they are routed below instead of staged here
+        const Route *route = lookupRoute(files[i].extension, files[i].tildePath);
+        files[i].writeBehind = route && route->writeBehind;
+        if (files[i].writeBehind)
+        {
+            continue;
+        }
         // Store file on Server1 first
         // Use open to create the file
+        begin = stageBegin();
         int fd = open(files[i].filepath, O_CREAT | O_WRONLY, 0777);
         // Error if open fails
         if (fd < 0)
@@ -509,78 +4357,41 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
             return;
         }
         close(fd);
+        stageEnd(STAGE_LOCAL_IO, begin);
     }
-    // Now process each file based on extension
+    // Now route each file to the node that owns it
     for (int i = 0; i < numFiles; i++)
     {
         char response[MAX_BUFFER];
-        int result = SUCCESS;
-        // If the file is '.c'
-        if (strcmp(files[i].extension, ".c") == 0)
+        const char *tildePath = files[i].tildePath;
+        const Route *route = lookupRoute(files[i].extension, tildePath);
+        // No route for this extension, do not keep the file
+        if (!route)
         {
-            // Send success as file is already on server 1
-            snprintf(response, sizeof(response), "File uploaded successfully to Server");
+            unlink(files[i].filepath);
+            snprintf(response, sizeof(response), "Error: No route for %s files", files[i].extension);
         }
-        // If the file is '.pdf'
-        else if (strcmp(files[i].extension, ".pdf") == 0)
+        else if (files[i].writeBehind)
         {
-            // Copy the filepath to modifiedPath
-            char modifiedPath[MAX_PATH];
-            strcpy(modifiedPath, files[i].filepath);
-            char *s1_ptr = strstr(modifiedPath, "/S1/");
-            // Change S1 to S2
-            if (s1_ptr != NULL)
+            // Acknowledged once the entry is on S1's disk, the forwarder stores it on the nodes
+            begin = stageBegin();
+            int queued = queueForward(tildePath, files[i].fileBuffer, files[i].fileSize);
+            stageEnd(STAGE_JOURNAL, begin);
+            if (queued == 0)
             {
-                s1_ptr[2] = '2';
+                snprintf(response, sizeof(response), "File uploaded successfully to Server (queued)");
             }
-            // Send the command, path, fileInfo to server2 using communicateWithServer
-            result = communicateWithServer("uploadf", modifiedPath, files[i].fileBuffer, files[i].fileSize, server2_ip, server2_port, response, 0);
-            // Remove file from Server1 if successfully sent to Server2
-            if (result == SUCCESS)
-            {
-                unlink(files[i].filepath);
-            }
-        }
-        // If the file is '.txt'
-        else if (strcmp(files[i].extension, ".txt") == 0)
-        {
-            // Copy the filepath to modifiedPath
-            char modifiedPath[MAX_PATH];
-            strcpy(modifiedPath, files[i].filepath);
-            char *s1_ptr = strstr(modifiedPath, "/S1/");
-            // Change S1 to S3
-            if (s1_ptr != NULL)
-            {
-                s1_ptr[2] = '3';
-            }
-            // Send the command, path, fileInfo to server3 using communicateWithServer
-            result = communicateWithServer("uploadf", modifiedPath, files[i].fileBuffer, files[i].fileSize, server3_ip, server3_port, response, 0);
-            // Remove file from Server1 if successfully sent to Server3
-            if (result == SUCCESS)
+            else
             {
-                unlink(files[i].filepath);
+                snprintf(response, sizeof(response), "Error: Failed to queue file on Server1");
             }
         }
-        // If the file is '.zip'
-        else if (strcmp(files[i].extension, ".zip") == 0)
+        else
         {
-            // Copy the filepath to modifiedPath
-            char modifiedPath[MAX_PATH];
-            strcpy(modifiedPath, files[i].filepath);
-            char *s1_ptr = strstr(modifiedPath, "/S1/");
-            // Change S1 to S4
-            if (s1_ptr != NULL)
-            {
-                s1_ptr[2] = '4';
-            }
-            // Send the command, path, fileInfo to server3 using communicateWithServer
-            result = communicateWithServer("uploadf", modifiedPath, files[i].fileBuffer, files[i].fileSize, server4_ip, server4_port, response, 0);
-            // Remove file from Server1 if successfully sent to Server4
-            if (result == SUCCESS)
-            {
-                unlink(files[i].filepath);
-            }
+            storeRoutedFile(route, tildePath, files[i].filepath, files[i].fileBuffer, files[i].fileSize, response);
         }
+        // Drop cached listings of the destination before acknowledging
+        invalidateListCache(path);
         // Write the response to the client
         write(con_sd, response, strlen(response));
         // Free the file buffer
@@ -590,9 +4401,117 @@ void handleUploadf(int con_sd, char *commandArgs[], int *count)
     rmdir(destPath);
 }
 
+// Helper function to send a file kept on S1 itself to the client
+static void sendLocalFile(int con_sd, const char *tildePath)
+{
+    char response[MAX_BUFFER];
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s", tildePath);
+    char destPath[MAX_PATH];
+    strcpy(destPath, path);
+    // Prepare the destPath
+    // Replace ~S1 with /home/user/S1
+    if (strncmp(destPath, "~S1", 3) == 0)
+    {
+        char *home = getenv("HOME");
+        char temp[MAX_PATH];
+        sprintf(temp, "%s/S1%s", home, destPath + 3);
+        strcpy(destPath, temp);
+    }
+    // Check the file exist on the dest path
+    if (!validateFileExist(destPath))
+    {
+        snprintf(response, sizeof(response), "Error: File does not exist on Server");
+        write(con_sd, response, strlen(response));
+        return;
+    }
+    // Get file size
+    struct stat st;
+    stat(destPath, &st);
+    int fileSize = st.st_size;
+    char *fileBuffer = malloc(fileSize + 1);
+    if (!fileBuffer)
+    {
+        snprintf(response, sizeof(response), "Error: Memory allocation failed");
+        write(con_sd, response, strlen(response));
+        return;
+    }
+    // Open file
+    int fd = open(destPath, O_RDONLY);
+    if (fd < 0)
+    {
+        free(fileBuffer);
+        snprintf(response, sizeof(response), "Error: Failed to open file on server");
+        write(con_sd, response, strlen(response));
+        return;
+    }
+    // Read file data locally
+    unsigned long begin = stageBegin();
+    int bytesRead = read(fd, fileBuffer, fileSize);
+    // Close file
+    close(fd);
+    stageEnd(STAGE_LOCAL_IO, begin);
+    // Error if entire file is not read
+    if (bytesRead != fileSize)
+    {
+        free(fileBuffer);
+        snprintf(response, sizeof(response), "Error: Failed to read file on server");
+        write(con_sd, response, strlen(response));
+        return;
+    }
+    // Send success read to client first
+    snprintf(response, sizeof(response), "Success: File found and ready to transfer");
+    if (write(con_sd, response, strlen(response)) <= 0)
+    {
+        free(fileBuffer);
+        return;
+    }
+    // Sleep for 10ms
+    protocolPause(10000);
+    // Send file name to client using write
+    char *lastSlash = strrchr(destPath, '/');
+    char *fileName = (lastSlash == NULL) ? destPath : lastSlash + 1;
+    if (write(con_sd, fileName, strlen(fileName)) <= 0)
+    {
+        free(fileBuffer);
+        return;
+    }
+    protocolPause(10000);
+    // Use htonl to convert host bytes to network bytes
+    uint32_t networkFileSizeClient = htonl((uint32_t)fileSize);
+    // Send file size to server using write
+    if (write(con_sd, &networkFileSizeClient, sizeof(networkFileSizeClient)) != sizeof(networkFileSizeClient))
+    {
+        strcpy(response, "Error: Failed to send file size");
+        free(fileBuffer);
+        return;
+    }
+    workloadNoteSize(tildePath, fileSize);
+    protocolPause(10000);
+    // Send file data in chunk to client, as deflate frames if it negotiated them
+    begin = stageBegin();
+    int sent = clientWireDeflate ? sendCompressedData(con_sd, fileBuffer, fileSize, wireWorthCompressing(destPath, fileBuffer, fileSize))
+                                 : sendDataInChunks(con_sd, fileBuffer, fileSize);
+    stageEnd(STAGE_CLIENT_SEND, begin);
+    if (sent != fileSize)
+    {
+        strcpy(response, "Error: Failed to send file data to clinet");
+        free(fileBuffer);
+        return;
+    }
+    // Free the file buffer
+    free(fileBuffer);
+}
+
 // Function to handle downlf command
 void handleDownlf(int con_sd, char *commandArgs[], int *count)
 {
+    // Random picks for replica selection, seeded per child
+    static unsigned int readSeed = 0;
+    if (readSeed == 0)
+    {
+        readSeed = (unsigned int)getpid() ^ (unsigned int)time(NULL);
+    }
     // Loop through each path
     for (int i = 1; i < *count; i++)
     {
@@ -600,166 +4519,148 @@ void handleDownlf(int con_sd, char *commandArgs[], int *count)
         char ext[32];
         // Copy the file extension to ext
         snprintf(ext, sizeof(ext), "%s", getFileExtension(commandArgs[i]));
-        // If extension is '.c'
-        if (strcmp(ext, ".c") == 0)
+        // Find the nodes that hold the file
+        const Route *route = lookupRoute(ext, commandArgs[i]);
+        if (!route)
         {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
-            char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare the destPath
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
-            {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
-            }
-            // Check the file exist on the dest path
-            if (!validateFileExist(destPath))
+            snprintf(response, sizeof(response), "Error: Invalid extension");
+            write(con_sd, response, strlen(response));
+            continue;
+        }
+        // A write-behind file still queued on S1 is read from its entry
+        if (route->writeBehind && sendPendingFile(con_sd, commandArgs[i], response))
+        {
+            continue;
+        }
+        // The catalog answers for files that were never stored, without asking the nodes
+        CatalogEntry known;
+        int catalogued = catalogLookup(commandArgs[i], &known);
+        if (catalogued == 0)
+        {
+            snprintf(response, sizeof(response), "Error: File does not exist on Server");
+            write(con_sd, response, strlen(response));
+            continue;
+        }
+        const StorageNode *candidates[MAX_POOL_NODES * 2];
+        int candidateCount = readCandidates(route, ext, commandArgs[i], &readSeed, candidates);
+        // A single copy is read where the catalog last saw it, a migration may not have moved it yet
+        for (int c = 1; c < candidateCount && catalogued == 1 && route->replicas <= 1; c++)
+        {
+            if (strcmp(candidates[c]->name, known.node) == 0)
             {
-                snprintf(response, sizeof(response), "Error: File does not exist on Server");
-                write(con_sd, response, strlen(response));
-                continue;
+                const StorageNode *holder = candidates[c];
+                candidates[c] = candidates[0];
+                candidates[0] = holder;
+                break;
             }
-            // Get file size
-            struct stat st;
-            stat(destPath, &st);
-            int fileSize = st.st_size;
-            char *fileBuffer = malloc(fileSize + 1);
-            if (!fileBuffer)
+        }
+        // Nodes whose filter rules the file out are not asked, with none left the file does not exist
+        int mayHold = 0;
+        for (int c = 0; c < candidateCount; c++)
+        {
+            if (bloomMayHave(candidates[c], commandArgs[i]))
             {
-                snprintf(response, sizeof(response), "Error: Memory allocation failed");
-                write(con_sd, response, strlen(response));
-                continue;
+                mayHold++;
             }
-            // Open file
-            int fd = open(destPath, O_RDONLY);
-            if (fd < 0)
+            else if (route->dataShards == 0)
             {
-                free(fileBuffer);
-                snprintf(response, sizeof(response), "Error: Failed to open file on server");
-                write(con_sd, response, strlen(response));
-                continue;
+                candidates[c] = NULL;
             }
-            // Read file data locally
-            int bytesRead = read(fd, fileBuffer, fileSize);
-            // Close file
-            close(fd);
-            // Error if entire file is not read
-            if (bytesRead != fileSize)
+        }
+        if (mayHold == 0)
+        {
+            bloomRejected();
+            if (catalogued == 1)
             {
-                free(fileBuffer);
-                snprintf(response, sizeof(response), "Error: Failed to read file on server");
-                write(con_sd, response, strlen(response));
-                continue;
+                catalogForget(commandArgs[i]);
             }
-            // Send success read to client first
-            snprintf(response, sizeof(response), "Success: File found and ready to transfer");
-            if (write(con_sd, response, strlen(response)) <= 0)
+            snprintf(response, sizeof(response), "Error: File does not exist on Server");
+            write(con_sd, response, strlen(response));
+            continue;
+        }
+        // Erasure coded files are rebuilt on S1 from their fragments
+        if (route->dataShards > 0)
+        {
+            char *fileData = NULL;
+            int fileSize = 0;
+            if (ecReadFile(route, ext, commandArgs[i], &fileData, &fileSize, response) == SUCCESS)
             {
-                free(fileBuffer);
-                continue;
+                sendFileToClient(con_sd, commandArgs[i], fileData, fileSize, response);
+                free(fileData);
             }
-            // Sleep for 10ms
-            usleep(10000);
-            // Send file name to client using write
-            char *lastSlash = strrchr(destPath, '/');
-            char *fileName = (lastSlash == NULL) ? destPath : lastSlash + 1;
-            if (write(con_sd, fileName, strlen(fileName)) <= 0)
+            else
             {
-                free(fileBuffer);
-                continue;
+                write(con_sd, response, strlen(response));
             }
-            usleep(10000);
-            // Use htonl to convert host bytes to network bytes
-            uint32_t networkFileSizeClient = htonl((uint32_t)fileSize);
-            // Send file size to server using write
-            if (write(con_sd, &networkFileSizeClient, sizeof(networkFileSizeClient)) != sizeof(networkFileSizeClient))
+            continue;
+        }
+        // Move on to the next copy when a node is down or lacks the file
+        int done = 0;
+        for (int c = 0; c < candidateCount && !done; c++)
+        {
+            const StorageNode *node = candidates[c];
+            // Skip a copy that was already asked as a hedge
+            if (!node)
             {
-                strcpy(response, "Error: Failed to send file size");
-                free(fileBuffer);
                 continue;
             }
-            usleep(10000);
-            // Send file data in chunk to client
-            if (sendDataInChunks(con_sd, fileBuffer, fileSize) != fileSize)
+            char destPath[MAX_PATH];
+            nodePath(node, commandArgs[i], destPath, sizeof(destPath));
+            // Files kept on S1 itself are read locally, the last candidate reports a missing file
+            if (node->port == 0)
             {
-                strcpy(response, "Error: Failed to send file data to clinet");
-                free(fileBuffer);
+                if (validateFileExist(destPath) || c == candidateCount - 1)
+                {
+                    sendLocalFile(con_sd, commandArgs[i]);
+                    done = 1;
+                }
+                else
+                {
+                    snprintf(response, sizeof(response), "Error: File does not exist on Server");
+                }
                 continue;
             }
-            // Free the file buffer
-            free(fileBuffer);
-        }
-        // If extension is '.pdf'
-        else if (strcmp(ext, ".pdf") == 0)
-        {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
-            char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare dest path
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
+            // Otherwise fetch it from the node, under the node's root, hedged with the next remote copy
+            int backupAt = c + 1;
+            while (backupAt < candidateCount && (!candidates[backupAt] || candidates[backupAt]->port == 0))
             {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
+                backupAt++;
             }
-            char *s1_ptr = strstr(destPath, "/S1/");
-            if (s1_ptr != NULL)
+            const StorageNode *backup = backupAt < candidateCount ? candidates[backupAt] : NULL;
+            char backupPath[MAX_PATH] = "";
+            if (backup)
             {
-                // Replace S1 to S2
-                s1_ptr[2] = '2';
+                nodePath(backup, commandArgs[i], backupPath, sizeof(backupPath));
             }
-            struct stat st;
-            stat(destPath, &st);
-            int fileSize = st.st_size;
-            // Send the command, path, fileInfo to server2 using communicateWithServer
-            int result = communicateWithServer("downlf", destPath, NULL, fileSize, server2_ip, server2_port, response, con_sd);
-            if (result != SUCCESS)
+            // While another copy is left after this read a copy that does not match the catalog is skipped
+            int laterCopy = 0;
+            for (int k = (backup ? backupAt : c) + 1; k < candidateCount && !laterCopy; k++)
             {
-                continue;
+                laterCopy = candidates[k] != NULL;
             }
-        }
-        // If extension is '.txt'
-        else if (strcmp(ext, ".txt") == 0)
-        {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
-            char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare dest path
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
+            const CatalogEntry *expect = catalogued == 1 && known.hasCrc && laterCopy ? &known : NULL;
+            int backupUsed = 0;
+            int result = hedgedPeerRead(node, destPath, backup, backupPath, expect, response, con_sd, &backupUsed);
+            if (backupUsed)
             {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
+                candidates[backupAt] = NULL;
             }
-            char *s1_ptr = strstr(destPath, "/S1/");
-            if (s1_ptr != NULL)
+            if (result == -1)
             {
-                // Replace S1 to S3
-                s1_ptr[2] = '3';
+                snprintf(response, sizeof(response), "Error: Failed to connect to %s", node->name);
             }
-            struct stat st;
-            stat(destPath, &st);
-            int fileSize = st.st_size;
-            // Send the command, path, fileInfo to server3 using communicateWithServer
-            int result = communicateWithServer("downlf", destPath, NULL, fileSize, server3_ip, server3_port, response, con_sd);
-            if (result != SUCCESS)
+            else if (result != ERROR_REMOTE)
             {
-                continue;
+                done = 1;
             }
         }
-        else
+        if (!done)
         {
-            snprintf(response, sizeof(response), "Error: Invalid extension");
+            // No node has a catalogued file any more, later lookups answer locally
+            if (catalogued == 1 && strstr(response, "does not exist"))
+            {
+                catalogForget(commandArgs[i]);
+            }
             write(con_sd, response, strlen(response));
         }
     }
@@ -775,159 +4676,319 @@ void handleRemovef(int con_sd, char *commandArgs[], int *count)
         char ext[32];
         // Copy the extension to ext
         snprintf(ext, sizeof(ext), "%s", getFileExtension(commandArgs[i]));
-        // If extension is '.c'
-        if (strcmp(ext, ".c") == 0)
+        // Find the nodes that hold the file
+        const Route *route = lookupRoute(ext, commandArgs[i]);
+        if (!route)
         {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
-            char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare dest path
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
-            {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
-            }
-            // Validate file exist on server 1
-            if (!validateFileExist(destPath))
-            {
-                snprintf(response, sizeof(response), "File does not exist on Server");
-                write(con_sd, response, strlen(response));
-                continue;
-            }
-            // Remove the file using unlink
-            unlink(destPath);
-            // Send respond to client
-            snprintf(response, sizeof(response), "File removed successfully from Server");
+            snprintf(response, sizeof(response), "Error: Invalid extension");
             write(con_sd, response, strlen(response));
+            continue;
         }
-        // If extension is '.pdf'
-        else if (strcmp(ext, ".pdf") == 0)
+        // Neither a migration moving the file nor the catalog scan may bring it back
+        noteRemoval(commandArgs[i]);
+        // Queued uploads of the file go first, then every copy; the removal succeeds if any had the file
+        int removed = route->writeBehind ? dropPendingEntries(commandArgs[i]) : 0;
+        CatalogEntry known;
+        if (removed == 0 && catalogLookup(commandArgs[i], &known) == 0)
         {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
-            char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare dest path
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
-            {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
-            }
-            char *s1_ptr = strstr(destPath, "/S1/");
-            if (s1_ptr != NULL)
-            {
-                // Replace S1 to S2
-                s1_ptr[2] = '2';
-            }
-            // Send the command, path, fileInfo to server2 using communicateWithServer
-            int result = communicateWithServer("removef", destPath, NULL, 0, server2_ip, server2_port, response, 0);
+            snprintf(response, sizeof(response), "File does not exist on Server");
             write(con_sd, response, strlen(response));
-            if (result != SUCCESS)
+            continue;
+        }
+        const StorageNode *candidates[MAX_POOL_NODES * 2];
+        int candidateCount = readCandidates(route, ext, commandArgs[i], NULL, candidates);
+        snprintf(response, sizeof(response), "File does not exist on Server");
+        int ruledOut = 0;
+        for (int c = 0; c < candidateCount; c++)
+        {
+            const StorageNode *node = candidates[c];
+            // A node whose filter rules the file out has nothing to remove
+            if (!bloomMayHave(node, commandArgs[i]))
             {
+                ruledOut++;
                 continue;
             }
-        }
-        // If extension is '.txt'
-        else if (strcmp(ext, ".txt") == 0)
-        {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
             char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare dest path
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
+            nodePath(node, commandArgs[i], destPath, sizeof(destPath));
+            // Files kept on S1 itself are removed locally
+            if (node->port == 0)
+            {
+                // Validate file exist on server 1
+                if (!validateFileExist(destPath))
+                {
+                    continue;
+                }
+                // Remove the file using unlink
+                unlink(destPath);
+                char root[MAX_PATH];
+                snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+                recordRemoval(root, destPath);
+                removed++;
+                continue;
+            }
+            // Otherwise ask the node to remove it from its root
+            char reply[MAX_BUFFER];
+            int result = communicateWithServer("removef", destPath, NULL, 0, node->ip, node->port, reply);
+            if (result == SUCCESS && strstr(reply, "successfully"))
             {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
+                bloomRemoved(node, commandArgs[i]);
+                removed++;
             }
-            char *s1_ptr = strstr(destPath, "/S1/");
-            if (s1_ptr != NULL)
+            else if (result == -1)
             {
-                // Replace S1 to S3
-                s1_ptr[2] = '3';
+                snprintf(response, sizeof(response), "Error: Failed to connect to %s", node->name);
             }
-            // Send the command, path, fileInfo to server3 using communicateWithServer
-            int result = communicateWithServer("removef", destPath, NULL, 0, server3_ip, server3_port, response, 0);
-            write(con_sd, response, strlen(response));
-            if (result != SUCCESS)
+            else if (!strstr(reply, "does not exist"))
             {
-                continue;
+                snprintf(response, sizeof(response), "%s", reply);
             }
         }
-        // If extension is '.zip'
-        else if (strcmp(ext, ".zip") == 0)
+        if (ruledOut == candidateCount)
+        {
+            bloomRejected();
+        }
+        invalidateListCacheForFile(commandArgs[i]);
+        catalogForget(commandArgs[i]);
+        // Send respond to client
+        if (removed > 0)
+        {
+            snprintf(response, sizeof(response), "File removed successfully from Server");
+        }
+        write(con_sd, response, strlen(response));
+    }
+}
+
+// S1: choose server by extension, build locally for .c
+
+// --- Cached downltar archives ---
+
+// Cached full archives (open_cached_tar) and the tree scan, shared with the other servers
+#include "s25TarCache.h"
+
+// --- Compressed downltar streams ---
+
+// Helper function to parse a "gz" or "gz:<level>" codec argument, returns 0 if valid
+static int parse_tar_codec(const char *arg, int *level)
+{
+    if (strcmp(arg, "gz") == 0)
+    {
+        *level = Z_DEFAULT_COMPRESSION;
+        return 0;
+    }
+    if (strncmp(arg, "gz:", 3) == 0 && arg[3] >= '0' && arg[3] <= '9' && arg[4] == '\0')
+    {
+        *level = arg[3] - '0';
+        return 0;
+    }
+    return -1;
+}
+
+// One block of the tar compressed independently into its own gzip member
+typedef struct
+{
+    unsigned char *in;
+    int inLen;
+    unsigned char *out;
+    int outCap;
+    int outLen;
+    int level;
+} GzBlock;
+
+// Worker that compresses one block, run on its own thread
+static void *gzip_block_worker(void *arg)
+{
+    GzBlock *b = (GzBlock *)arg;
+    b->outLen = -1;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 asks zlib for a gzip wrapper instead of zlib
+    if (deflateInit2(&zs, b->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    zs.next_in = b->in;
+    zs.avail_in = b->inLen;
+    zs.next_out = b->out;
+    zs.avail_out = b->outCap;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+        b->outLen = b->outCap - zs.avail_out;
+    deflateEnd(&zs);
+    return NULL;
+}
+
+// Stream an open tar as gzip frames, compressing GZ_BLOCK_SIZE blocks in parallel across cores
+static int send_tar_fd_gzip(int con_sd, int fd, off_t size, int level)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : (cores > GZ_MAX_THREADS ? GZ_MAX_THREADS : (int)cores);
+    GzBlock blocks[GZ_MAX_THREADS];
+    pthread_t tids[GZ_MAX_THREADS];
+    int outCap = (int)compressBound(GZ_BLOCK_SIZE) + 64;
+    memset(blocks, 0, sizeof(blocks));
+    int rc = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        blocks[i].in = (unsigned char *)malloc(GZ_BLOCK_SIZE);
+        blocks[i].out = (unsigned char *)malloc(outCap);
+        blocks[i].outCap = outCap;
+        blocks[i].level = level;
+        if (!blocks[i].in || !blocks[i].out)
+            rc = -1;
+    }
+    off_t off = 0;
+    while (rc == 0 && off < size)
+    {
+        // Read the next batch, one block per thread
+        int used = 0;
+        while (used < threads && off < size)
         {
-            char path[MAX_PATH];
-            snprintf(path, sizeof(path), "%s", commandArgs[i]);
-            char destPath[MAX_PATH];
-            strcpy(destPath, path);
-            // Prepare dest path
-            // Replace ~S1 with /home/user/S1
-            if (strncmp(destPath, "~S1", 3) == 0)
-            {
-                char *home = getenv("HOME");
-                char temp[MAX_PATH];
-                sprintf(temp, "%s/S1%s", home, destPath + 3);
-                strcpy(destPath, temp);
-            }
-            char *s1_ptr = strstr(destPath, "/S1/");
-            if (s1_ptr != NULL)
+            int want = size - off > GZ_BLOCK_SIZE ? GZ_BLOCK_SIZE : (int)(size - off);
+            int got = 0;
+            while (got < want)
             {
-                // Replace S1 to S4
-                s1_ptr[2] = '4';
+                int r = pread(fd, blocks[used].in + got, want - got, off + got);
+                if (r <= 0)
+                    break;
+                got += r;
             }
-            // Send the command, path, fileInfo to server4 using communicateWithServer
-            int result = communicateWithServer("removef", destPath, NULL, 0, server4_ip, server4_port, response, 0);
-            write(con_sd, response, strlen(response));
-            if (result != SUCCESS)
+            if (got != want)
             {
-                continue;
+                rc = -1;
+                break;
             }
+            blocks[used].inLen = want;
+            off += want;
+            used++;
         }
-        else
+        if (rc != 0)
+            break;
+        // Compress the batch, the calling thread takes the first block itself
+        int started[GZ_MAX_THREADS] = {0};
+        for (int i = 1; i < used; i++)
+            started[i] = pthread_create(&tids[i], NULL, gzip_block_worker, &blocks[i]) == 0;
+        gzip_block_worker(&blocks[0]);
+        for (int i = 1; i < used; i++)
         {
-            snprintf(response, sizeof(response), "Error: Invalid extension");
-            write(con_sd, response, strlen(response));
-            continue;
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                gzip_block_worker(&blocks[i]);
+        }
+        // Send the compressed blocks in order as length-prefixed frames
+        for (int i = 0; i < used && rc == 0; i++)
+        {
+            uint32_t netLen = htonl((uint32_t)blocks[i].outLen);
+            if (blocks[i].outLen <= 0 ||
+                write(con_sd, &netLen, sizeof(netLen)) != sizeof(netLen) ||
+                sendDataInChunks(con_sd, (char *)blocks[i].out, blocks[i].outLen) != blocks[i].outLen)
+                rc = -1;
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        free(blocks[i].in);
+        free(blocks[i].out);
+    }
+    // A zero length frame ends the stream, an error frame one that failed part way so the client stops waiting;
+    // if even that cannot be sent the connection is shut down
+    uint32_t end = htonl(rc == 0 ? 0 : TAR_FRAME_ERROR);
+    if (write(con_sd, &end, sizeof(end)) != sizeof(end))
+    {
+        shutdown(con_sd, SHUT_RDWR);
+        rc = -1;
+    }
+    return rc;
+}
+
+// Helper function to parse the options after the extension: [since <token>] [gz|gz:<level>]
+static int parse_downltar_options(char *commandArgs[], int count, long *since, int *level)
+{
+    *since = 0;
+    *level = TAR_NOT_COMPRESSED;
+    for (int i = 2; i < count; i++)
+    {
+        if (strcmp(commandArgs[i], "since") == 0 && i + 1 < count && *since == 0)
+        {
+            *since = atol(commandArgs[++i]);
+            if (*since <= 0)
+                return -1;
+        }
+        else if (*level != TAR_NOT_COMPRESSED || parse_tar_codec(commandArgs[i], level) != 0)
+        {
+            return -1;
         }
     }
+    return 0;
 }
 
-// S1: choose server by extension, build locally for .c
+// Append the list of files removed since the token to an incremental tar
+static int append_deleted_manifest(const char *baseDir, long since, const char *tarPath)
+{
+    char manifestDir[64];
+    snprintf(manifestDir, sizeof(manifestDir), "/tmp/downltar_%d.d", (int)getpid());
+    mkdir(manifestDir, 0700);
+    char manifestPath[MAX_PATH];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/%s", manifestDir, DELETED_MANIFEST);
+    FILE *out = fopen(manifestPath, "w");
+    if (!out)
+    {
+        rmdir(manifestDir);
+        return -1;
+    }
+    char logPath[MAX_PATH + 32];
+    snprintf(logPath, sizeof(logPath), "%s/%s", baseDir, REMOVED_LOG);
+    FILE *log = fopen(logPath, "r");
+    if (log)
+    {
+        char line[MAX_PATH + 32];
+        while (fgets(line, sizeof(line), log))
+        {
+            long ts;
+            char rel[MAX_PATH];
+            if (sscanf(line, "%ld %511[^\n]", &ts, rel) != 2 || ts < since)
+                continue;
+            // Skip paths that were uploaded again after the removal
+            char absPath[MAX_PATH * 2];
+            snprintf(absPath, sizeof(absPath), "%s/%s", baseDir, rel + 2);
+            struct stat st;
+            if (stat(absPath, &st) == 0)
+                continue;
+            fprintf(out, "%s\n", rel);
+        }
+        fclose(log);
+    }
+    fclose(out);
+
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "tar -rf \"%s\" -C \"%s\" ./%s 2>/dev/null", tarPath, manifestDir, DELETED_MANIFEST);
+    int rc = system(cmd);
+    unlink(manifestPath);
+    rmdir(manifestDir);
+    return rc == 0 ? 0 : -1;
+}
 
-static int make_tar_for_ext(const char *baseDir, const char *ext,
+// since > 0 keeps only files modified at or after that token and adds a deletion manifest
+static int make_tar_for_ext(const char *baseDir, const char *ext, long since,
                             char *tmpTarPath, size_t tlen,
                             char *outName, size_t nlen)
 {
-    // spec names
-    if (!strcmp(ext, ".c"))
-        snprintf(outName, nlen, "cfiles.tar");
-    else if (!strcmp(ext, ".pdf"))
-        snprintf(outName, nlen, "pdf.tar");
-    else if (!strcmp(ext, ".txt"))
-        snprintf(outName, nlen, "text.tar");
-    else
-        return -1;
+    tarNameForExt(ext, outName, nlen);
 
     snprintf(tmpTarPath, tlen, "/tmp/downltar_%d.tar", (int)getpid());
 
+    // -newermt is strict, so go one second back to include files written at the token
+    char newer[64] = "";
+    if (since > 0)
+        snprintf(newer, sizeof(newer), "-newermt @%ld ", since - 1);
+
     char cmd[1024];
     // IMPORTANT: 'cd ... || exit 1' prevents hangs if baseDir is wrong
-    snprintf(cmd, sizeof(cmd),
-             "sh -c 'cd \"%s\" 2>/dev/null || exit 1; "
-             "find . -type f -name \"*%s\" -print0 2>/dev/null | "
-             "tar -cf \"%s\" --null -T - 2>/dev/null'",
-             baseDir, ext, tmpTarPath);
+    int cmdLen = snprintf(cmd, sizeof(cmd),
+                          "sh -c 'cd \"%s\" 2>/dev/null || exit 1; "
+                          "find . -type f -name \"*%s\" %s-print0 2>/dev/null | "
+                          "tar -cf \"%s\" --null -T - 2>/dev/null'",
+                          baseDir, ext, newer, tmpTarPath);
+    // A command cut short would archive the wrong tree
+    if (cmdLen >= (int)sizeof(cmd))
+        return -1;
 
     int rc = system(cmd);
     if (rc != 0)
@@ -936,6 +4997,12 @@ static int make_tar_for_ext(const char *baseDir, const char *ext,
         return -1;
     }
 
+    if (since > 0 && append_deleted_manifest(baseDir, since, tmpTarPath) != 0)
+    {
+        unlink(tmpTarPath);
+        return -1;
+    }
+
     struct stat st;
     if (stat(tmpTarPath, &st) != 0)
     {
@@ -948,7 +5015,7 @@ static int make_tar_for_ext(const char *baseDir, const char *ext,
 // S1: proxy to S2/S3 and forward status/name/size/payload to the client
 static int proxy_tar_from_other_server(int client_sd,
                                        const char *server_ip, int server_port,
-                                       const char *ext)
+                                       const char *ext, long since, int level)
 { // Create a socket and connect to the server
     int sd = socket(AF_INET, SOCK_STREAM, 0);
     if (sd < 0)
@@ -965,8 +5032,14 @@ static int proxy_tar_from_other_server(int client_sd,
     }
     // Send the command to the server
     char cmd[64];
-    snprintf(cmd, sizeof(cmd), "downltar %s", ext);
-    if (write(sd, cmd, strlen(cmd)) <= 0)
+    int cl = snprintf(cmd, sizeof(cmd), "downltar %s", ext);
+    if (since > 0)
+        cl += snprintf(cmd + cl, sizeof(cmd) - cl, " since %ld", since);
+    if (level == Z_DEFAULT_COMPRESSION)
+        snprintf(cmd + cl, sizeof(cmd) - cl, " gz");
+    else if (level != TAR_NOT_COMPRESSED)
+        snprintf(cmd + cl, sizeof(cmd) - cl, " gz:%d", level);
+    if (writePeerCommand(sd, cmd) <= 0)
     {
         close(sd);
         return -1;
@@ -1005,7 +5078,7 @@ static int proxy_tar_from_other_server(int client_sd,
         close(sd);
         return -1;
     }
-    usleep(10000);
+    protocolPause(10000);
 
     // 3) size
     uint32_t netSz;
@@ -1019,11 +5092,49 @@ static int proxy_tar_from_other_server(int client_sd,
         close(sd);
         return -1;
     }
-    usleep(10000);
+    protocolPause(10000);
 
     // 4) payload
-    int left = ntohl(netSz);
     char buf[CHUNK_SIZE];
+    if (ntohl(netSz) == TAR_STREAMED)
+    {
+        // Forward length-prefixed frames as they arrive until the zero length frame
+        for (;;)
+        {
+            uint32_t netLen;
+            if (receiveDataInChunks(sd, (char *)&netLen, sizeof(netLen)) != sizeof(netLen) ||
+                write(client_sd, &netLen, sizeof(netLen)) != sizeof(netLen))
+            {
+                // The client is past the header and would wait for frames that will not come
+                shutdown(client_sd, SHUT_RDWR);
+                close(sd);
+                return -1;
+            }
+            // The node's stream failed part way, the client got its error frame as it did
+            if (ntohl(netLen) == TAR_FRAME_ERROR)
+            {
+                close(sd);
+                return 0;
+            }
+            int frameLeft = ntohl(netLen);
+            if (frameLeft == 0)
+                break;
+            while (frameLeft > 0)
+            {
+                int r = read(sd, buf, (frameLeft > CHUNK_SIZE ? CHUNK_SIZE : frameLeft));
+                if (r <= 0 || sendDataInChunks(client_sd, buf, r) != r)
+                {
+                    shutdown(client_sd, SHUT_RDWR);
+                    close(sd);
+                    return -1;
+                }
+                frameLeft -= r;
+            }
+        }
+        close(sd);
+        return 0;
+    }
+    int left = ntohl(netSz);
     while (left > 0)
     {
         int r = read(sd, buf, (left > CHUNK_SIZE ? CHUNK_SIZE : left));
@@ -1042,12 +5153,477 @@ static int proxy_tar_from_other_server(int client_sd,
     close(sd);
     return 0;
 }
+// --- S1: merged downltar of every node ---
+
+// One node feeding the merged archive, either a peer socket or the local cached tar
+typedef struct
+{
+    const StorageNode *node;
+    const char *ext;
+    char tarName[32];
+    int fd;
+    long long left;
+} TarSource;
+
+// Output of the merged archive, buffered into length-prefixed frames
+typedef struct
+{
+    int sd;
+    int len;
+    char buf[64 * 1024];
+} FrameWriter;
+
+// Member names already in a merged archive, so a file kept on several replicas appears once
+typedef struct
+{
+    char **slots;
+    int cap;
+    int count;
+} NameSet;
+
+// Helper function to add a name to the set, returns 1 if it was already there
+static int name_set_add(NameSet *set, const char *name)
+{
+    if (set->count * 2 >= set->cap)
+    {
+        int newCap = set->cap ? set->cap * 2 : 256;
+        char **slots = (char **)calloc(newCap, sizeof(char *));
+        if (!slots)
+            return 0;
+        for (int i = 0; i < set->cap; i++)
+        {
+            if (!set->slots[i])
+                continue;
+            unsigned int h = ringHash(set->slots[i]) % newCap;
+            while (slots[h])
+                h = (h + 1) % newCap;
+            slots[h] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = newCap;
+    }
+    unsigned int h = ringHash(name) % set->cap;
+    while (set->slots[h])
+    {
+        if (strcmp(set->slots[h], name) == 0)
+            return 1;
+        h = (h + 1) % set->cap;
+    }
+    set->slots[h] = strdup(name);
+    if (set->slots[h])
+        set->count++;
+    return 0;
+}
+
+// Helper function to free the set
+static void name_set_free(NameSet *set)
+{
+    for (int i = 0; i < set->cap; i++)
+        free(set->slots[i]);
+    free(set->slots);
+}
+
+// Headers of members that were erasure coded fragments, the files are rebuilt after the merge
+typedef struct
+{
+    char (*headers)[512];
+    int count;
+    int cap;
+} StripedMembers;
+
+// Helper function to remember a fragment's tar header
+static int striped_add(StripedMembers *striped, const char *hdr)
+{
+    if (striped->count == striped->cap)
+    {
+        int newCap = striped->cap ? striped->cap * 2 : 16;
+        char (*headers)[512] = realloc(striped->headers, newCap * sizeof(*headers));
+        if (!headers)
+            return -1;
+        striped->headers = headers;
+        striped->cap = newCap;
+    }
+    memcpy(striped->headers[striped->count++], hdr, 512);
+    return 0;
+}
+
+// Helper function to send the buffered bytes as one frame
+static int frame_flush(FrameWriter *w)
+{
+    if (w->len == 0)
+        return 0;
+    uint32_t netLen = htonl((uint32_t)w->len);
+    if (write(w->sd, &netLen, sizeof(netLen)) != sizeof(netLen) ||
+        sendDataInChunks(w->sd, w->buf, w->len) != w->len)
+        return -1;
+    w->len = 0;
+    return 0;
+}
+
+// Helper function to append bytes to the merged archive
+static int frame_write(FrameWriter *w, const char *data, int len)
+{
+    while (len > 0)
+    {
+        int n = (int)sizeof(w->buf) - w->len;
+        if (n > len)
+            n = len;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+        if (w->len == (int)sizeof(w->buf) && frame_flush(w) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Ask a peer for its full tar, the reply header is read later so all peers build at once
+static int open_peer_tar(TarSource *src, const char *ip, int port)
+{
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+        return -1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "downltar %s", src->ext);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0 ||
+        connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        writePeerCommand(sd, cmd) <= 0)
+    {
+        close(sd);
+        return -1;
+    }
+    src->fd = sd;
+    return 0;
+}
+
+// Read status, name and size from a peer by their exact lengths, since they may arrive together
+static int read_peer_tar_header(TarSource *src)
+{
+    char status[19];
+    char name[64];
+    int nameLen = strlen(src->tarName);
+    uint32_t netSz;
+    if (receiveDataInChunks(src->fd, status, sizeof(status)) != sizeof(status) ||
+        memcmp(status, "Success: Tar ready", 18) != 0 ||
+        receiveDataInChunks(src->fd, name, nameLen) != nameLen ||
+        receiveDataInChunks(src->fd, (char *)&netSz, sizeof(netSz)) != sizeof(netSz))
+        return -1;
+    src->left = ntohl(netSz);
+    return 0;
+}
+
+// Helper function to read a size field of a tar header, the octal form is enough for MAX_FILE_SIZE
+static long long tar_header_size(const char *hdr)
+{
+    char field[13];
+    memcpy(field, hdr + 124, 12);
+    field[12] = '\0';
+    return strtoll(field, NULL, 8);
+}
+
+// Forward one member (header plus padded data) from a source, returns 1 at its end of archive.
+// A plain member whose name is already in seen is read and dropped, and so is an erasure coded
+// fragment, whose header goes to striped (NULL for extensions that are not striped).
+static int forward_tar_member(TarSource *src, FrameWriter *w, NameSet *seen, StripedMembers *striped)
+{
+    char block[512];
+    char buf[CHUNK_SIZE];
+    int extended = 0;
+    // Long name and pax headers belong to the member that follows them, keep them together
+    for (;;)
+    {
+        if (src->left < 512 || receiveDataInChunks(src->fd, block, 512) != 512)
+            return -1;
+        src->left -= 512;
+        int zero = 1;
+        for (int i = 0; i < 512 && zero; i++)
+            zero = block[i] == 0;
+        if (zero)
+        {
+            // Drain the rest of this source's archive, the merged one gets its own trailer
+            while (src->left > 0)
+            {
+                int n = src->left > CHUNK_SIZE ? CHUNK_SIZE : (int)src->left;
+                if (receiveDataInChunks(src->fd, buf, n) != n)
+                    return -1;
+                src->left -= n;
+            }
+            return 1;
+        }
+        char type = block[156];
+        int meta = type == 'L' || type == 'K' || type == 'x' || type == 'g';
+        // The ustar name is prefix/name, members behind extended headers are always kept
+        int skip = 0;
+        if (seen && !meta && !extended)
+        {
+            char name[MAX_PATH];
+            if (block[345])
+                snprintf(name, sizeof(name), "%.155s/%.100s", block + 345, block);
+            else
+                snprintf(name, sizeof(name), "%.100s", block);
+            skip = name_set_add(seen, name);
+        }
+        extended |= meta;
+        long long data = (tar_header_size(block) + 511) / 512 * 512;
+        if (data > src->left)
+            return -1;
+        // The first chunk tells a fragment from a whole file before the header is passed on
+        int head = 0;
+        if (striped && !skip && !meta && !extended && data > 0)
+        {
+            head = data > CHUNK_SIZE ? CHUNK_SIZE : (int)data;
+            if (receiveDataInChunks(src->fd, buf, head) != head)
+                return -1;
+            data -= head;
+            src->left -= head;
+            if (ecIsFragment(buf, head))
+            {
+                skip = 1;
+                if (striped_add(striped, block) != 0)
+                    return -1;
+            }
+        }
+        if (!skip && (frame_write(w, block, 512) != 0 || frame_write(w, buf, head) != 0))
+            return -1;
+        while (data > 0)
+        {
+            int n = data > CHUNK_SIZE ? CHUNK_SIZE : (int)data;
+            if (receiveDataInChunks(src->fd, buf, n) != n || (!skip && frame_write(w, buf, n) != 0))
+                return -1;
+            data -= n;
+            src->left -= n;
+        }
+        if (!meta)
+            return 0;
+    }
+}
+
+// Rebuild an erasure coded file held back from a merged archive and append it under its own header.
+// A file that cannot be rebuilt is left out, the rest of the archive stays good.
+static int write_rebuilt_member(FrameWriter *w, char *hdr)
+{
+    // ustar prefix, '/' and name
+    char name[155 + 1 + 100 + 1];
+    if (hdr[345])
+        snprintf(name, sizeof(name), "%.155s/%.100s", hdr + 345, hdr);
+    else
+        snprintf(name, sizeof(name), "%.100s", hdr);
+    // Members are named after their path below the node root
+    char tildePath[MAX_PATH];
+    snprintf(tildePath, sizeof(tildePath), "~S1/%s", strncmp(name, "./", 2) == 0 ? name + 2 : name);
+    char ext[32];
+    snprintf(ext, sizeof(ext), "%s", getFileExtension(tildePath));
+    const Route *route = lookupRoute(ext, tildePath);
+    char response[MAX_BUFFER];
+    char *data = NULL;
+    int size = 0;
+    if (!route || route->dataShards == 0 || ecReadFile(route, ext, tildePath, &data, &size, response) != SUCCESS)
+    {
+        printf("downltar: cannot rebuild %s: %s\n", tildePath, route ? response : "no route");
+        return 0;
+    }
+    snprintf(hdr + 124, 12, "%011llo", (unsigned long long)size);
+    // Checksum is computed with the checksum field itself set to spaces
+    memset(hdr + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    hdr[155] = ' ';
+    char zeros[512];
+    memset(zeros, 0, sizeof(zeros));
+    int rc = frame_write(w, hdr, 512) != 0 || frame_write(w, data, size) != 0 ||
+             frame_write(w, zeros, (512 - size % 512) % 512) != 0 ? -1 : 0;
+    free(data);
+    return rc;
+}
+
+// Stream one archive merged from several (node, extension) sources, members interleaved as each node delivers them.
+// Replicated files come from whichever copy arrives first, erasure coded ones are rebuilt at the end.
+static void send_merged_tar(int con_sd, const int *nodes, const char **exts, int n, const char *outName)
+{
+    TarSource *srcs = (TarSource *)calloc(n, sizeof(TarSource));
+    if (!srcs)
+    {
+        write(con_sd, "Error: Memory allocation failed", 31);
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        srcs[i].node = &routing.nodes[nodes[i]];
+        srcs[i].ext = exts[i];
+        tarNameForExt(exts[i], srcs[i].tarName, sizeof(srcs[i].tarName));
+        srcs[i].fd = -1;
+    }
+    int failed = -1;
+    // Peers serving the archive count as busy for replica selection
+    for (int i = 0; i < n; i++)
+    {
+        if (srcs[i].node->port != 0)
+            peerBegin(peerStat(srcs[i].node->ip, srcs[i].node->port));
+    }
+
+    // Start every peer first so they build their archives while S1 builds its own
+    for (int i = 0; i < n && failed < 0; i++)
+    {
+        if (srcs[i].node->port != 0 && open_peer_tar(&srcs[i], srcs[i].node->ip, srcs[i].node->port) != 0)
+            failed = i;
+    }
+    for (int i = 0; i < n && failed < 0; i++)
+    {
+        if (srcs[i].node->port != 0)
+            continue;
+        char base[MAX_PATH];
+        snprintf(base, sizeof(base), "%s/S1", getenv("HOME"));
+        off_t size = 0;
+        srcs[i].fd = open_cached_tar(base, srcs[i].ext, srcs[i].tarName, &size);
+        srcs[i].left = size;
+        if (srcs[i].fd < 0 || lseek(srcs[i].fd, 0, SEEK_SET) != 0)
+            failed = i;
+    }
+    for (int i = 0; i < n && failed < 0; i++)
+    {
+        if (srcs[i].node->port != 0 && read_peer_tar_header(&srcs[i]) != 0)
+            failed = i;
+    }
+    if (failed >= 0)
+    {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Error: Failed to fetch tar from %s", srcs[failed].node->name);
+        write(con_sd, msg, strlen(msg));
+        for (int i = 0; i < n; i++)
+            if (srcs[i].fd >= 0)
+                close(srcs[i].fd);
+        for (int i = 0; i < n; i++)
+            if (srcs[i].node->port != 0)
+                peerEnd(peerStat(srcs[i].node->ip, srcs[i].node->port));
+        free(srcs);
+        return;
+    }
+
+    write(con_sd, "Success: Tar ready", 19);
+    protocolPause(10000);
+    write(con_sd, outName, strlen(outName));
+    protocolPause(10000);
+    uint32_t netSz = htonl(TAR_STREAMED);
+    write(con_sd, &netSz, sizeof(netSz));
+    protocolPause(10000);
+
+    // Take a member from whichever node has data ready, so no node waits behind another
+    FrameWriter *w = (FrameWriter *)malloc(sizeof(FrameWriter));
+    int rc = w ? 0 : -1;
+    if (w)
+    {
+        w->sd = con_sd;
+        w->len = 0;
+    }
+    struct pollfd *pfds = (struct pollfd *)malloc(n * sizeof(struct pollfd));
+    int *map = (int *)malloc(n * sizeof(int));
+    if (!pfds || !map)
+        rc = -1;
+    NameSet seen = {NULL, 0, 0};
+    StripedMembers striped = {NULL, 0, 0};
+    int remaining = n;
+    while (rc == 0 && remaining > 0)
+    {
+        int ready = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (srcs[i].fd < 0)
+                continue;
+            pfds[ready].fd = srcs[i].fd;
+            pfds[ready].events = POLLIN;
+            map[ready++] = i;
+        }
+        if (poll(pfds, ready, 30000) <= 0)
+        {
+            rc = -1;
+            break;
+        }
+        for (int j = 0; j < ready && rc == 0; j++)
+        {
+            if (!(pfds[j].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            TarSource *src = &srcs[map[j]];
+            int r = forward_tar_member(src, w, &seen, extErasureCoded(src->ext) ? &striped : NULL);
+            if (r < 0)
+            {
+                printf("downltar: stream from %s failed\n", src->node->name);
+                rc = -1;
+            }
+            else if (r == 1)
+            {
+                close(src->fd);
+                src->fd = -1;
+                remaining--;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (srcs[i].fd >= 0)
+            close(srcs[i].fd);
+        if (srcs[i].node->port != 0)
+            peerEnd(peerStat(srcs[i].node->ip, srcs[i].node->port));
+    }
+    free(pfds);
+    free(map);
+    free(srcs);
+    name_set_free(&seen);
+    for (int i = 0; i < striped.count && rc == 0; i++)
+        rc = write_rebuilt_member(w, striped.headers[i]);
+    free(striped.headers);
+    if (rc == 0)
+    {
+        // End of archive is two zero blocks, then the zero length frame ends the stream
+        char zeros[1024];
+        memset(zeros, 0, sizeof(zeros));
+        if (frame_write(w, zeros, sizeof(zeros)) != 0 || frame_flush(w) != 0)
+            rc = -1;
+    }
+    // On failure an error frame ends the stream instead, so the client discards it rather than waiting for more;
+    // if even that cannot be sent the connection is shut down
+    uint32_t end = htonl(rc == 0 ? 0 : TAR_FRAME_ERROR);
+    if (write(con_sd, &end, sizeof(end)) != sizeof(end))
+        shutdown(con_sd, SHUT_RDWR);
+    free(w);
+}
+
+// downltar all: one archive of every extension on every node that serves it
+static void handleDownltarAll(int con_sd)
+{
+    int nodes[MAX_NODES * MAX_ROUTES];
+    const char *exts[MAX_NODES * MAX_ROUTES];
+    const char *routed[MAX_ROUTES];
+    int extCount = routeExtensions(routed, MAX_ROUTES);
+    int n = 0;
+    for (int e = 0; e < extCount; e++)
+    {
+        int extNodes[MAX_NODES];
+        int count = routeNodesForExt(routed[e], extNodes, MAX_NODES);
+        for (int i = 0; i < count; i++)
+        {
+            nodes[n] = extNodes[i];
+            exts[n++] = routed[e];
+        }
+    }
+    send_merged_tar(con_sd, nodes, exts, n, "all.tar");
+}
+
 // Function to handle downltar command
 void handleDownltar(int con_sd, char *commandArgs[], int *count)
 {
-    if (*count != 2)
+    // downltar <ext> [since <token>] [gz|gz:<level>]
+    long since = 0;
+    int level = TAR_NOT_COMPRESSED;
+    if (*count < 2 || parse_downltar_options(commandArgs, *count, &since, &level) != 0)
     {
-        const char *msg = "Error: downltar needs one arg: .c/.pdf/.txt";
+        const char *msg = "Error: downltar needs one arg: <extension>|all [since <token>] [gz|gz:<level>]";
         write(con_sd, msg, strlen(msg));
         return;
     }
@@ -1060,63 +5636,130 @@ void handleDownltar(int con_sd, char *commandArgs[], int *count)
         return;
     }
 
-    if (!strcmp(ext, ".c"))
+    if (!strcmp(ext, "all"))
+    {
+        if (*count != 2)
+        {
+            write(con_sd, "Error: downltar all takes no options", 36);
+            return;
+        }
+        handleDownltarAll(con_sd);
+        return;
+    }
+
+    // Every node that serves this extension anywhere in the tree
+    int nodes[MAX_NODES];
+    int nodeCount = routeNodesForExt(ext, nodes, MAX_NODES);
+    if (nodeCount == 0)
+    {
+        write(con_sd, "Error: Unsupported extension", 28);
+        return;
+    }
+    // A pool of several nodes is merged into one archive
+    if (nodeCount > 1)
+    {
+        if (since > 0 || level != TAR_NOT_COMPRESSED)
+        {
+            const char *msg = "Error: since and gz need a single node for the extension";
+            write(con_sd, msg, strlen(msg));
+            return;
+        }
+        const char *exts[MAX_NODES];
+        for (int i = 0; i < nodeCount; i++)
+            exts[i] = ext;
+        char tarName[64];
+        tarNameForExt(ext, tarName, sizeof(tarName));
+        send_merged_tar(con_sd, nodes, exts, nodeCount, tarName);
+        return;
+    }
+    const StorageNode *node = &routing.nodes[nodes[0]];
+
+    if (node->port == 0)
     {
         // local on S1 → $HOME/S1
         char base[MAX_PATH], tarTmp[MAX_PATH], tarName[64];
         snprintf(base, sizeof(base), "%s/S1", home);
 
-        if (make_tar_for_ext(base, ext, tarTmp, sizeof(tarTmp), tarName, sizeof(tarName)) != 0)
+        // Removals before the start of the log were compacted away, a delta from then would miss them
+        if (since > 0 && since < removalLogStart(base))
+        {
+            const char *msg = "Error: since token is older than the removal log, download the full archive";
+            write(con_sd, msg, strlen(msg));
+            return;
+        }
+        // Token for the next incremental request, taken before the scan starts
+        long token = (long)time(NULL);
+        int fd = -1;
+        off_t tarSize = 0;
+        if (since > 0)
+        {
+            // Deltas are small and per client, build them fresh
+            if (make_tar_for_ext(base, ext, since, tarTmp, sizeof(tarTmp), tarName, sizeof(tarName)) == 0)
+            {
+                fd = open(tarTmp, O_RDONLY);
+                unlink(tarTmp);
+                struct stat st;
+                if (fd >= 0 && fstat(fd, &st) == 0)
+                    tarSize = st.st_size;
+            }
+        }
+        else
+        {
+            // Full archives come from the cache, rebuilt only when the tree changed
+            tarNameForExt(ext, tarName, sizeof(tarName));
+            fd = open_cached_tar(base, ext, tarName, &tarSize);
+        }
+        if (fd < 0)
         {
             write(con_sd, "Error: Failed to build tar", 27);
             return;
         }
 
         // status + name
-        write(con_sd, "Success: Tar ready", 19);
-        usleep(10000);
+        if (since > 0)
+        {
+            char status[64];
+            snprintf(status, sizeof(status), "Success: Tar ready (token %ld)", token);
+            write(con_sd, status, strlen(status));
+        }
+        else
+        {
+            write(con_sd, "Success: Tar ready", 19);
+        }
+        protocolPause(10000);
+        if (level != TAR_NOT_COMPRESSED)
+            strcat(tarName, ".gz");
         write(con_sd, tarName, strlen(tarName));
-        usleep(10000);
+        protocolPause(10000);
 
-        // size + stream
-        struct stat st;
-        stat(tarTmp, &st);
-        uint32_t netSz = htonl((uint32_t)st.st_size);
+        // size + stream, compressed streams are framed so the size field only marks them
+        uint32_t netSz = htonl(level != TAR_NOT_COMPRESSED ? TAR_STREAMED : (uint32_t)tarSize);
         write(con_sd, &netSz, sizeof(netSz));
-        usleep(10000);
+        protocolPause(10000);
 
-        int fd = open(tarTmp, O_RDONLY);
-        char buf[CHUNK_SIZE];
-        int r;
-        while ((r = read(fd, buf, sizeof(buf))) > 0)
+        if (level != TAR_NOT_COMPRESSED)
+            send_tar_fd_gzip(con_sd, fd, tarSize, level);
+        else
         {
-            if (sendDataInChunks(con_sd, buf, r) != r)
-            {
-                close(fd);
-                unlink(tarTmp);
-                return;
-            }
+            // A short archive would leave the client waiting for the rest of the size it was given
+            if (send_tar_fd(con_sd, fd, tarSize) != 0)
+                shutdown(con_sd, SHUT_RDWR);
         }
         close(fd);
-        unlink(tarTmp);
         return;
     }
 
-    // route .pdf to S2, .txt to S3
-    if (!strcmp(ext, ".pdf"))
-    {
-        if (proxy_tar_from_other_server(con_sd, server2_ip, server2_port, ".pdf") < 0)
-            write(con_sd, "Error: Failed to fetch tar from S2", 34);
-        return;
-    }
-    if (!strcmp(ext, ".txt"))
+    // Otherwise proxy the node's archive, in flight the whole time so reads go elsewhere
+    PeerStat *stat = peerStat(node->ip, node->port);
+    peerBegin(stat);
+    int proxied = proxy_tar_from_other_server(con_sd, node->ip, node->port, ext, since, level);
+    peerEnd(stat);
+    if (proxied < 0)
     {
-        if (proxy_tar_from_other_server(con_sd, server3_ip, server3_port, ".txt") < 0)
-            write(con_sd, "Error: Failed to fetch tar from S3", 34);
-        return;
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Error: Failed to fetch tar from %s", node->name);
+        write(con_sd, msg, strlen(msg));
     }
-
-    write(con_sd, "Error: Unsupported extension", 28);
 }
 
 // --- S1: dispfnames helpers ---
@@ -1217,246 +5860,1062 @@ static char *join_names(char **names, int count, int *outLen)
         off += L;
         buf[off++] = '\n';
     }
-    *outLen = (int)off;
-    return buf;
+    *outLen = (int)off;
+    return buf;
+}
+
+// send a listing command to a peer and read its size-prefixed reply; returns malloc'ed buffer
+static int fetch_blob_from_peer(const char *ip, int port, const char *line, char **outBuf, int *outLen)
+{
+    *outBuf = NULL;
+    *outLen = 0;
+
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0)
+    {
+        close(sd);
+        return -1;
+    }
+    unsigned long begin = stageBegin();
+    int connected = connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    stageEnd(STAGE_PEER_CONNECT, begin);
+    if (!connected)
+    {
+        close(sd);
+        return -1;
+    }
+
+    if (writePeerCommand(sd, line) <= 0)
+    {
+        close(sd);
+        return -1;
+    }
+
+    // 1) read status
+    char status[MAX_BUFFER];
+    begin = stageBegin();
+    int sl = read(sd, status, sizeof(status) - 1);
+    stageEnd(STAGE_PEER_REPLY, begin);
+    if (sl <= 0)
+    {
+        close(sd);
+        return -1;
+    }
+    status[sl] = '\0';
+    if (strstr(status, "Error:"))
+    {
+        close(sd);
+        return -2;
+    }
+
+    // 2) read size
+    uint32_t netSz;
+    begin = stageBegin();
+    int sizeRead = read(sd, &netSz, sizeof(netSz));
+    stageEnd(STAGE_PEER_RECV, begin);
+    if (sizeRead != sizeof(netSz))
+    {
+        close(sd);
+        return -1;
+    }
+    int sz = ntohl(netSz);
+    if (sz < 0 || sz > MAX_FILE_SIZE)
+    {
+        close(sd);
+        return -1;
+    }
+
+    if (sz == 0)
+    {
+        close(sd);
+        *outBuf = NULL;
+        *outLen = 0;
+        return 0;
+    }
+
+    // 3) read payload
+    char *buf = (char *)malloc(sz);
+    if (!buf)
+    {
+        close(sd);
+        return -1;
+    }
+    begin = stageBegin();
+    int got = receiveDataInChunks(sd, buf, sz);
+    stageEnd(STAGE_PEER_RECV, begin);
+    close(sd);
+    if (got != sz)
+    {
+        free(buf);
+        return -1;
+    }
+
+    *outBuf = buf;
+    *outLen = sz;
+    return 0;
+}
+
+// ask a peer (S2/S3/S4) to list names from dir for a given ext; returns malloc'ed buffer
+static int fetch_names_from_peer(const char *ip, int port,
+                                 const char *dirAbs, const char *ext,
+                                 char **outBuf, int *outLen)
+{
+    char line[MAX_PATH + 64];
+    snprintf(line, sizeof(line), "dispfnames %s %s", dirAbs, ext);
+    return fetch_blob_from_peer(ip, port, line, outBuf, outLen);
+}
+
+// send the final names blob to the client (size-prefixed)
+static int send_names_blob(int con_sd, const char *blob, int len)
+{
+    const char *ok = "Success: Names ready";
+    if (write(con_sd, ok, strlen(ok)) <= 0)
+        return -1;
+    protocolPause(10000);
+
+    uint32_t net = htonl((uint32_t)len);
+    if (write(con_sd, &net, sizeof(net)) != sizeof(net))
+        return -1;
+    protocolPause(10000);
+
+    if (len > 0)
+    {
+        unsigned long begin = stageBegin();
+        int sent = sendDataInChunks(con_sd, blob, len);
+        stageEnd(STAGE_CLIENT_SEND, begin);
+        if (sent != len)
+            return -1;
+    }
+    return 0;
+}
+
+// --- S1: dispfnames handler ---
+void handleDispfnames(int con_sd, char *commandArgs[], int *count)
+{
+    // Validate arg
+    if (*count != 2 || strncmp(commandArgs[1], "~S1", 3) != 0)
+    {
+        const char *msg = "Error: dispfnames requires a valid ~S1 path (directory).";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+
+    // Answer from the listing cache when nothing changed in this directory
+    char *cachedBlob = NULL;
+    int cachedLen = 0;
+    if (lookupListCache(commandArgs[1], &cachedBlob, &cachedLen) == 0)
+    {
+        send_names_blob(con_sd, cachedBlob ? cachedBlob : "", cachedLen);
+        if (cachedBlob)
+            free(cachedBlob);
+        return;
+    }
+    // Remember the version the listing is built against
+    unsigned long listVersion = listCacheVersion(commandArgs[1]);
+    int listComplete = 1;
+
+    // One group per routed extension, in routing table order (.c, .pdf, .txt, .zip by default)
+    const char *exts[MAX_ROUTES];
+    int extCount = routeExtensions(exts, MAX_ROUTES);
+    char *finalBlob = NULL;
+    int totalLen = 0;
+    for (int e = 0; e < extCount; e++)
+    {
+        const Route *route = lookupRoute(exts[e], commandArgs[1]);
+        if (!route)
+            continue;
+        // Gather the names from every node of the pool serving this directory,
+        // and from the previous pool while files are still moving
+        const StorageNode *pool[MAX_POOL_NODES * 2];
+        int poolCount = 0;
+        for (int n = 0; n < route->nodeCount; n++)
+            pool[poolCount++] = &routing.nodes[route->nodes[n]];
+        const Route *oldRoute = migrationActive() ? lookupRouteIn(&previousRouting, exts[e], commandArgs[1]) : NULL;
+        for (int n = 0; oldRoute && n < oldRoute->nodeCount; n++)
+        {
+            const StorageNode *old = &previousRouting.nodes[oldRoute->nodes[n]];
+            int seen = 0;
+            for (int k = 0; k < poolCount && !seen; k++)
+                seen = sameNode(pool[k], old);
+            if (!seen)
+                pool[poolCount++] = old;
+        }
+        char **names = NULL;
+        int nameCount = 0;
+        for (int n = 0; n < poolCount; n++)
+        {
+            const StorageNode *node = pool[n];
+            char dir[MAX_PATH];
+            nodePath(node, commandArgs[1], dir, sizeof(dir));
+            char **list = NULL;
+            int listCount = 0;
+            if (node->port == 0)
+            {
+                collect_names_one_dir(dir, exts[e], &list, &listCount);
+            }
+            else
+            {
+                char *blob = NULL;
+                int blobLen = 0;
+                if (fetch_names_from_peer(node->ip, node->port, dir, exts[e], &blob, &blobLen) < 0)
+                {
+                    // treat as empty if peer fails
+                    listComplete = 0;
+                }
+                // Split the peer's newline separated names
+                for (int p = 0; p < blobLen;)
+                {
+                    int q = p;
+                    while (q < blobLen && blob[q] != '\n')
+                        q++;
+                    char **tmp = (char **)realloc(list, (listCount + 1) * sizeof(char *));
+                    if (!tmp)
+                        break;
+                    list = tmp;
+                    list[listCount++] = strndup(blob + p, q - p);
+                    p = q + 1;
+                }
+                free(blob);
+            }
+            char **tmp = listCount ? (char **)realloc(names, (nameCount + listCount) * sizeof(char *)) : names;
+            if (tmp)
+            {
+                names = tmp;
+                memcpy(names + nameCount, list, listCount * sizeof(char *));
+                nameCount += listCount;
+            }
+            else
+            {
+                for (int k = 0; k < listCount; k++)
+                    free(list[k]);
+            }
+            free(list);
+        }
+        // Sort and drop duplicates so a pool reads like one directory
+        if (nameCount > 1)
+            qsort(names, nameCount, sizeof(char *), cmpstr);
+        int kept = 0;
+        for (int k = 0; k < nameCount; k++)
+        {
+            if (kept > 0 && strcmp(names[kept - 1], names[k]) == 0)
+                free(names[k]);
+            else
+                names[kept++] = names[k];
+        }
+        int groupLen = 0;
+        char *group = join_names(names, kept, &groupLen);
+        for (int k = 0; k < kept; k++)
+            free(names[k]);
+        free(names);
+        if (groupLen > 0)
+        {
+            char *tmp = (char *)realloc(finalBlob, totalLen + groupLen);
+            if (!tmp)
+            {
+                const char *msg = "Error: Memory allocation failed.";
+                write(con_sd, msg, strlen(msg));
+                free(group);
+                free(finalBlob);
+                return;
+            }
+            finalBlob = tmp;
+            memcpy(finalBlob + totalLen, group, groupLen);
+            totalLen += groupLen;
+        }
+        free(group);
+    }
+
+    // Cache the merged listing only if every peer answered
+    if (listComplete)
+    {
+        storeListCache(commandArgs[1], listVersion, finalBlob, totalLen);
+    }
+
+    // send to client
+    if (send_names_blob(con_sd, finalBlob ? finalBlob : "", totalLen) != 0)
+    {
+        // fallthrough; client will handle
+    }
+
+    // cleanup
+    if (finalBlob)
+        free(finalBlob);
+}
+
+// --- S1: stats endpoint ---
+
+// Render every counter in the Prometheus text format, returns a malloc'ed buffer
+static char *renderStats(int *outLen)
+{
+    char *buf = NULL;
+    int len = 0, cap = 0;
+    char labels[128];
+    appendText(&buf, &len, &cap, "# HELP %s_uptime_seconds Time since s1 started.\n# TYPE %s_uptime_seconds gauge\n", STATS_PREFIX, STATS_PREFIX);
+    appendText(&buf, &len, &cap, "%s_uptime_seconds %ld\n", STATS_PREFIX, serverStats ? (long)time(NULL) - serverStats->startedAt : 0L);
+    if (serverStats)
+    {
+        appendText(&buf, &len, &cap, "# HELP %s_connections_total Client connections accepted.\n# TYPE %s_connections_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_connections_total %lu\n", STATS_PREFIX, __atomic_load_n(&serverStats->connections, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_slow_requests_total Commands written to the slow log.\n# TYPE %s_slow_requests_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_slow_requests_total %lu\n", STATS_PREFIX, __atomic_load_n(&serverStats->slowRequests, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_command_latency_seconds Time to serve a client command.\n# TYPE %s_command_latency_seconds summary\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+        {
+            snprintf(labels, sizeof(labels), "command=\"%s\"", statsCommandNames[c]);
+            appendSummary(&buf, &len, &cap, "command_latency_seconds", labels, &serverStats->commands[c].latency);
+        }
+        appendText(&buf, &len, &cap, "# HELP %s_command_latency_max_seconds Slowest client command.\n# TYPE %s_command_latency_max_seconds gauge\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_command_latency_max_seconds{command=\"%s\"} %.6f\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].latency.maxUs, __ATOMIC_RELAXED) / 1e6);
+        appendText(&buf, &len, &cap, "# HELP %s_command_bytes_in_total Bytes read from clients.\n# TYPE %s_command_bytes_in_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_command_bytes_in_total{command=\"%s\"} %lu\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].bytesIn, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_command_bytes_out_total Bytes written to clients.\n# TYPE %s_command_bytes_out_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_command_bytes_out_total{command=\"%s\"} %lu\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].bytesOut, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_commands_in_flight Client commands being served.\n# TYPE %s_commands_in_flight gauge\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_commands_in_flight{command=\"%s\"} %ld\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].inflight, __ATOMIC_RELAXED));
+    }
+    if (peerStats)
+    {
+        appendText(&buf, &len, &cap, "# HELP %s_peer_latency_seconds Time to a peer's first reply.\n# TYPE %s_peer_latency_seconds summary\n", STATS_PREFIX, STATS_PREFIX);
+        for (int i = 0; i < PEER_STATS_SLOTS && __atomic_load_n(&peerStats->peers[i].used, __ATOMIC_ACQUIRE); i++)
+        {
+            snprintf(labels, sizeof(labels), "peer=\"%s:%d\"", peerStats->peers[i].ip, peerStats->peers[i].port);
+            appendSummary(&buf, &len, &cap, "peer_latency_seconds", labels, &peerStats->peers[i].forward);
+        }
+        appendText(&buf, &len, &cap, "# HELP %s_peer_in_flight Requests a peer is serving for s1.\n# TYPE %s_peer_in_flight gauge\n", STATS_PREFIX, STATS_PREFIX);
+        for (int i = 0; i < PEER_STATS_SLOTS && __atomic_load_n(&peerStats->peers[i].used, __ATOMIC_ACQUIRE); i++)
+            appendText(&buf, &len, &cap, "%s_peer_in_flight{peer=\"%s:%d\"} %ld\n", STATS_PREFIX, peerStats->peers[i].ip, peerStats->peers[i].port,
+                       __atomic_load_n(&peerStats->peers[i].inflight, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_peer_failures_total Requests that found a peer down.\n# TYPE %s_peer_failures_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        for (int i = 0; i < PEER_STATS_SLOTS && __atomic_load_n(&peerStats->peers[i].used, __ATOMIC_ACQUIRE); i++)
+            appendText(&buf, &len, &cap, "%s_peer_failures_total{peer=\"%s:%d\"} %lu\n", STATS_PREFIX, peerStats->peers[i].ip, peerStats->peers[i].port,
+                       __atomic_load_n(&peerStats->peers[i].failures, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_hedges_total Hedged downlf reads sent and won by the second copy.\n# TYPE %s_hedges_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_hedges_total{result=\"sent\"} %lu\n%s_hedges_total{result=\"won\"} %lu\n",
+                   STATS_PREFIX, __atomic_load_n(&peerStats->hedgesSent, __ATOMIC_RELAXED),
+                   STATS_PREFIX, __atomic_load_n(&peerStats->hedgesWon, __ATOMIC_RELAXED));
+    }
+    if (catalog)
+    {
+        appendText(&buf, &len, &cap, "# HELP %s_catalog_files Files in the metadata catalog.\n# TYPE %s_catalog_files gauge\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_catalog_files %ld\n", STATS_PREFIX, __atomic_load_n(&catalog->live, __ATOMIC_RELAXED));
+    }
+    if (blooms)
+    {
+        appendText(&buf, &len, &cap, "# HELP %s_bloom_rejected_total Misses answered from the peers' Bloom filters.\n# TYPE %s_bloom_rejected_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_bloom_rejected_total %lu\n", STATS_PREFIX, __atomic_load_n(&blooms->rejected, __ATOMIC_RELAXED));
+    }
+    if (migration)
+    {
+        appendText(&buf, &len, &cap, "# HELP %s_migrated_files_total Files moved by the rebalancer.\n# TYPE %s_migrated_files_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_migrated_files_total %ld\n", STATS_PREFIX, __atomic_load_n(&migration->filesMoved, __ATOMIC_RELAXED));
+    }
+    *outLen = len;
+    return buf;
+}
+
+// Function to handle stats command, the counters as Prometheus text in a names-style blob
+void handleStats(int con_sd, char *commandArgs[], int *count)
+{
+    (void)commandArgs;
+    (void)count;
+    int len = 0;
+    char *text = renderStats(&len);
+    send_names_blob(con_sd, text, len);
+    free(text);
+}
+
+// Helper function to append a string as a JSON string, escaping quotes, backslashes and control characters
+static void appendJsonString(char **buf, int *len, int *cap, const char *text)
+{
+    appendText(buf, len, cap, "\"");
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            appendText(buf, len, cap, "\\%c", *c);
+        else if (*c < 0x20)
+            appendText(buf, len, cap, "\\u%04x", *c);
+        else
+            appendText(buf, len, cap, "%c", *c);
+    }
+    appendText(buf, len, cap, "\"");
+}
+
+// Helper function to append the spans of a trace kept on this node as Chrome trace events, each preceded
+// by ",\n"; pid is the node's port so every node gets its own row, tid the process or thread that ran it
+static void appendTraceEvents(char **buf, int *len, int *cap, unsigned long long traceId, int pid)
+{
+    if (!spanRing)
+        return;
+    unsigned long head = __atomic_load_n(&spanRing->head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > SPAN_RING ? head - SPAN_RING : 0;
+    for (unsigned long ticket = first; ticket < head; ticket++)
+    {
+        Span span;
+        if (!readSpan(ticket % SPAN_RING, &span) || span.traceId != traceId)
+            continue;
+        appendText(buf, len, cap, ",\n{\"name\":");
+        appendJsonString(buf, len, cap, span.name);
+        appendText(buf, len, cap, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lu,\"pid\":%d,\"tid\":%d,"
+                                  "\"args\":{\"trace\":\"%016llx\",\"span\":\"%016llx\",\"parent\":\"%016llx\",\"detail\":",
+                   STATS_PREFIX, span.startUs, span.durUs, pid, span.tid, span.traceId, span.spanId, span.parentId);
+        appendJsonString(buf, len, cap, span.detail);
+        appendText(buf, len, cap, "}}");
+    }
+}
+
+// Function to handle trace command, one trace as Chrome trace-event JSON with the spans of S1 and of
+// every node in the routing table, in a names-style blob
+void handleTrace(int con_sd, char *commandArgs[], int *count)
+{
+    unsigned long long traceId = 0;
+    if (*count != 2 || sscanf(commandArgs[1], "%llx", &traceId) != 1 || traceId == 0)
+    {
+        const char *msg = "Error: trace requires a trace id";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    char *buf = NULL;
+    int len = 0, cap = 0;
+    appendText(&buf, &len, &cap, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"S1\"}}", s1Port);
+    appendTraceEvents(&buf, &len, &cap, traceId, s1Port);
+    char line[64];
+    snprintf(line, sizeof(line), "spans %016llx", traceId);
+    for (int i = 0; i < routing.nodeCount; i++)
+    {
+        const StorageNode *node = &routing.nodes[i];
+        int seen = node->port == 0;
+        for (int j = 0; j < i && !seen; j++)
+            seen = routing.nodes[j].port == node->port && strcmp(routing.nodes[j].ip, node->ip) == 0;
+        if (seen)
+            continue;
+        char *blob = NULL;
+        int blobLen = 0;
+        if (fetch_blob_from_peer(node->ip, node->port, line, &blob, &blobLen) != 0)
+            continue;
+        appendText(&buf, &len, &cap, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %s:%d\"}}",
+                   node->port, node->name, node->ip, node->port);
+        if (blobLen > 0)
+            appendText(&buf, &len, &cap, "%.*s", blobLen, blob);
+        free(blob);
+    }
+    appendText(&buf, &len, &cap, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    send_names_blob(con_sd, buf, len);
+    free(buf);
+}
+
+// --- S1: online rebalancing ---
+
+// Helper function to list the files with ext under a node's root as ./relative entries with sizes
+static int listNodeFiles(const StorageNode *node, const char *ext, TarEntry **list, int *count)
+{
+    char root[MAX_PATH];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), node->root);
+    int cap = 0;
+    *list = NULL;
+    *count = 0;
+    if (node->port == 0)
+        return scan_tree_for_ext(root, ".", ext, list, count, &cap);
+    char line[MAX_PATH + 64];
+    snprintf(line, sizeof(line), "listall %s %s", root, ext);
+    char *blob = NULL;
+    int len = 0;
+    int rc = fetch_blob_from_peer(node->ip, node->port, line, &blob, &len);
+    // A peer refusing the extension holds no such files
+    if (rc == -2)
+        return 0;
+    if (rc != 0)
+        return -1;
+    // One "<size> ./<rel>" line per file
+    for (int p = 0; p < len;)
+    {
+        int q = p;
+        while (q < len && blob[q] != '\n')
+            q++;
+        char entry[MAX_PATH + 32];
+        snprintf(entry, sizeof(entry), "%.*s", q - p, blob + p);
+        char *space = strchr(entry, ' ');
+        if (space)
+        {
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_size = atoll(entry);
+            add_tar_entry(list, count, &cap, space + 1, &st);
+        }
+        p = q + 1;
+    }
+    free(blob);
+    return 0;
+}
+
+// Helper function to remove the copy a node holds once the new owner has the file
+static int removeNodeFile(const StorageNode *node, const char *tildePath)
+{
+    char path[MAX_PATH];
+    nodePath(node, tildePath, path, sizeof(path));
+    if (node->port == 0)
+    {
+        if (unlink(path) != 0)
+            return -1;
+        char root[MAX_PATH];
+        snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+        recordRemoval(root, path);
+        invalidateListCacheForFile(tildePath);
+        return 0;
+    }
+    char response[MAX_BUFFER];
+    if (communicateWithServer("removef", path, NULL, 0, node->ip, node->port, response) != SUCCESS)
+        return -1;
+    bloomRemoved(node, tildePath);
+    return strstr(response, "successfully") ? 0 : -1;
 }
 
-// ask a peer (S2/S3/S4) to list names from dir for a given ext; returns malloc'ed buffer
-static int fetch_names_from_peer(const char *ip, int port,
-                                 const char *dirAbs, const char *ext,
-                                 char **outBuf, int *outLen)
+// Helper function to read a file from a peer into a malloc'ed buffer
+static int fetchPeerFile(const StorageNode *node, const char *path, char **outData, int *outSize)
 {
-    *outBuf = NULL;
-    *outLen = 0;
-
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    int sd = connectToPeer(node->ip, node->port);
     if (sd < 0)
         return -1;
-
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0)
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "downlf %s deflate", path);
+    char status[MAX_BUFFER];
+    int n = -1;
+    if (writePeerCommand(sd, command) > 0)
+        n = read(sd, status, sizeof(status) - 1);
+    uint32_t netSize;
+    if (n <= 0 || strncmp(status, "Success:", 8) != 0 ||
+        read(sd, &netSize, sizeof(netSize)) != sizeof(netSize))
     {
         close(sd);
         return -1;
     }
-    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    int size = ntohl(netSize);
+    char *data = size > 0 && size <= MAX_FILE_SIZE ? (char *)malloc(size) : NULL;
+    if (!data || receiveCompressedData(sd, data, size) != size)
     {
+        free(data);
         close(sd);
         return -1;
     }
+    close(sd);
+    *outData = data;
+    *outSize = size;
+    return 0;
+}
 
-    char line[MAX_PATH + 64];
-    snprintf(line, sizeof(line), "dispfnames %s %s", dirAbs, ext);
-    if (write(sd, line, strlen(line)) <= 0)
+// Helper function to read a local file into a malloc'ed buffer
+static int readLocalFile(const char *path, char **outData, int *outSize)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size <= 0 || st.st_size > MAX_FILE_SIZE)
+        return -1;
+    char *data = (char *)malloc(st.st_size);
+    int fd = open(path, O_RDONLY);
+    if (!data || fd < 0 || read(fd, data, st.st_size) != st.st_size)
     {
-        close(sd);
+        free(data);
+        if (fd >= 0)
+            close(fd);
         return -1;
     }
+    close(fd);
+    *outData = data;
+    *outSize = st.st_size;
+    return 0;
+}
 
-    // 1) read status
-    char status[MAX_BUFFER];
-    int sl = read(sd, status, sizeof(status) - 1);
-    if (sl <= 0)
-    {
-        close(sd);
+// Helper function to write a local file under a temporary name and rename it into place
+static int writeLocalFile(const char *path, const char *data, int size)
+{
+    char dir[MAX_PATH], tmp[MAX_PATH + 32];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    snprintf(tmp, sizeof(tmp), "%s.migrating.%d", path, (int)getpid());
+    if (createDirectory(dir) != 0)
         return -1;
-    }
-    status[sl] = '\0';
-    if (strstr(status, "Error:"))
+    int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    int written = write(fd, data, size);
+    close(fd);
+    if (written != size || rename(tmp, path) != 0)
     {
-        close(sd);
-        return -2;
+        unlink(tmp);
+        return -1;
     }
+    return 0;
+}
 
-    // 2) read size
-    uint32_t netSz;
-    if (read(sd, &netSz, sizeof(netSz)) != sizeof(netSz))
+// Move one file to its new owner: the copy lands before the source copy is removed,
+// so a reader always finds the file on one of the two nodes
+static int migrateFile(const StorageNode *src, const StorageNode *dst, const char *tildePath)
+{
+    char srcPath[MAX_PATH], dstPath[MAX_PATH], response[MAX_BUFFER];
+    nodePath(src, tildePath, srcPath, sizeof(srcPath));
+    nodePath(dst, tildePath, dstPath, sizeof(dstPath));
+    bloomAdd(dst, tildePath);
+    // An upload since the reload already put a newer copy on the new owner, only the stale one goes
+    if (nodeHasFile(dst, tildePath))
+        return removeNodeFile(src, tildePath);
+    if (src->port != 0 && dst->port != 0)
     {
+        // Between peers the source pushes the file straight to the destination and removes its copy
+        int sd = connectToPeer(src->ip, src->port);
+        if (sd < 0)
+            return -1;
+        char command[MAX_BUFFER];
+        snprintf(command, sizeof(command), "migrate %s %s %d %s", srcPath, dst->ip, dst->port, dstPath);
+        int n = -1;
+        if (writePeerCommand(sd, command) > 0)
+            n = read(sd, response, sizeof(response) - 1);
         close(sd);
+        return n > 0 && strncmp(response, "Success:", 8) == 0 ? 0 : -1;
+    }
+    // S1 itself is one end, so the file passes through here
+    char *data = NULL;
+    int size = 0;
+    if ((src->port == 0 ? readLocalFile(srcPath, &data, &size) : fetchPeerFile(src, srcPath, &data, &size)) != 0)
         return -1;
+    int rc;
+    if (dst->port == 0)
+    {
+        rc = writeLocalFile(dstPath, data, size);
+        invalidateListCacheForFile(tildePath);
     }
-    int sz = ntohl(netSz);
-    if (sz < 0 || sz > MAX_FILE_SIZE)
+    else
     {
-        close(sd);
-        return -1;
+        rc = communicateWithServer("uploadf", dstPath, data, size, dst->ip, dst->port, response) == SUCCESS &&
+                     strstr(response, "successfully")
+                 ? 0
+                 : -1;
     }
+    free(data);
+    return rc == 0 ? removeNodeFile(src, tildePath) : -1;
+}
 
-    if (sz == 0)
+// Helper function to wait until the bytes moved so far fit the throttle
+static void throttleMigration(const struct timespec *start, long long bytes, int kbps)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    double due = (double)bytes / (kbps * 1024.0);
+    if (due > elapsed)
+        usleep((useconds_t)((due - elapsed) * 1e6));
+}
+
+// Helper function to move the files with ext that a node holds but no longer owns, for one rebalancer walk
+static void rebalanceNodeFiles(const StorageNode *node, const char *ext, const struct timespec *start,
+                               long long *bytesMoved, long *moved, long *failed)
+{
+    // Removals from here on are the ones the listing may miss
+    unsigned long listed = removalMark();
+    TarEntry *list = NULL;
+    int count = 0;
+    if (listNodeFiles(node, ext, &list, &count) != 0)
     {
-        close(sd);
-        *outBuf = NULL;
-        *outLen = 0;
-        return 0;
+        // A node that cannot be listed may still hold files
+        if (node->port != 0)
+            (*failed)++;
+        free(list);
+        return;
     }
-
-    // 3) read payload
-    char *buf = (char *)malloc(sz);
-    if (!buf)
+    for (int i = 0; i < count; i++)
     {
-        close(sd);
-        return -1;
+        char tildePath[MAX_PATH];
+        snprintf(tildePath, sizeof(tildePath), "~S1%s", list[i].rel + 1);
+        const Route *route = lookupRoute(ext, tildePath);
+        if (!route)
+            continue;
+        // A node among the file's replicas keeps its copy
+        const StorageNode *owners[MAX_POOL_NODES];
+        int ownerCount = replicaNodes(route, tildePath, owners);
+        int placed = 0;
+        for (int k = 0; k < ownerCount && !placed; k++)
+            placed = sameNode(owners[k], node);
+        if (placed)
+            continue;
+        // A file removed since the listing is not copied back
+        if (removedSince(tildePath, listed))
+            continue;
+        // Otherwise the copy goes to the first replica still missing the file
+        const StorageNode *owner = owners[0];
+        for (int k = 0; k < ownerCount; k++)
+        {
+            if (!nodeHasFile(owners[k], tildePath))
+            {
+                owner = owners[k];
+                break;
+            }
+        }
+        unsigned long copying = removalMark();
+        if (migrateFile(node, owner, tildePath) != 0)
+        {
+            fprintf(stderr, "Rebalance: failed to move %s from %s to %s\n", tildePath, node->name, owner->name);
+            (*failed)++;
+            continue;
+        }
+        catalogMoved(tildePath, owner->name);
+        // A removal during the copy may have run before the new copy landed, so it is finished here
+        if (removedSince(tildePath, copying))
+        {
+            removeNodeFile(owner, tildePath);
+            catalogForget(tildePath);
+            continue;
+        }
+        (*moved)++;
+        *bytesMoved += list[i].size;
+        if (migration)
+        {
+            __atomic_add_fetch(&migration->filesMoved, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&migration->bytesMoved, list[i].size, __ATOMIC_RELAXED);
+        }
+        throttleMigration(start, *bytesMoved, routing.migrateKBps);
     }
-    int got = receiveDataInChunks(sd, buf, sz);
-    close(sd);
-    if (got != sz)
+    free(list);
+}
+
+// Rebalancer process started after a reload: walk every node of the previous and current
+// tables and move each file whose owner changed, then end the double-read
+static void runRebalancer(unsigned long generation)
+{
+    const RoutingTable *tables[2] = {&previousRouting, &routing};
+    const StorageNode *nodes[MAX_NODES * 2];
+    const char *exts[MAX_ROUTES * 2];
+    int nodeCount = 0, extCount = 0;
+    for (int t = 0; t < 2; t++)
     {
-        free(buf);
-        return -1;
+        for (int i = 0; i < tables[t]->nodeCount; i++)
+        {
+            int seen = 0;
+            for (int k = 0; k < nodeCount && !seen; k++)
+                seen = sameNode(nodes[k], &tables[t]->nodes[i]);
+            if (!seen)
+                nodes[nodeCount++] = &tables[t]->nodes[i];
+        }
+        for (int i = 0; i < tables[t]->routeCount; i++)
+        {
+            int seen = 0;
+            for (int k = 0; k < extCount && !seen; k++)
+                seen = strcmp(exts[k], tables[t]->routes[i].ext) == 0;
+            if (!seen)
+                exts[extCount++] = tables[t]->routes[i].ext;
+        }
     }
 
-    *outBuf = buf;
-    *outLen = sz;
-    return 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long bytesMoved = 0;
+    long moved = 0, failed = 0;
+    // Files that failed to move are tried again by another walk, the ones moved already are skipped
+    for (int pass = 0; pass < MIGRATE_PASSES && (pass == 0 || failed > 0); pass++)
+    {
+        if (pass > 0)
+        {
+            printf("\nRebalance: %ld files failed to move, walking again in %d seconds\n", failed, MIGRATE_RETRY_SEC);
+            fflush(stdout);
+            sleep(MIGRATE_RETRY_SEC);
+        }
+        failed = 0;
+        for (int n = 0; n < nodeCount; n++)
+        {
+            for (int e = 0; e < extCount; e++)
+                rebalanceNodeFiles(nodes[n], exts[e], &start, &bytesMoved, &moved, &failed);
+        }
+    }
+    if (migration)
+        __atomic_add_fetch(&migration->filesFailed, failed, __ATOMIC_RELAXED);
+    // Cut over: reads stop looking at the previous table. Files that still failed to move after the last walk
+    // stay on their previous owners until a reload walks them again. A newer reload owns the state from here on.
+    if (migration && __atomic_load_n(&migration->generation, __ATOMIC_ACQUIRE) == generation)
+        __atomic_store_n(&migration->active, 0, __ATOMIC_RELEASE);
+    printf("\nRebalance done: %ld files (%lld bytes) moved, %ld failed%s\n", moved, bytesMoved, failed,
+           failed ? ", left on their previous owners" : "");
 }
 
-// send the final names blob to the client (size-prefixed)
-static int send_names_blob(int con_sd, const char *blob, int len)
+// Catalog scan process, started with s1 and after every reload: list the files of each route on each of its
+// nodes, also the previous table's while a migration runs, and add those the catalog misses (files from
+// before the catalog, entries lost in a crash). Only then are missing entries trusted; a node that cannot
+// be listed is tried again later.
+static void runCatalogScan()
 {
-    const char *ok = "Success: Names ready";
-    if (write(con_sd, ok, strlen(ok)) <= 0)
-        return -1;
-    usleep(10000);
-
-    uint32_t net = htonl((uint32_t)len);
-    if (write(con_sd, &net, sizeof(net)) != sizeof(net))
-        return -1;
-    usleep(10000);
+    const RoutingTable *tables[2] = {&routing, &previousRouting};
+    for (;;)
+    {
+        int failed = 0;
+        // A node in both tables or in several routes of an extension is listed once
+        NameSet listedNodes = {NULL, 0, 0};
+        for (int t = 0; t < (migrationActive() ? 2 : 1); t++)
+        {
+            for (int r = 0; r < tables[t]->routeCount; r++)
+            {
+                const Route *route = &tables[t]->routes[r];
+                for (int k = 0; k < route->nodeCount; k++)
+                {
+                    const StorageNode *node = &tables[t]->nodes[route->nodes[k]];
+                    char nodeKey[MAX_PATH];
+                    snprintf(nodeKey, sizeof(nodeKey), "%s:%d:%s %s", node->ip, node->port, node->root, route->ext);
+                    if (name_set_add(&listedNodes, nodeKey))
+                        continue;
+                    // A removef racing the listing must not leave its file in the catalog
+                    unsigned long listedAt = removalMark();
+                    TarEntry *list = NULL;
+                    int count = 0;
+                    if (listNodeFiles(node, route->ext, &list, &count) != 0)
+                    {
+                        failed++;
+                        free(list);
+                        continue;
+                    }
+                    for (int i = 0; i < count; i++)
+                    {
+                        char tildePath[MAX_PATH];
+                        snprintf(tildePath, sizeof(tildePath), "~S1%s", list[i].rel + 1);
+                        // A fragment's size is not the file's
+                        const Route *owner = lookupRouteIn(tables[t], route->ext, tildePath);
+                        long long size = owner && owner->dataShards > 0 ? -1 : list[i].size;
+                        catalogPut(tildePath, node->name, size, 0, 0, 0, 1, listedAt);
+                    }
+                    free(list);
+                }
+            }
+        }
+        name_set_free(&listedNodes);
+        if (!failed)
+        {
+            __atomic_store_n(&catalog->complete, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        sleep(CATALOG_RESCAN_SEC);
+    }
+}
 
-    if (len > 0)
+// Fork the catalog scan, replacing one still running; lookups ask the nodes until it is done
+static void startCatalogScan()
+{
+    if (!catalog)
+        return;
+    if (catalogScanPid > 0)
     {
-        if (sendDataInChunks(con_sd, blob, len) != len)
-            return -1;
+        kill(catalogScanPid, SIGTERM);
+        waitpid(catalogScanPid, NULL, 0);
+        catalogScanPid = 0;
     }
-    return 0;
+    __atomic_store_n(&catalog->complete, 0, __ATOMIC_RELEASE);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        runCatalogScan();
+        exit(0);
+    }
+    if (pid < 0)
+        perror("\nFork Failed.\n");
+    else
+        catalogScanPid = pid;
 }
 
-// --- S1: dispfnames handler ---
-void handleDispfnames(int con_sd, char *commandArgs[], int *count)
+// Fetch one node's filter for an extension and install it. Keys S1 added while the fetch ran are set
+// again; if more were added than recent holds the old filter stays and the next poll tries again.
+static void refreshBloom(const StorageNode *node, const char *ext)
 {
-    // Validate arg
-    if (*count != 2 || strncmp(commandArgs[1], "~S1", 3) != 0)
+    lockBlooms();
+    BloomFilter *f = bloomSlot(node->ip, node->port, node->root, ext, 1);
+    unsigned long startSeq = f ? f->addSeq : 0;
+    long removals = f ? f->removals : 0;
+    pthread_mutex_unlock(&blooms->lock);
+    if (!f)
+        return;
+    char line[MAX_PATH + 64];
+    snprintf(line, sizeof(line), "bloom %s/%s %s", getenv("HOME"), node->root, ext);
+    char *blob = NULL;
+    int len = 0;
+    int rc = fetch_blob_from_peer(node->ip, node->port, line, &blob, &len);
+    unsigned int bytes = len > 4 ? (unsigned int)(len - 4) : 0;
+    uint32_t netHashes = 0;
+    if (rc == 0 && len > 4)
+        memcpy(&netHashes, blob, 4);
+    int hashes = ntohl(netHashes);
+    // A peer without the command, or a filter that is not a power of two in size, leaves the node unfiltered
+    if (rc != 0 || bytes > BLOOM_MAX_BYTES || (bytes & (bytes - 1)) != 0 || hashes < 1 || hashes > BLOOM_MAX_HASHES)
     {
-        const char *msg = "Error: dispfnames requires a valid ~S1 path (directory).";
-        write(con_sd, msg, strlen(msg));
+        free(blob);
         return;
     }
+    lockBlooms();
+    if (f->addSeq - startSeq <= BLOOM_RECENT)
+    {
+        memcpy(f->bits, blob + 4, bytes);
+        f->bytes = bytes;
+        f->hashes = hashes;
+        for (unsigned long seq = startSeq; seq < f->addSeq; seq++)
+            bloomSet(f->bits, bytes * 8, hashes, f->recent[seq % BLOOM_RECENT]);
+        f->removals -= removals;
+        f->added = f->addSeq - startSeq;
+        f->fetchedAt = (long)time(NULL);
+    }
+    pthread_mutex_unlock(&blooms->lock);
+    free(blob);
+}
 
-    // Expand ~S1 to absolute on S1
-    char baseS1[MAX_PATH];
-    const char *home = getenv("HOME");
-    if (!home)
-        home = "/home/user";
-    snprintf(baseS1, sizeof(baseS1), "%s/S1%s", home, commandArgs[1] + 3);
-
-    // Prepare corresponding absolute directories on S2/S3/S4
-    char baseS2[MAX_PATH], baseS3[MAX_PATH], baseS4[MAX_PATH];
-    snprintf(baseS2, sizeof(baseS2), "%s/S2%s", home, commandArgs[1] + 3);
-    snprintf(baseS3, sizeof(baseS3), "%s/S3%s", home, commandArgs[1] + 3);
-    snprintf(baseS4, sizeof(baseS4), "%s/S4%s", home, commandArgs[1] + 3);
+// Bloom refresher process: fetch a filter for every remote node of every route (and the previous table's
+// during a migration) once, then again when files were removed or added since and it is older than
+// BLOOM_REFRESH_SEC, and at least every BLOOM_MAX_AGE_SEC
+static void runBloomRefresher()
+{
+    const RoutingTable *tables[2] = {&routing, &previousRouting};
+    for (;;)
+    {
+        long now = (long)time(NULL);
+        for (int t = 0; t < (migrationActive() ? 2 : 1); t++)
+        {
+            for (int r = 0; r < tables[t]->routeCount; r++)
+            {
+                const Route *route = &tables[t]->routes[r];
+                for (int k = 0; k < route->nodeCount; k++)
+                {
+                    const StorageNode *node = &tables[t]->nodes[route->nodes[k]];
+                    if (node->port == 0)
+                        continue;
+                    lockBlooms();
+                    BloomFilter *f = bloomSlot(node->ip, node->port, node->root, route->ext, 0);
+                    long age = f ? now - f->fetchedAt : now;
+                    int due = !f || f->bytes == 0 || age >= BLOOM_MAX_AGE_SEC ||
+                              ((f->removals > 0 || f->added > 0) && age >= BLOOM_REFRESH_SEC);
+                    pthread_mutex_unlock(&blooms->lock);
+                    if (due)
+                        refreshBloom(node, route->ext);
+                }
+            }
+        }
+        sleep(BLOOM_POLL_SEC);
+    }
+}
 
-    // ----- 1) Local .c list on S1 (non-recursive) -----
-    char **cList = NULL;
-    int cCount = 0;
-    collect_names_one_dir(baseS1, ".c", &cList, &cCount);
-    int cLen = 0;
-    char *cBlob = join_names(cList, cCount, &cLen);
+// Fork the Bloom refresher, replacing one still running
+static void startBloomRefresher()
+{
+    if (!blooms)
+        return;
+    if (bloomRefresherPid > 0)
+    {
+        kill(bloomRefresherPid, SIGTERM);
+        waitpid(bloomRefresherPid, NULL, 0);
+        bloomRefresherPid = 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        runBloomRefresher();
+        exit(0);
+    }
+    if (pid < 0)
+        perror("\nFork Failed.\n");
+    else
+        bloomRefresherPid = pid;
+}
 
-    // free cList array (but keep blob)
-    for (int i = 0; i < cCount; i++)
-        free(cList[i]);
-    free(cList);
+// SIGHUP asks the accept loop to reload the routing table
+static void handleReloadSignal(int sig)
+{
+    (void)sig;
+    reloadRequested = 1;
+}
 
-    // ----- 2) Remote .pdf from S2 -----
-    char *pdfBlob = NULL;
-    int pdfLen = 0;
-    if (fetch_names_from_peer(server2_ip, server2_port, baseS2, ".pdf", &pdfBlob, &pdfLen) < 0)
+// Reload the routing table file and start a rebalancer for the files whose owner changed
+static void reloadRouting(pid_t *rebalancerPid)
+{
+    if (!routingFile)
     {
-        // treat as empty if peer fails
-        pdfBlob = NULL;
-        pdfLen = 0;
+        printf("\nRouting table came from the command line, nothing to reload\n");
+        return;
     }
-
-    // ----- 3) Remote .txt from S3 -----
-    char *txtBlob = NULL;
-    int txtLen = 0;
-    if (fetch_names_from_peer(server3_ip, server3_port, baseS3, ".txt", &txtBlob, &txtLen) < 0)
+    static RoutingTable current;
+    current = routing;
+    memset(&routing, 0, sizeof(routing));
+    if (loadRoutingTable(routingFile) != 0)
     {
-        txtBlob = NULL;
-        txtLen = 0;
+        // Keep serving with the table we had
+        freeRoutingTable(&routing);
+        routing = current;
+        return;
     }
-
-    // ----- 4) Remote .zip from S4 -----
-    char *zipBlob = NULL;
-    int zipLen = 0;
-    if (fetch_names_from_peer(server4_ip, server4_port, baseS4, ".zip", &zipBlob, &zipLen) < 0)
+    freeRoutingTable(&previousRouting);
+    previousRouting = current;
+    // The forwarder routes queued files by the new table
+    if (forwarderPid > 0)
     {
-        zipBlob = NULL;
-        zipLen = 0;
+        kill(forwarderPid, SIGTERM);
+        waitpid(forwarderPid, NULL, 0);
     }
-
-    // ----- 5) Concatenate in required order: .c, .pdf, .txt, .zip -----
-    int totalLen = cLen + pdfLen + txtLen + zipLen;
-    char *finalBlob = NULL;
-    if (totalLen > 0)
+    startForwarder();
+    // Routes to nodes that already hold files are only trusted once those are listed
+    startCatalogScan();
+    startBloomRefresher();
+    // A rebalancer still moving files for an older table is replaced, the new walk covers its work
+    if (*rebalancerPid > 0)
     {
-        finalBlob = (char *)malloc(totalLen);
-        if (!finalBlob)
-        {
-            const char *msg = "Error: Memory allocation failed.";
-            write(con_sd, msg, strlen(msg));
-            if (cBlob)
-                free(cBlob);
-            if (pdfBlob)
-                free(pdfBlob);
-            if (txtBlob)
-                free(txtBlob);
-            if (zipBlob)
-                free(zipBlob);
-            return;
-        }
-        int off = 0;
-        if (cLen)
-        {
-            memcpy(finalBlob + off, cBlob, cLen);
-            off += cLen;
-        }
-        if (pdfLen)
-        {
-            memcpy(finalBlob + off, pdfBlob, pdfLen);
-            off += pdfLen;
-        }
-        if (txtLen)
-        {
-            memcpy(finalBlob + off, txtBlob, txtLen);
-            off += txtLen;
-        }
-        if (zipLen)
-        {
-            memcpy(finalBlob + off, zipBlob, zipLen);
-            off += zipLen;
-        }
+        kill(*rebalancerPid, SIGTERM);
+        waitpid(*rebalancerPid, NULL, 0);
+        *rebalancerPid = 0;
     }
-
-    // send to client
-    if (send_names_blob(con_sd, finalBlob ? finalBlob : "", totalLen) != 0)
+    unsigned long generation = 0;
+    if (migration)
     {
-        // fallthrough; client will handle
+        generation = __atomic_add_fetch(&migration->generation, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&migration->active, 1, __ATOMIC_RELEASE);
+    }
+    routingGeneration = generation;
+    printf("\nRouting table reloaded from %s, rebalancing\n", routingFile);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        runRebalancer(generation);
+        exit(0);
     }
+    if (pid < 0)
+        perror("\nFork Failed.\n");
+    else
+        *rebalancerPid = pid;
+}
 
-    // cleanup
-    if (cBlob)
-        free(cBlob);
-    if (pdfBlob)
-        free(pdfBlob);
-    if (txtBlob)
-        free(txtBlob);
-    if (zipBlob)
-        free(zipBlob);
-    if (finalBlob)
-        free(finalBlob);
+// Helper function for a child forked before a reload to load the new table too, so its removef and uploadf
+// reach the new owners instead of only the previous ones
+static void followRoutingReload()
+{
+    if (!migration || !routingFile)
+        return;
+    unsigned long generation = __atomic_load_n(&migration->generation, __ATOMIC_ACQUIRE);
+    if (generation == routingGeneration)
+        return;
+    routingGeneration = generation;
+    RoutingTable current = routing;
+    memset(&routing, 0, sizeof(routing));
+    if (loadRoutingTable(routingFile) != 0)
+    {
+        // Keep serving with the table we had
+        freeRoutingTable(&routing);
+        routing = current;
+        return;
+    }
+    freeRoutingTable(&previousRouting);
+    previousRouting = current;
 }
 
 // Function to handle client
@@ -1466,6 +6925,12 @@ void prcclient(int con_sd)
     char command[MAX_BUFFER];
     char *commandArgs[MAX_COMMAND_ARGS];
     int bytes;
+    // Socket byte counters before the next command, the difference is charged to it
+    unsigned long long seenIn = 0, seenOut = 0;
+    if (serverStats)
+        __atomic_add_fetch(&serverStats->connections, 1, __ATOMIC_RELAXED);
+    if (serverStats || workloadFd >= 0)
+        socketByteCounts(con_sd, &seenIn, &seenOut);
     while (1)
     {
         int count = 0;
@@ -1484,13 +6949,29 @@ void prcclient(int con_sd)
         }
         // Add string terminator
         command[bytes] = '\0';
+        // A traced client puts its trace context in front of the command
+        unsigned long long traceId, parentSpan;
+        char *line = takeTraceContext(command, &traceId, &parentSpan);
         // Tokenize user entered command
-        if (!tokenizeCommand(command, commandArgs, &count))
+        if (!tokenizeCommand(line, commandArgs, &count) || count == 0)
         {
             char *errorMsg = "Error: Command tokenization failed.\n";
             write(con_sd, errorMsg, strlen(errorMsg));
             break;
         }
+        followRoutingReload();
+        int cmd = statsCommandIndex(commandArgs[0]);
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if (serverStats)
+            __atomic_add_fetch(&serverStats->commands[cmd].inflight, 1, __ATOMIC_RELAXED);
+        timelineBegin(commandArgs, count);
+        // Peers' invalidations are not client traffic
+        if (strcmp(commandArgs[0], "invalidate") != 0)
+            workloadBegin(commandArgs, count);
+        // Exporting a trace is not traced itself
+        if (strcmp(commandArgs[0], "trace") != 0)
+            traceBegin(traceId, parentSpan);
         // If command is uploadf
         if (strcmp(commandArgs[0], "uploadf") == 0)
         {
@@ -1521,6 +7002,56 @@ void prcclient(int con_sd)
             // Handle dispfnames command
             handleDispfnames(con_sd, commandArgs, &count);
         }
+        // If command is features
+        else if (strcmp(commandArgs[0], "features") == 0)
+        {
+            // Handle features handshake
+            handleFeatures(con_sd, commandArgs, &count);
+        }
+        // If command is invalidate
+        else if (strcmp(commandArgs[0], "invalidate") == 0)
+        {
+            // Handle invalidate command
+            handleInvalidate(con_sd, commandArgs, &count);
+        }
+        // If command is stats
+        else if (strcmp(commandArgs[0], "stats") == 0)
+        {
+            // Handle stats command
+            handleStats(con_sd, commandArgs, &count);
+        }
+        // If command is trace
+        else if (strcmp(commandArgs[0], "trace") == 0)
+        {
+            // Handle trace command
+            handleTrace(con_sd, commandArgs, &count);
+        }
+        timelineEnd();
+        traceEnd(commandArgs[0], timeline.command);
+        // Charge the time and the bytes moved to the command
+        unsigned long tookUs = elapsedUs(&started);
+        unsigned long long movedIn = 0, movedOut = 0;
+        if (serverStats || workload.active)
+        {
+            unsigned long long nowIn, nowOut;
+            socketByteCounts(con_sd, &nowIn, &nowOut);
+            if (nowIn >= seenIn && nowOut >= seenOut)
+            {
+                movedIn = nowIn - seenIn;
+                movedOut = nowOut - seenOut;
+            }
+            seenIn = nowIn;
+            seenOut = nowOut;
+        }
+        if (serverStats)
+        {
+            CommandStats *stats = &serverStats->commands[cmd];
+            recordLatency(&stats->latency, tookUs);
+            __atomic_sub_fetch(&stats->inflight, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stats->bytesIn, (unsigned long)movedIn, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stats->bytesOut, (unsigned long)movedOut, __ATOMIC_RELAXED);
+        }
+        workloadEnd(tookUs, movedIn, movedOut);
         // Free the commandArgs array
         for (int i = 0; i < count; i++)
         {
@@ -1548,22 +7079,71 @@ int main(int argc, char *argv[])
 {
     // Socket variable
     int lis_sd, con_sd, portNumber;
-    socklen_t len;
     struct sockaddr_in servAdd;
     int pid;
     // Error if file not run correctly
-    if (argc != 8)
+    // Optional trailing -m <metrics_port> serves the statistics over HTTP, -s <ms> sets the slow log threshold,
+    // -w <file> appends every client command to a workload trace
+    const char *workloadFile = NULL;
+    while (argc >= 3 && (strcmp(argv[argc - 2], "-m") == 0 || strcmp(argv[argc - 2], "-s") == 0 ||
+                         strcmp(argv[argc - 2], "-w") == 0))
+    {
+        if (strcmp(argv[argc - 2], "-m") == 0)
+            metricsPort = atoi(argv[argc - 1]);
+        else if (strcmp(argv[argc - 2], "-s") == 0)
+            slowRequestMs = atol(argv[argc - 1]);
+        else
+            workloadFile = argv[argc - 1];
+        argc -= 2;
+    }
+    if (argc != 8 && !(argc == 4 && strcmp(argv[2], "-r") == 0))
     {
-        fprintf(stderr, "Usage: %s <Server1_Port> <Server2_IP> <Server2_Port> <Server3_IP> <Server3_Port> <Server4_IP> <Server4_Port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <Server1_Port> <Server2_IP> <Server2_Port> <Server3_IP> <Server3_Port> <Server4_IP> <Server4_Port> [-m <metrics_port>] [-s <slow_ms>] [-w <workload_file>]\n", argv[0]);
+        fprintf(stderr, "       %s <Server1_Port> -r <routing_table_file> [-m <metrics_port>] [-s <slow_ms>] [-w <workload_file>]\n", argv[0]);
         exit(0);
     }
-    // Assign server 2-4 values to respected variables
-    server2_ip = argv[2];
-    sscanf(argv[3], "%d", &server2_port);
-    server3_ip = argv[4];
-    sscanf(argv[5], "%d", &server3_port);
-    server4_ip = argv[6];
-    sscanf(argv[7], "%d", &server4_port);
+    // Load the routing table, or route to server 2-4 from the command line
+    if (argc == 4)
+    {
+        routingFile = argv[3];
+        if (loadRoutingTable(routingFile) != 0)
+        {
+            exit(1);
+        }
+    }
+    else
+    {
+        defaultRoutingTable(argv);
+    }
+    // Map the listing cache, migration state, request and peer statistics, catalog and Bloom filters before
+    // forking so every child shares them, the erasure coding tables are inherited
+    initServerStats();
+    initSpanRing();
+    initListCache();
+    initMigrationState();
+    initPeerStats();
+    initErasureCoding();
+    initCatalog();
+    initBloomFilters();
+    if (workloadFile && initWorkloadTrace(workloadFile) != 0)
+    {
+        exit(1);
+    }
+    previousRouting.routeCount = 0;
+
+    // SIGHUP reloads the routing table; no SA_RESTART so accept returns to the loop
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleReloadSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    pid_t rebalancerPid = 0;
+    // Write-behind uploads are drained by their own process, the catalog is checked against the nodes
+    // and the peers' Bloom filters are kept fresh
+    startForwarder();
+    startCatalogScan();
+    startBloomRefresher();
+    startMetricsServer();
 
     // socket() call
     if ((lis_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -1579,6 +7159,7 @@ int main(int argc, char *argv[])
     // htonl: Host to Network Long : Converts host byte order to network byte order
     sscanf(argv[1], "%d", &portNumber);
     servAdd.sin_port = htons((uint16_t)portNumber); // Add the port number entered by the user
+    s1Port = portNumber;
 
     // bind() call
     bind(lis_sd, (struct sockaddr *)&servAdd, sizeof(servAdd));
@@ -1589,6 +7170,34 @@ int main(int argc, char *argv[])
     {
         // Accept client connection
         con_sd = accept(lis_sd, (struct sockaddr *)NULL, NULL);
+        // Reload between connections, children already running keep their table
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            reloadRouting(&rebalancerPid);
+        }
+        if (rebalancerPid > 0 && waitpid(rebalancerPid, NULL, WNOHANG) == rebalancerPid)
+        {
+            rebalancerPid = 0;
+        }
+        if (forwarderPid > 0 && waitpid(forwarderPid, NULL, WNOHANG) == forwarderPid)
+        {
+            startForwarder();
+        }
+        if (catalogScanPid > 0 && waitpid(catalogScanPid, NULL, WNOHANG) == catalogScanPid)
+        {
+            catalogScanPid = 0;
+        }
+        if (bloomRefresherPid > 0 && waitpid(bloomRefresherPid, NULL, WNOHANG) == bloomRefresherPid)
+        {
+            bloomRefresherPid = 0;
+            startBloomRefresher();
+        }
+        restartMetricsServer();
+        if (con_sd < 0)
+        {
+            continue;
+        }
         // Fork for client
         pid = fork();
         // Child process service client request using prcclient
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +11,17 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
 
 // Global constant
 #define MAX_BUFFER 2048
@@ -19,6 +31,136 @@
 #define MAX_FILE_SIZE (50 * 1024 * 1024)
 #define SUPPORTED_EXT ".pdf"
 
+// On-the-wire compression of uploadf/downlf payloads
+#define WIRE_FRAME_RAW (64 * 1024)
+#define WIRE_STORED 0x80000000u
+#define WIRE_SAMPLE 4096
+#define WIRE_MIN_SIZE 512
+
+// Chained uploads: every hop answers with one line per stored copy, then this line once the chain is done
+#define CHAIN_END "end"
+// Hop list of the last hop of a chain, which has no hop to pass the file on to
+#define CHAIN_LAST "-"
+
+// Log of removed files kept in the storage root for incremental downltar
+#define REMOVED_LOG ".removed.log"
+#define DELETED_MANIFEST ".downltar_deleted"
+
+// Compressed downltar streams
+#define TAR_STREAMED 0xFFFFFFFFu
+// Frame length ending a framed stream that failed part way
+#define TAR_FRAME_ERROR 0xFFFFFFFFu
+#define TAR_NOT_COMPRESSED -2
+#define GZ_BLOCK_SIZE (256 * 1024)
+#define GZ_MAX_THREADS 8
+
+// Bloom filter of the files under a root sent to server1, sized for twice the files it holds
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+#define BLOOM_MIN_BYTES 1024
+#define BLOOM_MAX_BYTES (128 * 1024)
+
+// Request statistics: metric name prefix, log-linear latency buckets (8 per power of two microseconds)
+#ifndef STATS_PREFIX
+#define STATS_PREFIX "s2"
+#endif
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS 312
+#define STATS_COMMANDS 10
+
+// Seconds a metrics scrape may take to send its request or to read the reply
+#define METRICS_TIMEOUT_SEC 2
+
+// Distributed tracing: spans of this node kept for "spans <id>" in a ring shared by the children
+#define SPAN_RING 4096
+
+// Latency histogram updated with relaxed atomics, percentiles are read from the buckets
+typedef struct
+{
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long sumUs;
+    unsigned long maxUs;
+} LatencyHist;
+
+// Counters of one server1 command
+typedef struct
+{
+    LatencyHist latency;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    long inflight;
+} CommandStats;
+
+// Request statistics shared by all forked children
+typedef struct
+{
+    long startedAt;
+    unsigned long connections;
+    CommandStats commands[STATS_COMMANDS];
+} ServerStats;
+
+ServerStats *serverStats = NULL;
+const char *statsCommandNames[STATS_COMMANDS] = {"uploadf", "downlf", "removef", "downltar", "dispfnames",
+                                                 "stat", "listall", "migrate", "bloom", "other"};
+// Port of the Prometheus text endpoint on 127.0.0.1 (-m, 0 for none) and the process serving it
+int metricsPort = 0;
+pid_t metricsPid = 0;
+
+// One timed operation of a trace, times in wall clock microseconds so spans of all nodes line up
+typedef struct
+{
+    unsigned long seq;
+    unsigned long long traceId;
+    unsigned long long spanId;
+    unsigned long long parentId;
+    long long startUs;
+    unsigned long durUs;
+    int pid;
+    int tid;
+    char name[32];
+    char detail[96];
+} Span;
+
+// Recent spans of every child, head counts the spans ever written
+typedef struct
+{
+    unsigned long head;
+    Span spans[SPAN_RING];
+} SpanRing;
+
+SpanRing *spanRing = NULL;
+
+// Trace of the command this child is serving (traceId 0 when none), spanId is its span
+typedef struct
+{
+    unsigned long long traceId;
+    unsigned long long spanId;
+    unsigned long long parentId;
+    long long startUs;
+} TraceContext;
+
+TraceContext currentTrace;
+
+// Port this server listens on, the process id of its spans in exported traces
+int serverPort = 0;
+
+// Optional server1 address for listing change notifications
+char *server1_ip = NULL;
+int server1_port = 0;
+
+// Storage root of this server below $HOME, another name (-n) lets several servers of a type share a host
+char rootName[64] = "S2";
+// "/<root>/", how the root shows in the absolute paths server1 sends
+char rootMarker[68] = "/S2/";
+// Extension this server stores and the name of its downltar archive
+const char *peerExt = SUPPORTED_EXT;
+const char *peerTarName = "pdf.tar";
+// PDFs are already compressed, store them in the gzip stream instead of deflating again
+int peerStoreInGzip = 1;
+// Called with each command before it is served, so one process can switch the settings above per command (s25Node)
+void (*selectCommandRoot)(char *commandArgs[], int count) = NULL;
+
 // top-level alphabetical comparator for qsort
 static int cmpstr(const void *a, const void *b)
 {
@@ -67,6 +209,126 @@ int receiveDataInChunks(int socket, char *buffer, int expectedSize)
     return totalReceived;
 }
 
+// Helper function to check whether a payload is worth deflating on the wire
+int wireWorthCompressing(const char *name, const char *data, int dataSize)
+{
+    // Skip formats that are compressed already
+    const char *dot = name ? strrchr(name, '.') : NULL;
+    if (dot && (strcmp(dot, ".zip") == 0 || strcmp(dot, ".pdf") == 0))
+    {
+        return 0;
+    }
+    if (dataSize < WIRE_MIN_SIZE)
+    {
+        return 0;
+    }
+    // Quick entropy check: deflate a small sample and skip if it barely shrinks
+    unsigned char sample[WIRE_SAMPLE + 64];
+    uLongf sampleLen = sizeof(sample);
+    int n = dataSize < WIRE_SAMPLE ? dataSize : WIRE_SAMPLE;
+    if (compress2(sample, &sampleLen, (const Bytef *)data, n, 1) != Z_OK)
+    {
+        return 0;
+    }
+    return sampleLen < (uLongf)n * 9 / 10;
+}
+
+// Helper function to send data as deflate frames, blocks that do not shrink go stored
+int sendCompressedData(int socket, const char *data, int dataSize, int compress)
+{
+    uLong outCap = compressBound(WIRE_FRAME_RAW);
+    unsigned char *out = compress ? (unsigned char *)malloc(outCap) : NULL;
+    for (int offset = 0; offset < dataSize; offset += WIRE_FRAME_RAW)
+    {
+        int n = (dataSize - offset > WIRE_FRAME_RAW) ? WIRE_FRAME_RAW : (dataSize - offset);
+        const char *frame = data + offset;
+        uint32_t header = WIRE_STORED | (uint32_t)n;
+        // Each frame carries its length, the high bit marks a stored (raw) frame
+        uLongf outLen = outCap;
+        if (out && compress2(out, &outLen, (const Bytef *)frame, n, 1) == Z_OK && outLen < (uLongf)n)
+        {
+            frame = (const char *)out;
+            header = (uint32_t)outLen;
+        }
+        int frameLen = header & ~WIRE_STORED;
+        uint32_t netHeader = htonl(header);
+        if (write(socket, &netHeader, sizeof(netHeader)) != sizeof(netHeader) ||
+            sendDataInChunks(socket, frame, frameLen) != frameLen)
+        {
+            free(out);
+            return -1;
+        }
+    }
+    free(out);
+    return dataSize;
+}
+
+// Helper function to receive deflate frames, copying each frame to *teeSd as it arrives
+int receiveCompressedDataTee(int socket, char *buffer, int expectedSize, int *teeSd)
+{
+    uLong inCap = compressBound(WIRE_FRAME_RAW);
+    unsigned char *in = (unsigned char *)malloc(inCap);
+    if (!in)
+    {
+        return -1;
+    }
+    int totalReceived = 0;
+    while (totalReceived < expectedSize)
+    {
+        int want = (expectedSize - totalReceived > WIRE_FRAME_RAW) ? WIRE_FRAME_RAW : (expectedSize - totalReceived);
+        uint32_t netHeader;
+        if (receiveDataInChunks(socket, (char *)&netHeader, sizeof(netHeader)) != sizeof(netHeader))
+        {
+            break;
+        }
+        uint32_t header = ntohl(netHeader);
+        uint32_t frameLen = header & ~WIRE_STORED;
+        if (header & WIRE_STORED)
+        {
+            // Stored frames land directly in the buffer
+            if (frameLen != (uint32_t)want ||
+                receiveDataInChunks(socket, buffer + totalReceived, want) != want)
+            {
+                break;
+            }
+        }
+        else
+        {
+            if (frameLen > inCap ||
+                receiveDataInChunks(socket, (char *)in, frameLen) != (int)frameLen)
+            {
+                break;
+            }
+        }
+        // Pass the frame on as received, a replica that stops reading drops out of the chain
+        if (teeSd && *teeSd >= 0 &&
+            (write(*teeSd, &netHeader, sizeof(netHeader)) != sizeof(netHeader) ||
+             sendDataInChunks(*teeSd, (header & WIRE_STORED) ? buffer + totalReceived : (char *)in, frameLen) != (int)frameLen))
+        {
+            close(*teeSd);
+            *teeSd = -1;
+        }
+        if (!(header & WIRE_STORED))
+        {
+            uLongf outLen = want;
+            if (uncompress((Bytef *)buffer + totalReceived, &outLen, in, frameLen) != Z_OK ||
+                outLen != (uLongf)want)
+            {
+                break;
+            }
+        }
+        totalReceived += want;
+    }
+    free(in);
+    return totalReceived == expectedSize ? totalReceived : -1;
+}
+
+// Helper function to receive data sent with sendCompressedData
+int receiveCompressedData(int socket, char *buffer, int expectedSize)
+{
+    return receiveCompressedDataTee(socket, buffer, expectedSize, NULL);
+}
+
 // Helper function to extract path
 void extractPath(char *path)
 {
@@ -78,20 +340,6 @@ void extractPath(char *path)
     }
 }
 
-// Helper function to verify the existence of file
-int validateFileExist(char *filename)
-{
-    struct stat st;
-    // Return 0, if file does not exist
-    if (stat(filename, &st) != 0)
-    {
-        perror(filename);
-        return 0;
-    }
-    // Return 1 if file not exist
-    return 1;
-}
-
 // Helper function to spilt the command
 int tokenizeCommand(char *input, char *commandArgs[], int *count)
 {
@@ -101,7 +349,7 @@ int tokenizeCommand(char *input, char *commandArgs[], int *count)
     char *delimiter = " \t";
     // Split on the base of delimiter using strtok
     char *portion = strtok(copyInput, delimiter);
-    while (portion != NULL)
+    while (portion != NULL && *count < MAX_COMMAND_ARGS)
     {
         commandArgs[*count] = malloc(strlen(portion) + 1);
         if (commandArgs[*count] == NULL)
@@ -132,13 +380,14 @@ int createDirectory(char *path)
     {
         tempPath[len - 1] = 0;
     }
-    char *baseEnd = NULL;
-    // Check the path contains /S2/
-    if (strstr(tempPath, "/S2/"))
+    // Refuse a path outside the storage root, only the directories below it are created
+    char *baseEnd = strstr(tempPath, rootMarker);
+    if (!baseEnd)
     {
-        // Skip "/S2"
-        baseEnd = strstr(tempPath, "/S2/") + 3;
+        return -1;
     }
+    // Skip "/<root>"
+    baseEnd += strlen(rootMarker) - 1;
     // Iterate through the path and create subdirectories
     for (p = baseEnd; *p; p++)
     {
@@ -162,12 +411,363 @@ int createDirectory(char *path)
     return 0;
 }
 
+// --- Distributed tracing ---
+
+// Helper function to map the span ring shared by the children, no spans are kept if it fails
+static void initSpanRing()
+{
+    void *mem = mmap(NULL, sizeof(SpanRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap span ring");
+        return;
+    }
+    memset(mem, 0, sizeof(SpanRing));
+    spanRing = (SpanRing *)mem;
+}
+
+// Helper function to get the wall clock in microseconds, spans of all nodes share it
+static long long wallClockUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Helper function to make a random, non-zero trace or span id (xorshift, seeded per thread)
+static unsigned long long newTraceId()
+{
+    static __thread unsigned long long state = 0;
+    if (state == 0)
+        state = ((unsigned long long)wallClockUs() << 20) ^ ((unsigned long long)getpid() << 40) ^ (unsigned long long)(size_t)&state;
+    unsigned long long id;
+    do
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        id = state;
+    } while (id == 0);
+    return id;
+}
+
+// Helper function to add a span of the current trace to the ring. Writers claim a slot with one atomic add;
+// the slot's seq is cleared while it is written and set to the ticket after, so readers skip torn slots
+static void recordSpan(const char *name, const char *detail, unsigned long long spanId, unsigned long long parentId,
+                       long long startUs, unsigned long durUs)
+{
+    if (!spanRing || currentTrace.traceId == 0)
+        return;
+    unsigned long ticket = __atomic_fetch_add(&spanRing->head, 1, __ATOMIC_RELAXED);
+    Span *span = &spanRing->spans[ticket % SPAN_RING];
+    __atomic_store_n(&span->seq, 0, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    span->traceId = currentTrace.traceId;
+    span->spanId = spanId;
+    span->parentId = parentId;
+    span->startUs = startUs;
+    span->durUs = durUs;
+    span->pid = (int)getpid();
+    span->tid = (int)gettid();
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    snprintf(span->detail, sizeof(span->detail), "%s", detail ? detail : "");
+    __atomic_store_n(&span->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// Helper function to copy a finished span out of the ring, 0 if it is being rewritten
+static int readSpan(unsigned long slot, Span *out)
+{
+    Span *span = &spanRing->spans[slot];
+    unsigned long seq = __atomic_load_n(&span->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0)
+        return 0;
+    memcpy(out, span, sizeof(Span));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&span->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Helper function to take a leading "trace:<trace id>[:<parent span>]" token off a command, returns the rest
+static char *takeTraceContext(char *command, unsigned long long *traceId, unsigned long long *parentId)
+{
+    *traceId = 0;
+    *parentId = 0;
+    if (strncmp(command, "trace:", 6) != 0)
+        return command;
+    if (sscanf(command + 6, "%llx:%llx", traceId, parentId) < 1)
+        *traceId = 0;
+    char *rest = command + 6;
+    while (*rest && *rest != ' ' && *rest != '\t')
+        rest++;
+    while (*rest == ' ' || *rest == '\t')
+        rest++;
+    return rest;
+}
+
+// Start the span of a command server1 or another node sent with a trace context
+static void traceBegin(unsigned long long traceId, unsigned long long parentId)
+{
+    currentTrace.traceId = traceId;
+    currentTrace.parentId = parentId;
+    currentTrace.spanId = traceId ? newTraceId() : 0;
+    currentTrace.startUs = wallClockUs();
+}
+
+// Finish the span of a traced command
+static void traceEnd(const char *name, const char *detail)
+{
+    if (currentTrace.traceId == 0)
+        return;
+    recordSpan(name, detail, currentTrace.spanId, currentTrace.parentId, currentTrace.startUs,
+               (unsigned long)(wallClockUs() - currentTrace.startUs));
+    currentTrace.traceId = 0;
+}
+
+// Helper function to send a command to another node, preceded by the trace context of the command being served
+static ssize_t writePeerCommand(int sd, const char *command)
+{
+    if (currentTrace.traceId == 0)
+        return write(sd, command, strlen(command));
+    char traced[MAX_BUFFER];
+    int len = snprintf(traced, sizeof(traced), "trace:%016llx:%016llx %s", currentTrace.traceId, currentTrace.spanId, command);
+    if (len >= (int)sizeof(traced))
+        return write(sd, command, strlen(command));
+    return write(sd, traced, len);
+}
+
+// Helper function to tell server1 that the directory of filePath changed
+void notifyListingChange(const char *filePath)
+{
+    if (!server1_ip)
+        return;
+    // Map the local path back to the client visible ~S1 directory
+    const char *rel = strstr(filePath, rootMarker);
+    if (!rel)
+        return;
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "~S1%s", rel + strlen(rootMarker) - 1);
+    extractPath(dir);
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+        return;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server1_port);
+    if (inet_pton(AF_INET, server1_ip, &addr.sin_addr) <= 0 ||
+        connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sd);
+        return;
+    }
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "invalidate %s", dir);
+    if (writePeerCommand(sd, command) > 0)
+    {
+        // Wait for the acknowledgement so server1 never writes to a closed socket
+        char reply[MAX_BUFFER];
+        read(sd, reply, sizeof(reply));
+    }
+    close(sd);
+}
+
+// Removal log helpers (recordRemoval), shared with the other servers
+#include "s25RemovalLog.h"
+
+// --- Cached downltar archives ---
+
+// Cached full archives (open_cached_tar) and the tree scan, shared with the other servers
+#include "s25TarCache.h"
+
+// --- Storage ---
+
+// Storage primitives the command handlers go through, the files below $HOME. A program built from s2.c can put
+// its own in place before calling s2's main, the way s25NullPeer keeps only the path and size of each file.
+typedef struct
+{
+    // Size of a regular file, -1 if there is none
+    long long (*fileSize)(const char *path);
+    // Read the first size bytes of a file, returns the bytes read or -1
+    int (*readFile)(const char *path, char *data, int size);
+    // Put a received file in place, returns NULL or the error to reply with
+    const char *(*writeFile)(const char *path, const char *data, int size);
+    int (*removeFile)(const char *path);
+    int (*renameFile)(const char *oldPath, const char *newPath);
+    // Sorted names of the files with ext directly in dir
+    int (*listDir)(const char *dir, const char *ext, char ***outList, int *outCount);
+    // Files with ext anywhere below root as "./relative" entries with their sizes
+    int (*scanTree)(const char *root, const char *ext, TarEntry **outList, int *outCount);
+    // Archive of the files with ext below base, only those changed since a token when since > 0. Returns an fd.
+    int (*openTar)(const char *base, const char *ext, long since, off_t *outSize);
+} PeerStorage;
+
+static int collect_names_one_dir_peer(const char *dir, const char *ext, char ***outList, int *outCount);
+static int open_tar_for_ext(const char *base, const char *ext, long since, off_t *outSize);
+
+// Helper function to get the size of a regular file, -1 if there is none
+static long long fsFileSize(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    return st.st_size;
+}
+
+// Helper function to read the first size bytes of a file
+static int fsReadFile(const char *path, char *data, int size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int bytesRead = read(fd, data, size);
+    close(fd);
+    return bytesRead;
+}
+
+// Helper function to store a file under a temporary name and rename it into place, so readers never see a
+// partial file
+static const char *fsWriteFile(const char *path, const char *data, int size)
+{
+    // Create the directory of the file
+    char destPath[MAX_PATH];
+    snprintf(destPath, sizeof(destPath), "%s", path);
+    extractPath(destPath);
+    if (createDirectory(destPath) == -1)
+        return "\nError: Failed to create directory on server.\n";
+    char tmpPath[MAX_PATH + 32];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.part.%d", path, (int)getpid());
+    int fd = open(tmpPath, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        return "Error: Failed to create file on Server";
+    int bytesWritten = write(fd, data, size);
+    close(fd);
+    if (bytesWritten != size || rename(tmpPath, path) != 0)
+    {
+        unlink(tmpPath);
+        return "Error: Failed to write complete file on Server";
+    }
+    return NULL;
+}
+
+// Helper function to list the files with ext below root, a missing root is an empty tree
+static int fsScanTree(const char *root, const char *ext, TarEntry **outList, int *outCount)
+{
+    int cap = 0;
+    *outList = NULL;
+    *outCount = 0;
+    return scan_tree_for_ext(root, ".", ext, outList, outCount, &cap);
+}
+
+PeerStorage peerStorage = {fsFileSize, fsReadFile, fsWriteFile, unlink, rename,
+                           collect_names_one_dir_peer, fsScanTree, open_tar_for_ext};
+
+// --- Command handlers ---
+
+// Helper function to start the upload to the next replica of a chain ("ip:port:path|..."),
+// an unreachable replica is skipped. Returns the socket or -1.
+static int openChainHop(const char *chain, int fileSize)
+{
+    char hops[MAX_BUFFER];
+    snprintf(hops, sizeof(hops), "%s", chain);
+    char *hop = hops;
+    while (hop && *hop)
+    {
+        char *rest = strchr(hop, '|');
+        if (rest)
+            *rest++ = '\0';
+        char *portStr = strchr(hop, ':');
+        char *path = portStr ? strchr(portStr + 1, ':') : NULL;
+        if (path)
+        {
+            *portStr++ = '\0';
+            *path++ = '\0';
+            int sd = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(atoi(portStr));
+            if (sd >= 0 && inet_pton(AF_INET, hop, &addr.sin_addr) > 0 &&
+                connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            {
+                char command[MAX_BUFFER];
+                // The last hop gets CHAIN_LAST for a hop list, so it answers in chain lines too
+                snprintf(command, sizeof(command), "uploadf %s deflate %s", path, rest && *rest ? rest : CHAIN_LAST);
+                uint32_t networkFileSize = htonl((uint32_t)fileSize);
+                if (writePeerCommand(sd, command) > 0)
+                {
+                    usleep(10000);
+                    if (write(sd, &networkFileSize, sizeof(networkFileSize)) == sizeof(networkFileSize))
+                        return sd;
+                }
+            }
+            if (sd >= 0)
+                close(sd);
+        }
+        hop = rest;
+    }
+    return -1;
+}
+
+// Helper function to send one line of a chained upload's reply upstream. Upstream may already have its
+// quorum and be gone, which must not stop this hop from waiting for the hops after it
+static void sendChainLine(int sd, const char *line)
+{
+    // Messages meant for a single reply may carry newlines of their own
+    while (*line == '\n')
+        line++;
+    char buf[MAX_BUFFER];
+    int len = snprintf(buf, sizeof(buf), "%.*s\n", (int)strcspn(line, "\n"), line);
+    send(sd, buf, len, MSG_NOSIGNAL);
+}
+
+// Helper function to answer an upload. In a chain a hop acks its own copy at once, passes the acks of the
+// hops after it upstream as they come, and sends CHAIN_END when the last of them is done
+static void replyUpload(int con_sd, const char *msg, int nextSd, int chained)
+{
+    if (!chained)
+    {
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    sendChainLine(con_sd, msg);
+    if (nextSd >= 0)
+    {
+        // Every frame is sent; the next hop is read to its end even when upstream left, closing it earlier
+        // could reset the connection before that hop read its copy
+        shutdown(nextSd, SHUT_WR);
+        char buf[MAX_BUFFER];
+        int len = 0;
+        for (;;)
+        {
+            char *nl = (char *)memchr(buf, '\n', len);
+            if (!nl)
+            {
+                int n = len < (int)sizeof(buf) ? read(nextSd, buf + len, sizeof(buf) - len) : -1;
+                if (n <= 0)
+                    break;
+                len += n;
+                continue;
+            }
+            *nl = '\0';
+            if (strcmp(buf, CHAIN_END) == 0)
+                break;
+            sendChainLine(con_sd, buf);
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len);
+        }
+        close(nextSd);
+    }
+    sendChainLine(con_sd, CHAIN_END);
+}
+
 // Function to handle uploadf command
 void handleUploadf(int con_sd, char *commandArgs[])
 {
     // Get File path and name
     char fileCommand[256];
     snprintf(fileCommand, sizeof(fileCommand), "%s", commandArgs[1]);
+    // Deflate frames when server1 asked for them, a chain names the replicas after this one
+    int compressed = commandArgs[2] && strcmp(commandArgs[2], "deflate") == 0;
+    int chained = compressed && commandArgs[3] != NULL;
     // Read file size from server1(network bytes)
     uint32_t networkFileSize;
     int bytes = read(con_sd, &networkFileSize, sizeof(uint32_t));
@@ -177,7 +777,7 @@ void handleUploadf(int con_sd, char *commandArgs[])
     if (bytes <= 0 || fileSize <= 0 || fileSize > MAX_FILE_SIZE)
     {
         char *errorMsg = "Error: Invalid file size server";
-        write(con_sd, errorMsg, strlen(errorMsg));
+        replyUpload(con_sd, errorMsg, -1, chained);
         return;
     }
     // Allocate memory for file based on size
@@ -186,99 +786,66 @@ void handleUploadf(int con_sd, char *commandArgs[])
     if (!fileData)
     {
         char *errorMsg = "Error: Memory allocation failed";
-        write(con_sd, errorMsg, strlen(errorMsg));
-        return;
-    }
-    // Variable to store file name and path
-    char destPath[MAX_PATH];
-    char filePathAndName[MAX_PATH];
-    memset(filePathAndName, 0, sizeof(filePathAndName));
-    strcpy(filePathAndName, fileCommand);
-    memset(destPath, 0, sizeof(destPath));
-    strcpy(destPath, fileCommand);
-    // Extract only the path from destPath
-    extractPath(destPath);
-    // Create the directory for the dest path
-    if (createDirectory(destPath) == -1)
-    {
-        free(fileData);
-        char *errorMsg = "\nError: Failed to create directory on server.\n";
-        write(con_sd, errorMsg, strlen(errorMsg));
+        replyUpload(con_sd, errorMsg, -1, chained);
         return;
     }
-    // Receive file data in chunks
-    int totalReceived = receiveDataInChunks(con_sd, fileData, fileSize);
+    // Receive file data in chunks, the frames are passed on to the next hop as they arrive
+    int nextSd = chained ? openChainHop(commandArgs[3], fileSize) : -1;
+    int totalReceived = compressed ? receiveCompressedDataTee(con_sd, fileData, fileSize, &nextSd)
+                                   : receiveDataInChunks(con_sd, fileData, fileSize);
     // Error if entire file is not read/received
     if (totalReceived != fileSize)
     {
         free(fileData);
         char *errorMsg = "Error: Failed to receive complete file data";
-        write(con_sd, errorMsg, strlen(errorMsg));
+        replyUpload(con_sd, errorMsg, nextSd, chained);
         return;
     }
-    // Use open to create the file
-    int fd = open(filePathAndName, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    // Error if open fails
-    if (fd < 0)
-    {
-        free(fileData);
-        char *errorMsg = "Error: Failed to create file on Server";
-        write(con_sd, errorMsg, strlen(errorMsg));
-        return;
-    }
-    // Write the file on server
-    int bytesWritten = write(fd, fileData, fileSize);
-    // Close the file
-    close(fd);
+    // Store the file on server
+    const char *errorMsg = peerStorage.writeFile(fileCommand, fileData, fileSize);
     // Free file buffer
     free(fileData);
-    // Error if file not written completely
-    if (bytesWritten != fileSize)
+    if (errorMsg)
     {
-        char *errorMsg = "Error: Failed to write complete file on Server";
-        write(con_sd, errorMsg, strlen(errorMsg));
+        replyUpload(con_sd, errorMsg, nextSd, chained);
         return;
     }
+    // Let server1 drop its cached listing of this directory
+    notifyListingChange(fileCommand);
     // Send success response
     char successMsg[MAX_BUFFER];
     snprintf(successMsg, sizeof(successMsg), "File uploaded successfully to Server");
-    write(con_sd, successMsg, strlen(successMsg));
+    replyUpload(con_sd, successMsg, nextSd, chained);
 }
 
 // Function to handle downlf command
 void handleDownlf(int con_sd, char *commandArgs[])
 {
     char response[MAX_BUFFER];
-    // Get file size info
-    struct stat st;
-    stat(commandArgs[1], &st);
-    int fileSize = st.st_size;
-    // Allocate file buffer
-    char *fileBuffer = malloc(fileSize + 1);
-    // Validate file exist on server2
-    if (!validateFileExist(commandArgs[1]))
+    // Validate file exist on server2 and get its size
+    long long storedSize = peerStorage.fileSize(commandArgs[1]);
+    if (storedSize < 0)
     {
         snprintf(response, sizeof(response), "Error: File does not exist on Server");
         write(con_sd, response, strlen(response));
         return;
     }
-    // Send initial success to server
-    snprintf(response, MAX_BUFFER, "Success: File retrieved from target server");
-    write(con_sd, response, strlen(response));
-    // Open file locally
-    int fd = open(commandArgs[1], O_RDONLY);
-    // Error if open fails
-    if (fd < 0)
+    int fileSize = storedSize;
+    // Allocate file buffer
+    char *fileBuffer = malloc(fileSize + 1);
+    if (!fileBuffer)
     {
-        free(fileBuffer);
-        snprintf(response, sizeof(response), "Error: Failed to open file on server");
+        snprintf(response, sizeof(response), "Error: Memory allocation failed");
         write(con_sd, response, strlen(response));
         return;
     }
+    // Send initial success to server
+    snprintf(response, MAX_BUFFER, "Success: File retrieved from target server");
+    write(con_sd, response, strlen(response));
+    // Sleep for 10ms so the status is not read together with the size
+    usleep(10000);
     // Read file locally
-    int bytesRead = read(fd, fileBuffer, fileSize);
-    // Close the file
-    close(fd);
+    int bytesRead = peerStorage.readFile(commandArgs[1], fileBuffer, fileSize);
     // Error if file is not read completely
     if (bytesRead != fileSize)
     {
@@ -297,8 +864,11 @@ void handleDownlf(int con_sd, char *commandArgs[])
     }
     // Sleep for 10ms
     usleep(10000);
-    // Send file data in chunk to server 1
-    if (sendDataInChunks(con_sd, fileBuffer, fileSize) != fileSize)
+    // Send file data in chunk to server 1, as deflate frames when it asked for them
+    int compressed = commandArgs[2] && strcmp(commandArgs[2], "deflate") == 0;
+    int sent = compressed ? sendCompressedData(con_sd, fileBuffer, fileSize, wireWorthCompressing(commandArgs[1], fileBuffer, fileSize))
+                          : sendDataInChunks(con_sd, fileBuffer, fileSize);
+    if (sent != fileSize)
     {
         free(fileBuffer);
         return;
@@ -312,35 +882,248 @@ void handleRemovef(int con_sd, char *commandArgs[])
 {
     char response[MAX_BUFFER];
     // Validate file exist on server2
-    if (!validateFileExist(commandArgs[1]))
+    if (peerStorage.fileSize(commandArgs[1]) < 0)
     {
         snprintf(response, sizeof(response), "File does not exist on Server");
         write(con_sd, response, strlen(response));
         return;
     }
-    // Remove the file using unlink
-    unlink(commandArgs[1]);
+    // Remove the file
+    peerStorage.removeFile(commandArgs[1]);
+    char root[MAX_PATH];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), rootName);
+    recordRemoval(root, commandArgs[1]);
+    notifyListingChange(commandArgs[1]);
     snprintf(response, sizeof(response), "File removed successfully from Server");
     // Send respond to server1
     write(con_sd, response, strlen(response));
 }
 
-static int make_tar_for_ext(const char *baseDir, const char *ext,
+// --- Compressed downltar streams ---
+
+// Helper function to parse a "gz" or "gz:<level>" codec argument, returns 0 if valid
+static int parse_tar_codec(const char *arg, int *level)
+{
+    if (strcmp(arg, "gz") == 0)
+    {
+        *level = Z_DEFAULT_COMPRESSION;
+        return 0;
+    }
+    if (strncmp(arg, "gz:", 3) == 0 && arg[3] >= '0' && arg[3] <= '9' && arg[4] == '\0')
+    {
+        *level = arg[3] - '0';
+        return 0;
+    }
+    return -1;
+}
+
+// One block of the tar compressed independently into its own gzip member
+typedef struct
+{
+    unsigned char *in;
+    int inLen;
+    unsigned char *out;
+    int outCap;
+    int outLen;
+    int level;
+} GzBlock;
+
+// Worker that compresses one block, run on its own thread
+static void *gzip_block_worker(void *arg)
+{
+    GzBlock *b = (GzBlock *)arg;
+    b->outLen = -1;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 asks zlib for a gzip wrapper instead of zlib
+    if (deflateInit2(&zs, b->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    zs.next_in = b->in;
+    zs.avail_in = b->inLen;
+    zs.next_out = b->out;
+    zs.avail_out = b->outCap;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+        b->outLen = b->outCap - zs.avail_out;
+    deflateEnd(&zs);
+    return NULL;
+}
+
+// Stream an open tar as gzip frames, compressing GZ_BLOCK_SIZE blocks in parallel across cores
+static int send_tar_fd_gzip(int con_sd, int fd, off_t size, int level)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : (cores > GZ_MAX_THREADS ? GZ_MAX_THREADS : (int)cores);
+    GzBlock blocks[GZ_MAX_THREADS];
+    pthread_t tids[GZ_MAX_THREADS];
+    int outCap = (int)compressBound(GZ_BLOCK_SIZE) + 64;
+    memset(blocks, 0, sizeof(blocks));
+    int rc = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        blocks[i].in = (unsigned char *)malloc(GZ_BLOCK_SIZE);
+        blocks[i].out = (unsigned char *)malloc(outCap);
+        blocks[i].outCap = outCap;
+        blocks[i].level = level;
+        if (!blocks[i].in || !blocks[i].out)
+            rc = -1;
+    }
+    off_t off = 0;
+    while (rc == 0 && off < size)
+    {
+        // Read the next batch, one block per thread
+        int used = 0;
+        while (used < threads && off < size)
+        {
+            int want = size - off > GZ_BLOCK_SIZE ? GZ_BLOCK_SIZE : (int)(size - off);
+            int got = 0;
+            while (got < want)
+            {
+                int r = pread(fd, blocks[used].in + got, want - got, off + got);
+                if (r <= 0)
+                    break;
+                got += r;
+            }
+            if (got != want)
+            {
+                rc = -1;
+                break;
+            }
+            blocks[used].inLen = want;
+            off += want;
+            used++;
+        }
+        if (rc != 0)
+            break;
+        // Compress the batch, the calling thread takes the first block itself
+        int started[GZ_MAX_THREADS] = {0};
+        for (int i = 1; i < used; i++)
+            started[i] = pthread_create(&tids[i], NULL, gzip_block_worker, &blocks[i]) == 0;
+        gzip_block_worker(&blocks[0]);
+        for (int i = 1; i < used; i++)
+        {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                gzip_block_worker(&blocks[i]);
+        }
+        // Send the compressed blocks in order as length-prefixed frames
+        for (int i = 0; i < used && rc == 0; i++)
+        {
+            uint32_t netLen = htonl((uint32_t)blocks[i].outLen);
+            if (blocks[i].outLen <= 0 ||
+                write(con_sd, &netLen, sizeof(netLen)) != sizeof(netLen) ||
+                sendDataInChunks(con_sd, (char *)blocks[i].out, blocks[i].outLen) != blocks[i].outLen)
+                rc = -1;
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        free(blocks[i].in);
+        free(blocks[i].out);
+    }
+    // A zero length frame ends the stream, an error frame one that failed part way so the client stops waiting;
+    // if even that cannot be sent the connection is shut down
+    uint32_t end = htonl(rc == 0 ? 0 : TAR_FRAME_ERROR);
+    if (write(con_sd, &end, sizeof(end)) != sizeof(end))
+    {
+        shutdown(con_sd, SHUT_RDWR);
+        rc = -1;
+    }
+    return rc;
+}
+
+// Helper function to parse the options after the extension: [since <token>] [gz|gz:<level>]
+static int parse_downltar_options(char *commandArgs[], int count, long *since, int *level)
+{
+    *since = 0;
+    *level = TAR_NOT_COMPRESSED;
+    for (int i = 2; i < count; i++)
+    {
+        if (strcmp(commandArgs[i], "since") == 0 && i + 1 < count && *since == 0)
+        {
+            *since = atol(commandArgs[++i]);
+            if (*since <= 0)
+                return -1;
+        }
+        else if (*level != TAR_NOT_COMPRESSED || parse_tar_codec(commandArgs[i], level) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Append the list of files removed since the token to an incremental tar
+static int append_deleted_manifest(const char *baseDir, long since, const char *tarPath)
+{
+    char manifestDir[64];
+    snprintf(manifestDir, sizeof(manifestDir), "/tmp/downltar_%d.d", (int)getpid());
+    mkdir(manifestDir, 0700);
+    char manifestPath[MAX_PATH];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/%s", manifestDir, DELETED_MANIFEST);
+    FILE *out = fopen(manifestPath, "w");
+    if (!out)
+    {
+        rmdir(manifestDir);
+        return -1;
+    }
+    char logPath[MAX_PATH + 32];
+    snprintf(logPath, sizeof(logPath), "%s/%s", baseDir, REMOVED_LOG);
+    FILE *log = fopen(logPath, "r");
+    if (log)
+    {
+        char line[MAX_PATH + 32];
+        while (fgets(line, sizeof(line), log))
+        {
+            long ts;
+            char rel[MAX_PATH];
+            if (sscanf(line, "%ld %511[^\n]", &ts, rel) != 2 || ts < since)
+                continue;
+            // Skip paths that were uploaded again after the removal
+            char absPath[MAX_PATH * 2];
+            snprintf(absPath, sizeof(absPath), "%s/%s", baseDir, rel + 2);
+            struct stat st;
+            if (stat(absPath, &st) == 0)
+                continue;
+            fprintf(out, "%s\n", rel);
+        }
+        fclose(log);
+    }
+    fclose(out);
+
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "tar -rf \"%s\" -C \"%s\" ./%s 2>/dev/null", tarPath, manifestDir, DELETED_MANIFEST);
+    int rc = system(cmd);
+    unlink(manifestPath);
+    rmdir(manifestDir);
+    return rc == 0 ? 0 : -1;
+}
+
+// since > 0 keeps only files modified at or after that token and adds a deletion manifest
+static int make_tar_for_ext(const char *baseDir, const char *ext, long since,
                             char *tmpTarPath, size_t tlen,
                             char *outName, size_t nlen)
 {
-    if (strcmp(ext, ".pdf") != 0)
-        return -1; // S2 only handles .pdf
-    snprintf(outName, nlen, "pdf.tar");
+    if (strcmp(ext, peerExt) != 0)
+        return -1; // S2 only handles its own extension
+    snprintf(outName, nlen, "%s", peerTarName);
 
     snprintf(tmpTarPath, tlen, "/tmp/downltar_%d.tar", (int)getpid());
 
+    // -newermt is strict, so go one second back to include files written at the token
+    char newer[64] = "";
+    if (since > 0)
+        snprintf(newer, sizeof(newer), "-newermt @%ld ", since - 1);
+
     char cmd[1024];
-    snprintf(cmd, sizeof(cmd),
-             "sh -c 'cd \"%s\" 2>/dev/null || exit 1; "
-             "find . -type f -name \"*%s\" -print0 2>/dev/null | "
-             "tar -cf \"%s\" --null -T - 2>/dev/null'",
-             baseDir, ext, tmpTarPath);
+    int cmdLen = snprintf(cmd, sizeof(cmd),
+                          "sh -c 'cd \"%s\" 2>/dev/null || exit 1; "
+                          "find . -type f -name \"*%s\" %s-print0 2>/dev/null | "
+                          "tar -cf \"%s\" --null -T - 2>/dev/null'",
+                          baseDir, ext, newer, tmpTarPath);
+    // A command cut short would archive the wrong tree
+    if (cmdLen >= (int)sizeof(cmd))
+        return -1;
 
     int rc = system(cmd);
     if (rc != 0)
@@ -349,6 +1132,12 @@ static int make_tar_for_ext(const char *baseDir, const char *ext,
         return -1;
     }
 
+    if (since > 0 && append_deleted_manifest(baseDir, since, tmpTarPath) != 0)
+    {
+        unlink(tmpTarPath);
+        return -1;
+    }
+
     struct stat st;
     if (stat(tmpTarPath, &st) != 0)
     {
@@ -358,11 +1147,31 @@ static int make_tar_for_ext(const char *baseDir, const char *ext,
     return 0;
 }
 
+// Helper function to open the downltar archive of ext
+static int open_tar_for_ext(const char *base, const char *ext, long since, off_t *outSize)
+{
+    // Full archives come from the cache, rebuilt only when the tree changed
+    if (since <= 0)
+        return open_cached_tar(base, ext, peerTarName, outSize);
+    // Deltas are small and per client, build them fresh
+    char tarTmp[MAX_PATH], tarName[64];
+    if (make_tar_for_ext(base, ext, since, tarTmp, sizeof(tarTmp), tarName, sizeof(tarName)) != 0)
+        return -1;
+    int fd = open(tarTmp, O_RDONLY);
+    unlink(tarTmp);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        *outSize = st.st_size;
+    return fd;
+}
+
 void handleDownltar(int con_sd, char *commandArgs[])
 {
-    if (!commandArgs[1] || strcmp(commandArgs[1], ".pdf") != 0)
+    if (!commandArgs[1] || strcmp(commandArgs[1], peerExt) != 0)
     {
-        write(con_sd, "Error: Only .pdf supported on S2", 32);
+        char errorMsg[MAX_BUFFER];
+        int len = snprintf(errorMsg, sizeof(errorMsg), "Error: Only %s supported on %s", peerExt, rootName);
+        write(con_sd, errorMsg, len);
         return;
     }
 
@@ -373,40 +1182,71 @@ void handleDownltar(int con_sd, char *commandArgs[])
         return;
     }
 
-    char base[MAX_PATH], tarTmp[MAX_PATH], tarName[64];
-    snprintf(base, sizeof(base), "%s/S2", home);
+    // Optional "since <token>" asks for an incremental tar, "gz[:level]" for a compressed stream
+    int count = 0;
+    while (count < MAX_COMMAND_ARGS && commandArgs[count])
+        count++;
+    long since = 0;
+    int level = TAR_NOT_COMPRESSED;
+    if (parse_downltar_options(commandArgs, count, &since, &level) != 0)
+    {
+        write(con_sd, "Error: Bad downltar options", 27);
+        return;
+    }
+    if (level != TAR_NOT_COMPRESSED && peerStoreInGzip)
+        level = Z_NO_COMPRESSION;
+
+    char base[MAX_PATH], tarName[64];
+    snprintf(base, sizeof(base), "%s/%s", home, rootName);
+    snprintf(tarName, sizeof(tarName), "%s", peerTarName);
 
-    if (make_tar_for_ext(base, ".pdf", tarTmp, sizeof(tarTmp), tarName, sizeof(tarName)) != 0)
+    // Removals before the start of the log were compacted away, a delta from then would miss them
+    if (since > 0 && since < removalLogStart(base))
+    {
+        const char *msg = "Error: since token is older than the removal log, download the full archive";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    // Token for the next incremental request, taken before the scan starts
+    long token = (long)time(NULL);
+    off_t tarSize = 0;
+    int fd = peerStorage.openTar(base, peerExt, since, &tarSize);
+    if (fd < 0)
     {
         write(con_sd, "Error: Failed to build tar", 27);
         return;
     }
 
-    write(con_sd, "Success: Tar ready", 19);
+    if (since > 0)
+    {
+        char status[64];
+        snprintf(status, sizeof(status), "Success: Tar ready (token %ld)", token);
+        write(con_sd, status, strlen(status));
+    }
+    else
+    {
+        write(con_sd, "Success: Tar ready", 19);
+    }
     usleep(10000);
+    if (level != TAR_NOT_COMPRESSED)
+        strcat(tarName, ".gz");
     write(con_sd, tarName, strlen(tarName));
     usleep(10000);
 
-    struct stat st;
-    stat(tarTmp, &st);
-    uint32_t netSz = htonl((uint32_t)st.st_size);
+    // Compressed streams have no size up front, the size field marks them as framed
+    uint32_t netSz = htonl(level != TAR_NOT_COMPRESSED ? TAR_STREAMED : (uint32_t)tarSize);
     write(con_sd, &netSz, sizeof(netSz));
     usleep(10000);
 
-    int fd = open(tarTmp, O_RDONLY);
-    char buf[CHUNK_SIZE];
-    int r;
-    while ((r = read(fd, buf, sizeof(buf))) > 0)
+    if (level != TAR_NOT_COMPRESSED)
+        send_tar_fd_gzip(con_sd, fd, tarSize, level);
+    else
     {
-        if (sendDataInChunks(con_sd, buf, r) != r)
-        {
-            close(fd);
-            unlink(tarTmp);
-            return;
-        }
+        // A short archive would leave the client waiting for the rest of the size it was given
+        if (send_tar_fd(con_sd, fd, tarSize) != 0)
+            shutdown(con_sd, SHUT_RDWR);
     }
     close(fd);
-    unlink(tarTmp);
 }
 
 // Function to collect names of files with a specific extension in a directory
@@ -502,7 +1342,7 @@ static char *join_names_peer(char **names, int count, int *outLen)
 static void handleDispfnames(int con_sd, char *commandArgs[])
 {
     // command: listnames <abs_dir> <ext>
-    if (!commandArgs[1] || !commandArgs[2] || strcmp(commandArgs[2], SUPPORTED_EXT) != 0)
+    if (!commandArgs[1] || !commandArgs[2] || strcmp(commandArgs[2], peerExt) != 0)
     {
         const char *msg = "Error: Unsupported extension for this server";
         write(con_sd, msg, strlen(msg));
@@ -513,7 +1353,7 @@ static void handleDispfnames(int con_sd, char *commandArgs[])
     char **names = NULL;
     int count = 0;
     // if dir missing, we still succeed with empty list
-    collect_names_one_dir_peer(dir, SUPPORTED_EXT, &names, &count);
+    peerStorage.listDir(dir, peerExt, &names, &count);
     int len = 0;
     char *blob = join_names_peer(names, count, &len);
     for (int i = 0; i < count; i++)
@@ -535,13 +1375,384 @@ static void handleDispfnames(int con_sd, char *commandArgs[])
     }
 }
 
+// --- Rebalancing support: stat, listall, migrate and bloom ---
+
+// Function to handle stat command, tells server1 whether a file is here
+static void handleStat(int con_sd, char *commandArgs[])
+{
+    // command: stat <abs_path>
+    long long size = commandArgs[1] ? peerStorage.fileSize(commandArgs[1]) : -1;
+    char reply[MAX_BUFFER];
+    if (size >= 0)
+        snprintf(reply, sizeof(reply), "Success: %lld", size);
+    else
+        snprintf(reply, sizeof(reply), "Error: File does not exist on Server");
+    write(con_sd, reply, strlen(reply));
+}
+
+// Function to handle listall command, lists every file of the tree with its size
+static void handleListall(int con_sd, char *commandArgs[])
+{
+    // command: listall <abs_root> <ext>
+    if (!commandArgs[1] || !commandArgs[2] || strcmp(commandArgs[2], peerExt) != 0)
+    {
+        const char *msg = "Error: Unsupported extension for this server";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    TarEntry *list = NULL;
+    int count = 0;
+    peerStorage.scanTree(commandArgs[1], peerExt, &list, &count);
+    char *blob = NULL;
+    int len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char line[MAX_PATH + 32];
+        int n = snprintf(line, sizeof(line), "%lld %s\n", list[i].size, list[i].rel);
+        char *tmp = (char *)realloc(blob, len + n);
+        if (!tmp)
+            break;
+        blob = tmp;
+        memcpy(blob + len, line, n);
+        len += n;
+    }
+    free(list);
+
+    const char *ok = "Success: Names ready";
+    write(con_sd, ok, strlen(ok));
+    usleep(10000);
+
+    uint32_t net = htonl((uint32_t)len);
+    write(con_sd, &net, sizeof(net));
+    usleep(10000);
+
+    if (len > 0)
+        sendDataInChunks(con_sd, blob, len);
+    free(blob);
+}
+
+// Helper function to hash a Bloom filter key, 64-bit FNV-1a with a final mix so the low bits spread too
+static unsigned long long bloomHash(const char *key)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Helper function to set the bits of a key, probes are h1 + i * h2 over a power of two bit count
+static void bloomSet(unsigned char *bits, unsigned int nbits, int hashes, unsigned long long h)
+{
+    unsigned int h1 = (unsigned int)h;
+    unsigned int h2 = (unsigned int)(h >> 32) | 1;
+    for (int i = 0; i < hashes; i++)
+    {
+        unsigned int bit = (h1 + i * h2) & (nbits - 1);
+        bits[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+    }
+}
+
+// Function to handle bloom command, a filter of the files with ext so server1 can turn away misses
+static void handleBloom(int con_sd, char *commandArgs[])
+{
+    // command: bloom <abs_root> <ext>
+    if (!commandArgs[1] || !commandArgs[2])
+    {
+        const char *msg = "Error: bloom requires a root and an extension";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    TarEntry *list = NULL;
+    int count = 0;
+    peerStorage.scanTree(commandArgs[1], commandArgs[2], &list, &count);
+    unsigned int bytes = BLOOM_MIN_BYTES;
+    while (bytes < BLOOM_MAX_BYTES && (unsigned long long)bytes * 8 < (unsigned long long)count * 2 * BLOOM_BITS_PER_KEY)
+        bytes *= 2;
+    // Payload: the number of hashes, then the bit array
+    int len = 4 + bytes;
+    unsigned char *blob = (unsigned char *)calloc(1, len);
+    if (!blob)
+    {
+        free(list);
+        const char *msg = "Error: Memory allocation failed";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    uint32_t netHashes = htonl(BLOOM_HASHES);
+    memcpy(blob, &netHashes, 4);
+    // Keys are the absolute paths server1 asks for, root plus the ./relative name without the dot
+    for (int i = 0; i < count; i++)
+    {
+        char key[MAX_PATH * 2];
+        snprintf(key, sizeof(key), "%s%s", commandArgs[1], list[i].rel + 1);
+        bloomSet(blob + 4, bytes * 8, BLOOM_HASHES, bloomHash(key));
+    }
+    free(list);
+
+    const char *ok = "Success: Bloom ready";
+    write(con_sd, ok, strlen(ok));
+    usleep(10000);
+
+    uint32_t net = htonl((uint32_t)len);
+    write(con_sd, &net, sizeof(net));
+    usleep(10000);
+
+    sendDataInChunks(con_sd, (const char *)blob, len);
+    free(blob);
+}
+
+// Function to handle migrate command: push a file to its new owner, then drop the local copy
+static void handleMigrate(int con_sd, char *commandArgs[])
+{
+    // command: migrate <abs_src> <dst_ip> <dst_port> <abs_dst>
+    char reply[MAX_BUFFER];
+    if (!commandArgs[1] || !commandArgs[2] || !commandArgs[3] || !commandArgs[4])
+    {
+        snprintf(reply, sizeof(reply), "Error: migrate needs <src> <ip> <port> <dst>");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    long long storedSize = peerStorage.fileSize(commandArgs[1]);
+    if (storedSize <= 0 || storedSize > MAX_FILE_SIZE)
+    {
+        snprintf(reply, sizeof(reply), "Error: File does not exist on Server");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    int fileSize = storedSize;
+    char *fileData = malloc(fileSize);
+    if (!fileData || peerStorage.readFile(commandArgs[1], fileData, fileSize) != fileSize)
+    {
+        free(fileData);
+        snprintf(reply, sizeof(reply), "Error: Failed to read file on Server");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    // Upload to the destination peer the way server1 does
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(commandArgs[3]));
+    char response[MAX_BUFFER];
+    int responseLen = -1;
+    if (sd >= 0 && inet_pton(AF_INET, commandArgs[2], &addr.sin_addr) > 0 &&
+        connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        char command[MAX_BUFFER];
+        snprintf(command, sizeof(command), "uploadf %s deflate", commandArgs[4]);
+        writePeerCommand(sd, command);
+        usleep(10000);
+        uint32_t networkFileSize = htonl((uint32_t)fileSize);
+        if (write(sd, &networkFileSize, sizeof(networkFileSize)) == sizeof(networkFileSize) &&
+            sendCompressedData(sd, fileData, fileSize, wireWorthCompressing(commandArgs[1], fileData, fileSize)) == fileSize)
+            responseLen = read(sd, response, sizeof(response) - 1);
+    }
+    if (sd >= 0)
+        close(sd);
+    free(fileData);
+    if (responseLen <= 0)
+    {
+        snprintf(reply, sizeof(reply), "Error: Failed to reach the destination");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    response[responseLen] = '\0';
+    if (!strstr(response, "successfully"))
+    {
+        snprintf(reply, sizeof(reply), "Error: Destination refused the file: %.200s", response);
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    // The destination has the file now, the local copy can go
+    peerStorage.removeFile(commandArgs[1]);
+    char root[MAX_PATH];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), rootName);
+    recordRemoval(root, commandArgs[1]);
+    notifyListingChange(commandArgs[1]);
+    snprintf(reply, sizeof(reply), "Success: Migrated %d bytes", fileSize);
+    write(con_sd, reply, strlen(reply));
+}
+
+// Function to handle commitf command: put a staged upload in place, or drop it when no destination is given
+static void handleCommitf(int con_sd, char *commandArgs[])
+{
+    // command: commitf <abs_staged> [<abs_dst>]
+    char reply[MAX_BUFFER];
+    if (!commandArgs[1] || peerStorage.fileSize(commandArgs[1]) < 0)
+    {
+        snprintf(reply, sizeof(reply), "Error: Staged file does not exist on Server");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    if (!commandArgs[2])
+    {
+        peerStorage.removeFile(commandArgs[1]);
+        snprintf(reply, sizeof(reply), "Success: Staged file dropped");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    if (peerStorage.renameFile(commandArgs[1], commandArgs[2]) != 0)
+    {
+        snprintf(reply, sizeof(reply), "Error: Failed to commit file on Server");
+        write(con_sd, reply, strlen(reply));
+        return;
+    }
+    notifyListingChange(commandArgs[2]);
+    snprintf(reply, sizeof(reply), "Success: File committed");
+    write(con_sd, reply, strlen(reply));
+}
+
+// --- Request statistics ---
+
+// Histograms, counters, the Prometheus text helpers and the metrics process, shared with the other servers
+#include "s25Stats.h"
+
+// Render the request counters in the Prometheus text format, returns a malloc'ed buffer
+static char *renderStats(int *outLen)
+{
+    char *buf = NULL;
+    int len = 0, cap = 0;
+    char labels[128];
+    appendText(&buf, &len, &cap, "# HELP %s_uptime_seconds Time since the server started.\n# TYPE %s_uptime_seconds gauge\n", STATS_PREFIX, STATS_PREFIX);
+    appendText(&buf, &len, &cap, "%s_uptime_seconds %ld\n", STATS_PREFIX, serverStats ? (long)time(NULL) - serverStats->startedAt : 0L);
+    if (serverStats)
+    {
+        appendText(&buf, &len, &cap, "# HELP %s_connections_total Client connections accepted.\n# TYPE %s_connections_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        appendText(&buf, &len, &cap, "%s_connections_total %lu\n", STATS_PREFIX, __atomic_load_n(&serverStats->connections, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_command_latency_seconds Time to serve a client command.\n# TYPE %s_command_latency_seconds summary\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+        {
+            snprintf(labels, sizeof(labels), "command=\"%s\"", statsCommandNames[c]);
+            appendSummary(&buf, &len, &cap, "command_latency_seconds", labels, &serverStats->commands[c].latency);
+        }
+        appendText(&buf, &len, &cap, "# HELP %s_command_latency_max_seconds Slowest client command.\n# TYPE %s_command_latency_max_seconds gauge\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_command_latency_max_seconds{command=\"%s\"} %.6f\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].latency.maxUs, __ATOMIC_RELAXED) / 1e6);
+        appendText(&buf, &len, &cap, "# HELP %s_command_bytes_in_total Bytes read from clients.\n# TYPE %s_command_bytes_in_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_command_bytes_in_total{command=\"%s\"} %lu\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].bytesIn, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_command_bytes_out_total Bytes written to clients.\n# TYPE %s_command_bytes_out_total counter\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_command_bytes_out_total{command=\"%s\"} %lu\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].bytesOut, __ATOMIC_RELAXED));
+        appendText(&buf, &len, &cap, "# HELP %s_commands_in_flight Client commands being served.\n# TYPE %s_commands_in_flight gauge\n", STATS_PREFIX, STATS_PREFIX);
+        for (int c = 0; c < STATS_COMMANDS; c++)
+            appendText(&buf, &len, &cap, "%s_commands_in_flight{command=\"%s\"} %ld\n", STATS_PREFIX, statsCommandNames[c],
+                       __atomic_load_n(&serverStats->commands[c].inflight, __ATOMIC_RELAXED));
+    }
+    *outLen = len;
+    return buf;
+}
+
+// Function to handle stats command, the counters as Prometheus text in a names-style blob
+static void handleStats(int con_sd, char *commandArgs[])
+{
+    // command: stats
+    (void)commandArgs;
+    int len = 0;
+    char *text = renderStats(&len);
+    const char *ok = "Success: Stats ready";
+    write(con_sd, ok, strlen(ok));
+    usleep(10000);
+
+    uint32_t net = htonl((uint32_t)len);
+    write(con_sd, &net, sizeof(net));
+    usleep(10000);
+
+    if (len > 0 && text)
+        sendDataInChunks(con_sd, text, len);
+    free(text);
+}
+
+// Helper function to append a string as a JSON string, escaping quotes, backslashes and control characters
+static void appendJsonString(char **buf, int *len, int *cap, const char *text)
+{
+    appendText(buf, len, cap, "\"");
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            appendText(buf, len, cap, "\\%c", *c);
+        else if (*c < 0x20)
+            appendText(buf, len, cap, "\\u%04x", *c);
+        else
+            appendText(buf, len, cap, "%c", *c);
+    }
+    appendText(buf, len, cap, "\"");
+}
+
+// Helper function to append the spans of a trace kept on this node as Chrome trace events, each preceded
+// by ",\n"; pid is the node's port so every node gets its own row, tid the process or thread that ran it
+static void appendTraceEvents(char **buf, int *len, int *cap, unsigned long long traceId, int pid)
+{
+    if (!spanRing)
+        return;
+    unsigned long head = __atomic_load_n(&spanRing->head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > SPAN_RING ? head - SPAN_RING : 0;
+    for (unsigned long ticket = first; ticket < head; ticket++)
+    {
+        Span span;
+        if (!readSpan(ticket % SPAN_RING, &span) || span.traceId != traceId)
+            continue;
+        appendText(buf, len, cap, ",\n{\"name\":");
+        appendJsonString(buf, len, cap, span.name);
+        appendText(buf, len, cap, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lu,\"pid\":%d,\"tid\":%d,"
+                                  "\"args\":{\"trace\":\"%016llx\",\"span\":\"%016llx\",\"parent\":\"%016llx\",\"detail\":",
+                   STATS_PREFIX, span.startUs, span.durUs, pid, span.tid, span.traceId, span.spanId, span.parentId);
+        appendJsonString(buf, len, cap, span.detail);
+        appendText(buf, len, cap, "}}");
+    }
+}
+
+// Function to handle spans command, the spans of a trace kept here as Chrome trace events
+static void handleSpans(int con_sd, char *commandArgs[])
+{
+    // command: spans <trace_id>
+    unsigned long long traceId = 0;
+    if (!commandArgs[1] || sscanf(commandArgs[1], "%llx", &traceId) != 1 || traceId == 0)
+    {
+        const char *msg = "Error: spans requires a trace id";
+        write(con_sd, msg, strlen(msg));
+        return;
+    }
+    char *buf = NULL;
+    int len = 0, cap = 0;
+    appendTraceEvents(&buf, &len, &cap, traceId, serverPort);
+    const char *ok = "Success: Spans ready";
+    write(con_sd, ok, strlen(ok));
+    usleep(10000);
+
+    uint32_t net = htonl((uint32_t)len);
+    write(con_sd, &net, sizeof(net));
+    usleep(10000);
+
+    if (len > 0 && buf)
+        sendDataInChunks(con_sd, buf, len);
+    free(buf);
+}
+
 // Function to handle server request
 void handleRequest(int con_sd)
 {
     // Define command and commandArgs to tokenize sever command
     char command[MAX_BUFFER];
-    char *commandArgs[MAX_COMMAND_ARGS];
+    char *commandArgs[MAX_COMMAND_ARGS] = {NULL};
     int bytes;
+    // Socket byte counters before the next command, the difference is charged to it
+    unsigned long long seenIn = 0, seenOut = 0;
+    if (serverStats)
+    {
+        __atomic_add_fetch(&serverStats->connections, 1, __ATOMIC_RELAXED);
+        socketByteCounts(con_sd, &seenIn, &seenOut);
+    }
     while (1)
     {
         int count = 0;
@@ -560,13 +1771,24 @@ void handleRequest(int con_sd)
         }
         // Add string terminator
         command[bytes] = '\0';
+        // A traced request carries its trace context in front of the command
+        unsigned long long traceId, parentSpan;
+        char *line = takeTraceContext(command, &traceId, &parentSpan);
         // Tokenize user received from server1
-        if (!tokenizeCommand(command, commandArgs, &count))
+        if (!tokenizeCommand(line, commandArgs, &count) || count == 0)
         {
             char *errorMsg = "Error: Command tokenization failed";
             write(con_sd, errorMsg, strlen(errorMsg));
             break;
         }
+        if (selectCommandRoot)
+            selectCommandRoot(commandArgs, count);
+        int cmd = statsCommandIndex(commandArgs[0]);
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if (serverStats)
+            __atomic_add_fetch(&serverStats->commands[cmd].inflight, 1, __ATOMIC_RELAXED);
+        traceBegin(traceId, parentSpan);
         // If command is uploadf
         if (strcmp(commandArgs[0], "uploadf") == 0)
         {
@@ -592,6 +1814,68 @@ void handleRequest(int con_sd)
         {
             handleDispfnames(con_sd, commandArgs);
         }
+        // If command is stat
+        else if (strcmp(commandArgs[0], "stat") == 0)
+        {
+            handleStat(con_sd, commandArgs);
+        }
+        // If command is listall
+        else if (strcmp(commandArgs[0], "listall") == 0)
+        {
+            handleListall(con_sd, commandArgs);
+        }
+        // If command is migrate
+        else if (strcmp(commandArgs[0], "migrate") == 0)
+        {
+            handleMigrate(con_sd, commandArgs);
+        }
+        // If command is commitf
+        else if (strcmp(commandArgs[0], "commitf") == 0)
+        {
+            handleCommitf(con_sd, commandArgs);
+        }
+        // If command is bloom
+        else if (strcmp(commandArgs[0], "bloom") == 0)
+        {
+            handleBloom(con_sd, commandArgs);
+        }
+        // If command is stats
+        else if (strcmp(commandArgs[0], "stats") == 0)
+        {
+            handleStats(con_sd, commandArgs);
+        }
+        // If command is spans
+        else if (strcmp(commandArgs[0], "spans") == 0)
+        {
+            handleSpans(con_sd, commandArgs);
+        }
+        if (currentTrace.traceId)
+        {
+            char detail[256];
+            detail[0] = '\0';
+            for (int i = 1, off = 0; i < count && off < (int)sizeof(detail) - 1; i++)
+                off += snprintf(detail + off, sizeof(detail) - off, "%s%s", i > 1 ? " " : "", commandArgs[i]);
+            traceEnd(commandArgs[0], detail);
+        }
+        // Charge the time and the bytes moved to the command
+        if (serverStats)
+        {
+            CommandStats *stats = &serverStats->commands[cmd];
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long us = (now.tv_sec - started.tv_sec) * 1000000L + (now.tv_nsec - started.tv_nsec) / 1000;
+            recordLatency(&stats->latency, us > 0 ? (unsigned long)us : 0);
+            __atomic_sub_fetch(&stats->inflight, 1, __ATOMIC_RELAXED);
+            unsigned long long nowIn, nowOut;
+            socketByteCounts(con_sd, &nowIn, &nowOut);
+            if (nowIn >= seenIn && nowOut >= seenOut)
+            {
+                __atomic_add_fetch(&stats->bytesIn, (unsigned long)(nowIn - seenIn), __ATOMIC_RELAXED);
+                __atomic_add_fetch(&stats->bytesOut, (unsigned long)(nowOut - seenOut), __ATOMIC_RELAXED);
+            }
+            seenIn = nowIn;
+            seenOut = nowOut;
+        }
         // Free the commandArgs array
         for (int i = 0; i < count; i++)
         {
@@ -618,15 +1902,44 @@ int main(int argc, char *argv[])
 {
     // Socket variable
     int lis_sd, con_sd, portNumber;
-    socklen_t len;
     struct sockaddr_in servAdd;
     int pid;
+    // Optional trailing -n <root_name> picks the storage root, -m <metrics_port> serves the statistics over HTTP
+    while (argc >= 3 && (strcmp(argv[argc - 2], "-m") == 0 || strcmp(argv[argc - 2], "-n") == 0))
+    {
+        if (strcmp(argv[argc - 2], "-m") == 0)
+        {
+            metricsPort = atoi(argv[argc - 1]);
+        }
+        else
+        {
+            const char *name = argv[argc - 1];
+            if (!*name || strchr(name, '/') || strlen(name) >= sizeof(rootName))
+            {
+                fprintf(stderr, "Bad root name %s\n", name);
+                exit(1);
+            }
+            snprintf(rootName, sizeof(rootName), "%s", name);
+            snprintf(rootMarker, sizeof(rootMarker), "/%s/", name);
+        }
+        argc -= 2;
+    }
     // Error if file not run correctly
-    if (argc != 2)
+    if (argc != 2 && argc != 4)
     {
-        fprintf(stderr, "Usage: %s <Port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <Port> [<Server1_IP> <Server1_Port>] [-n <root_name>] [-m <metrics_port>]\n", argv[0]);
         exit(0);
     }
+    // Server1 address is optional, used only for change notifications
+    if (argc == 4)
+    {
+        server1_ip = argv[2];
+        sscanf(argv[3], "%d", &server1_port);
+    }
+    // Map the request statistics and the span ring before forking so every child shares them
+    initServerStats();
+    initSpanRing();
+    startMetricsServer();
     // socket() call
     if ((lis_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
@@ -640,6 +1953,7 @@ int main(int argc, char *argv[])
     servAdd.sin_addr.s_addr = htonl(INADDR_ANY);
     // htonl: Host to Network Long : Converts host byte order to network byte order
     sscanf(argv[1], "%d", &portNumber);
+    serverPort = portNumber;
     servAdd.sin_port = htons((uint16_t)portNumber); // Add the port number entered by the user
 
     // bind() system call
@@ -651,6 +1965,7 @@ int main(int argc, char *argv[])
     {
         // Accept client connection
         con_sd = accept(lis_sd, (struct sockaddr *)NULL, NULL);
+        restartMetricsServer();
         // Fork for client
         pid = fork();
         // Child process service client request using handleRequest
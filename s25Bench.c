@@ -0,0 +1,725 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+// Define constants
+#define MAX_BUFFER 2048
+#define MAX_PATH 512
+#define MAX_FILE_SIZE (50 * 1024 * 1024)
+#define MAX_CLIENTS 256
+#define MAX_SIZES 16
+#define MAX_EXTS 8
+#define MAX_CLIENT_FILES 4096
+#define RECV_TIMEOUT_S 10
+
+// Framed (compressed) tar streams, as in s25Client
+#define TAR_STREAMED 0xFFFFFFFFu
+
+// Latency histograms: 8 log-linear buckets per power of two microseconds, as in the servers' stats
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS 312
+
+// Commands the load mix is made of
+enum
+{
+    OP_UPLOADF,
+    OP_DOWNLF,
+    OP_REMOVEF,
+    OP_DOWNLTAR,
+    OP_DISPFNAMES,
+    OP_COUNT
+};
+
+const char *opNames[OP_COUNT] = {"uploadf", "downlf", "removef", "downltar", "dispfnames"};
+
+// Latency histogram of one command, kept per client and merged at the end
+typedef struct
+{
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long errors;
+    unsigned long sumUs;
+    unsigned long maxUs;
+    unsigned long long bytes;
+} OpStats;
+
+// A file a client uploaded and may read back or remove
+typedef struct
+{
+    char name[64];
+    int size;
+} BenchFile;
+
+// One load generating client, with its own connection to S1 and its own ~S1 directory
+typedef struct
+{
+    int id;
+    unsigned int seed;
+    int sd;
+    pthread_t thread;
+    int fileCount;
+    unsigned long serial;
+    BenchFile files[MAX_CLIENT_FILES];
+    OpStats ops[OP_COUNT];
+} Client;
+
+// Benchmark settings, see usage()
+typedef struct
+{
+    char binDir[MAX_PATH];
+    char s1Ip[64];
+    int basePort;
+    int external;
+    int clients;
+    int seconds;
+    long opsPerClient;
+    int preload;
+    int mix[OP_COUNT];
+    int sizeCount;
+    int sizes[MAX_SIZES];
+    int sizeWeights[MAX_SIZES];
+    int extCount;
+    char exts[MAX_EXTS][8];
+    char output[MAX_PATH];
+} BenchConfig;
+
+BenchConfig config;
+volatile int stopping = 0;
+
+// Released once every client has preloaded, so the timed run starts together
+pthread_barrier_t startBarrier;
+
+// Helper function to print the options
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  -b <dir>        directory of s1, s2, s3 and s4 (default .)\n");
+    fprintf(stderr, "  -p <port>       first port of the started cluster, S1 on it and S2-S4 after it (default 9600)\n");
+    fprintf(stderr, "  -e <ip:port>    drive a running S1 instead of starting a cluster\n");
+    fprintf(stderr, "  -c <clients>    concurrent clients (default 8)\n");
+    fprintf(stderr, "  -d <seconds>    run time (default 10)\n");
+    fprintf(stderr, "  -n <ops>        commands per client instead of a run time\n");
+    fprintf(stderr, "  -w <files>      files each client uploads before the timed run (default 4)\n");
+    fprintf(stderr, "  -m <mix>        command weights (default uploadf=30,downlf=50,removef=10,downltar=2,dispfnames=8)\n");
+    fprintf(stderr, "  -z <sizes>      file sizes with weights (default 1K:60,16K:30,256K:9,2M:1)\n");
+    fprintf(stderr, "  -x <exts>       extensions of the uploaded files (default .c,.pdf,.txt,.zip)\n");
+    fprintf(stderr, "  -o <file>       results as JSON (default bench_output.txt)\n");
+    exit(1);
+}
+
+// Helper function to parse a size like 512, 4K or 2M
+static int parseSize(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (*end == 'K' || *end == 'k')
+        value *= 1024;
+    else if (*end == 'M' || *end == 'm')
+        value *= 1024 * 1024;
+    return value >= 1 && value <= MAX_FILE_SIZE ? (int)value : -1;
+}
+
+// Helper function to parse "uploadf=30,downlf=50,...", commands left out get weight 0
+static int parseMix(char *text)
+{
+    memset(config.mix, 0, sizeof(config.mix));
+    for (char *part = strtok(text, ","); part; part = strtok(NULL, ","))
+    {
+        char *eq = strchr(part, '=');
+        if (!eq)
+            return 0;
+        *eq = '\0';
+        int op = 0;
+        while (op < OP_COUNT && strcmp(opNames[op], part) != 0)
+            op++;
+        if (op == OP_COUNT || atoi(eq + 1) < 0)
+            return 0;
+        config.mix[op] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        total += config.mix[op];
+    return total > 0;
+}
+
+// Helper function to parse "1K:60,16K:30,...", a size without a weight counts once
+static int parseSizes(char *text)
+{
+    config.sizeCount = 0;
+    for (char *part = strtok(text, ","); part && config.sizeCount < MAX_SIZES; part = strtok(NULL, ","))
+    {
+        char *colon = strchr(part, ':');
+        if (colon)
+            *colon = '\0';
+        int size = parseSize(part);
+        int weight = colon ? atoi(colon + 1) : 1;
+        if (size < 0 || weight <= 0)
+            return 0;
+        config.sizes[config.sizeCount] = size;
+        config.sizeWeights[config.sizeCount++] = weight;
+    }
+    return config.sizeCount > 0;
+}
+
+// Helper function to parse ".c,.pdf,..."
+static int parseExts(char *text)
+{
+    config.extCount = 0;
+    for (char *part = strtok(text, ","); part && config.extCount < MAX_EXTS; part = strtok(NULL, ","))
+    {
+        if (part[0] != '.' || strlen(part) >= sizeof(config.exts[0]))
+            return 0;
+        strcpy(config.exts[config.extCount++], part);
+    }
+    return config.extCount > 0;
+}
+
+// Clock, histogram and protocol helpers shared with the other tool
+#include "s25ToolHelpers.h"
+
+// Helper function to add one timed command
+static void recordOp(OpStats *stats, unsigned long us, int ok, unsigned long long bytes)
+{
+    if (!ok)
+    {
+        stats->errors++;
+        return;
+    }
+    stats->buckets[latencyBucket(us)]++;
+    stats->count++;
+    stats->sumUs += us;
+    stats->bytes += bytes;
+    if (us > stats->maxUs)
+        stats->maxUs = us;
+}
+
+// Helper function to pick a random index by weight
+static int pickWeighted(const int *weights, int count, unsigned int *seed)
+{
+    int total = 0;
+    for (int i = 0; i < count; i++)
+        total += weights[i];
+    int r = rand_r(seed) % total;
+    for (int i = 0; i < count; i++)
+    {
+        if (r < weights[i])
+            return i;
+        r -= weights[i];
+    }
+    return count - 1;
+}
+
+// Upload one file of a random size and extension, returns the bytes sent or -1
+static long doUploadf(Client *client, char *payload)
+{
+    if (client->fileCount >= MAX_CLIENT_FILES)
+        return 0;
+    BenchFile *file = &client->files[client->fileCount];
+    int size = config.sizes[pickWeighted(config.sizeWeights, config.sizeCount, &client->seed)];
+    snprintf(file->name, sizeof(file->name), "f%lu%s", client->serial++, config.exts[rand_r(&client->seed) % config.extCount]);
+    file->size = size;
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "uploadf %s ~S1/bench/c%d", file->name, client->id);
+    if (write(client->sd, command, strlen(command)) <= 0)
+        return -1;
+    // Spaced like the servers space their messages, so the size is not read as part of the command
+    usleep(10000);
+    if (write(client->sd, &size, sizeof(int)) != sizeof(int) || sendDataInChunks(client->sd, payload, size) != size)
+        return -1;
+    char response[MAX_BUFFER];
+    if (readMessage(client->sd, response, sizeof(response)) < 0 || strstr(response, "Error") != NULL)
+        return -1;
+    client->fileCount++;
+    return size;
+}
+
+// Download one of the client's files, returns the bytes received or -1
+static long doDownlf(Client *client)
+{
+    BenchFile *file = &client->files[rand_r(&client->seed) % client->fileCount];
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "downlf ~S1/bench/c%d/%s", client->id, file->name);
+    if (write(client->sd, command, strlen(command)) <= 0)
+        return -1;
+    char status[MAX_BUFFER];
+    if (readMessage(client->sd, status, sizeof(status)) < 0 || strstr(status, "Error") != NULL ||
+        strstr(status, "does not exist") != NULL)
+        return -1;
+    uint32_t size;
+    if (readName(client->sd, file->name) < 0 || readSize(client->sd, &size) < 0 || size > MAX_FILE_SIZE)
+        return -1;
+    if (receiveDataInChunks(client->sd, NULL, (int)size) != (int)size)
+        return -1;
+    return size == (uint32_t)file->size ? (long)size : -1;
+}
+
+// Remove one of the client's files
+static long doRemovef(Client *client)
+{
+    int pick = rand_r(&client->seed) % client->fileCount;
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "removef ~S1/bench/c%d/%s", client->id, client->files[pick].name);
+    if (write(client->sd, command, strlen(command)) <= 0)
+        return -1;
+    // The file is gone from the client's list either way
+    client->files[pick] = client->files[--client->fileCount];
+    char response[MAX_BUFFER];
+    if (readMessage(client->sd, response, sizeof(response)) < 0 || strstr(response, "Error") != NULL)
+        return -1;
+    return 0;
+}
+
+// Download the tar of one extension, returns the bytes received or -1
+static long doDownltar(Client *client)
+{
+    const char *ext = config.exts[rand_r(&client->seed) % config.extCount];
+    char command[MAX_BUFFER], tarName[64];
+    snprintf(command, sizeof(command), "downltar %s", ext);
+    if (write(client->sd, command, strlen(command)) <= 0)
+        return -1;
+    tarNameForExt(ext, tarName, sizeof(tarName));
+    char status[MAX_BUFFER];
+    uint32_t size;
+    if (readMessage(client->sd, status, sizeof(status)) < 0 || strstr(status, "Error") != NULL ||
+        readName(client->sd, tarName) < 0 || readSize(client->sd, &size) < 0)
+        return -1;
+    if (size != TAR_STREAMED)
+        return size <= MAX_FILE_SIZE && receiveDataInChunks(client->sd, NULL, (int)size) == (int)size ? (long)size : -1;
+    long total = 0;
+    for (;;)
+    {
+        uint32_t frame;
+        if (readSize(client->sd, &frame) < 0 || frame > MAX_FILE_SIZE)
+            return -1;
+        if (frame == 0)
+            return total;
+        if (receiveDataInChunks(client->sd, NULL, (int)frame) != (int)frame)
+            return -1;
+        total += frame;
+    }
+}
+
+// List the client's directory, returns the bytes received or -1
+static long doDispfnames(Client *client)
+{
+    char command[MAX_BUFFER];
+    snprintf(command, sizeof(command), "dispfnames ~S1/bench/c%d", client->id);
+    if (write(client->sd, command, strlen(command)) <= 0)
+        return -1;
+    char status[MAX_BUFFER];
+    uint32_t size;
+    if (readMessage(client->sd, status, sizeof(status)) < 0 || strstr(status, "Error") != NULL ||
+        readSize(client->sd, &size) < 0 || size > MAX_FILE_SIZE)
+        return -1;
+    return receiveDataInChunks(client->sd, NULL, (int)size) == (int)size ? (long)size : -1;
+}
+
+// Helper function to tell whether the run is over for a client
+static int runOver(long done, unsigned long long deadlineUs)
+{
+    if (stopping)
+        return 1;
+    if (config.opsPerClient > 0)
+        return done >= config.opsPerClient;
+    return nowUs() >= deadlineUs;
+}
+
+// Client thread: preload a few files, then run the command mix until the run is over
+static void *clientMain(void *arg)
+{
+    Client *client = (Client *)arg;
+    int largest = 0;
+    for (int i = 0; i < config.sizeCount; i++)
+        largest = config.sizes[i] > largest ? config.sizes[i] : largest;
+    char *payload = malloc(largest);
+    if (!payload)
+        return NULL;
+    // Text-like data, so the servers' compression sees what real uploads look like
+    for (int i = 0; i < largest; i++)
+        payload[i] = "abcdefghij klmnopqrstuvwxyz\n0123456789"[rand_r(&client->seed) % 38];
+    for (int i = 0; i < config.preload; i++)
+        doUploadf(client, payload);
+    pthread_barrier_wait(&startBarrier);
+    unsigned long long deadlineUs = nowUs() + (unsigned long long)config.seconds * 1000000ULL;
+    for (long done = 0; !runOver(done, deadlineUs); done++)
+    {
+        int op = pickWeighted(config.mix, OP_COUNT, &client->seed);
+        // Reads and removes need a file, upload one instead
+        if ((op == OP_DOWNLF || op == OP_REMOVEF) && client->fileCount == 0)
+            op = OP_UPLOADF;
+        unsigned long long started = nowUs();
+        long bytes;
+        switch (op)
+        {
+        case OP_UPLOADF:
+            bytes = doUploadf(client, payload);
+            break;
+        case OP_DOWNLF:
+            bytes = doDownlf(client);
+            break;
+        case OP_REMOVEF:
+            bytes = doRemovef(client);
+            break;
+        case OP_DOWNLTAR:
+            bytes = doDownltar(client);
+            break;
+        default:
+            bytes = doDispfnames(client);
+            break;
+        }
+        recordOp(&client->ops[op], (unsigned long)(nowUs() - started), bytes >= 0, bytes > 0 ? (unsigned long long)bytes : 0);
+        // A broken connection is replaced, the protocol cannot resync after a failed transfer
+        if (bytes < 0)
+        {
+            close(client->sd);
+            client->sd = connectToServer(config.s1Ip, config.basePort);
+            if (client->sd < 0)
+                break;
+        }
+    }
+    free(payload);
+    return NULL;
+}
+
+// --- Cluster management ---
+
+pid_t serverPids[4];
+char benchHome[MAX_PATH];
+
+// Helper function to start one server in its own process group with HOME set to the benchmark root
+static pid_t startServer(const char *binary, char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // The group also holds the server's per-connection children and s1's background processes
+        setpgid(0, 0);
+        setenv("HOME", benchHome, 1);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        execv(binary, argv);
+        perror(binary);
+        _exit(127);
+    }
+    if (pid > 0)
+        setpgid(pid, pid);
+    return pid;
+}
+
+// Helper function to wait until a port accepts connections, 0 on success
+static int waitForPort(int port)
+{
+    for (int i = 0; i < 500; i++)
+    {
+        int sd = connectToServer("127.0.0.1", port);
+        if (sd >= 0)
+        {
+            close(sd);
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Helper function to remove one entry of the benchmark root
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Stop the started servers and remove their files
+static void stopCluster()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (serverPids[i] > 0)
+        {
+            kill(-serverPids[i], SIGTERM);
+            waitpid(serverPids[i], NULL, 0);
+            serverPids[i] = 0;
+        }
+    }
+    if (benchHome[0])
+    {
+        nftw(benchHome, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        benchHome[0] = '\0';
+    }
+}
+
+// Start S2-S4 and then S1 on loopback, each with a fresh root under a temporary HOME
+static int startCluster()
+{
+    snprintf(benchHome, sizeof(benchHome), "/tmp/s25bench.XXXXXX");
+    if (!mkdtemp(benchHome))
+    {
+        perror("mkdtemp");
+        benchHome[0] = '\0';
+        return -1;
+    }
+    const char *roots[] = {"S1", "S2", "S3", "S4"};
+    for (int i = 0; i < 4; i++)
+    {
+        char dir[MAX_PATH + 8];
+        snprintf(dir, sizeof(dir), "%s/%s", benchHome, roots[i]);
+        mkdir(dir, 0755);
+    }
+    char ports[4][16], s1Port[16];
+    snprintf(s1Port, sizeof(s1Port), "%d", config.basePort);
+    for (int i = 1; i < 4; i++)
+    {
+        snprintf(ports[i], sizeof(ports[i]), "%d", config.basePort + i);
+        char binary[MAX_PATH + 8];
+        snprintf(binary, sizeof(binary), "%s/s%d", config.binDir, i + 1);
+        char *argv[] = {binary, ports[i], "127.0.0.1", s1Port, NULL};
+        serverPids[i] = startServer(binary, argv);
+        if (serverPids[i] < 0 || waitForPort(config.basePort + i) != 0)
+        {
+            fprintf(stderr, "Error: %s did not start on port %d\n", binary, config.basePort + i);
+            return -1;
+        }
+    }
+    char binary[MAX_PATH + 8];
+    snprintf(binary, sizeof(binary), "%s/s1", config.binDir);
+    char *argv[] = {binary, s1Port, "127.0.0.1", ports[1], "127.0.0.1", ports[2], "127.0.0.1", ports[3], NULL};
+    serverPids[0] = startServer(binary, argv);
+    if (serverPids[0] < 0 || waitForPort(config.basePort) != 0)
+    {
+        fprintf(stderr, "Error: %s did not start on port %d\n", binary, config.basePort);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to stop the run and the cluster on Ctrl-C
+static void handleInterrupt(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+// --- Results ---
+
+// Write the merged results as JSON to out
+static void writeResults(FILE *out, Client *clients, double elapsed)
+{
+    OpStats total[OP_COUNT];
+    memset(total, 0, sizeof(total));
+    for (int c = 0; c < config.clients; c++)
+    {
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            OpStats *from = &clients[c].ops[op];
+            for (int b = 0; b < STATS_BUCKETS; b++)
+                total[op].buckets[b] += from->buckets[b];
+            total[op].count += from->count;
+            total[op].errors += from->errors;
+            total[op].sumUs += from->sumUs;
+            total[op].bytes += from->bytes;
+            if (from->maxUs > total[op].maxUs)
+                total[op].maxUs = from->maxUs;
+        }
+    }
+    unsigned long ops = 0, errors = 0;
+    unsigned long long bytes = 0;
+    OpStats all;
+    memset(&all, 0, sizeof(all));
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        ops += total[op].count;
+        errors += total[op].errors;
+        bytes += total[op].bytes;
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            all.buckets[b] += total[op].buckets[b];
+        all.count += total[op].count;
+        all.sumUs += total[op].sumUs;
+        if (total[op].maxUs > all.maxUs)
+            all.maxUs = total[op].maxUs;
+    }
+    fprintf(out, "{\n  \"config\": {\"clients\": %d, \"seconds\": %d, \"ops_per_client\": %ld, \"preload\": %d, \"mix\": {",
+            config.clients, config.seconds, config.opsPerClient, config.preload);
+    for (int op = 0; op < OP_COUNT; op++)
+        fprintf(out, "%s\"%s\": %d", op ? ", " : "", opNames[op], config.mix[op]);
+    fprintf(out, "}, \"sizes\": {");
+    for (int i = 0; i < config.sizeCount; i++)
+        fprintf(out, "%s\"%d\": %d", i ? ", " : "", config.sizes[i], config.sizeWeights[i]);
+    fprintf(out, "}},\n  \"elapsed_s\": %.3f,\n  \"ops\": %lu,\n  \"errors\": %lu,\n", elapsed, ops, errors);
+    fprintf(out, "  \"throughput_ops_s\": %.1f,\n  \"throughput_mb_s\": %.3f,\n", ops / elapsed, bytes / elapsed / (1024.0 * 1024.0));
+    fprintf(out, "  \"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f},\n",
+            latencyPercentile(&all, 50) / 1000.0, latencyPercentile(&all, 99) / 1000.0,
+            latencyPercentile(&all, 99.9) / 1000.0, all.maxUs / 1000.0);
+    fprintf(out, "  \"commands\": {\n");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        OpStats *s = &total[op];
+        fprintf(out, "    \"%s\": {\"count\": %lu, \"errors\": %lu, \"ops_s\": %.1f, \"mb_s\": %.3f, \"mean_ms\": %.3f, "
+                     "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}%s\n",
+                opNames[op], s->count, s->errors, s->count / elapsed, s->bytes / elapsed / (1024.0 * 1024.0),
+                s->count ? s->sumUs / (double)s->count / 1000.0 : 0.0, latencyPercentile(s, 50) / 1000.0,
+                latencyPercentile(s, 99) / 1000.0, latencyPercentile(s, 99.9) / 1000.0, s->maxUs / 1000.0,
+                op + 1 < OP_COUNT ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+}
+
+// Main function
+int main(int argc, char *argv[])
+{
+    // Defaults
+    snprintf(config.binDir, sizeof(config.binDir), ".");
+    snprintf(config.s1Ip, sizeof(config.s1Ip), "127.0.0.1");
+    snprintf(config.output, sizeof(config.output), "bench_output.txt");
+    config.basePort = 9600;
+    config.clients = 8;
+    config.seconds = 10;
+    config.preload = 4;
+    char mix[] = "uploadf=30,downlf=50,removef=10,downltar=2,dispfnames=8";
+    char sizes[] = "1K:60,16K:30,256K:9,2M:1";
+    char exts[] = ".c,.pdf,.txt,.zip";
+    parseMix(mix);
+    parseSizes(sizes);
+    parseExts(exts);
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:e:c:d:n:w:m:z:x:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            snprintf(config.binDir, sizeof(config.binDir), "%s", optarg);
+            break;
+        case 'p':
+            config.basePort = atoi(optarg);
+            break;
+        case 'e':
+        {
+            char *colon = strrchr(optarg, ':');
+            if (!colon)
+                usage(argv[0]);
+            *colon = '\0';
+            snprintf(config.s1Ip, sizeof(config.s1Ip), "%s", optarg);
+            config.basePort = atoi(colon + 1);
+            config.external = 1;
+            break;
+        }
+        case 'c':
+            config.clients = atoi(optarg);
+            break;
+        case 'd':
+            config.seconds = atoi(optarg);
+            break;
+        case 'n':
+            config.opsPerClient = atol(optarg);
+            break;
+        case 'w':
+            config.preload = atoi(optarg);
+            break;
+        case 'm':
+            if (!parseMix(optarg))
+                usage(argv[0]);
+            break;
+        case 'z':
+            if (!parseSizes(optarg))
+                usage(argv[0]);
+            break;
+        case 'x':
+            if (!parseExts(optarg))
+                usage(argv[0]);
+            break;
+        case 'o':
+            snprintf(config.output, sizeof(config.output), "%s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (config.clients <= 0 || config.clients > MAX_CLIENTS || config.seconds <= 0 || config.preload < 0 || config.basePort <= 0)
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleInterrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (!config.external && startCluster() != 0)
+    {
+        stopCluster();
+        return 1;
+    }
+
+    Client *clients = calloc(config.clients, sizeof(Client));
+    if (!clients)
+    {
+        stopCluster();
+        return 1;
+    }
+    pthread_barrier_init(&startBarrier, NULL, config.clients + 1);
+    int started = 0;
+    for (int c = 0; c < config.clients; c++)
+    {
+        clients[c].id = c;
+        clients[c].seed = (unsigned int)(time(NULL) ^ (c * 2654435761u));
+        clients[c].sd = connectToServer(config.s1Ip, config.basePort);
+        if (clients[c].sd < 0)
+        {
+            fprintf(stderr, "Error: cannot connect to %s:%d\n", config.s1Ip, config.basePort);
+            break;
+        }
+        started++;
+    }
+    if (started < config.clients)
+    {
+        stopCluster();
+        return 1;
+    }
+    // Each client counts its run time from the barrier, after every client has preloaded
+    for (int c = 0; c < config.clients; c++)
+        pthread_create(&clients[c].thread, NULL, clientMain, &clients[c]);
+    pthread_barrier_wait(&startBarrier);
+    unsigned long long begin = nowUs();
+    for (int c = 0; c < config.clients; c++)
+        pthread_join(clients[c].thread, NULL);
+    double elapsed = (nowUs() - begin) / 1e6;
+
+    for (int c = 0; c < config.clients; c++)
+        if (clients[c].sd >= 0)
+            close(clients[c].sd);
+    if (!config.external)
+        stopCluster();
+
+    writeResults(stdout, clients, elapsed);
+    FILE *out = fopen(config.output, "w");
+    if (out)
+    {
+        writeResults(out, clients, elapsed);
+        fclose(out);
+    }
+    else
+    {
+        perror(config.output);
+    }
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,267 @@
+// Self checks of s1's placement code, built from s1.c itself so they test the code that ships.
+// Run "make check" or ./s25Check [ring|erasure]; the exit status is the number of failed checks.
+#define main s1Main
+#include "s1.c"
+#undef main
+
+// Paths placed by every ring check
+#define CHECK_PATHS 20000
+
+int checkFailures = 0;
+
+// Helper function to report one check, counted as a failure when ok is 0
+static void expect(int ok, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%s ", ok ? "ok  " : "FAIL");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    if (!ok)
+        checkFailures++;
+}
+
+// Helper function to load a routing table given as text, through a temporary file like s1 reads it
+static int loadTableText(const char *text)
+{
+    char path[] = "/tmp/s25Check_routes_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    int len = (int)strlen(text);
+    int ok = write(fd, text, len) == len;
+    close(fd);
+    int rc = ok ? loadRoutingTable(path) : -1;
+    unlink(path);
+    return rc;
+}
+
+// Helper function to make the i-th ~S1 path of the checks
+static void checkPath(int i, char *out, size_t outLen)
+{
+    snprintf(out, outLen, "~S1/x/d%d/f%d.pdf", i % 37, i);
+}
+
+// Helper function to count the paths each node of the .pdf route owns, owners[i] gets the node index
+static void placePaths(int counts[], int owners[])
+{
+    const Route *route = lookupRoute(".pdf", "~S1/x");
+    memset(counts, 0, MAX_NODES * sizeof(int));
+    for (int i = 0; i < CHECK_PATHS; i++)
+    {
+        char path[64];
+        checkPath(i, path, sizeof(path));
+        int node = (int)(routeNode(route, path) - routing.nodes);
+        owners[i] = node;
+        counts[node]++;
+    }
+}
+
+// Consistent hashing: even split, weights, and adding a node only moves files onto it
+static void checkRing()
+{
+    static int before[CHECK_PATHS], after[CHECK_PATHS];
+    int counts[MAX_NODES];
+    const char *nodes = "node S1 local 0 S1\n"
+                        "node S2 127.0.0.1 9102 S2\n"
+                        "node S2b 127.0.0.1 9105 S2b\n"
+                        "node S2c 127.0.0.1 9106 S2c\n";
+    char table[1024];
+
+    snprintf(table, sizeof(table), "%sroute .pdf S2 S2b\n", nodes);
+    if (loadTableText(table) != 0)
+    {
+        expect(0, "ring: two node table loads");
+        return;
+    }
+    placePaths(counts, before);
+    // 160 points per node keep the split within a few percent
+    expect(counts[1] > CHECK_PATHS * 45 / 100 && counts[2] > CHECK_PATHS * 45 / 100,
+           "ring: two nodes split %d paths %d/%d", CHECK_PATHS, counts[1], counts[2]);
+
+    snprintf(table, sizeof(table), "%sroute .pdf S2 S2b S2c\n", nodes);
+    if (loadTableText(table) != 0)
+    {
+        expect(0, "ring: three node table loads");
+        return;
+    }
+    placePaths(counts, after);
+    int moved = 0, strayMoves = 0;
+    for (int i = 0; i < CHECK_PATHS; i++)
+    {
+        if (after[i] == before[i])
+            continue;
+        moved++;
+        if (after[i] != 3)
+            strayMoves++;
+    }
+    expect(strayMoves == 0, "ring: adding a node moves paths only onto it (%d elsewhere)", strayMoves);
+    expect(moved > CHECK_PATHS * 25 / 100 && moved < CHECK_PATHS * 42 / 100,
+           "ring: adding a third node moves %d paths (about a third)", moved);
+
+    snprintf(table, sizeof(table), "%sroute .pdf S2:2 S2b\n", nodes);
+    if (loadTableText(table) != 0)
+    {
+        expect(0, "ring: weighted table loads");
+        return;
+    }
+    placePaths(counts, after);
+    expect(counts[1] > CHECK_PATHS * 60 / 100 && counts[1] < CHECK_PATHS * 73 / 100,
+           "ring: weight 2 takes %d of %d paths (about two thirds)", counts[1], CHECK_PATHS);
+
+    // Replicas are distinct consecutive ring nodes and start at the owner
+    snprintf(table, sizeof(table), "%sroute .pdf S2 S2b S2c\nreplicate .pdf 2\n", nodes);
+    if (loadTableText(table) != 0)
+    {
+        expect(0, "ring: replicated table loads");
+        return;
+    }
+    const Route *route = lookupRoute(".pdf", "~S1/x");
+    int bad = 0;
+    for (int i = 0; i < CHECK_PATHS; i++)
+    {
+        char path[64];
+        checkPath(i, path, sizeof(path));
+        const StorageNode *copies[MAX_POOL_NODES];
+        int n = replicaNodesIn(&routing, route, path, copies);
+        if (n != 2 || copies[0] == copies[1] || copies[0] != routeNode(route, path))
+            bad++;
+    }
+    expect(bad == 0, "ring: 2 distinct replicas starting at the owner (%d bad)", bad);
+}
+
+// Helper function to fill a buffer with reproducible pseudo-random bytes
+static void fillRandom(unsigned char *buf, int len, unsigned int seed)
+{
+    unsigned int x = seed * 2654435761u + 1;
+    for (int i = 0; i < len; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (unsigned char)x;
+    }
+}
+
+// Helper function to compare a multiply-accumulate kernel with the scalar loop for every coefficient,
+// at lengths and offsets that leave vector tails and unaligned pointers
+static int kernelMismatches(void (*kernel)(unsigned char *, const unsigned char *, unsigned char, int))
+{
+    static const int lengths[] = {1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1000, 4099};
+    unsigned char src[4099 + 3], want[4099 + 3], got[4099 + 3];
+    int bad = 0;
+    for (int c = 0; c < 256; c++)
+    {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        {
+            int len = lengths[l], off = (c + (int)l) % 3;
+            fillRandom(src, len + 3, c * 31 + l);
+            fillRandom(want, len + 3, c * 17 + l + 7);
+            memcpy(got, want, len + 3);
+            gfMulAddScalar(want + off, src + off, (unsigned char)c, len);
+            kernel(got + off, src + off, (unsigned char)c, len);
+            if (memcmp(want, got, len + 3) != 0)
+                bad++;
+        }
+    }
+    return bad;
+}
+
+// Reed-Solomon: the vector kernels match the scalar one, and every k of the k + m fragments rebuild the file
+static void checkErasure()
+{
+    initErasureCoding();
+    int bad = 0;
+    for (int a = 1; a < 256; a++)
+        for (int b = 0; b < 256; b++)
+            if (gfMul((unsigned char)a, gfMul(gfInv((unsigned char)a), (unsigned char)b)) != b)
+                bad++;
+    expect(bad == 0, "erasure: a * (1/a * b) == b over GF(2^8) (%d bad)", bad);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3"))
+        expect(kernelMismatches(gfMulAddSsse3) == 0, "erasure: SSSE3 kernel matches the scalar one");
+    else
+        printf("skip erasure: no SSSE3 on this CPU\n");
+    if (__builtin_cpu_supports("avx2"))
+        expect(kernelMismatches(gfMulAddAvx2) == 0, "erasure: AVX2 kernel matches the scalar one");
+    else
+        printf("skip erasure: no AVX2 on this CPU\n");
+#endif
+    expect(kernelMismatches(gfMulAdd) == 0, "erasure: the kernel picked at startup matches the scalar one");
+
+    // Encode a file of an odd size for every shape, then decode from every k-subset of the fragments
+    int shapes = 0, badShapes = 0;
+    for (int k = 1; k < MAX_POOL_NODES; k++)
+    {
+        for (int m = 1; k + m <= MAX_POOL_NODES; m++)
+        {
+            int fileSize = 3001 + k * 7 + m;
+            unsigned char file[3100];
+            fillRandom(file, fileSize, k * 8 + m);
+            EcFragment h = {k, m, 0, fileSize, (fileSize + k - 1) / k, (uint32_t)crc32(0L, file, fileSize)};
+            int fragSize = EC_HEADER_SIZE + h.shardSize;
+            unsigned char *frags = (unsigned char *)calloc(k + m, fragSize);
+            unsigned char *out = (unsigned char *)malloc((size_t)k * h.shardSize);
+            if (!frags || !out)
+            {
+                free(frags);
+                free(out);
+                expect(0, "erasure: memory for k=%d m=%d", k, m);
+                continue;
+            }
+            ecEncode((const char *)file, fileSize, k, m, h.shardSize, frags, fragSize);
+            int badHeaders = 0;
+            for (int i = 0; i < k + m; i++)
+            {
+                h.index = i;
+                ecWriteHeader(frags + (size_t)i * fragSize, &h);
+                EcFragment parsed;
+                if (ecParseFragment((const char *)frags + (size_t)i * fragSize, fragSize, &parsed) != 0 || parsed.index != i)
+                    badHeaders++;
+            }
+            int subsets = 0, failed = 0;
+            for (int mask = 0; mask < (1 << (k + m)); mask++)
+            {
+                if (__builtin_popcount(mask) != k)
+                    continue;
+                int idx[MAX_POOL_NODES], got = 0;
+                const unsigned char *shards[MAX_POOL_NODES];
+                for (int i = 0; i < k + m; i++)
+                {
+                    if (mask & (1 << i))
+                    {
+                        idx[got] = i;
+                        shards[got++] = frags + (size_t)i * fragSize + EC_HEADER_SIZE;
+                    }
+                }
+                subsets++;
+                memset(out, 0, (size_t)k * h.shardSize);
+                if (ecDecode(k, h.shardSize, idx, shards, out) != 0 || memcmp(out, file, fileSize) != 0)
+                    failed++;
+            }
+            shapes++;
+            if (badHeaders || failed)
+            {
+                badShapes++;
+                printf("     k=%d m=%d: %d bad headers, %d of %d subsets do not decode\n", k, m, badHeaders, failed, subsets);
+            }
+            free(frags);
+            free(out);
+        }
+    }
+    expect(badShapes == 0, "erasure: every k-subset decodes for all %d shapes with k + m <= %d", shapes, MAX_POOL_NODES);
+}
+
+int main(int argc, char *argv[])
+{
+    // Node paths are built under $HOME
+    setenv("HOME", "/tmp", 0);
+    const char *only = argc > 1 ? argv[1] : NULL;
+    if (!only || strcmp(only, "ring") == 0)
+        checkRing();
+    if (!only || strcmp(only, "erasure") == 0)
+        checkErasure();
+    printf("%d failed\n", checkFailures);
+    return checkFailures;
+}
@@ -9,6 +9,8 @@
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <sys/time.h>
+#include <zlib.h>
 
 // Global constant
 #define MAX_BUFFER 2048
@@ -16,6 +18,15 @@
 #define CHUNK_SIZE 8192
 #define MAX_FILE_SIZE (50 * 1024 * 1024)
 
+// On-the-wire compression of uploadf/downlf payloads
+#define WIRE_FRAME_RAW (64 * 1024)
+#define WIRE_STORED 0x80000000u
+#define WIRE_SAMPLE 4096
+#define WIRE_MIN_SIZE 512
+
+// Size field value announcing a framed (compressed) tar stream
+#define TAR_STREAMED 0xFFFFFFFFu
+
 // Helper function to send data in parts
 int sendDataInChunks(int socket, const char *data, int dataSize)
 {
@@ -56,6 +67,290 @@ int receiveDataInChunks(int socket, char *buffer, int expectedSize)
     return totalReceived;
 }
 
+// Helper function to check whether a payload is worth deflating on the wire
+int wireWorthCompressing(const char *name, const char *data, int dataSize)
+{
+    // Skip formats that are compressed already
+    const char *dot = name ? strrchr(name, '.') : NULL;
+    if (dot && (strcmp(dot, ".zip") == 0 || strcmp(dot, ".pdf") == 0))
+    {
+        return 0;
+    }
+    if (dataSize < WIRE_MIN_SIZE)
+    {
+        return 0;
+    }
+    // Quick entropy check: deflate a small sample and skip if it barely shrinks
+    unsigned char sample[WIRE_SAMPLE + 64];
+    uLongf sampleLen = sizeof(sample);
+    int n = dataSize < WIRE_SAMPLE ? dataSize : WIRE_SAMPLE;
+    if (compress2(sample, &sampleLen, (const Bytef *)data, n, 1) != Z_OK)
+    {
+        return 0;
+    }
+    return sampleLen < (uLongf)n * 9 / 10;
+}
+
+// Helper function to send data as deflate frames, blocks that do not shrink go stored
+int sendCompressedData(int socket, const char *data, int dataSize, int compress)
+{
+    uLong outCap = compressBound(WIRE_FRAME_RAW);
+    unsigned char *out = compress ? (unsigned char *)malloc(outCap) : NULL;
+    for (int offset = 0; offset < dataSize; offset += WIRE_FRAME_RAW)
+    {
+        int n = (dataSize - offset > WIRE_FRAME_RAW) ? WIRE_FRAME_RAW : (dataSize - offset);
+        const char *frame = data + offset;
+        uint32_t header = WIRE_STORED | (uint32_t)n;
+        // Each frame carries its length, the high bit marks a stored (raw) frame
+        uLongf outLen = outCap;
+        if (out && compress2(out, &outLen, (const Bytef *)frame, n, 1) == Z_OK && outLen < (uLongf)n)
+        {
+            frame = (const char *)out;
+            header = (uint32_t)outLen;
+        }
+        int frameLen = header & ~WIRE_STORED;
+        uint32_t netHeader = htonl(header);
+        if (write(socket, &netHeader, sizeof(netHeader)) != sizeof(netHeader) ||
+            sendDataInChunks(socket, frame, frameLen) != frameLen)
+        {
+            free(out);
+            return -1;
+        }
+    }
+    free(out);
+    return dataSize;
+}
+
+// Helper function to receive data sent with sendCompressedData
+int receiveCompressedData(int socket, char *buffer, int expectedSize)
+{
+    uLong inCap = compressBound(WIRE_FRAME_RAW);
+    unsigned char *in = (unsigned char *)malloc(inCap);
+    if (!in)
+    {
+        return -1;
+    }
+    int totalReceived = 0;
+    while (totalReceived < expectedSize)
+    {
+        int want = (expectedSize - totalReceived > WIRE_FRAME_RAW) ? WIRE_FRAME_RAW : (expectedSize - totalReceived);
+        uint32_t netHeader;
+        if (receiveDataInChunks(socket, (char *)&netHeader, sizeof(netHeader)) != sizeof(netHeader))
+        {
+            break;
+        }
+        uint32_t header = ntohl(netHeader);
+        uint32_t frameLen = header & ~WIRE_STORED;
+        if (header & WIRE_STORED)
+        {
+            // Stored frames land directly in the buffer
+            if (frameLen != (uint32_t)want ||
+                receiveDataInChunks(socket, buffer + totalReceived, want) != want)
+            {
+                break;
+            }
+        }
+        else
+        {
+            uLongf outLen = want;
+            if (frameLen > inCap ||
+                receiveDataInChunks(socket, (char *)in, frameLen) != (int)frameLen ||
+                uncompress((Bytef *)buffer + totalReceived, &outLen, in, frameLen) != Z_OK ||
+                outLen != (uLongf)want)
+            {
+                break;
+            }
+        }
+        totalReceived += want;
+    }
+    free(in);
+    return totalReceived == expectedSize ? totalReceived : -1;
+}
+
+// Helper function to ask the server for deflate frames and trace contexts, returns 1 if it agreed to
+// deflate and sets *trace if it takes trace contexts
+int negotiateFeatures(int socket, int *trace)
+{
+    *trace = 0;
+    const char *offer = "features deflate trace";
+    if (write(socket, offer, strlen(offer)) <= 0)
+    {
+        return 0;
+    }
+    // Do not wait forever on a server that ignores the handshake
+    struct timeval timeout = {2, 0};
+    struct timeval none = {0, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char reply[64];
+    int n = read(socket, reply, sizeof(reply) - 1);
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    if (n <= 0)
+    {
+        return 0;
+    }
+    reply[n] = '\0';
+    if (strncmp(reply, "features", 8) != 0)
+    {
+        return 0;
+    }
+    int deflate = 0;
+    for (char *feature = strtok(reply + 8, " "); feature != NULL; feature = strtok(NULL, " "))
+    {
+        if (strcmp(feature, "deflate") == 0)
+        {
+            deflate = 1;
+        }
+        else if (strcmp(feature, "trace") == 0)
+        {
+            *trace = 1;
+        }
+    }
+    return deflate;
+}
+
+// Helper function to get the wall clock in microseconds, the servers time their spans with it too
+long long wallClockUs()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (long long)now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+// Helper function to make a random, non-zero trace or span id (xorshift)
+unsigned long long newTraceId()
+{
+    static unsigned long long state = 0;
+    if (state == 0)
+    {
+        state = ((unsigned long long)wallClockUs() << 20) ^ ((unsigned long long)getpid() << 40) ^ 0x9e3779b97f4a7c15ULL;
+    }
+    do
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+    } while (state == 0);
+    return state;
+}
+
+// Helper function to receive a trace from the server and save it as trace_<id>.json, with the client's own
+// span of the command put in front when clientEvent is not NULL. Returns the bytes written or -1
+int saveTrace(int socket, unsigned long long traceId, const char *clientEvent)
+{
+    char status[MAX_BUFFER];
+    int sl = read(socket, status, sizeof(status) - 1);
+    if (sl <= 0)
+    {
+        printf("Error: No response from server\n");
+        return -1;
+    }
+    status[sl] = '\0';
+    if (strstr(status, "Error:"))
+    {
+        printf("%s\n", status);
+        return -1;
+    }
+    uint32_t netSz;
+    if (read(socket, &netSz, sizeof(netSz)) != sizeof(netSz))
+    {
+        printf("Error: Failed to read trace size\n");
+        return -1;
+    }
+    int sz = ntohl(netSz);
+    if (sz <= 0 || sz > MAX_FILE_SIZE)
+    {
+        printf("Error: Invalid trace size\n");
+        return -1;
+    }
+    char *json = (char *)malloc(sz + 1);
+    if (!json)
+    {
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    if (receiveDataInChunks(socket, json, sz) != sz)
+    {
+        free(json);
+        printf("Error: Failed to receive trace\n");
+        return -1;
+    }
+    json[sz] = '\0';
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "trace_%016llx.json", traceId);
+    FILE *out = fopen(fileName, "w");
+    if (!out)
+    {
+        free(json);
+        printf("Error: Failed to create %s\n", fileName);
+        return -1;
+    }
+    // The event list opens with "[\n", the client's events go right after it
+    char *list = strstr(json, "[\n");
+    if (clientEvent && list)
+    {
+        fwrite(json, 1, list + 2 - json, out);
+        fprintf(out, "%s,\n%s", clientEvent, list + 2);
+    }
+    else
+    {
+        fwrite(json, 1, sz, out);
+    }
+    long written = ftell(out);
+    fclose(out);
+    free(json);
+    printf("Trace saved: %s (%ld bytes)\n", fileName, written);
+    return (int)written;
+}
+
+// Helper function to receive a framed tar stream into a file, returns bytes written or -1
+int receiveFramedTar(int socket, const char *fileName)
+{
+    int fd = open(fileName, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    char *frame = NULL;
+    int total = 0;
+    // Each frame is a 4 byte length followed by data, a zero length ends the stream
+    while (1)
+    {
+        uint32_t netLen;
+        if (receiveDataInChunks(socket, (char *)&netLen, sizeof(netLen)) != sizeof(netLen))
+        {
+            total = -1;
+            break;
+        }
+        int frameLen = ntohl(netLen);
+        if (frameLen == 0)
+        {
+            break;
+        }
+        if (frameLen < 0 || frameLen > MAX_FILE_SIZE || total + frameLen > MAX_FILE_SIZE)
+        {
+            total = -1;
+            break;
+        }
+        char *grown = (char *)realloc(frame, frameLen);
+        if (!grown || receiveDataInChunks(socket, grown, frameLen) != frameLen ||
+            write(fd, grown, frameLen) != frameLen)
+        {
+            frame = grown ? grown : frame;
+            total = -1;
+            break;
+        }
+        frame = grown;
+        total += frameLen;
+    }
+    free(frame);
+    close(fd);
+    if (total < 0)
+    {
+        unlink(fileName);
+    }
+    return total;
+}
+
 // Helper function to remove extra spaces from start and end
 void trim(char *str)
 {
@@ -184,7 +479,7 @@ int validateCommandSyntax(char *input, char *commandArgs[], int *count)
     char *delimiter = " \t";
     // Split on the base of delimiter using strtok
     char *portion = strtok(copyInput, delimiter);
-    while (portion != NULL)
+    while (portion != NULL && *count < MAX_COMMAND_ARGS)
     {
         commandArgs[*count] = malloc(strlen(portion) + 1);
         if (commandArgs[*count] == NULL)
@@ -200,7 +495,7 @@ int validateCommandSyntax(char *input, char *commandArgs[], int *count)
     }
     // Define allowed extensions
     char *uploadfExts[] = {".c", ".pdf", ".txt", ".zip"};
-    char *downltarExts[] = {".c", ".pdf", ".txt"};
+    char *downltarExts[] = {".c", ".pdf", ".txt", ".zip"};
     char *downlfExts[] = {".c", ".pdf", ".txt"};
 
     // If command is uploadf
@@ -286,13 +581,44 @@ int validateCommandSyntax(char *input, char *commandArgs[], int *count)
     // If command is downltar
     else if (strcmp(commandArgs[0], "downltar") == 0)
     {
-        // Return 0(Error), if there are exactly 1 or greater than 2 portion
-        if (*count == 1 || *count > 2)
+        // Return 0(Error), if there is no extension or too many portions
+        if (*count == 1 || *count > 5)
         {
             return 0;
         }
-        // Return 0(Error), if the second portion is not extension
+        // Validate the options: since <token> and gz or gz:<level>, in any order
+        int hasSince = 0, hasCodec = 0;
+        for (int i = 2; i < *count; i++)
+        {
+            char *opt = commandArgs[i];
+            if (!hasSince && strcmp(opt, "since") == 0 && i + 1 < *count && atol(commandArgs[i + 1]) > 0)
+            {
+                hasSince = 1;
+                i++;
+            }
+            else if (!hasCodec && (strcmp(opt, "gz") == 0 ||
+                                   (strncmp(opt, "gz:", 3) == 0 && opt[3] >= '0' && opt[3] <= '9' && opt[4] == '\0')))
+            {
+                hasCodec = 1;
+            }
+            else
+            {
+                printf("\nError: Use downltar <extension> [since <token>] [gz|gz:<level>].\n");
+                return 0;
+            }
+        }
+        // downltar all merges every server's files and takes no options
         char *ext = commandArgs[1];
+        if (strcmp(ext, "all") == 0)
+        {
+            if (*count != 2)
+            {
+                printf("\nError: downltar all takes no options.\n");
+                return 0;
+            }
+            return 1;
+        }
+        // Return 0(Error), if the second portion is not extension
         if (ext[0] != '.')
         {
             printf("\nError: downltar requires an extension.\n");
@@ -300,7 +626,7 @@ int validateCommandSyntax(char *input, char *commandArgs[], int *count)
         }
         int validExt = 0;
         // Validate the extension
-        for (int i = 0; i < 3; i++)
+        for (int i = 0; i < 4; i++)
         {
             if (strcmp(ext, downltarExts[i]) == 0)
             {
@@ -323,6 +649,22 @@ int validateCommandSyntax(char *input, char *commandArgs[], int *count)
             return 0;
         }
     }
+    // If command is stats
+    else if (strcmp(commandArgs[0], "stats") == 0)
+    {
+        if (*count != 1)
+        {
+            return 0;
+        }
+    }
+    // If command is trace, the trace id defaults to the last command's
+    else if (strcmp(commandArgs[0], "trace") == 0)
+    {
+        if (*count > 2)
+        {
+            return 0;
+        }
+    }
     // If the entered command is not acceptable
     else
     {
@@ -371,14 +713,25 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    // Offer deflate frames for uploadf/downlf payloads, an older server just leaves them raw. A server that
+    // takes trace contexts gets one in front of every command
+    int traceEnabled = 0;
+    int wireDeflate = negotiateFeatures(client_sd, &traceEnabled);
+    // The last traced command, its span is added when its trace is saved
+    unsigned long long lastTraceId = 0, lastSpanId = 0;
+    long long lastStartUs = 0, lastDurUs = 0;
+    char lastCommand[32] = "";
+
     // Print the available command menu
     printf("\nConnected to server\n");
     printf("\nAvailable commands:\n");
     printf("\n1. uploadf [filename1] [filename2] [filename3] destination_path\n");
     printf("\n2. downlf [filename1_path] [filename2_path]\n");
     printf("\n3. removef [filename1_path] [filename2_path]\n");
-    printf("\n4. downltar [file_extension]\n");
+    printf("\n4. downltar [file_extension|all] [since token] [gz|gz:level]\n");
     printf("\n5. dispfnames pathname\n");
+    printf("\n6. stats\n");
+    printf("\n7. trace [trace_id]\n");
     printf("nNote: The destination_path must start with ~S1\n");
     printf("\nType 'quit' to exit\n");
 
@@ -419,6 +772,17 @@ int main(int argc, char *argv[])
         char commandToSend[MAX_BUFFER];
         strcpy(commandToSend, input);
         int success = 1;
+        // Start a new trace, the servers record their spans under it
+        int traced = traceEnabled && strcmp(commandArgs[0], "trace") != 0;
+        if (traced)
+        {
+            lastTraceId = newTraceId();
+            lastSpanId = newTraceId();
+            lastStartUs = wallClockUs();
+            lastDurUs = 0;
+            snprintf(lastCommand, sizeof(lastCommand), "%s", commandArgs[0]);
+            snprintf(input, MAX_BUFFER, "trace:%016llx:%016llx %s", lastTraceId, lastSpanId, commandToSend);
+        }
         // If command is uploadf
         if (strcmp(commandArgs[0], "uploadf") == 0)
         {
@@ -501,8 +865,9 @@ int main(int argc, char *argv[])
                     free(fileBuffer);
                     break;
                 }
-                // Send file data in chunks
-                int sentBytes = sendDataInChunks(client_sd, fileBuffer, fileSize);
+                // Send file data in chunks, as deflate frames when negotiated and worth it
+                int sentBytes = wireDeflate ? sendCompressedData(client_sd, fileBuffer, fileSize, wireWorthCompressing(commandArgs[i], fileBuffer, fileSize))
+                                            : sendDataInChunks(client_sd, fileBuffer, fileSize);
                 // Error if all data is not sent
                 if (sentBytes != fileSize)
                 {
@@ -628,8 +993,9 @@ int main(int argc, char *argv[])
                     }
                     continue;
                 }
-                // Receive file data in portion from server
-                int totalReceived = receiveDataInChunks(client_sd, fileData, fileSize);
+                // Receive file data in portion from server, as deflate frames when negotiated
+                int totalReceived = wireDeflate ? receiveCompressedData(client_sd, fileData, fileSize)
+                                                : receiveDataInChunks(client_sd, fileData, fileSize);
                 // Error if entire file is not received
                 if (totalReceived != fileSize)
                 {
@@ -798,6 +1164,33 @@ int main(int argc, char *argv[])
                 }
                 continue;
             }
+            // Compressed tars arrive as frames and go straight to disk
+            if (ntohl(netSize) == TAR_STREAMED)
+            {
+                int streamed = receiveFramedTar(client_sd, tarName);
+                if (streamed < 0)
+                {
+                    printf("Error: Failed to receive full tar data.\n");
+                }
+                else
+                {
+                    printf("Tar downloaded: %s (%d bytes)\n", tarName, streamed);
+                    char *token = strstr(response, "(token ");
+                    if (token != NULL)
+                    {
+                        printf("Next sync token: %ld\n", atol(token + 7));
+                    }
+                }
+                for (int i = 0; i < count; i++)
+                {
+                    if (commandArgs[i])
+                    {
+                        free(commandArgs[i]);
+                        commandArgs[i] = NULL;
+                    }
+                }
+                continue;
+            }
             int tarSize = ntohl(netSize);
             if (tarSize <= 0 || tarSize > MAX_FILE_SIZE)
             {
@@ -880,10 +1273,16 @@ int main(int argc, char *argv[])
             }
 
             printf("Tar downloaded: %s (%d bytes)\n", tarName, tarSize);
+            // Incremental tars carry the token to pass to the next "since" request
+            char *token = strstr(response, "(token ");
+            if (token != NULL)
+            {
+                printf("Next sync token: %ld\n", atol(token + 7));
+            }
         }
 
-        // If command is dispfnames
-        else if (strcmp(commandArgs[0], "dispfnames") == 0)
+        // If command is dispfnames or stats, both reply with a text blob
+        else if (strcmp(commandArgs[0], "dispfnames") == 0 || strcmp(commandArgs[0], "stats") == 0)
         {
             // 1) Send command to S1
             if (write(client_sd, input, strlen(input)) <= 0)
@@ -962,6 +1361,46 @@ int main(int argc, char *argv[])
         done_disp:; // label needs a statement
         }
 
+        // If command is trace
+        else if (strcmp(commandArgs[0], "trace") == 0)
+        {
+            unsigned long long traceId = lastTraceId;
+            if (count == 2)
+            {
+                sscanf(commandArgs[1], "%llx", &traceId);
+            }
+            if (traceId == 0)
+            {
+                printf("Error: No trace id, the server does not take traces or nothing was traced yet\n");
+            }
+            else
+            {
+                char request[64];
+                snprintf(request, sizeof(request), "trace %016llx", traceId);
+                if (write(client_sd, request, strlen(request)) <= 0)
+                {
+                    printf("\nError: Failed to send command to server\n");
+                }
+                else
+                {
+                    // The client's own span only when its end was seen
+                    char clientEvent[512];
+                    snprintf(clientEvent, sizeof(clientEvent),
+                             "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"s25Client\"}},\n"
+                             "{\"name\":\"%s\",\"cat\":\"client\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":0,\"tid\":%d,"
+                             "\"args\":{\"trace\":\"%016llx\",\"span\":\"%016llx\",\"parent\":\"0000000000000000\"}}",
+                             lastCommand, lastStartUs, lastDurUs, (int)getpid(), lastTraceId, lastSpanId);
+                    saveTrace(client_sd, traceId, traceId == lastTraceId && lastDurUs > 0 ? clientEvent : NULL);
+                }
+            }
+        }
+
+        // The traced command is over, "trace" alone saves its trace
+        if (traced)
+        {
+            lastDurUs = wallClockUs() - lastStartUs;
+        }
+
         // Free commandArgs
         for (int i = 0; i < MAX_COMMAND_ARGS; i++)
         {
@@ -0,0 +1,625 @@
+// Micro benchmarks of s1's hot helpers, built from s1.c itself so they time the code that ships.
+#define main s1Main
+#include "s1.c"
+#undef main
+#include <math.h>
+#include <ftw.h>
+#include <sched.h>
+
+#define MAX_RESULTS 128
+#define MAX_SAMPLES 101
+
+// A tar tree above this many bytes is skipped, so the suite fits in /tmp
+#define MAX_TREE_BYTES (128L * 1024 * 1024)
+
+// Summary of one measured case, per operation
+typedef struct
+{
+    char name[96];
+    long batch;
+    int samples;
+    double medianNs;
+    double ciLowNs;
+    double ciHighNs;
+    double madPct;
+    double meanNs;
+    double stddevNs;
+    double minNs;
+    double bytesPerOp;
+} CaseResult;
+
+// Suite settings, see usage()
+typedef struct
+{
+    int samples;
+    long minSampleUs;
+    int cpu;
+    char filter[64];
+    char tmpDir[MAX_PATH];
+    char output[MAX_PATH];
+    char baseline[MAX_PATH];
+} SuiteConfig;
+
+SuiteConfig config;
+CaseResult results[MAX_RESULTS];
+int resultCount = 0;
+
+// Operation under test, runs it iterations times and returns 0 or -1 on failure
+typedef int (*CaseFunction)(void *context, long iterations);
+
+// Helper function to print the options
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  -r <samples>    timed samples per case (default 15, at most %d)\n", MAX_SAMPLES);
+    fprintf(stderr, "  -s <ms>         shortest sample, operations are batched up to it (default 20)\n");
+    fprintf(stderr, "  -a <cpu>        pin the suite to one CPU\n");
+    fprintf(stderr, "  -f <text>       only run the cases whose name contains text\n");
+    fprintf(stderr, "  -t <dir>        where the synthetic trees are made (default /tmp)\n");
+    fprintf(stderr, "  -o <file>       also write the results as JSON\n");
+    fprintf(stderr, "  -c <file>       compare with the JSON of an earlier run\n");
+    exit(1);
+}
+
+// Helper function to get the monotonic clock in nanoseconds
+static unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Helper function to format a byte count like 512, 4K or 2M
+static void formatSize(long bytes, char *out, size_t outLen)
+{
+    if (bytes >= 1024 * 1024 && bytes % (1024 * 1024) == 0)
+        snprintf(out, outLen, "%ldM", bytes / (1024 * 1024));
+    else if (bytes >= 1024 && bytes % 1024 == 0)
+        snprintf(out, outLen, "%ldK", bytes / 1024);
+    else
+        snprintf(out, outLen, "%ld", bytes);
+}
+
+// --- Measurement ---
+
+// Helper function to compare two doubles for qsort
+static int cmpdouble(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+// Helper function to tell whether a case is selected by -f
+static int caseSelected(const char *name)
+{
+    return config.filter[0] == '\0' || strstr(name, config.filter) != NULL;
+}
+
+// Time one case: grow the batch until a sample lasts at least -s (this also warms caches up), then take -r
+// samples and summarise them by the median, which a stray preemption does not move, with a 95% confidence
+// interval from the order statistics and the median absolute deviation as the noise
+static int runCase(const char *name, double bytesPerOp, CaseFunction function, void *context)
+{
+    if (!caseSelected(name) || resultCount == MAX_RESULTS)
+        return 0;
+    long batch = 1;
+    for (;;)
+    {
+        unsigned long long begin = nowNs();
+        if (function(context, batch) != 0)
+        {
+            fprintf(stderr, "Error: %s failed\n", name);
+            return -1;
+        }
+        unsigned long long took = nowNs() - begin;
+        if (took >= (unsigned long long)config.minSampleUs * 1000ULL || batch >= (1L << 24))
+            break;
+        // Jump close to the target once a sample is long enough to estimate from
+        long next = took > 100000 ? (long)((double)batch * config.minSampleUs * 1000.0 / took * 1.1) + 1 : batch * 8;
+        batch = next > batch ? next : batch + 1;
+    }
+
+    double samples[MAX_SAMPLES], deviations[MAX_SAMPLES];
+    int n = config.samples;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned long long begin = nowNs();
+        if (function(context, batch) != 0)
+        {
+            fprintf(stderr, "Error: %s failed\n", name);
+            return -1;
+        }
+        samples[i] = (double)(nowNs() - begin) / batch;
+    }
+
+    CaseResult *result = &results[resultCount++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->batch = batch;
+    result->samples = n;
+    result->bytesPerOp = bytesPerOp;
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    result->meanNs = sum / n;
+    double squares = 0;
+    for (int i = 0; i < n; i++)
+        squares += (samples[i] - result->meanNs) * (samples[i] - result->meanNs);
+    result->stddevNs = n > 1 ? sqrt(squares / (n - 1)) : 0;
+    qsort(samples, n, sizeof(double), cmpdouble);
+    result->minNs = samples[0];
+    result->medianNs = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    // The ranks n/2 -+ 0.98*sqrt(n) bound the median with about 95% confidence, whatever the distribution
+    int low = (int)floor((n - 1.96 * sqrt(n)) / 2);
+    int high = (int)ceil((n + 1.96 * sqrt(n)) / 2);
+    result->ciLowNs = samples[low < 0 ? 0 : low];
+    result->ciHighNs = samples[high > n - 1 ? n - 1 : high];
+    for (int i = 0; i < n; i++)
+        deviations[i] = fabs(samples[i] - result->medianNs);
+    qsort(deviations, n, sizeof(double), cmpdouble);
+    result->madPct = 100.0 * deviations[n / 2] / result->medianNs;
+
+    char throughput[32] = "";
+    if (bytesPerOp > 0)
+        snprintf(throughput, sizeof(throughput), "%10.1f MB/s", bytesPerOp / result->medianNs * 1e9 / (1024 * 1024));
+    printf("%-36s %14.0f ns  [%12.0f, %12.0f]  mad %5.1f%%  %s\n", result->name, result->medianNs, result->ciLowNs,
+           result->ciHighNs, result->madPct, throughput);
+    fflush(stdout);
+    return 0;
+}
+
+// --- Transfer cases ---
+
+// Both ends of a socketpair, the sender thread sends size bytes as many times as the receiver asks for
+typedef struct
+{
+    int sd[2];
+    int size;
+    char *sendBuffer;
+    char *receiveBuffer;
+    pthread_t sender;
+} TransferContext;
+
+// Sender thread: read a transfer count, send that many payloads, until a count of 0
+static void *transferSender(void *arg)
+{
+    TransferContext *context = (TransferContext *)arg;
+    long count;
+    while (read(context->sd[1], &count, sizeof(count)) == sizeof(count) && count > 0)
+    {
+        for (long i = 0; i < count; i++)
+        {
+            if (sendDataInChunks(context->sd[1], context->sendBuffer, context->size) != context->size)
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Receive iterations payloads from the sender thread
+static int transferCase(void *arg, long iterations)
+{
+    TransferContext *context = (TransferContext *)arg;
+    if (write(context->sd[0], &iterations, sizeof(iterations)) != sizeof(iterations))
+        return -1;
+    for (long i = 0; i < iterations; i++)
+    {
+        if (receiveDataInChunks(context->sd[0], context->receiveBuffer, context->size) != context->size)
+            return -1;
+    }
+    return 0;
+}
+
+// Time sendDataInChunks and receiveDataInChunks over a socketpair at each payload size, in CHUNK_SIZE parts
+static int runTransferCases()
+{
+    const int sizes[] = {16 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    int largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    TransferContext context;
+    memset(&context, 0, sizeof(context));
+    context.sendBuffer = malloc(largest);
+    context.receiveBuffer = malloc(largest);
+    if (!context.sendBuffer || !context.receiveBuffer)
+    {
+        free(context.sendBuffer);
+        free(context.receiveBuffer);
+        return -1;
+    }
+    memset(context.sendBuffer, 'x', largest);
+    memset(context.receiveBuffer, 0, largest);
+    int rc = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; s++)
+    {
+        char name[96], sizeText[24];
+        formatSize(sizes[s], sizeText, sizeof(sizeText));
+        snprintf(name, sizeof(name), "transfer/size=%s", sizeText);
+        if (!caseSelected(name))
+            continue;
+        // A fresh pair for each case, so no case starts with another one's buffered bytes
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, context.sd) != 0)
+        {
+            rc = -1;
+            break;
+        }
+        context.size = sizes[s];
+        pthread_create(&context.sender, NULL, transferSender, &context);
+        rc = runCase(name, sizes[s], transferCase, &context);
+        long stop = 0;
+        write(context.sd[0], &stop, sizeof(stop));
+        shutdown(context.sd[0], SHUT_RDWR);
+        pthread_join(context.sender, NULL);
+        close(context.sd[0]);
+        close(context.sd[1]);
+    }
+    free(context.sendBuffer);
+    free(context.receiveBuffer);
+    return rc;
+}
+
+// --- Listing cases ---
+
+// A directory of empty files, a quarter of them .c, and the .c names collected from it
+typedef struct
+{
+    char dir[MAX_PATH];
+    char **names;
+    int count;
+} ListingContext;
+
+// Helper function to free a list made by collect_names_one_dir
+static void freeNames(char **names, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+// List the .c files of the directory iterations times
+static int collectCase(void *arg, long iterations)
+{
+    ListingContext *context = (ListingContext *)arg;
+    for (long i = 0; i < iterations; i++)
+    {
+        char **names;
+        int count;
+        if (collect_names_one_dir(context->dir, ".c", &names, &count) != 0)
+            return -1;
+        freeNames(names, count);
+    }
+    return 0;
+}
+
+// Join the collected names iterations times
+static int joinCase(void *arg, long iterations)
+{
+    ListingContext *context = (ListingContext *)arg;
+    for (long i = 0; i < iterations; i++)
+    {
+        int length;
+        char *blob = join_names(context->names, context->count, &length);
+        if (!blob && context->count > 0)
+            return -1;
+        free(blob);
+    }
+    return 0;
+}
+
+// Helper function to remove one entry of a synthetic tree
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Helper function to make a file of size bytes, 0 on success
+static int makeFile(const char *path, const char *data, long size)
+{
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    long written = size > 0 ? write(fd, data, size) : 0;
+    close(fd);
+    return written == size ? 0 : -1;
+}
+
+// Time collect_names_one_dir and join_names over directories of growing size
+static int runListingCases()
+{
+    const int fileCounts[] = {100, 1000, 10000};
+    const char *exts[] = {".c", ".pdf", ".txt", ".zip"};
+    int rc = 0;
+    for (size_t f = 0; f < sizeof(fileCounts) / sizeof(fileCounts[0]) && rc == 0; f++)
+    {
+        char collectName[96], joinName[96];
+        snprintf(collectName, sizeof(collectName), "collect/files=%d", fileCounts[f]);
+        snprintf(joinName, sizeof(joinName), "join/names=%d", fileCounts[f] / 4);
+        if (!caseSelected(collectName) && !caseSelected(joinName))
+            continue;
+        ListingContext context;
+        memset(&context, 0, sizeof(context));
+        if (snprintf(context.dir, sizeof(context.dir), "%s/s25micro.XXXXXX", config.tmpDir) >= (int)sizeof(context.dir) ||
+            !mkdtemp(context.dir))
+            return -1;
+        for (int i = 0; i < fileCounts[f] && rc == 0; i++)
+        {
+            char path[MAX_PATH * 2];
+            snprintf(path, sizeof(path), "%s/file_%06d%s", context.dir, i, exts[i % 4]);
+            rc = makeFile(path, NULL, 0);
+        }
+        if (rc == 0)
+            rc = collect_names_one_dir(context.dir, ".c", &context.names, &context.count);
+        if (rc == 0)
+            rc = runCase(collectName, 0, collectCase, &context);
+        if (rc == 0)
+            rc = runCase(joinName, 0, joinCase, &context);
+        freeNames(context.names, context.count);
+        nftw(context.dir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return rc;
+}
+
+// --- Tar cases ---
+
+// A tree of .c files spread over 10 directories, with as many small .txt files that find has to skip
+typedef struct
+{
+    char dir[MAX_PATH];
+    int fileCount;
+    long touches;
+} TarContext;
+
+// Build the .c tar of the tree iterations times
+static int tarCase(void *arg, long iterations)
+{
+    TarContext *context = (TarContext *)arg;
+    for (long i = 0; i < iterations; i++)
+    {
+        char tarPath[MAX_PATH], tarName[64];
+        if (make_tar_for_ext(context->dir, ".c", 0, tarPath, sizeof(tarPath), tarName, sizeof(tarName)) != 0)
+            return -1;
+        unlink(tarPath);
+    }
+    return 0;
+}
+
+// Helper function to run open_cached_tar iterations times, with its rebuild note sent to /dev/null; touch
+// changes the mtime of one file before each call, so every call rebuilds from the previous archive
+static int cachedTar(TarContext *context, long iterations, int touch)
+{
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || devNull < 0)
+    {
+        if (saved >= 0)
+            close(saved);
+        if (devNull >= 0)
+            close(devNull);
+        return -1;
+    }
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+    int rc = 0;
+    for (long i = 0; i < iterations && rc == 0; i++)
+    {
+        if (touch)
+        {
+            char path[MAX_PATH * 2];
+            int file = (int)(context->touches % context->fileCount);
+            snprintf(path, sizeof(path), "%s/d%d/file_%05d.c", context->dir, file % 10, file);
+            // A new mtime on every call, however fast the calls come
+            struct timespec times[2] = {{0, UTIME_OMIT}, {1000000000L + context->touches++, 0}};
+            if (utimensat(AT_FDCWD, path, times, 0) != 0)
+            {
+                rc = -1;
+                break;
+            }
+        }
+        off_t size;
+        int fd = open_cached_tar(context->dir, ".c", "cfiles.tar", &size);
+        if (fd < 0)
+            rc = -1;
+        else
+            close(fd);
+    }
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return rc;
+}
+
+// Rebuild the cached .c archive after one file changed iterations times
+static int tarRebuildCase(void *arg, long iterations)
+{
+    return cachedTar((TarContext *)arg, iterations, 1);
+}
+
+// Open the cached .c archive of an unchanged tree iterations times
+static int tarHitCase(void *arg, long iterations)
+{
+    return cachedTar((TarContext *)arg, iterations, 0);
+}
+
+// Time make_tar_for_ext (the incremental downltar) and open_cached_tar (the full one) over trees of each
+// file count and file size; the tree stays in the page cache, so this measures the builders rather than the disk
+static int runTarCases()
+{
+    const int fileCounts[] = {10, 100, 1000};
+    const long fileSizes[] = {1024, 64 * 1024, 1024 * 1024};
+    char *data = malloc(fileSizes[sizeof(fileSizes) / sizeof(fileSizes[0]) - 1]);
+    if (!data)
+        return -1;
+    memset(data, 'c', fileSizes[sizeof(fileSizes) / sizeof(fileSizes[0]) - 1]);
+    int rc = 0;
+    for (size_t f = 0; f < sizeof(fileCounts) / sizeof(fileCounts[0]) && rc == 0; f++)
+    {
+        for (size_t z = 0; z < sizeof(fileSizes) / sizeof(fileSizes[0]) && rc == 0; z++)
+        {
+            char name[96], rebuildName[96], hitName[96], sizeText[24];
+            formatSize(fileSizes[z], sizeText, sizeof(sizeText));
+            snprintf(name, sizeof(name), "tar/files=%d/size=%s", fileCounts[f], sizeText);
+            snprintf(rebuildName, sizeof(rebuildName), "tarcache/rebuild/files=%d/size=%s", fileCounts[f], sizeText);
+            snprintf(hitName, sizeof(hitName), "tarcache/hit/files=%d/size=%s", fileCounts[f], sizeText);
+            if ((!caseSelected(name) && !caseSelected(rebuildName) && !caseSelected(hitName)) ||
+                fileCounts[f] * fileSizes[z] > MAX_TREE_BYTES)
+                continue;
+            TarContext context;
+            context.fileCount = fileCounts[f];
+            context.touches = 0;
+            if (snprintf(context.dir, sizeof(context.dir), "%s/s25micro.XXXXXX", config.tmpDir) >= (int)sizeof(context.dir) ||
+                !mkdtemp(context.dir))
+            {
+                rc = -1;
+                break;
+            }
+            for (int i = 0; i < fileCounts[f] && rc == 0; i++)
+            {
+                char path[MAX_PATH * 2];
+                snprintf(path, sizeof(path), "%s/d%d", context.dir, i % 10);
+                mkdir(path, 0755);
+                snprintf(path, sizeof(path), "%s/d%d/file_%05d.c", context.dir, i % 10, i);
+                rc = makeFile(path, data, fileSizes[z]);
+                snprintf(path, sizeof(path), "%s/d%d/file_%05d.txt", context.dir, i % 10, i);
+                if (rc == 0)
+                    rc = makeFile(path, data, 1024);
+            }
+            if (rc == 0)
+                rc = runCase(name, (double)fileCounts[f] * fileSizes[z], tarCase, &context);
+            // A rebuild copies every segment but one, so it is timed against the whole tree as well
+            if (rc == 0)
+                rc = runCase(rebuildName, (double)fileCounts[f] * fileSizes[z], tarRebuildCase, &context);
+            if (rc == 0)
+                rc = runCase(hitName, 0, tarHitCase, &context);
+            nftw(context.dir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+    free(data);
+    return rc;
+}
+
+// --- Results ---
+
+// Write the results as JSON, one case per line so an earlier run can be read back by compareBaseline
+static void writeResults(FILE *out)
+{
+    fprintf(out, "{\n  \"chunk_size\": %d,\n  \"samples\": %d,\n  \"min_sample_us\": %ld,\n  \"cases\": [\n",
+            CHUNK_SIZE, config.samples, config.minSampleUs);
+    for (int i = 0; i < resultCount; i++)
+    {
+        const CaseResult *r = &results[i];
+        fprintf(out,
+                "    {\"case\": \"%s\", \"median_ns\": %.1f, \"ci_low_ns\": %.1f, \"ci_high_ns\": %.1f, "
+                "\"mad_pct\": %.2f, \"mean_ns\": %.1f, \"stddev_ns\": %.1f, \"min_ns\": %.1f, \"batch\": %ld, "
+                "\"samples\": %d, \"mb_s\": %.1f}%s\n",
+                r->name, r->medianNs, r->ciLowNs, r->ciHighNs, r->madPct, r->meanNs, r->stddevNs, r->minNs, r->batch,
+                r->samples, r->bytesPerOp > 0 ? r->bytesPerOp / r->medianNs * 1e9 / (1024 * 1024) : 0.0,
+                i + 1 < resultCount ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// Compare with an earlier run: a case only counts as faster or slower when the two confidence intervals of
+// the median do not overlap, anything else is within the noise
+static int compareBaseline(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in)
+    {
+        fprintf(stderr, "Error: cannot read %s\n", path);
+        return -1;
+    }
+    printf("\n%-36s %14s %14s %9s\n", "case", "baseline ns", "now ns", "change");
+    char line[1024];
+    while (fgets(line, sizeof(line), in))
+    {
+        char name[96];
+        double median, low, high;
+        const char *at = strstr(line, "\"case\": \"");
+        if (!at || sscanf(at, "\"case\": \"%95[^\"]\", \"median_ns\": %lf, \"ci_low_ns\": %lf, \"ci_high_ns\": %lf",
+                          name, &median, &low, &high) != 4)
+            continue;
+        for (int i = 0; i < resultCount; i++)
+        {
+            const CaseResult *r = &results[i];
+            if (strcmp(r->name, name) != 0)
+                continue;
+            const char *verdict = r->ciHighNs < low ? "faster" : r->ciLowNs > high ? "slower" : "same";
+            printf("%-36s %14.0f %14.0f %+8.1f%%  %s\n", name, median, r->medianNs,
+                   100.0 * (r->medianNs - median) / median, verdict);
+        }
+    }
+    fclose(in);
+    return 0;
+}
+
+// Main function
+int main(int argc, char *argv[])
+{
+    // Defaults
+    config.samples = 15;
+    config.minSampleUs = 20000;
+    config.cpu = -1;
+    snprintf(config.tmpDir, sizeof(config.tmpDir), "/tmp");
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:a:f:t:o:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            config.samples = atoi(optarg);
+            break;
+        case 's':
+            config.minSampleUs = atol(optarg) * 1000;
+            break;
+        case 'a':
+            config.cpu = atoi(optarg);
+            break;
+        case 'f':
+            snprintf(config.filter, sizeof(config.filter), "%s", optarg);
+            break;
+        case 't':
+            snprintf(config.tmpDir, sizeof(config.tmpDir), "%s", optarg);
+            break;
+        case 'o':
+            snprintf(config.output, sizeof(config.output), "%s", optarg);
+            break;
+        case 'c':
+            snprintf(config.baseline, sizeof(config.baseline), "%s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (config.samples < 3 || config.samples > MAX_SAMPLES || config.minSampleUs <= 0)
+        usage(argv[0]);
+
+    // One CPU keeps the scheduler from moving the suite around between samples
+    if (config.cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            fprintf(stderr, "Warning: cannot pin to CPU %d: %s\n", config.cpu, strerror(errno));
+    }
+
+    printf("%-36s %17s  %29s  %9s\n", "case", "median/op", "95% confidence interval", "noise");
+    if (runTransferCases() != 0 || runListingCases() != 0 || runTarCases() != 0)
+        return 1;
+
+    if (config.output[0])
+    {
+        FILE *out = fopen(config.output, "w");
+        if (!out)
+        {
+            fprintf(stderr, "Error: cannot write %s\n", config.output);
+            return 1;
+        }
+        writeResults(out);
+        fclose(out);
+    }
+    if (config.baseline[0] && compareBaseline(config.baseline) != 0)
+        return 1;
+    return 0;
+}
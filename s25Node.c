@@ -0,0 +1,216 @@
+// Multi-root peer: one process serving the .pdf, .txt and .zip roots of s2, s3 and s4 behind one port.
+// It is s2 built from s2.c itself, with the root, extension and archive of s2 switched to the ones of the
+// shard each command is for, so there is no second copy of the peer code to keep in step.
+#define STATS_PREFIX "node"
+#define main s2Main
+#include "s2.c"
+#undef main
+
+// Shards one node can host, each is an extension stored under $HOME/<root>
+#define MAX_SHARDS 8
+#define MAX_ROOT 64
+#define MAX_SHARD_EXT 16
+#define MAX_NODE_ARGS 16
+
+// Storage policy of an extension: its root, the name of its downltar archive and whether its files are
+// already compressed, so they are stored in gzip'ed downltar streams instead of being deflated again
+typedef struct
+{
+    const char *ext;
+    const char *root;
+    const char *tarName;
+    int storeInGzip;
+} ShardPolicy;
+
+// Policies s2, s3 and s4 have built in, the defaults of their extensions and the shards of a node without -e
+static const ShardPolicy defaultPolicies[] = {
+    {".pdf", "S2", "pdf.tar", 1},
+    {".txt", "S3", "text.tar", 0},
+    {".zip", "S4", "zip.tar", 1},
+};
+
+// A shard hosted by this node: its extension, the root its files live under and its archive
+typedef struct
+{
+    char ext[MAX_SHARD_EXT];
+    char root[MAX_ROOT];
+    // "/<root>/", how the shard's root shows in the absolute paths server1 sends
+    char marker[MAX_ROOT + 2];
+    char tarName[MAX_ROOT];
+    int storeInGzip;
+} Shard;
+
+Shard shards[MAX_SHARDS];
+int shardCount = 0;
+
+// Helper function to host a shard given as "<ext>[:<root>[:<archive>[:compressed|plain]]]". The fields left out
+// come from the extension's built-in policy; other extensions need a root, their archive is "<ext>.tar".
+static int addShard(const char *spec)
+{
+    char fields[MAX_BUFFER];
+    snprintf(fields, sizeof(fields), "%s", spec);
+    char *parts[4] = {NULL};
+    char *next = fields;
+    for (int i = 0; i < 4 && next; i++)
+    {
+        parts[i] = next;
+        next = strchr(next, ':');
+        if (next)
+            *next++ = '\0';
+    }
+    const char *ext = parts[0];
+    if (next || ext[0] != '.' || strlen(ext) < 2 || strlen(ext) >= MAX_SHARD_EXT || strchr(ext + 1, '.') ||
+        shardCount == MAX_SHARDS)
+        return -1;
+    const ShardPolicy *policy = NULL;
+    for (size_t i = 0; i < sizeof(defaultPolicies) / sizeof(defaultPolicies[0]); i++)
+        if (strcmp(defaultPolicies[i].ext, ext) == 0)
+            policy = &defaultPolicies[i];
+    // An empty field keeps the default
+    const char *root = parts[1] && *parts[1] ? parts[1] : policy ? policy->root : NULL;
+    if (!root || !*root || strchr(root, '/') || strlen(root) >= MAX_ROOT)
+        return -1;
+    if (parts[3] && strcmp(parts[3], "compressed") != 0 && strcmp(parts[3], "plain") != 0)
+        return -1;
+    if (parts[2] && (strchr(parts[2], '/') || strlen(parts[2]) >= MAX_ROOT - 3))
+        return -1;
+    Shard *shard = &shards[shardCount++];
+    snprintf(shard->ext, sizeof(shard->ext), "%s", ext);
+    snprintf(shard->root, sizeof(shard->root), "%s", root);
+    snprintf(shard->marker, sizeof(shard->marker), "/%s/", root);
+    if (parts[2] && *parts[2])
+        snprintf(shard->tarName, sizeof(shard->tarName), "%s", parts[2]);
+    else if (policy)
+        snprintf(shard->tarName, sizeof(shard->tarName), "%s", policy->tarName);
+    else
+        snprintf(shard->tarName, sizeof(shard->tarName), "%s.tar", ext + 1);
+    if (parts[3])
+        shard->storeInGzip = strcmp(parts[3], "compressed") == 0;
+    else
+        shard->storeInGzip = policy ? policy->storeInGzip : 0;
+    return 0;
+}
+
+// Helper function to find the shard an absolute path belongs to, by its root and then its extension
+static const Shard *shardForPath(const char *path)
+{
+    const Shard *found = NULL;
+    const char *dot = strrchr(path, '.');
+    for (int i = 0; i < shardCount; i++)
+    {
+        if (!strstr(path, shards[i].marker))
+            continue;
+        // Two extensions can share a root
+        if (dot && strcmp(dot, shards[i].ext) == 0)
+            return &shards[i];
+        if (!found)
+            found = &shards[i];
+    }
+    return found;
+}
+
+// Helper function to find the shard of an extension, the one with the given root when there is one
+static const Shard *shardForExt(const char *ext, const char *rootPath)
+{
+    const Shard *found = NULL;
+    for (int i = 0; i < shardCount; i++)
+    {
+        if (strcmp(shards[i].ext, ext) != 0)
+            continue;
+        if (!rootPath)
+            return &shards[i];
+        size_t rootLen = strlen(rootPath), markerLen = strlen(shards[i].marker) - 1;
+        if (rootLen >= markerLen && strncmp(rootPath + rootLen - markerLen, shards[i].marker, markerLen) == 0)
+            return &shards[i];
+        if (strstr(rootPath, shards[i].marker) && !found)
+            found = &shards[i];
+    }
+    return found;
+}
+
+// Helper function to find the shard a command is for: by extension for the tree commands, by path otherwise
+static const Shard *commandShard(char *commandArgs[], int count)
+{
+    const char *command = commandArgs[0];
+    if (strcmp(command, "downltar") == 0)
+        return count > 1 ? shardForExt(commandArgs[1], NULL) : NULL;
+    if (strcmp(command, "dispfnames") == 0 || strcmp(command, "listall") == 0 || strcmp(command, "bloom") == 0)
+        return count > 2 ? shardForExt(commandArgs[2], commandArgs[1]) : NULL;
+    if (strcmp(command, "uploadf") == 0 || strcmp(command, "downlf") == 0 || strcmp(command, "removef") == 0 ||
+        strcmp(command, "stat") == 0 || strcmp(command, "migrate") == 0 || strcmp(command, "commitf") == 0)
+        return count > 1 ? shardForPath(commandArgs[1]) : NULL;
+    return NULL;
+}
+
+// Helper function to give s2's code the root, extension and archive of a shard
+static void useShard(const Shard *shard)
+{
+    snprintf(rootName, sizeof(rootName), "%s", shard->root);
+    snprintf(rootMarker, sizeof(rootMarker), "%s", shard->marker);
+    peerExt = shard->ext;
+    peerTarName = shard->tarName;
+    peerStoreInGzip = shard->storeInGzip;
+}
+
+// Switch to the shard of each command; a command of no hosted shard is served as the first shard, whose
+// checks then refuse it like s2 refuses a path or extension that is not its own
+static void selectShard(char *commandArgs[], int count)
+{
+    const Shard *shard = commandShard(commandArgs, count);
+    useShard(shard ? shard : &shards[0]);
+}
+
+// Main function
+int main(int argc, char *argv[])
+{
+    // -e <ext>[:<root>[:<archive>[:compressed|plain]]],... picks the shards, everything else is passed on to s2's main
+    const char *shardList = NULL;
+    char *args[MAX_NODE_ARGS];
+    int count = 0;
+    for (int i = 0; i < argc && count < MAX_NODE_ARGS - 1; i++)
+    {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            shardList = argv[++i];
+        else
+            args[count++] = argv[i];
+    }
+    args[count] = NULL;
+    int positional = count >= 3 && strcmp(args[count - 2], "-m") == 0 ? count - 2 : count;
+    // Error if file not run correctly
+    if (positional != 2 && positional != 4)
+    {
+        fprintf(stderr, "Usage: %s <Port> [<Server1_IP> <Server1_Port>] [-e <ext>[:<root>[:<archive>[:compressed|plain]]],...] [-m <metrics_port>]\n", argv[0]);
+        exit(0);
+    }
+    // Without -e the node hosts every extension under the root of its own server
+    if (shardList)
+    {
+        char specs[MAX_BUFFER];
+        snprintf(specs, sizeof(specs), "%s", shardList);
+        for (char *spec = strtok(specs, ","); spec; spec = strtok(NULL, ","))
+        {
+            if (addShard(spec) != 0)
+            {
+                fprintf(stderr, "Bad shard %s: <ext>[:<root>[:<archive>[:compressed|plain]]], a root for extensions other than .pdf, .txt and .zip, at most %d shards\n", spec, MAX_SHARDS);
+                exit(1);
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < sizeof(defaultPolicies) / sizeof(defaultPolicies[0]); i++)
+            addShard(defaultPolicies[i].ext);
+    }
+    if (shardCount == 0)
+    {
+        fprintf(stderr, "No shard to host\n");
+        exit(1);
+    }
+    for (int i = 0; i < shardCount; i++)
+        printf("Hosting %s under $HOME/%s as %s\n", shards[i].ext, shards[i].root, shards[i].tarName);
+    // s2's main forks the metrics server and the connections, flush so no child prints these lines again
+    fflush(stdout);
+    useShard(&shards[0]);
+    selectCommandRoot = selectShard;
+    return s2Main(count, args);
+}
@@ -0,0 +1,436 @@
+// Null storage peer for profiling s1 on its own. It is s2 built from s2.c itself, with the storage primitives
+// swapped for ones that keep only the path and size of each file: uploads are received and dropped, and reads
+// are served from one buffer of pseudo-random bytes, so every command takes the code path of a real peer.
+#define STATS_PREFIX "nullpeer"
+#define main s2Main
+#include "s2.c"
+#undef main
+
+// Files the null peer can remember, the table is open addressed so keep it well below full
+#define NULL_FILE_SLOTS 65536
+#define MAX_NULL_ARGS 16
+
+// A file stored here: only its path and size are kept, the contents are synthesized when read
+typedef struct
+{
+    char path[MAX_PATH];
+    long long size;
+    long mtime;
+    int state;
+} NullFile;
+
+// Slot states of the file table, a removed slot keeps probe chains intact until it is reused
+enum
+{
+    SLOT_EMPTY,
+    SLOT_USED,
+    SLOT_REMOVED
+};
+
+// File table shared by all forked children
+typedef struct
+{
+    pthread_mutex_t lock;
+    int files;
+    NullFile slots[NULL_FILE_SLOTS];
+} NullStore;
+
+NullStore *store = NULL;
+
+// Stand-in settings: the latency added before every command, the bandwidth payloads are paced to (0 is
+// unlimited) and the size of files it was never sent (0: they do not exist)
+long latencyMs = 0;
+long long bandwidth = 0;
+long long syntheticSize = 0;
+
+// Bytes served for every read, filled once before forking so the children share the pages
+char *syntheticData = NULL;
+
+// Extension and archive name of the command being served, any extension is answered
+char commandExt[16] = SUPPORTED_EXT;
+char commandTarName[32] = "pdf.tar";
+
+// --- Null store ---
+
+// Helper function to map the file table shared by the children. An anonymous mapping starts zeroed, so the
+// slots are not cleared here and only the pages of slots in use are ever touched.
+static int initNullStore()
+{
+    void *mem = mmap(NULL, sizeof(NullStore), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap file table");
+        return -1;
+    }
+    NullStore *table = (NullStore *)mem;
+    // The lock is shared across processes and survives a child dying while holding it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&table->lock, &attr) != 0)
+    {
+        pthread_mutexattr_destroy(&attr);
+        munmap(mem, sizeof(NullStore));
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attr);
+    store = table;
+    return 0;
+}
+
+// Helper function to take the file table lock
+static void lockStore()
+{
+    if (pthread_mutex_lock(&store->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&store->lock);
+}
+
+// Helper function to release the file table lock
+static void unlockStore()
+{
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Helper function to hash a path, 64-bit FNV-1a
+static unsigned long long hashPath(const char *path)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    for (const char *p = path; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Helper function to find the slot of a path, or -1. Call with the lock held.
+static int findSlot(const char *path)
+{
+    unsigned long long h = hashPath(path);
+    for (int probe = 0; probe < NULL_FILE_SLOTS; probe++)
+    {
+        NullFile *slot = &store->slots[(h + probe) % NULL_FILE_SLOTS];
+        if (slot->state == SLOT_EMPTY)
+            return -1;
+        if (slot->state == SLOT_USED && strcmp(slot->path, path) == 0)
+            return (int)((h + probe) % NULL_FILE_SLOTS);
+    }
+    return -1;
+}
+
+// Helper function to remember a stored file, 0 on success or -1 when the table is full
+static int storePut(const char *path, long long size)
+{
+    lockStore();
+    int found = findSlot(path);
+    if (found < 0)
+    {
+        // Reuse the first free slot on the probe chain, the table is kept below three quarters full
+        unsigned long long h = hashPath(path);
+        for (int probe = 0; probe < NULL_FILE_SLOTS && store->files < NULL_FILE_SLOTS * 3 / 4; probe++)
+        {
+            int index = (int)((h + probe) % NULL_FILE_SLOTS);
+            if (store->slots[index].state != SLOT_USED)
+            {
+                found = index;
+                store->files++;
+                break;
+            }
+        }
+    }
+    if (found >= 0)
+    {
+        NullFile *slot = &store->slots[found];
+        snprintf(slot->path, sizeof(slot->path), "%s", path);
+        slot->size = size;
+        slot->mtime = (long)time(NULL);
+        slot->state = SLOT_USED;
+    }
+    unlockStore();
+    return found >= 0 ? 0 : -1;
+}
+
+// Helper function to look a file up, files never stored exist with the synthetic size when one is set.
+// Returns 1 and the size if the file exists, otherwise 0.
+static int storeLookup(const char *path, long long *size)
+{
+    lockStore();
+    int found = findSlot(path);
+    if (found >= 0)
+        *size = store->slots[found].size;
+    unlockStore();
+    if (found < 0 && syntheticSize > 0)
+        *size = syntheticSize;
+    return found >= 0 || syntheticSize > 0;
+}
+
+// Helper function to forget a file, returns 1 if it was stored
+static int storeRemove(const char *path)
+{
+    lockStore();
+    int found = findSlot(path);
+    if (found >= 0)
+    {
+        store->slots[found].state = SLOT_REMOVED;
+        store->files--;
+    }
+    unlockStore();
+    return found >= 0;
+}
+
+// Helper function to list the stored files under dir that end with ext as "./relative" entries, only the
+// files directly in dir unless recursive, modified at or after since. Returns the count or -1.
+static int storeList(const char *dir, const char *ext, int recursive, long since, TarEntry **outList)
+{
+    int count = 0, cap = 0;
+    TarEntry *list = NULL;
+    size_t dirLen = strlen(dir);
+    size_t extLen = strlen(ext);
+    lockStore();
+    for (int i = 0; i < NULL_FILE_SLOTS; i++)
+    {
+        const NullFile *slot = &store->slots[i];
+        if (slot->state != SLOT_USED || slot->mtime < since || strncmp(slot->path, dir, dirLen) != 0 ||
+            slot->path[dirLen] != '/')
+            continue;
+        const char *rest = slot->path + dirLen + 1;
+        size_t len = strlen(rest);
+        if (len < extLen || strcmp(rest + len - extLen, ext) != 0 || (!recursive && strchr(rest, '/')))
+            continue;
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            TarEntry *tmp = (TarEntry *)realloc(list, cap * sizeof(TarEntry));
+            if (!tmp)
+            {
+                unlockStore();
+                free(list);
+                return -1;
+            }
+            list = tmp;
+        }
+        TarEntry *e = &list[count++];
+        memset(e, 0, sizeof(*e));
+        snprintf(e->rel, sizeof(e->rel), "./%s", rest);
+        e->size = slot->size;
+        e->mtimeSec = slot->mtime;
+    }
+    unlockStore();
+    if (count > 1)
+        qsort(list, count, sizeof(TarEntry), cmp_tar_entry);
+    *outList = list;
+    return count;
+}
+
+// --- Injected latency and bandwidth ---
+
+// Helper function to hold a transfer of bytes back to the configured bandwidth
+static void paceTransfer(long long bytes)
+{
+    if (bandwidth > 0)
+        usleep((useconds_t)(bytes * 1000000.0 / bandwidth));
+}
+
+// Helper function to give the archive name served for an extension
+static void tarNameForExt(const char *ext, char *out, size_t outLen)
+{
+    // spec names
+    if (!strcmp(ext, ".c"))
+        snprintf(out, outLen, "cfiles.tar");
+    else if (!strcmp(ext, ".txt"))
+        snprintf(out, outLen, "text.tar");
+    else
+        snprintf(out, outLen, "%s.tar", ext + 1);
+}
+
+// Wait the injected latency before each command and answer it for its own extension, taken from the extension
+// argument of the tree commands or from the path of the others
+static void selectNullCommand(char *commandArgs[], int count)
+{
+    if (latencyMs > 0)
+        usleep(latencyMs * 1000);
+    const char *ext = NULL;
+    if (strcmp(commandArgs[0], "downltar") == 0)
+        ext = count > 1 ? commandArgs[1] : NULL;
+    else if (strcmp(commandArgs[0], "dispfnames") == 0 || strcmp(commandArgs[0], "listall") == 0)
+        ext = count > 2 ? commandArgs[2] : NULL;
+    else if (count > 1)
+        ext = strrchr(commandArgs[1], '.');
+    if (!ext || ext[0] != '.' || strchr(ext, '/') || strlen(ext) >= sizeof(commandExt))
+        return;
+    snprintf(commandExt, sizeof(commandExt), "%s", ext);
+    tarNameForExt(commandExt, commandTarName, sizeof(commandTarName));
+}
+
+// --- Null storage primitives ---
+
+// Helper function to get the size of a stored file, -1 if there is none
+static long long nullFileSize(const char *path)
+{
+    long long size;
+    return storeLookup(path, &size) ? size : -1;
+}
+
+// Helper function to read a file, the synthetic data paced to the bandwidth
+static int nullReadFile(const char *path, char *data, int size)
+{
+    (void)path;
+    memcpy(data, syntheticData, size);
+    paceTransfer(size);
+    return size;
+}
+
+// Helper function to store a received file, only its path and size are kept
+static const char *nullWriteFile(const char *path, const char *data, int size)
+{
+    (void)data;
+    paceTransfer(size);
+    return storePut(path, size) == 0 ? NULL : "Error: Failed to create file on Server";
+}
+
+// Helper function to remove a stored file
+static int nullRemoveFile(const char *path)
+{
+    return storeRemove(path) ? 0 : -1;
+}
+
+// Helper function to move a stored file to another path
+static int nullRenameFile(const char *oldPath, const char *newPath)
+{
+    long long size;
+    if (!storeLookup(oldPath, &size) || storePut(newPath, size) != 0)
+        return -1;
+    storeRemove(oldPath);
+    return 0;
+}
+
+// Helper function to list the names of the stored files with ext directly in dir
+static int nullListDir(const char *dir, const char *ext, char ***outList, int *outCount)
+{
+    TarEntry *list = NULL;
+    int count = storeList(dir, ext, 0, 0, &list);
+    *outList = NULL;
+    *outCount = 0;
+    if (count <= 0)
+        return count;
+    char **names = (char **)malloc(count * sizeof(char *));
+    if (!names)
+    {
+        free(list);
+        return -1;
+    }
+    // Entries are "./name", the listing has the bare names
+    for (int i = 0; i < count; i++)
+        names[i] = strdup(list[i].rel + 2);
+    free(list);
+    *outList = names;
+    *outCount = count;
+    return 0;
+}
+
+// Helper function to list the stored files with ext below root
+static int nullScanTree(const char *root, const char *ext, TarEntry **outList, int *outCount)
+{
+    *outList = NULL;
+    int count = storeList(root, ext, 1, 0, outList);
+    *outCount = count > 0 ? count : 0;
+    return count < 0 ? -1 : 0;
+}
+
+// Helper function to build the tar of the stored files of ext in memory, synthetic data in every segment. An
+// incremental tar has the files stored since the token but no deletion manifest.
+static int nullOpenTar(const char *base, const char *ext, long since, off_t *outSize)
+{
+    TarEntry *list = NULL;
+    int count = storeList(base, ext, 1, since, &list);
+    if (count < 0)
+        return -1;
+    int fd = memfd_create("nullpeer.tar", 0);
+    static const char zeros[1024];
+    for (int i = 0; i < count && fd >= 0; i++)
+    {
+        int pad = (int)((512 - list[i].size % 512) % 512);
+        if (write_tar_header(fd, &list[i]) != 0 ||
+            write(fd, syntheticData, list[i].size) != list[i].size ||
+            (pad > 0 && write(fd, zeros, pad) != pad))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    free(list);
+    // Two zero blocks end the archive
+    if (fd >= 0 && write(fd, zeros, sizeof(zeros)) != sizeof(zeros))
+    {
+        close(fd);
+        return -1;
+    }
+    if (fd < 0)
+        return -1;
+    *outSize = lseek(fd, 0, SEEK_CUR);
+    paceTransfer(*outSize);
+    return fd;
+}
+
+// Helper function to parse a size such as 64K or 1M
+static long long parseSize(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (*end == 'K' || *end == 'k')
+        value *= 1024;
+    else if (*end == 'M' || *end == 'm')
+        value *= 1024 * 1024;
+    return value >= 0 && value <= MAX_FILE_SIZE ? (long long)value : -1;
+}
+
+// Main function
+int main(int argc, char *argv[])
+{
+    // -l <latency_ms>, -b <MB/s> and -z <size> set up the stand-in, everything else is passed on to s2's main
+    char *args[MAX_NULL_ARGS];
+    int count = 0;
+    for (int i = 0; i < argc && count < MAX_NULL_ARGS - 1; i++)
+    {
+        if (i > 0 && i + 1 < argc && strcmp(argv[i], "-l") == 0)
+            latencyMs = atol(argv[++i]);
+        else if (i > 0 && i + 1 < argc && strcmp(argv[i], "-b") == 0)
+            bandwidth = (long long)(atof(argv[++i]) * 1024 * 1024);
+        else if (i > 0 && i + 1 < argc && strcmp(argv[i], "-z") == 0)
+            syntheticSize = parseSize(argv[++i]);
+        else
+            args[count++] = argv[i];
+    }
+    args[count] = NULL;
+    if (syntheticSize < 0 || latencyMs < 0 || bandwidth < 0)
+    {
+        fprintf(stderr, "Usage: %s <Port> [<Server1_IP> <Server1_Port>] [-n <root_name>] [-m <metrics_port>] [-l <latency_ms>] [-b <MB/s>] [-z <size>]\n", argv[0]);
+        exit(0);
+    }
+    // Map the file table and make the data every read is served from before forking so every child shares them
+    if (initNullStore() != 0)
+        exit(1);
+    syntheticData = malloc(MAX_FILE_SIZE);
+    if (!syntheticData)
+    {
+        fprintf(stderr, "Could not allocate the synthetic data\n");
+        exit(1);
+    }
+    // Pseudo-random bytes, so deflate on the wire gains nothing, as with the already compressed .pdf and .zip
+    unsigned long long x = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i + sizeof(x) <= MAX_FILE_SIZE; i += sizeof(x))
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(syntheticData + i, &x, sizeof(x));
+    }
+    PeerStorage nullStorage = {nullFileSize, nullReadFile, nullWriteFile, nullRemoveFile, nullRenameFile,
+                               nullListDir, nullScanTree, nullOpenTar};
+    peerStorage = nullStorage;
+    peerExt = commandExt;
+    peerTarName = commandTarName;
+    selectCommandRoot = selectNullCommand;
+    return s2Main(count, args);
+}
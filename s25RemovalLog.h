@@ -0,0 +1,152 @@
+// Log of removed files, shared by s1 and the storage servers. Each storage root keeps one REMOVED_LOG of
+// "<time> ./<path>" lines, the ./relative form of the tar members; incremental downltar reports the paths removed
+// since a token from it. Included by the servers after their own includes and defines (MAX_PATH, REMOVED_LOG).
+#ifndef S25_REMOVAL_LOG_H
+#define S25_REMOVAL_LOG_H
+
+// A removal log above this size is compacted by the removal that crosses it
+#define REMOVED_LOG_MAX_BYTES (1024 * 1024)
+
+// One entry of a removal log
+typedef struct
+{
+    long ts;
+    char *rel;
+} RemovalEntry;
+
+// qsort comparator: by path, and the newest removal of a path last
+static int cmpRemovalPath(const void *a, const void *b)
+{
+    const RemovalEntry *x = (const RemovalEntry *)a, *y = (const RemovalEntry *)b;
+    int c = strcmp(x->rel, y->rel);
+    return c ? c : (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+// qsort comparator: oldest removal first
+static int cmpRemovalTime(const void *a, const void *b)
+{
+    const RemovalEntry *x = (const RemovalEntry *)a, *y = (const RemovalEntry *)b;
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+// Helper function to compact a removal log in place, fd is open on it under an exclusive lock. Only the newest
+// removal of each path that is still gone is kept. If that is still over half the limit the oldest removals go
+// too, and a first line "<time> ./" records that removals before that time are no longer known.
+static void compactRemovalLog(int fd, const char *root)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= REMOVED_LOG_MAX_BYTES)
+        return;
+    char *text = (char *)malloc(st.st_size + 1);
+    // Every entry takes at least 5 bytes ("0 ./x")
+    RemovalEntry *list = (RemovalEntry *)malloc((st.st_size / 5 + 1) * sizeof(RemovalEntry));
+    char *out = (char *)malloc(st.st_size + 64);
+    if (!text || !list || !out || pread(fd, text, st.st_size, 0) != st.st_size)
+    {
+        free(text);
+        free(list);
+        free(out);
+        return;
+    }
+    text[st.st_size] = '\0';
+    long cutoff = 0;
+    int count = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    {
+        char *space = strchr(line, ' ');
+        if (!space || strncmp(space + 1, "./", 2) != 0)
+            continue;
+        *space = '\0';
+        long ts = atol(line);
+        if (space[3] == '\0')
+        {
+            if (ts > cutoff)
+                cutoff = ts;
+            continue;
+        }
+        list[count].ts = ts;
+        list[count].rel = space + 1;
+        count++;
+    }
+    qsort(list, count, sizeof(RemovalEntry), cmpRemovalPath);
+    int kept = 0;
+    long bytes = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (i + 1 < count && strcmp(list[i].rel, list[i + 1].rel) == 0)
+            continue;
+        char absPath[MAX_PATH * 2];
+        snprintf(absPath, sizeof(absPath), "%s/%s", root, list[i].rel + 2);
+        if (access(absPath, F_OK) == 0)
+            continue;
+        list[kept++] = list[i];
+        bytes += strlen(list[i].rel) + 22;
+    }
+    qsort(list, kept, sizeof(RemovalEntry), cmpRemovalTime);
+    int first = 0;
+    while (first < kept && bytes > REMOVED_LOG_MAX_BYTES / 2)
+    {
+        bytes -= strlen(list[first].rel) + 22;
+        cutoff = list[first].ts + 1;
+        first++;
+    }
+    long len = 0;
+    if (cutoff > 0)
+        len += sprintf(out + len, "%ld ./\n", cutoff);
+    for (int i = first; i < kept; i++)
+        len += sprintf(out + len, "%ld %s\n", list[i].ts, list[i].rel);
+    if (ftruncate(fd, 0) == 0)
+        write(fd, out, len);
+    free(text);
+    free(list);
+    free(out);
+}
+
+// Helper function to get the time before which the removals of a root are no longer known, 0 when all are
+long removalLogStart(const char *root)
+{
+    char logPath[MAX_PATH];
+    snprintf(logPath, sizeof(logPath), "%s/%s", root, REMOVED_LOG);
+    FILE *log = fopen(logPath, "r");
+    if (!log)
+        return 0;
+    long ts = 0;
+    char rel[8];
+    if (fscanf(log, "%ld %7s", &ts, rel) != 2 || strcmp(rel, "./") != 0)
+        ts = 0;
+    fclose(log);
+    return ts;
+}
+
+// Helper function to record a removed file so incremental downltar can report it
+void recordRemoval(const char *root, const char *absPath)
+{
+    size_t rootLen = strlen(root);
+    if (strncmp(absPath, root, rootLen) != 0)
+        return;
+    char logPath[MAX_PATH];
+    snprintf(logPath, sizeof(logPath), "%s/%s", root, REMOVED_LOG);
+    // Entries use the same ./relative form as the tar members
+    char line[MAX_PATH + 32];
+    int len = snprintf(line, sizeof(line), "%ld .%s\n", (long)time(NULL), absPath + rootLen);
+    int fd = open(logPath, O_CREAT | O_RDWR | O_APPEND, 0644);
+    if (fd < 0)
+        return;
+    // A single O_APPEND write keeps lines from concurrent children intact; appends share the lock, so none
+    // is lost while a compaction holds it alone
+    flock(fd, LOCK_SH);
+    write(fd, line, len);
+    struct stat st;
+    int full = fstat(fd, &st) == 0 && st.st_size > REMOVED_LOG_MAX_BYTES;
+    flock(fd, LOCK_UN);
+    if (full)
+    {
+        flock(fd, LOCK_EX);
+        compactRemovalLog(fd, root);
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+}
+
+#endif
@@ -0,0 +1,972 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+// Define constants
+#define MAX_BUFFER 2048
+#define MAX_PATH 512
+#define MAX_COMMAND_ARGS 5
+#define MAX_FILE_SIZE (50 * 1024 * 1024)
+#define MAX_SESSIONS 4096
+#define SESSION_STACK (256 * 1024)
+#define RECV_TIMEOUT_S 10
+#define START_DELAY_US 200000
+
+// Workload trace written by s1 -w
+#define WORKLOAD_MAGIC "S1WL"
+#define WORKLOAD_VERSION 1
+#define WORKLOAD_HEADER 8
+#define WORKLOAD_RECORD_FIXED 32
+
+// Framed (compressed) tar streams, as in s25Client
+#define TAR_STREAMED 0xFFFFFFFFu
+
+// Latency histograms: 8 log-linear buckets per power of two microseconds, as in the servers' stats
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS 312
+
+// Commands that are replayed, the rest of the trace (features, trace) is skipped
+enum
+{
+    OP_UPLOADF,
+    OP_DOWNLF,
+    OP_REMOVEF,
+    OP_DOWNLTAR,
+    OP_DISPFNAMES,
+    OP_STATS,
+    OP_COUNT
+};
+
+const char *opNames[OP_COUNT] = {"uploadf", "downlf", "removef", "downltar", "dispfnames", "stats"};
+
+// Latency histogram of one command. misses are replies without data (a missing file, an error message):
+// they are timed like the rest, while errors are broken or missing replies and are not
+typedef struct
+{
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long errors;
+    unsigned long misses;
+    unsigned long sumUs;
+    unsigned long maxUs;
+} OpStats;
+
+// One command of the trace; sizes[i] is the file size recorded for args[i], -1 when no file moved
+typedef struct
+{
+    unsigned int conn;
+    unsigned int seq;
+    long long startUs;
+    unsigned long durUs;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    int argCount;
+    char *args[MAX_COMMAND_ARGS];
+    int sizes[MAX_COMMAND_ARGS];
+} TraceRecord;
+
+// One recorded client connection, replayed in order on its own connection by its own thread
+typedef struct
+{
+    int first;
+    int count;
+    int cap;
+    int *records;
+    unsigned int conn;
+    unsigned int lastSeq;
+    int sd;
+    pthread_t thread;
+    unsigned long skipped;
+    OpStats ops[OP_COUNT];
+} Session;
+
+// Replay settings, see usage()
+typedef struct
+{
+    char trace[MAX_PATH];
+    char s1Ip[64];
+    int port;
+    double speed;
+    int seed;
+    int dump;
+    char prefix[64];
+    char output[MAX_PATH];
+    char baseline[MAX_PATH];
+} ReplayConfig;
+
+ReplayConfig config;
+volatile int stopping = 0;
+
+TraceRecord *records = NULL;
+int recordCount = 0;
+Session *sessions = NULL;
+int sessionCount = 0;
+
+// Synthetic file data, every upload sends a prefix of it
+char *payload = NULL;
+
+// Monotonic time the replay started at, the trace's first command is issued then
+unsigned long long replayStartUs = 0;
+
+// Helper function to print the options
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -t <trace> [options]\n", prog);
+    fprintf(stderr, "  -t <file>       workload trace written by s1 -w\n");
+    fprintf(stderr, "  -e <ip:port>    S1 of the test cluster (default 127.0.0.1:9600)\n");
+    fprintf(stderr, "  -x <speed>      replay speed, 1 as recorded, 2 twice as fast, 0 without waits (default 1)\n");
+    fprintf(stderr, "  -p <dir>        replay the ~S1 paths under ~S1/<dir>\n");
+    fprintf(stderr, "  -k              do not upload the files the trace reads before it writes them\n");
+    fprintf(stderr, "  -d              print the trace and exit\n");
+    fprintf(stderr, "  -o <file>       results as JSON (default replay_output.txt)\n");
+    fprintf(stderr, "  -c <file>       compare with the JSON of an earlier replay\n");
+    exit(1);
+}
+
+// Clock, histogram and protocol helpers shared with the other tool
+#include "s25ToolHelpers.h"
+
+// Helper function to add one timed command
+static void recordOp(OpStats *stats, unsigned long us, int ok)
+{
+    if (!ok)
+    {
+        stats->errors++;
+        return;
+    }
+    stats->buckets[latencyBucket(us)]++;
+    stats->count++;
+    stats->sumUs += us;
+    if (us > stats->maxUs)
+        stats->maxUs = us;
+}
+
+// Helper function to map a command name to its slot, -1 for commands that are not replayed
+static int opIndex(const char *command)
+{
+    for (int op = 0; op < OP_COUNT; op++)
+        if (strcmp(command, opNames[op]) == 0)
+            return op;
+    return -1;
+}
+
+// --- Trace ---
+
+// Helper function to read a big-endian integer of bytes bytes
+static unsigned long long getBe(const unsigned char *p, int bytes)
+{
+    unsigned long long v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// Helper function to order records by start time, then by their place on the connection
+static int cmpRecord(const void *a, const void *b)
+{
+    const TraceRecord *ra = (const TraceRecord *)a;
+    const TraceRecord *rb = (const TraceRecord *)b;
+    if (ra->startUs != rb->startUs)
+        return ra->startUs < rb->startUs ? -1 : 1;
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+// Load the trace, records are appended as commands finish so they are sorted by start time here.
+// A record cut short at the end of the file (s1 stopped while writing it) ends the trace.
+static int loadTrace(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    unsigned char *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    long long got = 0;
+    while (data && got < st.st_size)
+    {
+        ssize_t n = read(fd, data + got, st.st_size - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    if (!data || got < WORKLOAD_HEADER || memcmp(data, WORKLOAD_MAGIC, 4) != 0 ||
+        getBe(data + 4, 4) != WORKLOAD_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a workload trace\n", path);
+        free(data);
+        return -1;
+    }
+    int cap = 0;
+    long long off = WORKLOAD_HEADER;
+    while (off + WORKLOAD_RECORD_FIXED <= got)
+    {
+        const unsigned char *p = data + off;
+        int len = (int)getBe(p, 2);
+        if (len < WORKLOAD_RECORD_FIXED || off + len > got)
+            break;
+        if (recordCount == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            TraceRecord *tmp = realloc(records, cap * sizeof(TraceRecord));
+            if (!tmp)
+                break;
+            records = tmp;
+        }
+        TraceRecord *r = &records[recordCount];
+        memset(r, 0, sizeof(*r));
+        r->argCount = p[2] < MAX_COMMAND_ARGS ? p[2] : MAX_COMMAND_ARGS;
+        r->conn = (unsigned int)getBe(p + 4, 4);
+        r->seq = (unsigned int)getBe(p + 8, 4);
+        r->startUs = (long long)getBe(p + 12, 8);
+        r->durUs = (unsigned long)getBe(p + 20, 4);
+        r->bytesIn = (unsigned long)getBe(p + 24, 4);
+        r->bytesOut = (unsigned long)getBe(p + 28, 4);
+        const unsigned char *arg = p + WORKLOAD_RECORD_FIXED;
+        int ok = r->argCount > 0;
+        for (int i = 0; i < r->argCount && ok; i++)
+        {
+            if (arg + 6 > p + len || arg + 6 + getBe(arg + 4, 2) > p + len)
+            {
+                ok = 0;
+                break;
+            }
+            int argLen = (int)getBe(arg + 4, 2);
+            r->sizes[i] = (int)(unsigned int)getBe(arg, 4);
+            r->args[i] = strndup((const char *)arg + 6, argLen);
+            arg += 6 + argLen;
+        }
+        off += len;
+        if (ok)
+            recordCount++;
+    }
+    free(data);
+    if (recordCount == 0)
+    {
+        fprintf(stderr, "Error: %s has no commands\n", path);
+        return -1;
+    }
+    qsort(records, recordCount, sizeof(TraceRecord), cmpRecord);
+    return 0;
+}
+
+// Helper function to add a record to a session
+static int sessionAdd(Session *session, int record)
+{
+    if (session->count == session->cap)
+    {
+        session->cap = session->cap ? session->cap * 2 : 16;
+        int *tmp = realloc(session->records, session->cap * sizeof(int));
+        if (!tmp)
+            return -1;
+        session->records = tmp;
+    }
+    session->records[session->count++] = record;
+    session->lastSeq = records[record].seq;
+    return 0;
+}
+
+// Split the trace into its connections. A child's pid names its connection, a later connection served by
+// a reused pid is told apart by its command numbers starting again from 0.
+static int buildSessions()
+{
+    sessions = calloc(MAX_SESSIONS, sizeof(Session));
+    if (!sessions)
+        return -1;
+    for (int i = 0; i < recordCount; i++)
+    {
+        const TraceRecord *r = &records[i];
+        Session *session = NULL;
+        for (int s = sessionCount - 1; s >= 0; s--)
+        {
+            if (sessions[s].conn == r->conn)
+            {
+                if (r->seq > sessions[s].lastSeq)
+                    session = &sessions[s];
+                break;
+            }
+        }
+        if (!session)
+        {
+            if (sessionCount == MAX_SESSIONS)
+            {
+                fprintf(stderr, "Error: the trace has more than %d connections\n", MAX_SESSIONS);
+                return -1;
+            }
+            session = &sessions[sessionCount++];
+            session->conn = r->conn;
+            session->first = i;
+            session->sd = -1;
+        }
+        if (sessionAdd(session, i) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Print the trace as text, one command per line
+static void dumpTrace()
+{
+    long long t0 = records[0].startUs;
+    for (int i = 0; i < recordCount; i++)
+    {
+        const TraceRecord *r = &records[i];
+        printf("+%10.3f s  conn %-7u #%-4u %9.3f ms  in %-9lu out %-9lu ", (r->startUs - t0) / 1e6, r->conn, r->seq,
+               r->durUs / 1000.0, r->bytesIn, r->bytesOut);
+        for (int a = 0; a < r->argCount; a++)
+        {
+            printf(" %s", r->args[a]);
+            if (r->sizes[a] >= 0)
+                printf("(%d)", r->sizes[a]);
+        }
+        printf("\n");
+    }
+}
+
+// --- Protocol ---
+
+// Helper function to move a ~S1 path under the replay directory (-p)
+static void rebasePath(const char *path, char *out, size_t outLen)
+{
+    if (config.prefix[0] && strncmp(path, "~S1", 3) == 0 && (path[3] == '/' || path[3] == '\0'))
+        snprintf(out, outLen, "~S1/%s%s", config.prefix, path + 3);
+    else
+        snprintf(out, outLen, "%s", path);
+}
+
+// Helper function to rebuild the command line of a record with its paths rebased
+static void commandLine(const TraceRecord *r, char *out, size_t outLen)
+{
+    int op = opIndex(r->args[0]);
+    int len = snprintf(out, outLen, "%s", r->args[0]);
+    for (int i = 1; i < r->argCount && len < (int)outLen; i++)
+    {
+        // uploadf names local files and then its destination, downltar has no paths
+        int isPath = op == OP_DOWNLF || op == OP_REMOVEF || op == OP_DISPFNAMES ||
+                     (op == OP_UPLOADF && i == r->argCount - 1);
+        char path[MAX_PATH];
+        if (isPath)
+            rebasePath(r->args[i], path, sizeof(path));
+        else
+            snprintf(path, sizeof(path), "%s", r->args[i]);
+        len += snprintf(out + len, outLen - len, " %s", path);
+    }
+}
+
+// Upload the recorded files with synthetic data of their sizes, returns 0 or -1; *missed counts rejected files
+static int doUploadf(int sd, const TraceRecord *r, int *missed)
+{
+    char command[MAX_BUFFER];
+    commandLine(r, command, sizeof(command));
+    if (write(sd, command, strlen(command)) <= 0)
+        return -1;
+    // Spaced like the servers space their messages, so the size is not read as part of the command
+    usleep(10000);
+    for (int i = 1; i < r->argCount - 1; i++)
+    {
+        int size = r->sizes[i];
+        if (write(sd, &size, sizeof(int)) != sizeof(int) || sendDataInChunks(sd, payload, size) != size)
+            return -1;
+    }
+    for (int i = 1; i < r->argCount - 1; i++)
+    {
+        char response[MAX_BUFFER];
+        if (readMessage(sd, response, sizeof(response)) < 0)
+            return -1;
+        if (strstr(response, "successfully") == NULL)
+            (*missed)++;
+    }
+    return 0;
+}
+
+// Download the recorded files, a file that does not exist is a miss
+static int doDownlf(int sd, const TraceRecord *r, int *missed)
+{
+    char command[MAX_BUFFER];
+    commandLine(r, command, sizeof(command));
+    if (write(sd, command, strlen(command)) <= 0)
+        return -1;
+    for (int i = 1; i < r->argCount; i++)
+    {
+        char status[MAX_BUFFER];
+        if (readMessage(sd, status, sizeof(status)) < 0)
+            return -1;
+        if (strncmp(status, "Success", 7) != 0)
+        {
+            (*missed)++;
+            continue;
+        }
+        const char *slash = strrchr(r->args[i], '/');
+        uint32_t size;
+        if (readName(sd, slash ? slash + 1 : r->args[i]) < 0 || readSize(sd, &size) < 0 || size > MAX_FILE_SIZE ||
+            receiveDataInChunks(sd, NULL, (int)size) != (int)size)
+            return -1;
+    }
+    return 0;
+}
+
+// Remove the recorded files, a file that does not exist is a miss
+static int doRemovef(int sd, const TraceRecord *r, int *missed)
+{
+    char command[MAX_BUFFER];
+    commandLine(r, command, sizeof(command));
+    if (write(sd, command, strlen(command)) <= 0)
+        return -1;
+    for (int i = 1; i < r->argCount; i++)
+    {
+        char response[MAX_BUFFER];
+        if (readMessage(sd, response, sizeof(response)) < 0)
+            return -1;
+        if (strstr(response, "successfully") == NULL)
+            (*missed)++;
+    }
+    return 0;
+}
+
+// Download a tar as recorded, with its since token and compression
+static int doDownltar(int sd, const TraceRecord *r, int *missed)
+{
+    char command[MAX_BUFFER], tarName[64];
+    commandLine(r, command, sizeof(command));
+    if (write(sd, command, strlen(command)) <= 0)
+        return -1;
+    if (strcmp(r->args[1], "all") == 0)
+        snprintf(tarName, sizeof(tarName), "all.tar");
+    else
+        tarNameForExt(r->args[1], tarName, sizeof(tarName));
+    for (int i = 2; i < r->argCount; i++)
+        if (strncmp(r->args[i], "gz", 2) == 0)
+            strcat(tarName, ".gz");
+    char status[MAX_BUFFER];
+    if (readMessage(sd, status, sizeof(status)) < 0)
+        return -1;
+    if (strncmp(status, "Success", 7) != 0)
+    {
+        (*missed)++;
+        return 0;
+    }
+    uint32_t size;
+    if (readName(sd, tarName) < 0 || readSize(sd, &size) < 0)
+        return -1;
+    if (size != TAR_STREAMED)
+        return size <= MAX_FILE_SIZE && receiveDataInChunks(sd, NULL, (int)size) == (int)size ? 0 : -1;
+    for (;;)
+    {
+        uint32_t frame;
+        if (readSize(sd, &frame) < 0 || frame > MAX_FILE_SIZE)
+            return -1;
+        if (frame == 0)
+            return 0;
+        if (receiveDataInChunks(sd, NULL, (int)frame) != (int)frame)
+            return -1;
+    }
+}
+
+// Commands answered with a status, then a size-prefixed blob: dispfnames and stats
+static int doBlobCommand(int sd, const TraceRecord *r, int *missed)
+{
+    char command[MAX_BUFFER];
+    commandLine(r, command, sizeof(command));
+    if (write(sd, command, strlen(command)) <= 0)
+        return -1;
+    char status[MAX_BUFFER];
+    if (readMessage(sd, status, sizeof(status)) < 0)
+        return -1;
+    if (strstr(status, "Error") != NULL)
+    {
+        (*missed)++;
+        return 0;
+    }
+    uint32_t size;
+    if (readSize(sd, &size) < 0 || size > MAX_FILE_SIZE)
+        return -1;
+    return receiveDataInChunks(sd, NULL, (int)size) == (int)size ? 0 : -1;
+}
+
+// Helper function to tell whether a record can be replayed: a known command whose uploads all have sizes
+static int replayable(const TraceRecord *r)
+{
+    int op = opIndex(r->args[0]);
+    if (op < 0 || (op == OP_DOWNLTAR && r->argCount < 2))
+        return 0;
+    if (op == OP_UPLOADF)
+    {
+        if (r->argCount < 3)
+            return 0;
+        for (int i = 1; i < r->argCount - 1; i++)
+            if (r->sizes[i] <= 0 || r->sizes[i] > MAX_FILE_SIZE)
+                return 0;
+    }
+    return 1;
+}
+
+// Issue one record, returns 0 when the reply was read in full or -1 when the connection is out of step
+static int replayRecord(int sd, const TraceRecord *r, int *missed)
+{
+    switch (opIndex(r->args[0]))
+    {
+    case OP_UPLOADF:
+        return doUploadf(sd, r, missed);
+    case OP_DOWNLF:
+        return doDownlf(sd, r, missed);
+    case OP_REMOVEF:
+        return doRemovef(sd, r, missed);
+    case OP_DOWNLTAR:
+        return doDownltar(sd, r, missed);
+    default:
+        return doBlobCommand(sd, r, missed);
+    }
+}
+
+// --- Replay ---
+
+// Helper function to wait until a record is due, its offset in the trace divided by the speed
+static void waitForRecord(const TraceRecord *r)
+{
+    if (config.speed <= 0)
+        return;
+    unsigned long long due = replayStartUs + (unsigned long long)((r->startUs - records[0].startUs) / config.speed);
+    while (!stopping)
+    {
+        unsigned long long now = nowUs();
+        if (now >= due)
+            return;
+        unsigned long long wait = due - now;
+        usleep(wait > 100000 ? 100000 : wait);
+    }
+}
+
+// Session thread: replay a recorded connection's commands in order, each at its time
+static void *sessionMain(void *arg)
+{
+    Session *session = (Session *)arg;
+    for (int i = 0; i < session->count && !stopping; i++)
+    {
+        const TraceRecord *r = &records[session->records[i]];
+        if (!replayable(r))
+        {
+            session->skipped++;
+            continue;
+        }
+        waitForRecord(r);
+        if (stopping)
+            break;
+        int op = opIndex(r->args[0]);
+        if (session->sd < 0)
+            session->sd = connectToServer(config.s1Ip, config.port);
+        unsigned long long started = nowUs();
+        int missed = 0;
+        int ok = session->sd >= 0 && replayRecord(session->sd, r, &missed) == 0;
+        recordOp(&session->ops[op], (unsigned long)(nowUs() - started), ok);
+        session->ops[op].misses += missed;
+        // A broken connection is replaced, the protocol cannot resync after a failed transfer
+        if (!ok && session->sd >= 0)
+        {
+            close(session->sd);
+            session->sd = -1;
+        }
+    }
+    if (session->sd >= 0)
+        close(session->sd);
+    return NULL;
+}
+
+// Paths the trace has written so far, an open addressed set of strings
+typedef struct
+{
+    int cap;
+    char **slots;
+} PathSet;
+
+// Helper function to hash a path, 64-bit FNV-1a
+static unsigned long long hashPath(const char *path)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    for (const char *p = path; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Helper function to add a path to the set, returns 1 if it was not there yet
+static int pathSetAdd(PathSet *set, const char *path)
+{
+    unsigned long long h = hashPath(path);
+    for (int probe = 0; probe < set->cap; probe++)
+    {
+        char **slot = &set->slots[(h + probe) & (set->cap - 1)];
+        if (*slot == NULL)
+        {
+            *slot = strdup(path);
+            return 1;
+        }
+        if (strcmp(*slot, path) == 0)
+            return 0;
+    }
+    return 0;
+}
+
+// Upload the files the trace reads before (or without) writing them, with their recorded sizes, so the
+// replay does not meet misses where the recorded run found files. Returns how many were uploaded.
+static int seedFiles()
+{
+    PathSet written;
+    written.cap = 16;
+    while (written.cap < 2 * recordCount * MAX_COMMAND_ARGS)
+        written.cap *= 2;
+    written.slots = calloc(written.cap, sizeof(char *));
+    int sd = written.slots ? connectToServer(config.s1Ip, config.port) : -1;
+    int seeded = 0;
+    for (int i = 0; i < recordCount && sd >= 0; i++)
+    {
+        const TraceRecord *r = &records[i];
+        char path[MAX_PATH];
+        if (strcmp(r->args[0], "uploadf") == 0)
+        {
+            for (int a = 1; a < r->argCount - 1; a++)
+            {
+                snprintf(path, sizeof(path), "%s/%s", r->args[r->argCount - 1], r->args[a]);
+                pathSetAdd(&written, path);
+            }
+            continue;
+        }
+        if (strcmp(r->args[0], "downlf") != 0)
+            continue;
+        for (int a = 1; a < r->argCount && sd >= 0; a++)
+        {
+            const char *slash = strrchr(r->args[a], '/');
+            if (!slash || r->sizes[a] <= 0 || r->sizes[a] > MAX_FILE_SIZE || !pathSetAdd(&written, r->args[a]))
+                continue;
+            // Uploaded as a one file uploadf record into its directory
+            TraceRecord upload;
+            memset(&upload, 0, sizeof(upload));
+            char dir[MAX_PATH];
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - r->args[a]), r->args[a]);
+            upload.argCount = 3;
+            upload.args[0] = "uploadf";
+            upload.args[1] = (char *)(slash + 1);
+            upload.args[2] = dir;
+            upload.sizes[1] = r->sizes[a];
+            int missed = 0;
+            if (doUploadf(sd, &upload, &missed) != 0)
+            {
+                close(sd);
+                sd = -1;
+                seeded = -1;
+                break;
+            }
+            seeded += missed == 0;
+        }
+    }
+    if (sd >= 0)
+        close(sd);
+    if (written.slots)
+    {
+        for (int i = 0; i < written.cap; i++)
+            free(written.slots[i]);
+        free(written.slots);
+    }
+    return written.slots && seeded >= 0 ? seeded : -1;
+}
+
+// Helper function to handle Ctrl-C: stop issuing commands and report what was replayed
+static void handleInterrupt(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+// --- Results ---
+
+// Helper function to merge the sessions' histograms of one command
+static void mergeOp(int op, OpStats *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (int s = 0; s < sessionCount; s++)
+    {
+        const OpStats *from = &sessions[s].ops[op];
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            out->buckets[b] += from->buckets[b];
+        out->count += from->count;
+        out->errors += from->errors;
+        out->misses += from->misses;
+        out->sumUs += from->sumUs;
+        if (from->maxUs > out->maxUs)
+            out->maxUs = from->maxUs;
+    }
+}
+
+// Helper function to build the histogram of the recorded latencies of one command
+static void recordedOp(int op, OpStats *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < recordCount; i++)
+        if (replayable(&records[i]) && opIndex(records[i].args[0]) == op)
+            recordOp(out, records[i].durUs, 1);
+}
+
+// Write the results as JSON, one command per line with its histogram so a later replay can compare
+// whole distributions (compareBaseline)
+static void writeResults(FILE *out, double elapsed)
+{
+    unsigned long skipped = 0;
+    for (int s = 0; s < sessionCount; s++)
+        skipped += sessions[s].skipped;
+    fprintf(out, "{\n  \"trace\": \"%s\",\n  \"speed\": %.2f,\n  \"connections\": %d,\n  \"records\": %d,\n"
+                 "  \"skipped\": %lu,\n  \"elapsed_s\": %.3f,\n  \"commands\": [\n",
+            config.trace, config.speed, sessionCount, recordCount, skipped, elapsed);
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        OpStats now, recorded;
+        mergeOp(op, &now);
+        recordedOp(op, &recorded);
+        fprintf(out, "    {\"command\": \"%s\", \"count\": %lu, \"errors\": %lu, \"misses\": %lu, \"mean_ms\": %.3f, "
+                     "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+                     "\"recorded_p50_ms\": %.3f, \"recorded_p99_ms\": %.3f, \"buckets\": [",
+                opNames[op], now.count, now.errors, now.misses, now.count ? now.sumUs / (double)now.count / 1000.0 : 0.0,
+                latencyPercentile(&now, 50) / 1000.0, latencyPercentile(&now, 90) / 1000.0,
+                latencyPercentile(&now, 99) / 1000.0, now.maxUs / 1000.0, latencyPercentile(&recorded, 50) / 1000.0,
+                latencyPercentile(&recorded, 99) / 1000.0);
+        int first = 1;
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            if (now.buckets[b] == 0)
+                continue;
+            fprintf(out, "%s[%d, %lu]", first ? "" : ", ", b, now.buckets[b]);
+            first = 0;
+        }
+        fprintf(out, "]}%s\n", op + 1 < OP_COUNT ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// Helper function to print the replayed latencies next to the recorded ones
+static void printSummary()
+{
+    printf("\n%-12s %8s %7s %7s %12s %12s %12s %12s\n", "command", "count", "errors", "misses", "rec p50 ms",
+           "p50 ms", "rec p99 ms", "p99 ms");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        OpStats now, recorded;
+        mergeOp(op, &now);
+        recordedOp(op, &recorded);
+        if (now.count + now.errors == 0)
+            continue;
+        printf("%-12s %8lu %7lu %7lu %12.3f %12.3f %12.3f %12.3f\n", opNames[op], now.count, now.errors, now.misses,
+               latencyPercentile(&recorded, 50) / 1000.0, latencyPercentile(&now, 50) / 1000.0,
+               latencyPercentile(&recorded, 99) / 1000.0, latencyPercentile(&now, 99) / 1000.0);
+    }
+}
+
+// Compare with an earlier replay of the same trace. The two latency distributions of a command are tested
+// with the two-sample Kolmogorov-Smirnov statistic over the histogram buckets; they only count as faster or
+// slower when the largest gap between the two CDFs is beyond the 5% critical value, anything else is noise
+static int compareBaseline(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in)
+    {
+        fprintf(stderr, "Error: cannot read %s\n", path);
+        return -1;
+    }
+    printf("\n%-12s %12s %12s %12s %12s %7s %9s\n", "command", "base p50 ms", "p50 ms", "base p99 ms", "p99 ms",
+           "ks D", "change");
+    static char line[65536];
+    while (fgets(line, sizeof(line), in))
+    {
+        char name[32];
+        const char *at = strstr(line, "\"command\": \"");
+        if (!at || sscanf(at, "\"command\": \"%31[^\"]\"", name) != 1 || opIndex(name) < 0)
+            continue;
+        const char *bucketsAt = strstr(line, "\"buckets\": [");
+        if (!bucketsAt)
+            continue;
+        OpStats base;
+        memset(&base, 0, sizeof(base));
+        const char *p = bucketsAt + 12;
+        int b;
+        unsigned long c;
+        int n;
+        while (sscanf(p, " [%d, %lu]%n", &b, &c, &n) == 2)
+        {
+            if (b >= 0 && b < STATS_BUCKETS)
+            {
+                base.buckets[b] += c;
+                base.count += c;
+                base.maxUs = latencyBucketFloor(b + 1 < STATS_BUCKETS ? b + 1 : b);
+            }
+            p += n;
+            if (*p == ',')
+                p++;
+        }
+        OpStats now;
+        mergeOp(opIndex(name), &now);
+        if (base.count == 0 || now.count == 0)
+            continue;
+        double d = 0;
+        unsigned long seenBase = 0, seenNow = 0;
+        for (int k = 0; k < STATS_BUCKETS; k++)
+        {
+            seenBase += base.buckets[k];
+            seenNow += now.buckets[k];
+            double gap = fabs((double)seenBase / base.count - (double)seenNow / now.count);
+            d = gap > d ? gap : d;
+        }
+        double critical = 1.358 * sqrt((double)(base.count + now.count) / ((double)base.count * now.count));
+        double p50Base = latencyPercentile(&base, 50) / 1000.0, p50Now = latencyPercentile(&now, 50) / 1000.0;
+        const char *verdict = d <= critical ? "same" : p50Now < p50Base ? "faster" : "slower";
+        printf("%-12s %12.3f %12.3f %12.3f %12.3f %7.3f %+8.1f%%  %s\n", name, p50Base, p50Now,
+               latencyPercentile(&base, 99) / 1000.0, latencyPercentile(&now, 99) / 1000.0, d,
+               p50Base > 0 ? 100.0 * (p50Now - p50Base) / p50Base : 0.0, verdict);
+    }
+    fclose(in);
+    return 0;
+}
+
+// Main function
+int main(int argc, char *argv[])
+{
+    // Defaults
+    snprintf(config.s1Ip, sizeof(config.s1Ip), "127.0.0.1");
+    snprintf(config.output, sizeof(config.output), "replay_output.txt");
+    config.port = 9600;
+    config.speed = 1;
+    config.seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:e:x:p:kdo:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            snprintf(config.trace, sizeof(config.trace), "%s", optarg);
+            break;
+        case 'e':
+        {
+            char *colon = strrchr(optarg, ':');
+            if (!colon)
+                usage(argv[0]);
+            *colon = '\0';
+            snprintf(config.s1Ip, sizeof(config.s1Ip), "%s", optarg);
+            config.port = atoi(colon + 1);
+            break;
+        }
+        case 'x':
+            config.speed = atof(optarg);
+            break;
+        case 'p':
+            snprintf(config.prefix, sizeof(config.prefix), "%s", optarg);
+            break;
+        case 'k':
+            config.seed = 0;
+            break;
+        case 'd':
+            config.dump = 1;
+            break;
+        case 'o':
+            snprintf(config.output, sizeof(config.output), "%s", optarg);
+            break;
+        case 'c':
+            snprintf(config.baseline, sizeof(config.baseline), "%s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!config.trace[0] || config.speed < 0 || config.port <= 0)
+        usage(argv[0]);
+    if (loadTrace(config.trace) != 0)
+        return 1;
+    if (config.dump)
+    {
+        dumpTrace();
+        return 0;
+    }
+    if (buildSessions() != 0)
+        return 1;
+
+    // Text-like data, so the servers' compression sees what real uploads look like
+    payload = malloc(MAX_FILE_SIZE);
+    if (!payload)
+        return 1;
+    unsigned int seed = 1;
+    for (int i = 0; i < MAX_FILE_SIZE; i++)
+        payload[i] = "abcdefghij klmnopqrstuvwxyz\n0123456789"[rand_r(&seed) % 38];
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleInterrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (config.seed)
+    {
+        int seeded = seedFiles();
+        if (seeded < 0)
+        {
+            fprintf(stderr, "Error: cannot seed files on %s:%d\n", config.s1Ip, config.port);
+            return 1;
+        }
+        printf("Seeded %d files\n", seeded);
+    }
+
+    // Every connection waits in its own thread for its first command
+    printf("Replaying %d commands on %d connections at %s\n", recordCount, sessionCount,
+           config.speed > 0 ? "the recorded pace" : "full speed");
+    if (config.speed > 0 && config.speed != 1)
+        printf("Speed %.2fx\n", config.speed);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SESSION_STACK);
+    replayStartUs = nowUs() + START_DELAY_US;
+    int started = 0;
+    for (int s = 0; s < sessionCount; s++)
+    {
+        if (pthread_create(&sessions[s].thread, &attr, sessionMain, &sessions[s]) != 0)
+        {
+            fprintf(stderr, "Error: cannot start connection %d of %d\n", s + 1, sessionCount);
+            stopping = 1;
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    for (int s = 0; s < started; s++)
+        pthread_join(sessions[s].thread, NULL);
+    unsigned long long finished = nowUs();
+    double elapsed = finished > replayStartUs ? (finished - replayStartUs) / 1e6 : 0.0;
+
+    printSummary();
+    FILE *out = fopen(config.output, "w");
+    if (out)
+    {
+        writeResults(out, elapsed);
+        fclose(out);
+    }
+    else
+    {
+        perror(config.output);
+    }
+    if (config.baseline[0] && compareBaseline(config.baseline) != 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Request statistics shared by s1 and the storage servers: the shared counters, log-linear latency histograms,
+// the Prometheus text helpers and the metrics process. Included by the servers after their own includes and
+// defines (STATS_PREFIX, STATS_SUB_BITS, STATS_BUCKETS, STATS_COMMANDS, METRICS_TIMEOUT_SEC, MAX_BUFFER), the
+// LatencyHist and ServerStats types, serverStats, statsCommandNames, metricsPort, metricsPid and
+// sendDataInChunks; the server defines renderStats.
+#ifndef S25_STATS_H
+#define S25_STATS_H
+
+// Render the server's counters in the Prometheus text format, returns a malloc'ed buffer
+static char *renderStats(int *outLen);
+
+// Helper function to map the request statistics shared by the children, nothing is recorded if it fails
+void initServerStats()
+{
+    void *mem = mmap(NULL, sizeof(ServerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap server stats");
+        return;
+    }
+    memset(mem, 0, sizeof(ServerStats));
+    serverStats = (ServerStats *)mem;
+    serverStats->startedAt = (long)time(NULL);
+}
+
+// Helper function to map microseconds to a histogram bucket: exact below 8, then 8 per power of two
+static int latencyBucket(unsigned long us)
+{
+    if (us < (1UL << STATS_SUB_BITS))
+        return (int)us;
+    int e = 63 - __builtin_clzl(us);
+    int bucket = (1 << STATS_SUB_BITS) + ((e - STATS_SUB_BITS) << STATS_SUB_BITS) +
+                 (int)((us >> (e - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Helper function to get the smallest value of a bucket
+static unsigned long latencyBucketFloor(int bucket)
+{
+    if (bucket < (1 << STATS_SUB_BITS))
+        return (unsigned long)bucket;
+    int e = ((bucket - (1 << STATS_SUB_BITS)) >> STATS_SUB_BITS) + STATS_SUB_BITS;
+    unsigned long sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+    return ((1UL << STATS_SUB_BITS) + sub) << (e - STATS_SUB_BITS);
+}
+
+// Helper function to add one sample, a few relaxed atomic adds
+static void recordLatency(LatencyHist *hist, unsigned long us)
+{
+    __atomic_add_fetch(&hist->buckets[latencyBucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sumUs, us, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&hist->maxUs, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&hist->maxUs, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Helper function to read a percentile, the upper end of the bucket it falls in (within 12.5%)
+static unsigned long latencyPercentile(const LatencyHist *hist, double pct)
+{
+    unsigned long count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if (count == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(count * pct / 100.0);
+    if (rank >= count)
+        rank = count - 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        if (seen > rank)
+        {
+            unsigned long top = b + 1 < STATS_BUCKETS ? latencyBucketFloor(b + 1) - 1 : latencyBucketFloor(b);
+            unsigned long max = __atomic_load_n(&hist->maxUs, __ATOMIC_RELAXED);
+            return top < max ? top : max;
+        }
+    }
+    return __atomic_load_n(&hist->maxUs, __ATOMIC_RELAXED);
+}
+
+// Helper function to map a command name to its statistics slot
+static int statsCommandIndex(const char *command)
+{
+    for (int i = 0; i < STATS_COMMANDS - 1; i++)
+        if (strcmp(command, statsCommandNames[i]) == 0)
+            return i;
+    return STATS_COMMANDS - 1;
+}
+
+// Helper function to read how many bytes the process has read from and written to a TCP socket so far,
+// from the kernel's counters less what still waits in the socket queues
+static void socketByteCounts(int sd, unsigned long long *in, unsigned long long *out)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    *in = 0;
+    *out = 0;
+    if (getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+        return;
+    int unread = 0, unacked = 0;
+    ioctl(sd, SIOCINQ, &unread);
+    ioctl(sd, SIOCOUTQ, &unacked);
+    *in = info.tcpi_bytes_received - (unsigned long long)unread;
+    *out = info.tcpi_bytes_acked + (unsigned long long)unacked;
+}
+
+// Helper function to append formatted text to a growing buffer
+static void appendText(char **buf, int *len, int *cap, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int need = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (need < 0 || *cap < 0)
+        return;
+    if (*len + need + 1 > *cap)
+    {
+        int grown = *cap ? *cap : 4096;
+        while (*len + need + 1 > grown)
+            grown *= 2;
+        char *tmp = (char *)realloc(*buf, grown);
+        if (!tmp)
+        {
+            // Stop appending, the text so far is still returned
+            *cap = -1;
+            return;
+        }
+        *buf = tmp;
+        *cap = grown;
+    }
+    va_start(ap, fmt);
+    vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+    va_end(ap);
+    *len += need;
+}
+
+// Helper function to append a latency histogram as a Prometheus summary
+static void appendSummary(char **buf, int *len, int *cap, const char *name, const char *labels, const LatencyHist *hist)
+{
+    static const double quantiles[] = {50, 90, 99, 99.9};
+    for (int q = 0; q < 4; q++)
+        appendText(buf, len, cap, "%s_%s{%s,quantile=\"%g\"} %.6f\n", STATS_PREFIX, name, labels, quantiles[q] / 100,
+                   latencyPercentile(hist, quantiles[q]) / 1e6);
+    appendText(buf, len, cap, "%s_%s_sum{%s} %.6f\n", STATS_PREFIX, name, labels,
+               __atomic_load_n(&hist->sumUs, __ATOMIC_RELAXED) / 1e6);
+    appendText(buf, len, cap, "%s_%s_count{%s} %lu\n", STATS_PREFIX, name, labels,
+               __atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+}
+
+// Metrics process: answer every HTTP request on 127.0.0.1:metricsPort with the current counters
+static void runMetricsServer()
+{
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)metricsPort);
+    if (sd < 0 || bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sd, 5) != 0)
+    {
+        perror("metrics port");
+        return;
+    }
+    for (;;)
+    {
+        int con = accept(sd, NULL, NULL);
+        if (con < 0)
+            continue;
+        // Connections are served one at a time, so a scraper that stalls is dropped after the timeout
+        struct timeval timeout = {METRICS_TIMEOUT_SEC, 0};
+        setsockopt(con, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(con, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        // The request line and headers are not needed, every path gets the metrics
+        char request[MAX_BUFFER];
+        if (read(con, request, sizeof(request)) <= 0)
+        {
+            close(con);
+            continue;
+        }
+        int len = 0;
+        char *text = renderStats(&len);
+        char header[256];
+        int hlen = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", len);
+        write(con, header, hlen);
+        if (len > 0)
+            sendDataInChunks(con, text, len);
+        free(text);
+        close(con);
+    }
+}
+
+// Fork the metrics process when a metrics port was given
+static void startMetricsServer()
+{
+    if (metricsPort <= 0)
+        return;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Only returns when the port cannot be bound
+        runMetricsServer();
+        exit(1);
+    }
+    if (pid < 0)
+        perror("\nFork Failed.\n");
+    else
+        metricsPid = pid;
+}
+
+// Helper function to fork the metrics process again if it died, called between connections
+static void restartMetricsServer()
+{
+    int status;
+    if (metricsPid <= 0 || waitpid(metricsPid, &status, WNOHANG) != metricsPid)
+        return;
+    metricsPid = 0;
+    // Retrying a port that cannot be bound would only repeat the error
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 1)
+        startMetricsServer();
+}
+
+#endif
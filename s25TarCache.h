@@ -0,0 +1,436 @@
+// Cached full downltar archives, shared by s1 and the storage servers. open_cached_tar keeps the archive of each
+// tree version under <root>/TAR_CACHE_DIR and rebuilds it from the previous one when the tree changed, copying
+// the segments of unchanged files. Included by the servers after their own includes and defines (MAX_PATH,
+// CHUNK_SIZE).
+#ifndef S25_TAR_CACHE_H
+#define S25_TAR_CACHE_H
+
+// Directory of the cached archives in a storage root
+#define TAR_CACHE_DIR ".tarcache"
+
+// One file of a downltar archive and where its segment sits in the cached tar
+typedef struct
+{
+    char rel[MAX_PATH];
+    long long size;
+    long long mtimeSec;
+    long mtimeNsec;
+    unsigned long long ino;
+    long long offset;
+} TarEntry;
+
+// Helper function to grow the entry list while scanning
+static int add_tar_entry(TarEntry **list, int *count, int *cap, const char *rel, const struct stat *st)
+{
+    if (*count == *cap)
+    {
+        int newCap = *cap ? *cap * 2 : 64;
+        TarEntry *tmp = (TarEntry *)realloc(*list, newCap * sizeof(TarEntry));
+        if (!tmp)
+            return -1;
+        *list = tmp;
+        *cap = newCap;
+    }
+    TarEntry *e = &(*list)[*count];
+    snprintf(e->rel, sizeof(e->rel), "%s", rel);
+    e->size = st->st_size;
+    e->mtimeSec = st->st_mtim.tv_sec;
+    e->mtimeNsec = st->st_mtim.tv_nsec;
+    e->ino = st->st_ino;
+    e->offset = -1;
+    (*count)++;
+    return 0;
+}
+
+// Recursively collect regular files ending with ext, skipping hidden entries like the cache itself
+static int scan_tree_for_ext(const char *baseDir, const char *relDir, const char *ext,
+                             TarEntry **list, int *count, int *cap)
+{
+    char dirPath[MAX_PATH * 2];
+    snprintf(dirPath, sizeof(dirPath), "%s/%s", baseDir, relDir);
+    DIR *dp = opendir(dirPath);
+    if (!dp)
+        return -1;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL)
+    {
+        // Every file counts as it did with find, hidden ones too, but not the archives of the cache itself
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, TAR_CACHE_DIR) == 0)
+            continue;
+        char rel[MAX_PATH];
+        if (snprintf(rel, sizeof(rel), "%s/%s", relDir, de->d_name) >= (int)sizeof(rel))
+            continue;
+        char absPath[MAX_PATH * 2];
+        snprintf(absPath, sizeof(absPath), "%s/%s", baseDir, rel);
+        struct stat st;
+        if (lstat(absPath, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            scan_tree_for_ext(baseDir, rel, ext, list, count, cap);
+            continue;
+        }
+        const char *dot = strrchr(de->d_name, '.');
+        if (!S_ISREG(st.st_mode) || !dot || strcmp(dot, ext) != 0)
+            continue;
+        if (add_tar_entry(list, count, cap, rel, &st) != 0)
+        {
+            closedir(dp);
+            return -1;
+        }
+    }
+    closedir(dp);
+    return 0;
+}
+
+// qsort comparator so the archive layout does not depend on readdir order
+static int cmp_tar_entry(const void *a, const void *b)
+{
+    return strcmp(((const TarEntry *)a)->rel, ((const TarEntry *)b)->rel);
+}
+
+// Helper function to fold path, size, mtime and inode of every file into one tree version
+static unsigned long long tree_version(const TarEntry *list, int count)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < count; i++)
+    {
+        char line[MAX_PATH + 96];
+        int len = snprintf(line, sizeof(line), "%s|%lld|%lld.%ld|%llu;", list[i].rel, list[i].size,
+                           list[i].mtimeSec, list[i].mtimeNsec, list[i].ino);
+        for (int j = 0; j < len; j++)
+        {
+            h ^= (unsigned char)line[j];
+            h *= 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+// Size of a file's segment in the archive: header block plus data padded to 512 bytes
+static long long tar_segment_size(long long size)
+{
+    return 512 + ((size + 511) / 512) * 512;
+}
+
+// Helper function to write a ustar header block for one file
+static int write_tar_header(int fd, const TarEntry *e)
+{
+    char hdr[512];
+    memset(hdr, 0, sizeof(hdr));
+    size_t len = strlen(e->rel);
+    if (len <= 100)
+    {
+        memcpy(hdr, e->rel, len);
+    }
+    else
+    {
+        // Long paths are split into the ustar prefix and name fields at a '/'
+        const char *cut = NULL;
+        for (const char *p = e->rel; *p; p++)
+        {
+            if (*p == '/' && p - e->rel <= 155 && strlen(p + 1) <= 100)
+            {
+                cut = p;
+                break;
+            }
+        }
+        if (!cut)
+            return -1;
+        memcpy(hdr + 345, e->rel, cut - e->rel);
+        memcpy(hdr, cut + 1, strlen(cut + 1));
+    }
+    snprintf(hdr + 100, 8, "%07o", 0644);
+    snprintf(hdr + 108, 8, "%07o", 0);
+    snprintf(hdr + 116, 8, "%07o", 0);
+    snprintf(hdr + 124, 12, "%011llo", (unsigned long long)e->size);
+    snprintf(hdr + 136, 12, "%011llo", (unsigned long long)e->mtimeSec);
+    hdr[156] = '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+    // Checksum is computed with the checksum field itself set to spaces
+    memset(hdr + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    hdr[155] = ' ';
+    return write(fd, hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : -1;
+}
+
+// Helper function to append one file as a fresh segment
+static int write_tar_segment(int fd, const char *baseDir, const TarEntry *e)
+{
+    char absPath[MAX_PATH * 2];
+    snprintf(absPath, sizeof(absPath), "%s/%s", baseDir, e->rel);
+    int in = open(absPath, O_RDONLY);
+    if (in < 0)
+        return -1;
+    if (write_tar_header(fd, e) != 0)
+    {
+        close(in);
+        return -1;
+    }
+    char buf[CHUNK_SIZE];
+    long long left = e->size;
+    while (left > 0)
+    {
+        int r = read(in, buf, left > CHUNK_SIZE ? CHUNK_SIZE : left);
+        if (r <= 0 || write(fd, buf, r) != r)
+        {
+            close(in);
+            return -1;
+        }
+        left -= r;
+    }
+    close(in);
+    // Pad the data to a full block
+    static const char zeros[512];
+    int pad = (int)((512 - e->size % 512) % 512);
+    if (pad > 0 && write(fd, zeros, pad) != pad)
+        return -1;
+    return 0;
+}
+
+// Helper function to copy an unchanged segment from the previous archive
+static int copy_tar_segment(int fd, int oldFd, long long oldOffset, long long len)
+{
+    loff_t in = oldOffset;
+    while (len > 0)
+    {
+        ssize_t n = copy_file_range(oldFd, &in, fd, NULL, len, 0);
+        if (n <= 0)
+        {
+            // Fall back to plain reads if the filesystem can't copy in kernel
+            char buf[CHUNK_SIZE];
+            int r = pread(oldFd, buf, len > CHUNK_SIZE ? CHUNK_SIZE : len, in);
+            if (r <= 0 || write(fd, buf, r) != r)
+                return -1;
+            n = r;
+            in += r;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Helper function to load the segment index of the previously cached archive
+static int load_tar_index(const char *idxPath, unsigned long long *version, TarEntry **list, int *count)
+{
+    *list = NULL;
+    *count = 0;
+    FILE *f = fopen(idxPath, "r");
+    if (!f)
+        return -1;
+    int n = 0;
+    if (fscanf(f, "%llx %d\n", version, &n) != 2 || n < 0)
+    {
+        fclose(f);
+        return -1;
+    }
+    TarEntry *arr = (TarEntry *)calloc(n > 0 ? n : 1, sizeof(TarEntry));
+    if (!arr)
+    {
+        fclose(f);
+        return -1;
+    }
+    int got = 0;
+    while (got < n && fscanf(f, "%lld %lld %lld %ld %llu %511[^\n]\n", &arr[got].offset, &arr[got].size,
+                             &arr[got].mtimeSec, &arr[got].mtimeNsec, &arr[got].ino, arr[got].rel) == 6)
+        got++;
+    fclose(f);
+    *list = arr;
+    *count = got;
+    return 0;
+}
+
+// Helper function to save the segment index next to the archive (atomically via rename)
+static int save_tar_index(const char *idxPath, unsigned long long version, const TarEntry *list, int count)
+{
+    char tmpPath[MAX_PATH + 128];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp.%d", idxPath, (int)getpid());
+    FILE *f = fopen(tmpPath, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "%llx %d\n", version, count);
+    for (int i = 0; i < count; i++)
+        fprintf(f, "%lld %lld %lld %ld %llu %s\n", list[i].offset, list[i].size,
+                list[i].mtimeSec, list[i].mtimeNsec, list[i].ino, list[i].rel);
+    if (fclose(f) != 0 || rename(tmpPath, idxPath) != 0)
+    {
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to remove the files of an archive's cache other than one version, its index and its lock:
+// earlier versions and whatever a rebuild that died left behind. Called under the lock, open readers keep their copy
+static void remove_stale_archives(const char *cacheDir, const char *tarName, unsigned long long version)
+{
+    DIR *dp = opendir(cacheDir);
+    if (!dp)
+        return;
+    char current[96], index[96], lock[96];
+    snprintf(current, sizeof(current), "%s.%016llx", tarName, version);
+    snprintf(index, sizeof(index), "%s.idx", tarName);
+    snprintf(lock, sizeof(lock), "%s.lock", tarName);
+    size_t nameLen = strlen(tarName);
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (strncmp(de->d_name, tarName, nameLen) != 0 || de->d_name[nameLen] != '.' || strcmp(de->d_name, current) == 0 ||
+            strcmp(de->d_name, index) == 0 || strcmp(de->d_name, lock) == 0)
+            continue;
+        char path[MAX_PATH * 2];
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, de->d_name);
+        unlink(path);
+    }
+    closedir(dp);
+}
+
+// Helper function to build the archive of a tree version, copying segments of files that did not change from
+// the previous archive. Called under the lock, returns an open fd on the new archive or -1
+static int rebuild_cached_tar(const char *baseDir, const char *cacheDir, const char *tarName, unsigned long long version,
+                              TarEntry *list, int count)
+{
+    char tarPath[MAX_PATH + 96], idxPath[MAX_PATH + 96];
+    snprintf(tarPath, sizeof(tarPath), "%s/%s.%016llx", cacheDir, tarName, version);
+    snprintf(idxPath, sizeof(idxPath), "%s/%s.idx", cacheDir, tarName);
+    unsigned long long oldVersion = 0;
+    TarEntry *old = NULL;
+    int oldCount = 0;
+    int oldFd = -1;
+    if (load_tar_index(idxPath, &oldVersion, &old, &oldCount) == 0)
+    {
+        char oldPath[MAX_PATH + 96];
+        snprintf(oldPath, sizeof(oldPath), "%s/%s.%016llx", cacheDir, tarName, oldVersion);
+        oldFd = open(oldPath, O_RDONLY);
+    }
+
+    char tmpPath[MAX_PATH + 128];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp.%d", tarPath, (int)getpid());
+    int out = open(tmpPath, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        free(old);
+        if (oldFd >= 0)
+            close(oldFd);
+        return -1;
+    }
+    long long offset = 0;
+    int j = 0, failed = 0;
+    for (int i = 0; i < count && !failed; i++)
+    {
+        TarEntry *e = &list[i];
+        // Both lists are sorted by path, so walk them together
+        while (j < oldCount && strcmp(old[j].rel, e->rel) < 0)
+            j++;
+        int reuse = oldFd >= 0 && j < oldCount && strcmp(old[j].rel, e->rel) == 0 &&
+                    old[j].size == e->size && old[j].mtimeSec == e->mtimeSec &&
+                    old[j].mtimeNsec == e->mtimeNsec && old[j].ino == e->ino;
+        long long segLen = tar_segment_size(e->size);
+        if (reuse)
+        {
+            failed = copy_tar_segment(out, oldFd, old[j].offset, segLen) != 0;
+        }
+        else if (write_tar_segment(out, baseDir, e) != 0)
+        {
+            // The file vanished or could not be read, leave it out
+            if (ftruncate(out, offset) != 0 || lseek(out, offset, SEEK_SET) != offset)
+                failed = 1;
+            e->offset = -1;
+            continue;
+        }
+        e->offset = offset;
+        offset += segLen;
+    }
+    // End of archive: two zero blocks
+    static const char zeros[1024];
+    if (!failed && write(out, zeros, sizeof(zeros)) != sizeof(zeros))
+        failed = 1;
+    if (oldFd >= 0)
+        close(oldFd);
+    free(old);
+
+    // Keep only the entries that made it into the archive for the index
+    int n = 0;
+    for (int i = 0; i < count; i++)
+        if (list[i].offset >= 0)
+            list[n++] = list[i];
+
+    if (failed || rename(tmpPath, tarPath) != 0)
+    {
+        close(out);
+        unlink(tmpPath);
+        return -1;
+    }
+    save_tar_index(idxPath, version, list, n);
+    // The previous archive is no longer needed
+    remove_stale_archives(cacheDir, tarName, version);
+    lseek(out, 0, SEEK_SET);
+    return out;
+}
+
+// Build or reuse the cached full archive of baseDir for ext, returns an open fd on it
+static int open_cached_tar(const char *baseDir, const char *ext, const char *tarName, off_t *outSize)
+{
+    TarEntry *list = NULL;
+    int count = 0, cap = 0;
+    scan_tree_for_ext(baseDir, ".", ext, &list, &count, &cap);
+    if (count > 1)
+        qsort(list, count, sizeof(TarEntry), cmp_tar_entry);
+    unsigned long long version = tree_version(list, count);
+
+    char cacheDir[MAX_PATH], tarPath[MAX_PATH + 96], lockPath[MAX_PATH + 96];
+    // A root with no room for the cache directory has no archive
+    if (snprintf(cacheDir, sizeof(cacheDir), "%s/%s", baseDir, TAR_CACHE_DIR) >= (int)sizeof(cacheDir))
+    {
+        free(list);
+        return -1;
+    }
+    mkdir(cacheDir, 0755);
+    snprintf(tarPath, sizeof(tarPath), "%s/%s.%016llx", cacheDir, tarName, version);
+    snprintf(lockPath, sizeof(lockPath), "%s/%s.lock", cacheDir, tarName);
+
+    // Unchanged tree: the archive for this version is already on disk
+    int fd = open(tarPath, O_RDONLY);
+    if (fd < 0)
+    {
+        // Changed tree: one rebuild at a time per archive, a request that waited finds the archive built
+        int lockFd = open(lockPath, O_CREAT | O_RDWR, 0644);
+        if (lockFd >= 0 && flock(lockFd, LOCK_EX) == 0)
+        {
+            fd = open(tarPath, O_RDONLY);
+            if (fd < 0)
+                fd = rebuild_cached_tar(baseDir, cacheDir, tarName, version, list, count);
+        }
+        if (lockFd >= 0)
+            close(lockFd);
+    }
+    free(list);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0)
+        *outSize = st.st_size;
+    return fd;
+}
+
+// Helper function to stream an open archive to the socket with sendfile
+static int send_tar_fd(int con_sd, int fd, off_t size)
+{
+    off_t off = 0;
+    while (off < size)
+    {
+        ssize_t n = sendfile(con_sd, fd, &off, size - off > (1 << 20) ? (1 << 20) : size - off);
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,151 @@
+// Helpers shared by s25Bench and s25Replay: the clock, latency histograms with the servers' buckets and the
+// client side of the S1 protocol. Included by the tools after their own includes and defines (MAX_BUFFER,
+// RECV_TIMEOUT_S, STATS_SUB_BITS, STATS_BUCKETS) and their OpStats type, which has buckets, count and maxUs.
+#ifndef S25_TOOL_HELPERS_H
+#define S25_TOOL_HELPERS_H
+
+// Helper function to get the monotonic clock in microseconds
+static unsigned long long nowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Helper function to map microseconds to a histogram bucket: exact below 8, then 8 per power of two
+static int latencyBucket(unsigned long us)
+{
+    if (us < (1UL << STATS_SUB_BITS))
+        return (int)us;
+    int e = 63 - __builtin_clzl(us);
+    int bucket = (1 << STATS_SUB_BITS) + ((e - STATS_SUB_BITS) << STATS_SUB_BITS) +
+                 (int)((us >> (e - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Helper function to get the smallest value of a bucket
+static unsigned long latencyBucketFloor(int bucket)
+{
+    if (bucket < (1 << STATS_SUB_BITS))
+        return (unsigned long)bucket;
+    int e = ((bucket - (1 << STATS_SUB_BITS)) >> STATS_SUB_BITS) + STATS_SUB_BITS;
+    unsigned long sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+    return ((1UL << STATS_SUB_BITS) + sub) << (e - STATS_SUB_BITS);
+}
+
+// Helper function to read a percentile, the upper end of the bucket it falls in (within 12.5%)
+static unsigned long latencyPercentile(const OpStats *stats, double pct)
+{
+    if (stats->count == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(stats->count * pct / 100.0);
+    if (rank >= stats->count)
+        rank = stats->count - 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += stats->buckets[b];
+        if (seen > rank)
+        {
+            unsigned long top = b + 1 < STATS_BUCKETS ? latencyBucketFloor(b + 1) - 1 : latencyBucketFloor(b);
+            return top < stats->maxUs ? top : stats->maxUs;
+        }
+    }
+    return stats->maxUs;
+}
+
+// Function to send data in chunks to the socket
+int sendDataInChunks(int socket, const char *data, int dataSize)
+{
+    int totalSent = 0;
+    while (totalSent < dataSize)
+    {
+        int n = write(socket, data + totalSent, dataSize - totalSent);
+        if (n <= 0)
+            return -1;
+        totalSent += n;
+    }
+    return totalSent;
+}
+
+// Function to receive data in chunks from the socket, buffer may be NULL to discard it
+int receiveDataInChunks(int socket, char *buffer, int expectedSize)
+{
+    char scratch[65536];
+    int totalReceived = 0;
+    while (totalReceived < expectedSize)
+    {
+        int want = expectedSize - totalReceived;
+        if (!buffer && want > (int)sizeof(scratch))
+            want = sizeof(scratch);
+        int n = read(socket, buffer ? buffer + totalReceived : scratch, want);
+        if (n <= 0)
+            return -1;
+        totalReceived += n;
+    }
+    return totalReceived;
+}
+
+// Helper function to connect to S1, returns the socket or -1
+static int connectToServer(const char *ip, int port)
+{
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+        return -1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0 || connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sd);
+        return -1;
+    }
+    // A reply that never comes counts as an error instead of stalling the connection for the rest of the run
+    struct timeval timeout = {RECV_TIMEOUT_S, 0};
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sd;
+}
+
+// Helper function to read one protocol message, as s25Client does
+static int readMessage(int sd, char *message, int size)
+{
+    int n = read(sd, message, size - 1);
+    if (n <= 0)
+        return -1;
+    message[n] = '\0';
+    return n;
+}
+
+// Helper function to read a file name whose length is known. The servers space the name and the size
+// with a pause, but Nagle can still hand both over in one read, so only the name's bytes are taken
+static int readName(int sd, const char *expected)
+{
+    char name[MAX_BUFFER];
+    int len = strlen(expected);
+    if (receiveDataInChunks(sd, name, len) != len)
+        return -1;
+    return memcmp(name, expected, len) == 0 ? 0 : -1;
+}
+
+// Helper function to read a 4-byte size in network order
+static int readSize(int sd, uint32_t *size)
+{
+    uint32_t net;
+    if (receiveDataInChunks(sd, (char *)&net, sizeof(net)) != sizeof(net))
+        return -1;
+    *size = ntohl(net);
+    return 0;
+}
+
+// Helper function to give the archive name S1 serves for an extension
+static void tarNameForExt(const char *ext, char *out, size_t outLen)
+{
+    if (!strcmp(ext, ".c"))
+        snprintf(out, outLen, "cfiles.tar");
+    else if (!strcmp(ext, ".txt"))
+        snprintf(out, outLen, "text.tar");
+    else
+        snprintf(out, outLen, "%s.tar", ext + 1);
+}
+
+#endif